@@ -48,6 +48,10 @@ struct control_config {
 			long window_size;
 			float ks_distance;
 		} prefetch;
+		struct {
+			long max_decrement;
+			int timeout;  /* ms */
+		} actuator;
 	} control_loop;
 
 	struct {
@@ -102,6 +106,9 @@ control_config control_config::parse_yaml(YAML::Node &root) {
 	config.control_loop.prefetch.size = prefetch["size"].as<long>();
 	config.control_loop.prefetch.window_size = prefetch["window_size"].as<long>();
 	config.control_loop.prefetch.ks_distance = prefetch["ks_distance"].as<float>();
+	YAML::Node actuator = control_loop["actuator"];
+	config.control_loop.actuator.max_decrement = actuator["max_decrement"].as<long>();
+	config.control_loop.actuator.timeout = actuator["timeout"].as<int>();
 
 	YAML::Node logging = root["logging"];
 	config.logging.file_path = logging["file_path"].as<string>();
@@ -12,6 +12,7 @@
 #include <cmath>
 #include "yaml-cpp/yaml.h"
 #include "config.h"
+#include "../harvester/common/cgroup_actuator.h"
 #include "avl_tree.h"
 
 #define CGROUP_PATH_MAX_LEN 256
@@ -37,6 +38,7 @@ struct control_context {
 
 	/* cgroup limit */
 	atomic<long> cgroup_limit;
+	cgroup_actuator *actuator;
 
 	/* timestamp */
 	long timestamp;
@@ -112,22 +114,10 @@ struct perf_point {
 	}
 };
 
+/* never blocks on reclaim, returns false if a previous limit could not be applied */
 bool apply_cgroup_limit() {
-	char cgroup_limit_path[CGROUP_PATH_MAX_LEN];
-	sprintf(cgroup_limit_path,
-		"/sys/fs/cgroup/memory/%s/memory.limit_in_bytes",
-		g_ctx.config.cgroup_name.c_str());
-
-	ofstream limit_file;
-	limit_file.open(cgroup_limit_path);
-	if (!limit_file) {
-		cout << "[ERROR] cannot open cgroup limit file" << endl;
-		exit(1);
-	}
-
-	limit_file << g_ctx.cgroup_limit << endl;
-
-	return !!limit_file;
+	g_ctx.actuator->set_target(g_ctx.cgroup_limit);
+	return !g_ctx.actuator->consume_failure();
 }
 
 long get_memory_size() {
@@ -387,6 +377,9 @@ void init_ctx(YAML::Node &config_file) {
 
 	g_ctx.state = RECOVERY;
 
+	g_ctx.actuator = new cgroup_actuator(g_ctx.config.cgroup_name,
+	                                     g_ctx.config.control_loop.actuator.max_decrement,
+	                                     chrono::milliseconds(g_ctx.config.control_loop.actuator.timeout));
 	g_ctx.cgroup_limit = get_memory_size();
 	apply_cgroup_limit();
 
@@ -424,7 +417,9 @@ void init_ctx(YAML::Node &config_file) {
 			   << "cgroup_swap,"
 			   << "baseline_size,"
 			   << "outlier_prob,"
-			   << "ks_distance"
+			   << "ks_distance,"
+			   << "applied_cgroup_limit,"
+			   << "actuator_latency_us"
 			   << endl;
 }
 
@@ -546,9 +541,11 @@ int main(int argc, char *argv[]) {
 		}
 
 		/* log */
+		cgroup_actuator::stats actuator_stats = g_ctx.actuator->get_stats();
 		cout << "[INFO] timestamp: " << g_ctx.timestamp << ", "
 		     << "state: " << ((cur_state == HARVEST) ? "HARVEST" : "RECOVERY") << ", "
 		     << "cgroup limit: " << (g_ctx.cgroup_limit >> 20) << " MB, "
+		     << "applied cgroup limit: " << (actuator_stats.applied_limit >> 20) << " MB, "
 		     << "recovery time: " << cur_recovery_time << " s, "
 		     << "performance: " << performance << ", "
 		     << "promotion rate: " << (promotion_rate >> 20) << " MB, "
@@ -572,7 +569,9 @@ int main(int argc, char *argv[]) {
 				   << cgroup_swap << ","
 				   << g_ctx.baseline_list.size() << ","
 				   << outlier_prob << ","
-				   << ks_distance
+				   << ks_distance << ","
+				   << actuator_stats.applied_limit << ","
+				   << actuator_stats.last_latency_us
 				   << endl;
 
 		++g_ctx.timestamp;
@@ -8,6 +8,11 @@
 #include <unistd.h>
 #include <cstring>
 #include <sys/mman.h>
+#include "../common/harvest_shm.h"
+#include "../common/numa_mem.h"
+#include "../common/availability.h"
+#include "../common/tswap_stat.h"
+#include "predictor.h"
 
 #define MAX_HARVESTED_LEN 64
 #define CGROUP_PATH_MAX_LEN 256
@@ -23,18 +28,27 @@ long g_total_memory;
 long g_est_available_memory;
 mutex g_est_available_memory_lock;
 
+/* per NUMA node state, indexed like g_numa.node_id */
+struct numa_mem g_numa;
+predictor *g_node_predictor[MAX_NUMA_NODES];
+long g_node_est_available_memory[MAX_NUMA_NODES];
+long g_node_harvested_memory[MAX_NUMA_NODES];
+
 long g_harvested_memory;
 mutex g_harvested_lock;
 
 const char *g_cgroup_name;
+const char *g_spot_cgroup_name;
 const char *g_file_path;
 int g_fd;
 
+const char *g_shm_name;
+struct harvest_shm *g_shm;
+
 /*
  * Constants
  */
 
-constexpr float g_ewma_beta = 0.2;
 constexpr long g_alloc_threshold = (8l << 30);
 constexpr long g_evict_threshold = (1l << 30);
 constexpr int g_sleep_time = 1;
@@ -63,10 +77,10 @@ long get_total_memory_size()
 	exit(1);
 }
 
-long get_cgroup_rss()
+long get_cgroup_rss(const char *cgroup_name)
 {
 	char cgroup_path[CGROUP_PATH_MAX_LEN];
-	sprintf(cgroup_path, "/sys/fs/cgroup/memory/%s/memory.stat", g_cgroup_name);
+	sprintf(cgroup_path, "/sys/fs/cgroup/memory/%s/memory.stat", cgroup_name);
 
 	ifstream in(cgroup_path);
 	if (!in) {
@@ -87,6 +101,12 @@ long get_cgroup_rss()
 
 long get_tswap_memory_size()
 {
+	struct tswap_stat_snapshot snapshot;
+	if (tswap_stat_read(TSWAP_STAT_BIN_PATH, &snapshot) == 0) {
+		return tswap_stat_memory_pages(&snapshot, PAGE_SHIFT) << PAGE_SHIFT;
+	}
+
+	/* tswap without the binary stat */
 	ifstream in("/sys/kernel/tswap/tswap_stat");
 	if (!in) {
 		cout << "cannot open tswap stat file" << endl;
@@ -101,23 +121,73 @@ long get_tswap_memory_size()
 		    || key == "nr_in_memory_zombie_page:"
 		    || key == "nr_in_flight_page:") {
 			nr_memory_page += value;
+		} else if (key == "nr_compress_saved_page:") {
+			/* quarantined pages held compressed take less memory */
+			nr_memory_page -= value;
 		}
 	}
 	return nr_memory_page << PAGE_SHIFT;
 }
 
-long get_available_memory()
+/*
+ * Split the application's demand (cgroup usage plus tswap) across NUMA
+ * nodes in proportion to the cgroup's per-node usage, and return the memory
+ * available on each node, capped by the host's pressure-aware estimate
+ */
+long get_node_available_memory(long *tswap_memory, long node_available_memory[])
 {
-	return g_total_memory - get_cgroup_rss() - get_tswap_memory_size();
+	struct availability_estimate est;
+	long long node_usage[MAX_NUMA_NODES];
+	long long total_usage = 0;
+	long rss = get_cgroup_rss(g_cgroup_name);
+
+	*tswap_memory = get_tswap_memory_size();
+	if (g_numa.nr_nodes > 1 && numa_read_cgroup_usage(g_cgroup_name, &g_numa, node_usage) == 0) {
+		for (int i = 0; i < g_numa.nr_nodes; ++i) {
+			total_usage += node_usage[i];
+		}
+	}
+
+	long available_memory = 0;
+	for (int i = 0; i < g_numa.nr_nodes; ++i) {
+		/* fall back to a split by node size without per-node usage */
+		double share = (total_usage > 0) ? (double) node_usage[i] / (double) total_usage
+		                                 : (double) g_numa.total[i] / (double) g_total_memory;
+		node_available_memory[i] = g_numa.total[i] - (long) (share * (double) (rss + *tswap_memory));
+		available_memory += node_available_memory[i];
+	}
+
+	/* what the spot stores actually use is out of MemAvailable but ours to reclaim */
+	long spot_usage = (g_spot_cgroup_name != nullptr) ? get_cgroup_rss(g_spot_cgroup_name) : 0;
+	if (estimate_availability(g_cgroup_name, spot_usage, *tswap_memory, &est) < 0) {
+		cout << "cannot read MemAvailable" << endl;
+		exit(1);
+	}
+	cout << "HOST  | safe to harvest: " << (est.safe >> 20) << " MB, "
+	     << "band: [" << (est.low >> 20) << ", " << (est.high >> 20) << "] MB, "
+	     << "memory pressure: " << est.psi_some_avg10 << endl;
+	if (available_memory > est.safe && available_memory > 0) {
+		double scale = (double) est.safe / (double) available_memory;
+		for (int i = 0; i < g_numa.nr_nodes; ++i) {
+			node_available_memory[i] = (long) (scale * (double) node_available_memory[i]);
+		}
+		available_memory = est.safe;
+	}
+	return available_memory;
 }
 
-long atomic_update_est_available_memory(long available_memory)
+long atomic_update_est_available_memory(int node, long available_memory)
 {
 	long cur_est_available_memory;
+	long demand = g_numa.total[node] - available_memory;
 	g_est_available_memory_lock.lock();
-	g_est_available_memory = (long) (g_ewma_beta * available_memory
-	                                 + (1 - g_ewma_beta) * g_est_available_memory);
-	cur_est_available_memory = min(g_est_available_memory, available_memory);
+	g_node_predictor[node]->update(demand);
+	g_node_est_available_memory[node] = g_numa.total[node] - (long) g_node_predictor[node]->forecast();
+	cur_est_available_memory = min(g_node_est_available_memory[node], available_memory);
+	g_est_available_memory = 0;
+	for (int i = 0; i < g_numa.nr_nodes; ++i) {
+		g_est_available_memory += g_node_est_available_memory[i];
+	}
 	g_est_available_memory_lock.unlock();
 	return cur_est_available_memory;
 }
@@ -169,65 +239,156 @@ void atomic_update_file(int fd, long data)
 	file_write_unlock(fd);
 }
 
+void publish_harvested_memory(long est_available_memory, long tswap_memory, bool changed)
+{
+	if (changed) {
+		atomic_update_file(g_fd, g_harvested_memory);
+	}
+	if (g_shm != nullptr) {
+		struct harvest_snapshot snapshot, published;
+		snapshot.harvested_memory = g_harvested_memory;
+		snapshot.est_available_memory = est_available_memory;
+		snapshot.tswap_memory = tswap_memory;
+		snapshot.nr_nodes = g_numa.nr_nodes;
+		for (int i = 0; i < g_numa.nr_nodes; ++i) {
+			snapshot.node_id[i] = g_numa.node_id[i];
+			snapshot.node_harvested_memory[i] = g_node_harvested_memory[i];
+		}
+		/* a SKIP tick with the same estimate wakes no reader */
+		harvest_shm_read(g_shm, &published);
+		if (!harvest_snapshot_same(&snapshot, &published))
+			harvest_shm_publish(g_shm, &snapshot);
+	}
+}
+
 /*
  * Main Function
  */
 
 int main(int argc, char *argv[])
 {
-	if (argc != 3) {
-		cout << "Usage: <cgroup name> <harvested size file path>" << endl;
+	int opt;
+	const char *predictor_name = "ewma";
+
+	g_shm_name = nullptr;
+	g_spot_cgroup_name = nullptr;
+	while ((opt = getopt(argc, argv, "s:p:c:")) != -1) {
+		switch (opt) {
+		case 's':
+			g_shm_name = optarg;
+			break;
+		case 'c':
+			g_spot_cgroup_name = optarg;
+			break;
+		case 'p':
+			predictor_name = optarg;
+			break;
+		default:
+			break;
+		}
+	}
+	if (argc - optind != 2) {
+		cout << "Usage: [-s <shared memory name>] [-p <ewma|holt-winters|quantile>] "
+		        "<cgroup name> <harvested size file path>" << endl;
 		exit(1);
 	}
-	g_cgroup_name = argv[1];
-	g_file_path = argv[2];
+	g_cgroup_name = argv[optind];
+	g_file_path = argv[optind + 1];
 	g_est_available_memory = 0;
 	g_total_memory = get_total_memory_size();
 	g_harvested_memory = 0;
 
+	if (numa_read_meminfo(&g_numa) < 0) {
+		cout << "cannot read NUMA node meminfo" << endl;
+		exit(1);
+	}
+	if (g_numa.nr_nodes == 1) {
+		g_numa.total[0] = g_total_memory;
+	}
+	for (int i = 0; i < g_numa.nr_nodes; ++i) {
+		/* start as if the whole node were in use, as the original EWMA did */
+		g_node_predictor[i] = make_predictor(predictor_name, g_numa.total[i]);
+		if (g_node_predictor[i] == nullptr) {
+			cout << "unknown predictor " << predictor_name << endl;
+			exit(1);
+		}
+		g_node_est_available_memory[i] = 0;
+		g_node_harvested_memory[i] = 0;
+	}
+
 	g_fd = open(g_file_path, O_WRONLY | O_CREAT, 00777);
 	if (g_fd < 0) {
 		cout << "cannot open harvested size file" << endl;
 		exit(1);
 	}
-	atomic_update_file(g_fd, g_harvested_memory);
+	g_shm = nullptr;
+	if (g_shm_name != nullptr) {
+		g_shm = harvest_shm_create(g_shm_name);
+		if (g_shm == nullptr) {
+			cout << "cannot create harvested size shared memory" << endl;
+			exit(1);
+		}
+	}
+	publish_harvested_memory(0, 0, true);
 
 	for (this_thread::sleep_for(chrono::seconds(g_sleep_time));;
 	     this_thread::sleep_for(chrono::seconds(g_sleep_time))) {
 		g_harvested_lock.lock();
 
-		long available_memory = get_available_memory();
-		long cur_est_available_memory = atomic_update_est_available_memory(available_memory);
-		if (cur_est_available_memory - g_harvested_memory < g_evict_threshold) {
-			long diff = g_evict_threshold - (cur_est_available_memory - g_harvested_memory);
-			int evict_count = 0;
-
-			while (diff > 0 && g_harvested_memory > 0) {
-				g_harvested_memory -= g_node_size;
-				++evict_count;
+		long tswap_memory;
+		long node_available_memory[MAX_NUMA_NODES];
+		get_node_available_memory(&tswap_memory, node_available_memory);
+		bool changed = false;
+
+		/* harvest from each node separately, so the application keeps its local memory */
+		for (int node = 0; node < g_numa.nr_nodes; ++node) {
+			long available_memory = node_available_memory[node];
+			long cur_est_available_memory = atomic_update_est_available_memory(node, available_memory);
+			long &harvested_memory = g_node_harvested_memory[node];
+			double node_share = (double) g_numa.total[node] / (double) g_total_memory;
+			long alloc_threshold = (long) (node_share * g_alloc_threshold);
+			long evict_threshold = (long) (node_share * g_evict_threshold);
+
+			cout << "node " << g_numa.node_id[node] << " | ";
+			if (cur_est_available_memory - harvested_memory < evict_threshold) {
+				long diff = evict_threshold - (cur_est_available_memory - harvested_memory);
+				int evict_count = 0;
+
+				while (diff > 0 && harvested_memory > 0) {
+					harvested_memory -= g_node_size;
+					diff -= g_node_size;
+					++evict_count;
+				}
+				changed = true;
+				int remain_count = harvested_memory / g_node_size;
+
+				cout << "EVICT | available memory: " << (available_memory >> 20) << " MB, "
+				     << "estimated available memory: " << (cur_est_available_memory >> 20) << " MB, "
+				     << "allocated memory: " << ((remain_count * g_node_size) >> 20) << " MB, "
+				     << "evicted: " << ((evict_count * g_node_size) >> 20) << " MB" << endl;
+			} else if (cur_est_available_memory - harvested_memory > alloc_threshold) {
+				harvested_memory += g_node_size;
+				int remain_count = harvested_memory / g_node_size;
+				changed = true;
+
+				cout << "ALLOC | available memory: " << (available_memory >> 20) << " MB, "
+				     << "estimated available memory: " << (cur_est_available_memory >> 20) << " MB, "
+				     << "allocated memory: " << ((remain_count * g_node_size) >> 20) << " MB" << endl;
+			} else {
+				int remain_count = harvested_memory / g_node_size;
+
+				cout << "SKIP  | available memory: " << (available_memory >> 20) << " MB, "
+				     << "estimated available memory: " << (cur_est_available_memory >> 20) << " MB, "
+				     << "allocated memory: " << ((remain_count * g_node_size) >> 20) << " MB" << endl;
 			}
-			atomic_update_file(g_fd, g_harvested_memory);
-			int remain_count = g_harvested_memory / g_node_size;
-
-			cout << "EVICT | available memory: " << (available_memory >> 20) << " MB, "
-			     << "estimated available memory: " << (cur_est_available_memory >> 20) << " MB, "
-			     << "allocated memory: " << ((remain_count * g_node_size) >> 20) << " MB, "
-			     << "evicted: " << ((evict_count * g_node_size) >> 20) << " MB" << endl;
-		} else if (cur_est_available_memory - g_harvested_memory > g_alloc_threshold) {
-			g_harvested_memory += g_node_size;
-			int remain_count = g_harvested_memory / g_node_size;
-			atomic_update_file(g_fd, g_harvested_memory);
-
-			cout << "ALLOC | available memory: " << (available_memory >> 20) << " MB, "
-			     << "estimated available memory: " << (cur_est_available_memory >> 20) << " MB, "
-			     << "allocated memory: " << ((remain_count * g_node_size) >> 20) << " MB" << endl;
-		} else {
-			int remain_count = g_harvested_memory / g_node_size;
-
-			cout << "SKIP  | available memory: " << (available_memory >> 20) << " MB, "
-			     << "estimated available memory: " << (cur_est_available_memory >> 20) << " MB, "
-			     << "allocated memory: " << ((remain_count * g_node_size) >> 20) << " MB" << endl;
 		}
+
+		g_harvested_memory = 0;
+		for (int node = 0; node < g_numa.nr_nodes; ++node) {
+			g_harvested_memory += g_node_harvested_memory[node];
+		}
+		/* the file only changes on ALLOC/EVICT, shared memory readers always get a fresh estimate */
+		publish_harvested_memory(g_est_available_memory, tswap_memory, changed);
 		g_harvested_lock.unlock();
 	}
 }
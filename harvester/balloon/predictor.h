@@ -0,0 +1,214 @@
+#ifndef BALLOON_PREDICTOR_H
+#define BALLOON_PREDICTOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+ * Demand predictors used by the balloon to size harvested memory.
+ *
+ * A predictor is fed one observation of the producer application's memory
+ * demand (cgroup usage plus tswap's in-memory size) per balloon epoch and
+ * returns an upper-confidence forecast of the demand for the next epoch.
+ * The balloon never harvests beyond max(forecast, current demand).
+ */
+
+class predictor {
+public:
+	virtual ~predictor() {}
+
+	virtual void update(double demand) = 0;
+
+	virtual double forecast() const = 0;
+
+	virtual const char *name() const = 0;
+};
+
+/*
+ * Exponentially weighted moving average, the balloon's original estimator
+ */
+class ewma_predictor : public predictor {
+public:
+	ewma_predictor(double beta, double initial)
+		: beta(beta), estimate(initial) {
+	}
+
+	void update(double demand) override {
+		estimate = beta * demand + (1 - beta) * estimate;
+	}
+
+	double forecast() const override {
+		return estimate;
+	}
+
+	const char *name() const override {
+		return "ewma";
+	}
+
+private:
+	double beta;
+	double estimate;
+};
+
+/*
+ * Additive Holt-Winters (level, trend, season) with an upper bound of
+ * z standard deviations of the one-step forecast error
+ */
+class holt_winters_predictor : public predictor {
+public:
+	holt_winters_predictor(double alpha, double beta, double gamma,
+	                       size_t season_length, double z)
+		: alpha(alpha), beta(beta), gamma(gamma), z(z),
+		  season(season_length, 0), season_index(0),
+		  level(0), trend(0), error_var(0), nr_update(0) {
+	}
+
+	void update(double demand) override {
+		if (nr_update == 0) {
+			level = demand;
+		} else {
+			double error = demand - point_forecast();
+			error_var = alpha * error * error + (1 - alpha) * error_var;
+
+			double prev_level = level;
+			double &cur_season = season[season_index];
+			level = alpha * (demand - cur_season) + (1 - alpha) * (level + trend);
+			trend = beta * (level - prev_level) + (1 - beta) * trend;
+			cur_season = gamma * (demand - level) + (1 - gamma) * cur_season;
+		}
+		season_index = (season_index + 1) % season.size();
+		++nr_update;
+	}
+
+	double forecast() const override {
+		return point_forecast() + z * std::sqrt(error_var);
+	}
+
+	const char *name() const override {
+		return "holt-winters";
+	}
+
+private:
+	double point_forecast() const {
+		return level + trend + season[season_index];
+	}
+
+	double alpha;
+	double beta;
+	double gamma;
+	double z;
+
+	std::vector<double> season;
+	size_t season_index;
+	double level;
+	double trend;
+	double error_var;
+	long nr_update;
+};
+
+/*
+ * Linear quantile regression of the demand on time over a recent sliding
+ * window, extrapolated one epoch ahead, so that a ramp is followed before
+ * the window fills with it. The pinball loss is minimized by
+ * majorize-minimize iterations (Hunter and Lange, 2000), each a weighted
+ * least squares fit of the intercept and slope, warm-started from the fit
+ * of the previous epoch.
+ */
+class quantile_predictor : public predictor {
+public:
+	quantile_predictor(size_t window_size, double quantile)
+		: window_size(window_size), quantile(quantile), intercept(0), slope(0), nr_update(0) {
+	}
+
+	void update(double demand) override {
+		window.push_back(demand);
+		if (window.size() > window_size) {
+			window.pop_front();
+			/* times are relative to the oldest sample of the window */
+			intercept += slope;
+		}
+		if (nr_update++ == 0) {
+			intercept = demand;
+		}
+		fit();
+	}
+
+	double forecast() const override {
+		if (window.empty()) {
+			return 0;
+		}
+		return intercept + slope * (double) window.size();
+	}
+
+	const char *name() const override {
+		return "quantile";
+	}
+
+private:
+	static constexpr int nr_iterations = 20;
+
+	void fit() {
+		double scale = 0;
+		for (double demand : window) {
+			scale = std::max(scale, std::fabs(demand));
+		}
+		/* smooths the loss around zero residuals, keeps the weights finite */
+		double epsilon = 1e-6 * scale + 1e-9;
+		double n = (double) window.size();
+		double bias = 1 - 2 * quantile;
+
+		for (int iter = 0; iter < nr_iterations; ++iter) {
+			double sw = 0, swt = 0, swtt = 0, swy = 0, swty = 0, st = 0;
+			for (size_t i = 0; i < window.size(); ++i) {
+				double t = (double) i;
+				double residual = window[i] - intercept - slope * t;
+				double w = 1 / (epsilon + std::fabs(residual));
+				sw += w;
+				swt += w * t;
+				swtt += w * t * t;
+				swy += w * window[i];
+				swty += w * t * window[i];
+				st += t;
+			}
+			/* normal equations of the surrogate: sum w r = (1 - 2q) n, sum w t r = (1 - 2q) sum t */
+			double det = sw * swtt - swt * swt;
+			if (det <= 0) {
+				intercept = (swy - bias * n) / sw;
+				slope = 0;
+				continue;
+			}
+			double rhs0 = swy - bias * n;
+			double rhs1 = swty - bias * st;
+			intercept = (rhs0 * swtt - rhs1 * swt) / det;
+			slope = (sw * rhs1 - swt * rhs0) / det;
+		}
+	}
+
+	size_t window_size;
+	double quantile;
+	std::deque<double> window;
+	double intercept;  /* the fit at the oldest sample of the window */
+	double slope;  /* per epoch */
+	long nr_update;
+};
+
+/*
+ * @initial_demand seeds the EWMA so that the balloon starts conservatively;
+ * returns nullptr for an unknown predictor name
+ */
+inline predictor *make_predictor(const std::string &name, double initial_demand)
+{
+	if (name == "ewma") {
+		return new ewma_predictor(0.2, initial_demand);
+	} else if (name == "holt-winters") {
+		return new holt_winters_predictor(0.2, 0.05, 0.1, 60, 3);
+	} else if (name == "quantile") {
+		return new quantile_predictor(300, 0.99);
+	}
+	return nullptr;
+}
+
+#endif //BALLOON_PREDICTOR_H
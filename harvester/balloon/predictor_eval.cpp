@@ -0,0 +1,149 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <unistd.h>
+#include "predictor.h"
+
+using namespace std;
+
+/*
+ * Offline evaluation of the balloon's demand predictors on a memory trace
+ * such as cluster_trace/cpu_mem.csv (sec,cpu,mem with mem as a fraction of
+ * the machine). Each predictor drives a replay of the balloon's sizing loop
+ * (one sample per balloon epoch) and we report how much memory it harvested
+ * against how long the application was left under-provisioned.
+ *
+ * The balloon's thresholds are sized for a 64 GB machine; by default they
+ * scale with the machine, and with the step of harvested memory they can
+ * be set to compare the predictors where their forecasts bind.
+ */
+
+/*
+ * Constants (same as balloon.cpp at 64 GB)
+ */
+
+constexpr int g_sleep_time = 1;
+long g_alloc_threshold;  /* default 1/8 of the machine, 8 GB at 64 GB */
+long g_evict_threshold;  /* default 1/64 of the machine, 1 GB at 64 GB */
+long g_node_size = (64l << 20);
+
+/*
+ * Helper Functions
+ */
+
+vector<double> load_trace(const char *path)
+{
+	ifstream in(path);
+	if (!in) {
+		cout << "cannot open trace file" << endl;
+		exit(1);
+	}
+
+	vector<double> mem;
+	long nr_skipped = 0;
+	string line;
+	getline(in, line);  /* header */
+	while (getline(in, line)) {
+		stringstream ss(line);
+		string sec, cpu, value;
+		if (getline(ss, sec, ',') && getline(ss, cpu, ',') && getline(ss, value, ',')) {
+			double fraction = stod(value);
+			/* the trace has a few corrupted samples outside [0, 1] */
+			if (fraction < 0 || fraction > 1) {
+				++nr_skipped;
+				continue;
+			}
+			mem.push_back(fraction);
+		}
+	}
+	if (nr_skipped > 0) {
+		cerr << "skipped " << nr_skipped << " out-of-range samples" << endl;
+	}
+	return mem;
+}
+
+void evaluate(predictor *pred, const vector<double> &trace, long total_memory)
+{
+	long harvested_memory = 0;
+	double harvested_byte_seconds = 0;
+	long under_provisioned_seconds = 0;
+	long max_shortfall = 0;
+
+	for (double fraction : trace) {
+		long demand = (long) (fraction * (double) total_memory);
+		long available_memory = total_memory - demand;
+
+		/* the application's demand for this epoch is served before resizing */
+		if (demand + harvested_memory > total_memory) {
+			under_provisioned_seconds += g_sleep_time;
+			max_shortfall = max(max_shortfall, demand + harvested_memory - total_memory);
+		}
+		harvested_byte_seconds += (double) harvested_memory * g_sleep_time;
+
+		pred->update(demand);
+		long est_available_memory = min(total_memory - (long) pred->forecast(), available_memory);
+		if (est_available_memory - harvested_memory < g_evict_threshold) {
+			long diff = g_evict_threshold - (est_available_memory - harvested_memory);
+			while (diff > 0 && harvested_memory > 0) {
+				harvested_memory -= g_node_size;
+				diff -= g_node_size;
+			}
+		} else if (est_available_memory - harvested_memory > g_alloc_threshold) {
+			harvested_memory += g_node_size;
+		}
+	}
+
+	cout << pred->name() << ","
+	     << harvested_byte_seconds / 3600 / (1l << 30) << ","
+	     << under_provisioned_seconds << ","
+	     << (max_shortfall >> 20) << endl;
+}
+
+/*
+ * Main Function
+ */
+
+int main(int argc, char *argv[])
+{
+	long total_memory = 64l << 30;
+	double alloc_gb = -1, evict_gb = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:a:e:n:")) != -1) {
+		switch (opt) {
+		case 'm':
+			total_memory = atol(optarg) << 30;
+			break;
+		case 'a':
+			alloc_gb = atof(optarg);
+			break;
+		case 'e':
+			evict_gb = atof(optarg);
+			break;
+		case 'n':
+			g_node_size = atol(optarg) << 20;
+			break;
+		default:
+			break;
+		}
+	}
+	if (argc - optind != 1 || total_memory <= 0 || g_node_size <= 0) {
+		cout << "Usage: [-m machine memory (GB, default 64)] [-a alloc threshold (GB)] "
+		        "[-e evict threshold (GB)] [-n harvest step (MB, default 64)] <trace csv path>" << endl;
+		exit(1);
+	}
+	g_alloc_threshold = (alloc_gb >= 0) ? (long) (alloc_gb * (1l << 30)) : total_memory / 8;
+	g_evict_threshold = (evict_gb >= 0) ? (long) (evict_gb * (1l << 30)) : total_memory / 64;
+	vector<double> trace = load_trace(argv[optind]);
+
+	cout << "predictor,harvested_gb_hours,under_provisioned_seconds,max_shortfall_mb" << endl;
+	for (const char *name : {"ewma", "holt-winters", "quantile"}) {
+		unique_ptr<predictor> pred(make_predictor(name, total_memory));
+		evaluate(pred.get(), trace, total_memory);
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Check that the cgroup actuator walks down from an unlimited cgroup in a
+ * few bounded steps, against a fake cgroup directory.
+ *
+ * Usage: ./cgroup_actuator_check
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../common/cgroup_actuator.h"
+
+using namespace std;
+
+constexpr long g_unlimited = 9223372036854771712l;
+constexpr long g_usage = (2l << 30);
+constexpr long g_target = (1l << 30);
+constexpr long g_max_decrement = (256l << 20);
+
+void write_file(const string &path, long value)
+{
+	ofstream out(path, ios::trunc);
+	out << value << endl;
+}
+
+int main()
+{
+	char root[] = "/tmp/cgroup_actuator_check.XXXXXX";
+	if (mkdtemp(root) == nullptr) {
+		cout << "cannot create fake cgroup root" << endl;
+		return 1;
+	}
+	string cgroup_path = string(root) + "/app";
+	mkdir(cgroup_path.c_str(), 0755);
+	write_file(cgroup_path + "/memory.limit_in_bytes", g_unlimited);
+	write_file(cgroup_path + "/memory.usage_in_bytes", g_usage);
+
+	int ret = 0;
+	{
+		cgroup_actuator actuator("app", g_max_decrement, chrono::milliseconds(1000), root);
+		actuator.set_target(g_target);
+
+		cgroup_actuator::stats stats = actuator.get_stats();
+		for (int i = 0; i < 500 && stats.nr_complete == 0 && stats.nr_fail == 0; ++i) {
+			this_thread::sleep_for(chrono::milliseconds(10));
+			stats = actuator.get_stats();
+		}
+
+		long max_write = (g_usage - g_target + g_max_decrement - 1) / g_max_decrement;
+		cout << "writes: " << stats.nr_write << " (at most " << max_write << "), "
+		     << "applied limit: " << (stats.applied_limit >> 20) << " MB, "
+		     << "failures: " << stats.nr_fail << endl;
+		if (stats.nr_complete != 1 || stats.applied_limit != g_target || stats.nr_write > max_write) {
+			cout << "FAIL" << endl;
+			ret = 1;
+		} else {
+			cout << "OK" << endl;
+		}
+	}
+
+	remove((cgroup_path + "/memory.limit_in_bytes").c_str());
+	remove((cgroup_path + "/memory.usage_in_bytes").c_str());
+	rmdir(cgroup_path.c_str());
+	rmdir(root);
+	return ret;
+}
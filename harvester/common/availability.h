@@ -0,0 +1,129 @@
+#ifndef __AVAILABILITY_H_
+#define __AVAILABILITY_H_
+
+/*
+ * Memory-pressure-aware estimate of how much memory is safe to harvest,
+ * shared by the balloon and the producer agent.
+ *
+ * The upper end of the band trusts the kernel: MemAvailable (free memory
+ * plus reclaimable page cache and slab) plus the memory already handed to
+ * spot stores, minus the application's active file pages which it is
+ * actively using. The lower end additionally keeps the application's
+ * inactive file pages (they may be refaulted) and everything quarantined in
+ * tswap (it may be promoted back). The point estimate slides from the upper
+ * to the lower end as /proc/pressure/memory reports stalls.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define AVAILABILITY_PATH_MAX_LEN 256
+/* some avg10 (% of time stalled) at which only the lower end is trusted */
+#define AVAILABILITY_PSI_FULL_WEIGHT 10.0
+
+struct availability_estimate {
+	/* inputs, bytes */
+	long long mem_available;
+	long long active_file;
+	long long inactive_file;
+	long long spot_usage;
+	long long tswap_memory;
+	double psi_some_avg10;  /* -1 if PSI is not available */
+
+	/* outputs, bytes */
+	long long low;
+	long long high;
+	long long safe;
+};
+
+static inline long long availability_read_mem_available(void)
+{
+	FILE *in = fopen("/proc/meminfo", "r");
+	char key[128], unit[16];
+	long long value;
+
+	if (!in)
+		return -1;
+	while (fscanf(in, "%127s %lld %15s", key, &value, unit) == 3) {
+		if (strcmp(key, "MemAvailable:") == 0) {
+			fclose(in);
+			return value << 10;
+		}
+	}
+	fclose(in);
+	return -1;
+}
+
+static inline double availability_read_psi_some_avg10(void)
+{
+	FILE *in = fopen("/proc/pressure/memory", "r");
+	double avg10;
+
+	if (!in)
+		return -1;
+	if (fscanf(in, "some avg10=%lf", &avg10) != 1)
+		avg10 = -1;
+	fclose(in);
+	return avg10;
+}
+
+static inline void availability_read_cgroup_file(const char *cgroup_name,
+                                                 long long *active_file,
+                                                 long long *inactive_file)
+{
+	char path[AVAILABILITY_PATH_MAX_LEN], key[128];
+	long long value;
+	FILE *in;
+
+	*active_file = 0;
+	*inactive_file = 0;
+	if (!cgroup_name)
+		return;
+	sprintf(path, "/sys/fs/cgroup/memory/%s/memory.stat", cgroup_name);
+	in = fopen(path, "r");
+	if (!in)
+		return;
+	while (fscanf(in, "%127s %lld", key, &value) == 2) {
+		if (strcmp(key, "total_active_file") == 0)
+			*active_file = value;
+		else if (strcmp(key, "total_inactive_file") == 0)
+			*inactive_file = value;
+	}
+	fclose(in);
+}
+
+/*
+ * @app_cgroup: cgroup of the producer's application (NULL if unknown)
+ * @spot_usage: memory currently used by spot stores, which is ours to give back
+ * @tswap_memory: tswap's in-memory size
+ * returns 0 on success, -1 if MemAvailable cannot be read
+ */
+static inline int estimate_availability(const char *app_cgroup, long long spot_usage,
+                                        long long tswap_memory,
+                                        struct availability_estimate *est)
+{
+	double weight;
+
+	est->mem_available = availability_read_mem_available();
+	if (est->mem_available < 0)
+		return -1;
+	availability_read_cgroup_file(app_cgroup, &est->active_file, &est->inactive_file);
+	est->spot_usage = spot_usage;
+	est->tswap_memory = tswap_memory;
+	est->psi_some_avg10 = availability_read_psi_some_avg10();
+
+	est->high = est->mem_available + est->spot_usage - est->active_file;
+	est->low = est->high - est->inactive_file - est->tswap_memory;
+	if (est->high < 0)
+		est->high = 0;
+	if (est->low < 0)
+		est->low = 0;
+
+	weight = (est->psi_some_avg10 < 0) ? 0.5 : est->psi_some_avg10 / AVAILABILITY_PSI_FULL_WEIGHT;
+	if (weight > 1)
+		weight = 1;
+	est->safe = est->high - (long long) (weight * (double) (est->high - est->low));
+	return 0;
+}
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef HARVESTER_CGROUP_ACTUATOR_H
+#define HARVESTER_CGROUP_ACTUATOR_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Asynchronous writer of memory.limit_in_bytes for one cgroup.
+ *
+ * Lowering the limit makes the kernel reclaim synchronously inside write(),
+ * which can block for seconds on large cgroups. Decision threads therefore
+ * only post a target with set_target(), which never blocks; a dedicated
+ * actuator thread applies the latest target (last writer wins, older ones
+ * are coalesced away) and walks down to it in bounded decrements, so that
+ * each write only reclaims a bounded amount. The walk starts from the
+ * cgroup's usage when that is below the applied limit, so an unlimited
+ * cgroup does not take billions of steps. Writes failing with EBUSY
+ * (usage could not be reclaimed below the new limit) are retried with
+ * backoff until the request times out, after which the target is dropped
+ * and the failure is reported through consume_failure().
+ */
+
+class cgroup_actuator {
+public:
+	struct stats {
+		long nr_request;  /* set_target() calls */
+		long nr_coalesced;  /* targets replaced before being reached */
+		long nr_write;  /* successful writes to memory.limit_in_bytes */
+		long nr_busy_retry;  /* EBUSY retries */
+		long nr_fail;  /* targets dropped after timeout or non-EBUSY error */
+		long nr_complete;  /* targets reached */
+		long target_limit;
+		long applied_limit;
+		long last_latency_us;  /* set_target() to target reached */
+		long max_latency_us;
+	};
+
+	cgroup_actuator(const std::string &cgroup_name, long max_decrement,
+	                std::chrono::milliseconds timeout,
+	                const std::string &cgroup_root = "/sys/fs/cgroup/memory")
+		: max_decrement(max_decrement), timeout(timeout), has_target(false),
+		  failed(false), stopped(false) {
+		limit_path = cgroup_root + "/" + cgroup_name + "/memory.limit_in_bytes";
+		usage_path = cgroup_root + "/" + cgroup_name + "/memory.usage_in_bytes";
+
+		memset(&stat, 0, sizeof(stat));
+		stat.applied_limit = read_value(limit_path);
+		stat.target_limit = stat.applied_limit;
+		worker = std::thread(&cgroup_actuator::worker_fn, this);
+	}
+
+	~cgroup_actuator() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopped = true;
+		}
+		cv.notify_all();
+		worker.join();
+	}
+
+	/* never blocks on reclaim */
+	void set_target(long limit) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			++stat.nr_request;
+			if (has_target && target != limit) {
+				++stat.nr_coalesced;
+			}
+			if (!has_target || target != limit) {
+				request_time = std::chrono::steady_clock::now();
+			}
+			target = limit;
+			has_target = true;
+			stat.target_limit = limit;
+		}
+		cv.notify_all();
+	}
+
+	/* returns true once for every target dropped since the last call */
+	bool consume_failure() {
+		std::lock_guard<std::mutex> guard(lock);
+		bool ret = failed;
+		failed = false;
+		return ret;
+	}
+
+	stats get_stats() {
+		std::lock_guard<std::mutex> guard(lock);
+		return stat;
+	}
+
+private:
+	/* returns -1 if @path cannot be read */
+	static long read_value(const std::string &path) {
+		long value = -1;
+		FILE *file = fopen(path.c_str(), "r");
+		if (file != nullptr) {
+			if (fscanf(file, "%ld", &value) != 1) {
+				value = -1;
+			}
+			fclose(file);
+		}
+		return value;
+	}
+
+	/* returns 0 or -errno */
+	int write_limit(long limit) {
+		char buffer[32];
+		int len = snprintf(buffer, sizeof(buffer), "%ld\n", limit);
+		int fd = open(limit_path.c_str(), O_WRONLY);
+		if (fd < 0) {
+			return -errno;
+		}
+		int ret = (write(fd, buffer, len) == len) ? 0 : -errno;
+		close(fd);
+		return ret;
+	}
+
+	void worker_fn() {
+		std::unique_lock<std::mutex> guard(lock);
+		std::chrono::milliseconds backoff(10);
+
+		while (true) {
+			cv.wait(guard, [this] { return stopped || has_target; });
+			if (stopped) {
+				return;
+			}
+
+			long cur_target = target;
+			long applied = stat.applied_limit;
+
+			guard.unlock();
+			/* nothing is reclaimed until the limit goes below the usage */
+			long usage = read_value(usage_path);
+			if (usage >= 0 && (applied < 0 || usage < applied)) {
+				applied = usage;
+			}
+			long next = cur_target;
+			if (applied >= 0 && cur_target < applied && applied - cur_target > max_decrement) {
+				next = applied - max_decrement;
+			}
+			int ret = write_limit(next);
+			guard.lock();
+
+			auto now = std::chrono::steady_clock::now();
+			if (ret == 0) {
+				++stat.nr_write;
+				stat.applied_limit = next;
+				backoff = std::chrono::milliseconds(10);
+				if (next == target) {
+					has_target = false;
+					++stat.nr_complete;
+					stat.last_latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+						now - request_time).count();
+					stat.max_latency_us = std::max(stat.max_latency_us, stat.last_latency_us);
+				}
+				continue;
+			}
+
+			if (ret == -EBUSY && now - request_time < timeout) {
+				++stat.nr_busy_retry;
+				/* a newer target wakes us up early */
+				cv.wait_for(guard, backoff, [this, cur_target] { return stopped || target != cur_target; });
+				backoff = std::min(backoff * 2, std::chrono::milliseconds(1000));
+				continue;
+			}
+
+			++stat.nr_fail;
+			failed = true;
+			stat.applied_limit = read_value(limit_path);
+			backoff = std::chrono::milliseconds(10);
+			if (target == cur_target) {
+				has_target = false;
+			} else {
+				/* a newer target has arrived in the meantime, give it a full timeout */
+				request_time = now;
+			}
+		}
+	}
+
+	std::string limit_path;
+	std::string usage_path;
+	long max_decrement;
+	std::chrono::milliseconds timeout;
+
+	std::mutex lock;
+	std::condition_variable cv;
+	long target;
+	bool has_target;
+	bool failed;
+	bool stopped;
+	std::chrono::time_point<std::chrono::steady_clock> request_time;
+	stats stat;
+
+	std::thread worker;
+};
+
+#endif //HARVESTER_CGROUP_ACTUATOR_H
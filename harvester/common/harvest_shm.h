@@ -0,0 +1,221 @@
+#ifndef __HARVEST_SHM_H_
+#define __HARVEST_SHM_H_
+
+/*
+ * Shared-memory publication of the balloon's harvest decision.
+ *
+ * The balloon (writer) keeps a small seqlock-protected record in a POSIX
+ * shared memory segment (/dev/shm/<name>). Readers map the segment read-only
+ * and take a consistent snapshot without any syscall; they may also sleep on
+ * the sequence word with futex until the next publication. A restarted
+ * writer keeps an existing segment as it is, so readers attached to it
+ * never see it reset, and only publishes snapshots that changed.
+ *
+ * This header is shared between the C++ balloon and the C producer agent,
+ * so it only relies on GCC __atomic builtins instead of <atomic>/<stdatomic.h>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define HARVEST_SHM_MAGIC 0x53565248u  /* "HRVS" */
+#define HARVEST_SHM_VERSION 2
+#define HARVEST_SHM_MAX_NODES 16
+
+struct harvest_snapshot {
+	int64_t harvested_memory;  /* bytes */
+	int64_t est_available_memory;  /* bytes */
+	int64_t tswap_memory;  /* bytes */
+	uint64_t generation;  /* bumped on every publication */
+	int32_t nr_nodes;
+	int32_t node_id[HARVEST_SHM_MAX_NODES];
+	int64_t node_harvested_memory[HARVEST_SHM_MAX_NODES];  /* bytes */
+};
+
+struct harvest_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;  /* odd while the writer is updating; also the futex word */
+	uint32_t reserved;
+	struct harvest_snapshot data;
+};
+
+static inline struct harvest_shm *harvest_shm_map(const char *name, int writable)
+{
+	struct harvest_shm *shm;
+	struct stat st;
+	int fd, fresh;
+	uint32_t seq;
+
+	fd = shm_open(name, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 00666);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	/* a segment of another size is new, or of another layout */
+	fresh = st.st_size != sizeof(struct harvest_shm);
+	if (fresh && (!writable || ftruncate(fd, sizeof(struct harvest_shm)) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	shm = (struct harvest_shm *) mmap(NULL, sizeof(struct harvest_shm),
+	                                  writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+	                                  MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+	if (!writable)
+		return shm;
+	if (fresh || __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != HARVEST_SHM_MAGIC ||
+	    shm->version != HARVEST_SHM_VERSION) {
+		memset(shm, 0, sizeof(struct harvest_shm));
+		shm->version = HARVEST_SHM_VERSION;
+		/* readers only trust the segment once magic is visible */
+		__atomic_store_n(&shm->magic, HARVEST_SHM_MAGIC, __ATOMIC_RELEASE);
+		return shm;
+	}
+	/* a writer that died while publishing left seq odd, close its update */
+	seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	if (seq & 1) {
+		__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &shm->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+	}
+	return shm;
+}
+
+/* writer side: create the segment, or take over an existing one as it is */
+static inline struct harvest_shm *harvest_shm_create(const char *name)
+{
+	return harvest_shm_map(name, 1);
+}
+
+/* reader side: map an existing segment read-only */
+static inline struct harvest_shm *harvest_shm_attach(const char *name)
+{
+	struct harvest_shm *shm = harvest_shm_map(name, 0);
+
+	if (shm && (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != HARVEST_SHM_MAGIC
+	            || shm->version != HARVEST_SHM_VERSION)) {
+		munmap(shm, sizeof(struct harvest_shm));
+		return NULL;
+	}
+	return shm;
+}
+
+static inline void harvest_shm_detach(struct harvest_shm *shm)
+{
+	munmap(shm, sizeof(struct harvest_shm));
+}
+
+/* whether @a and @b hold the same decision, their generations aside */
+static inline int harvest_snapshot_same(const struct harvest_snapshot *a,
+                                        const struct harvest_snapshot *b)
+{
+	int i;
+
+	if (a->harvested_memory != b->harvested_memory || a->est_available_memory != b->est_available_memory ||
+	    a->tswap_memory != b->tswap_memory || a->nr_nodes != b->nr_nodes)
+		return 0;
+	for (i = 0; i < a->nr_nodes && i < HARVEST_SHM_MAX_NODES; i++) {
+		if (a->node_id[i] != b->node_id[i] || a->node_harvested_memory[i] != b->node_harvested_memory[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* single writer only; the generation of @snapshot is ignored */
+static inline void harvest_shm_publish(struct harvest_shm *shm,
+                                       const struct harvest_snapshot *snapshot)
+{
+	uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	int i, nr_nodes;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&shm->data.harvested_memory, snapshot->harvested_memory, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->data.est_available_memory, snapshot->est_available_memory, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->data.tswap_memory, snapshot->tswap_memory, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->data.generation, shm->data.generation + 1, __ATOMIC_RELAXED);
+	nr_nodes = snapshot->nr_nodes < HARVEST_SHM_MAX_NODES ? snapshot->nr_nodes : HARVEST_SHM_MAX_NODES;
+	__atomic_store_n(&shm->data.nr_nodes, nr_nodes, __ATOMIC_RELAXED);
+	for (i = 0; i < nr_nodes; i++) {
+		__atomic_store_n(&shm->data.node_id[i], snapshot->node_id[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&shm->data.node_harvested_memory[i], snapshot->node_harvested_memory[i],
+		                 __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+
+	/* publication is infrequent, readers never need a syscall to read */
+	syscall(SYS_futex, &shm->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Take a consistent snapshot; returns the (even) sequence number
+ * the snapshot belongs to, to be passed to harvest_shm_wait()
+ */
+static inline uint32_t harvest_shm_read(struct harvest_shm *shm,
+                                        struct harvest_snapshot *snapshot)
+{
+	uint32_t seq_begin, seq_end;
+	int i;
+
+	do {
+		seq_begin = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq_begin & 1)
+			continue;  /* writer in progress */
+
+		snapshot->harvested_memory = __atomic_load_n(&shm->data.harvested_memory, __ATOMIC_RELAXED);
+		snapshot->est_available_memory = __atomic_load_n(&shm->data.est_available_memory, __ATOMIC_RELAXED);
+		snapshot->tswap_memory = __atomic_load_n(&shm->data.tswap_memory, __ATOMIC_RELAXED);
+		snapshot->generation = __atomic_load_n(&shm->data.generation, __ATOMIC_RELAXED);
+		snapshot->nr_nodes = __atomic_load_n(&shm->data.nr_nodes, __ATOMIC_RELAXED);
+		if (snapshot->nr_nodes < 0 || snapshot->nr_nodes > HARVEST_SHM_MAX_NODES) {
+			seq_end = seq_begin + 2;  /* torn read, retry */
+			continue;
+		}
+		for (i = 0; i < snapshot->nr_nodes; i++) {
+			snapshot->node_id[i] = __atomic_load_n(&shm->data.node_id[i], __ATOMIC_RELAXED);
+			snapshot->node_harvested_memory[i] =
+				__atomic_load_n(&shm->data.node_harvested_memory[i], __ATOMIC_RELAXED);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq_end = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	} while ((seq_begin & 1) || seq_begin != seq_end);
+
+	return seq_begin;
+}
+
+/*
+ * Sleep until the segment is republished after @seq or @timeout_ms expires;
+ * returns 1 if a newer publication is available, 0 on timeout
+ */
+static inline int harvest_shm_wait(struct harvest_shm *shm, uint32_t seq, long timeout_ms)
+{
+	struct timespec timeout;
+	uint32_t cur_seq;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+	cur_seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+	if (cur_seq != seq)
+		return 1;
+
+	syscall(SYS_futex, &shm->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+
+	return __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE) != seq;
+}
+
+#endif
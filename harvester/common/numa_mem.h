@@ -0,0 +1,146 @@
+#ifndef __NUMA_MEM_H_
+#define __NUMA_MEM_H_
+
+/*
+ * Per-NUMA-node memory accounting shared by the balloon and the producer agent.
+ *
+ * Node sizes come from /sys/devices/system/node/node<N>/meminfo and the
+ * cgroup's per-node usage from memory.numa_stat (cgroup v1, in pages).
+ * Machines without the node directory are reported as a single node 0
+ * backed by /proc/meminfo.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#define MAX_NUMA_NODES 16
+#define NUMA_PATH_MAX_LEN 256
+#define NUMA_PAGE_SHIFT 12
+
+struct numa_mem {
+	int nr_nodes;
+	int node_id[MAX_NUMA_NODES];  /* kernel node id of each slot */
+	long long total[MAX_NUMA_NODES];  /* bytes */
+	long long free[MAX_NUMA_NODES];  /* bytes */
+	long long file[MAX_NUMA_NODES];  /* bytes of page cache (FilePages) */
+};
+
+static inline long long numa_parse_meminfo_value(const char *path, const char *key)
+{
+	FILE *in = fopen(path, "r");
+	char line[256];
+	long long value = -1;
+	char *pos;
+
+	if (!in)
+		return -1;
+	while (fgets(line, sizeof(line), in)) {
+		pos = strstr(line, key);
+		if (pos && pos[strlen(key)] == ':') {
+			value = strtoll(pos + strlen(key) + 1, NULL, 10) << 10;
+			break;
+		}
+	}
+	fclose(in);
+	return value;
+}
+
+static inline int numa_node_id_cmp(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* returns the number of nodes found (at least 1), or -1 on error */
+static inline int numa_read_meminfo(struct numa_mem *mem)
+{
+	char path[NUMA_PATH_MAX_LEN];
+	struct dirent *ent;
+	DIR *dir;
+	int i, id;
+
+	mem->nr_nodes = 0;
+	dir = opendir("/sys/devices/system/node");
+	if (dir) {
+		while ((ent = readdir(dir)) != NULL && mem->nr_nodes < MAX_NUMA_NODES) {
+			if (sscanf(ent->d_name, "node%d", &id) == 1)
+				mem->node_id[mem->nr_nodes++] = id;
+		}
+		closedir(dir);
+	}
+
+	if (mem->nr_nodes == 0) {
+		mem->nr_nodes = 1;
+		mem->node_id[0] = 0;
+		mem->total[0] = numa_parse_meminfo_value("/proc/meminfo", "MemTotal");
+		mem->free[0] = numa_parse_meminfo_value("/proc/meminfo", "MemFree");
+		mem->file[0] = numa_parse_meminfo_value("/proc/meminfo", "Cached");
+		return (mem->total[0] < 0) ? -1 : 1;
+	}
+
+	qsort(mem->node_id, mem->nr_nodes, sizeof(int), numa_node_id_cmp);
+	for (i = 0; i < mem->nr_nodes; i++) {
+		sprintf(path, "/sys/devices/system/node/node%d/meminfo", mem->node_id[i]);
+		mem->total[i] = numa_parse_meminfo_value(path, "MemTotal");
+		mem->free[i] = numa_parse_meminfo_value(path, "MemFree");
+		mem->file[i] = numa_parse_meminfo_value(path, "FilePages");
+		if (mem->total[i] < 0 || mem->free[i] < 0)
+			return -1;
+	}
+	return mem->nr_nodes;
+}
+
+/*
+ * Fill @usage (bytes, indexed like mem->node_id) from the cgroup's
+ * memory.numa_stat; hierarchical totals are preferred so that child
+ * cgroups are accounted, returns 0 on success
+ */
+static inline int numa_read_cgroup_usage(const char *cgroup_name, const struct numa_mem *mem,
+                                         long long usage[])
+{
+	char path[NUMA_PATH_MAX_LEN], line[1024], *token, *save;
+	int i, id, found = 0;
+	long long pages;
+	FILE *in;
+
+	for (i = 0; i < mem->nr_nodes; i++)
+		usage[i] = 0;
+
+	sprintf(path, "/sys/fs/cgroup/memory/%s/memory.numa_stat", cgroup_name);
+	in = fopen(path, "r");
+	if (!in)
+		return -1;
+	while (fgets(line, sizeof(line), in)) {
+		int hierarchical = (strncmp(line, "hierarchical_total=", 19) == 0);
+		if (!hierarchical && (found || strncmp(line, "total=", 6) != 0))
+			continue;
+		for (token = strtok_r(line, " \n", &save); token; token = strtok_r(NULL, " \n", &save)) {
+			if (sscanf(token, "N%d=%lld", &id, &pages) != 2)
+				continue;
+			for (i = 0; i < mem->nr_nodes; i++) {
+				if (mem->node_id[i] == id)
+					usage[i] = pages << NUMA_PAGE_SHIFT;
+			}
+		}
+		found = 1;
+		if (hierarchical)
+			break;
+	}
+	fclose(in);
+	return found ? 0 : -1;
+}
+
+/* index of the node slot with the most bytes in @value */
+static inline int numa_max_node(const struct numa_mem *mem, const long long value[])
+{
+	int i, best = 0;
+
+	for (i = 1; i < mem->nr_nodes; i++) {
+		if (value[i] > value[best])
+			best = i;
+	}
+	return best;
+}
+
+#endif
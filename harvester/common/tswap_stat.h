@@ -0,0 +1,142 @@
+#ifndef __TSWAP_STAT_H_
+#define __TSWAP_STAT_H_
+
+/*
+ * Reader of tswap's binary statistics (/sys/kernel/tswap/tswap_stat_bin).
+ *
+ * The file holds a versioned snapshot of tswap's counters. Counters only
+ * grow, so any number of readers can keep their own previous snapshot and
+ * compute deltas. Gauges (tswap_stat_is_gauge()) are current levels, like
+ * the pages tswap holds, and are used as they are. Indices follow struct
+ * tswap_stat in tswap/tswap.h; counters are only ever appended, and those
+ * a loaded module does not have yet read as 0.
+ *
+ * Each counter is read atomically, but not all of them at the same
+ * instant, so related counters may disagree by the updates in between.
+ *
+ * Shared between the C++ controllers and the C agents like harvest_shm.h.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TSWAP_STAT_BIN_PATH "/sys/kernel/tswap/tswap_stat_bin"
+#define TSWAP_STAT_MAGIC 0x50575354u  /* "TSWP" */
+#define TSWAP_STAT_VERSION 1
+#define TSWAP_STAT_MAX_COUNTERS 128
+
+enum tswap_stat_counter {
+	TSWAP_STAT_NR_ZOMBIE_PAGE = 0,  /* gauge */
+	TSWAP_STAT_NR_IN_MEMORY_PAGE,  /* gauge */
+	TSWAP_STAT_NR_IN_MEMORY_ZOMBIE_PAGE,  /* gauge */
+	TSWAP_STAT_NR_IN_FLIGHT_PAGE,  /* gauge */
+	TSWAP_STAT_LEN_QUARANTINE_LIST,  /* gauge */
+	TSWAP_STAT_NR_ASYNC_IO,
+	TSWAP_STAT_NR_ASYNC_END_IO,
+	TSWAP_STAT_NR_ASYNC_IO_FAIL,
+	TSWAP_STAT_NR_ASYNC_END_IO_FAIL,
+	TSWAP_STAT_NR_THP,
+	TSWAP_STAT_NR_MALLOC_FAIL,
+	TSWAP_STAT_NR_KMAP_FAIL,
+	TSWAP_STAT_NR_RADIX_TREE_INSERT_FAIL,
+	TSWAP_STAT_NR_RADIX_TREE_DELETE_FAIL,
+	TSWAP_STAT_NR_STORE,
+	TSWAP_STAT_NR_LOAD,
+	TSWAP_STAT_NR_INVALID_LOAD,
+	TSWAP_STAT_NR_OVERWRITE_STORE,
+	TSWAP_STAT_NR_INVALIDATE_PAGE,
+	TSWAP_STAT_NR_INVALID_INVALIDATE_PAGE,
+	TSWAP_STAT_NR_INVALIDATE_AREA,
+	TSWAP_STAT_NR_INIT,
+	TSWAP_STAT_NR_QUARANTINE_DELETE_STALE,
+	TSWAP_STAT_NR_QUARANTINE_SKIP_MEM_ZOMBIE,
+	TSWAP_STAT_NR_DISCHARGE_BIO,
+	TSWAP_STAT_NR_DISCHARGE_PAGE,
+	TSWAP_STAT_DISCHARGE_BUSY_TIME,  /* ms */
+	TSWAP_STAT_NR_RESERVE_PAGE,  /* gauge */
+	TSWAP_STAT_NR_RESERVE_ALLOC,
+	TSWAP_STAT_NR_COMPRESSED_PAGE,  /* gauge */
+	TSWAP_STAT_COMPRESSED_SIZE,  /* gauge, bytes */
+	TSWAP_STAT_NR_COMPRESS_REJECT,
+	TSWAP_STAT_NR_DECOMPRESS_FAIL,
+	TSWAP_STAT_NR_PREFETCH_BIO,
+	TSWAP_STAT_NR_PREFETCH_PAGE,
+	TSWAP_STAT_NR_PREFETCH_HIT,
+	TSWAP_STAT_NR_PREFETCH_INFLIGHT,  /* gauge */
+	TSWAP_STAT_NR_READAHEAD_PAGE,
+	TSWAP_STAT_NR_READAHEAD_HIT,
+	TSWAP_STAT_NR_PROMOTED_PAGE,
+	TSWAP_STAT_NR_DISK_PROMOTED_PAGE,
+	TSWAP_STAT_NR_COUNTERS
+};
+
+struct tswap_stat_snapshot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_counters;
+	uint32_t reserved;
+	uint64_t timestamp_ms;  /* ms since boot on the jiffies clock */
+	uint64_t counters[TSWAP_STAT_MAX_COUNTERS];
+};
+
+/* returns 0, or -1 if tswap is not loaded or has no binary stat */
+static inline int tswap_stat_read(const char *path, struct tswap_stat_snapshot *snapshot)
+{
+	ssize_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	memset(snapshot, 0, sizeof(*snapshot));
+	size = pread(fd, snapshot, sizeof(*snapshot), 0);
+	close(fd);
+	if (size < (ssize_t) offsetof(struct tswap_stat_snapshot, counters)
+	    || snapshot->magic != TSWAP_STAT_MAGIC || snapshot->version != TSWAP_STAT_VERSION)
+		return -1;
+	if (snapshot->nr_counters > TSWAP_STAT_MAX_COUNTERS)
+		snapshot->nr_counters = TSWAP_STAT_MAX_COUNTERS;
+	return 0;
+}
+
+/* whether @counter is a level rather than a count of events */
+static inline int tswap_stat_is_gauge(int counter)
+{
+	switch (counter) {
+	case TSWAP_STAT_NR_ZOMBIE_PAGE:
+	case TSWAP_STAT_NR_IN_MEMORY_PAGE:
+	case TSWAP_STAT_NR_IN_MEMORY_ZOMBIE_PAGE:
+	case TSWAP_STAT_NR_IN_FLIGHT_PAGE:
+	case TSWAP_STAT_LEN_QUARANTINE_LIST:
+	case TSWAP_STAT_NR_RESERVE_PAGE:
+	case TSWAP_STAT_NR_COMPRESSED_PAGE:
+	case TSWAP_STAT_COMPRESSED_SIZE:
+	case TSWAP_STAT_NR_PREFETCH_INFLIGHT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static inline int64_t tswap_stat_counter(const struct tswap_stat_snapshot *snapshot, int counter)
+{
+	return counter < (int) snapshot->nr_counters ? (int64_t) snapshot->counters[counter] : 0;
+}
+
+/* pages tswap holds in memory, less what compression saves */
+static inline int64_t tswap_stat_memory_pages(const struct tswap_stat_snapshot *snapshot, int page_shift)
+{
+	int64_t nr_compressed_page = tswap_stat_counter(snapshot, TSWAP_STAT_NR_COMPRESSED_PAGE);
+	int64_t compressed_size = tswap_stat_counter(snapshot, TSWAP_STAT_COMPRESSED_SIZE);
+
+	return tswap_stat_counter(snapshot, TSWAP_STAT_NR_ZOMBIE_PAGE)
+	       + tswap_stat_counter(snapshot, TSWAP_STAT_NR_IN_MEMORY_PAGE)
+	       + tswap_stat_counter(snapshot, TSWAP_STAT_NR_IN_MEMORY_ZOMBIE_PAGE)
+	       + tswap_stat_counter(snapshot, TSWAP_STAT_NR_IN_FLIGHT_PAGE)
+	       - (((nr_compressed_page << page_shift) - compressed_size) >> page_shift);
+}
+
+#endif
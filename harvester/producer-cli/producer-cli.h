@@ -167,6 +167,9 @@ long long get_tswap_memory_size() {
     while( fscanf(tswap_stat, "%s %ld", key, &value) != EOF) {
         if( (strcmp(key, "nr_zombie_page:") == 0) || (strcmp(key, "nr_in_memory_page:") == 0) || (strcmp(key, "nr_in_memory_zombie_page:") == 0) || (strcmp(key, "nr_in_flight_page:") == 0)) {
             nr_memory_page += value;
+        } else if (strcmp(key, "nr_compress_saved_page:") == 0) {
+            // quarantined pages held compressed take less memory
+            nr_memory_page -= value;
         }
     }
 //    printf("tswap page size: %lld\n", nr_memory_page << PAGE_SHIFT);
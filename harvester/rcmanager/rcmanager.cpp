@@ -9,6 +9,8 @@
 #include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include "../common/cgroup_actuator.h"
+#include "../common/tswap_stat.h"
 
 #define CGROUP_PATH_MAX_LEN 256
 #define MAX_PERFORMANCE_LEN 256
@@ -29,6 +31,7 @@ long g_physical_memory_size;
 
 mutex g_cgroup_limit_lock;
 long g_cgroup_limit;
+cgroup_actuator *g_cgroup_actuator;
 
 atomic_long g_promo_rate;
 atomic_long g_disk_promo_rate;
@@ -46,6 +49,8 @@ chrono::time_point<chrono::system_clock> g_bottom_line_expire_time;
 
 constexpr long g_unit_size = (64 << 20);
 constexpr long g_min_cgroup_limit = 0;
+constexpr long g_actuator_max_decrement = 4 * g_unit_size;
+constexpr long g_actuator_timeout = 3000;  /* ms */
 
 constexpr long g_promo_rate_mi_threshold = (4 << 20);
 constexpr long g_disk_promo_rate_mi_threshold = (64 << 10);
@@ -67,7 +72,8 @@ constexpr long g_dec_sleep_time = 5;
 constexpr long g_warrior_sleep_time = 1;
 constexpr long g_logging_sleep_time = 1;
 
-constexpr long g_touch_rss_bottom_line_ttl = 3 * 300;  /* depends on quarantine time */
+constexpr long g_touch_rss_bottom_line_ttl_factor = 3;  /* times tswap's quarantine time */
+constexpr long g_default_quarantine_time = 300;
 constexpr long g_touch_rss_bottom_line_threshold = 2 * g_ad;
 constexpr long g_overflow_threshold = g_unit_size;
 
@@ -94,23 +100,28 @@ long get_memory_size()
 	exit(1);
 }
 
-bool set_cgroup_limit(const char *cgroup_name, long limit_size)
+/*
+ * Hands the limit to the actuator thread, never blocks on reclaim; returns
+ * false if a previously requested limit could not be applied
+ */
+bool set_cgroup_limit(long limit_size)
 {
-	char cgroup_limit_path[CGROUP_PATH_MAX_LEN];
-	sprintf(cgroup_limit_path,
-	        "/sys/fs/cgroup/memory/%s/memory.limit_in_bytes",
-	        cgroup_name);
-
-	ofstream limit_file;
-	limit_file.open(cgroup_limit_path);
-	if (!limit_file) {
-		cout << "cannot open cgroup limit file" << endl;
-		exit(1);
-	}
-
-	limit_file << limit_size << endl;
+	g_cgroup_actuator->set_target(limit_size);
+	return !g_cgroup_actuator->consume_failure();
+}
 
-	return !!limit_file;
+void print_actuator_stats()
+{
+	cgroup_actuator::stats stats = g_cgroup_actuator->get_stats();
+	cout << "ACTUATOR | target: " << (stats.target_limit >> 20)
+	     << " MB, applied: " << (stats.applied_limit >> 20)
+	     << " MB, requests: " << stats.nr_request
+	     << ", coalesced: " << stats.nr_coalesced
+	     << ", writes: " << stats.nr_write
+	     << ", busy retries: " << stats.nr_busy_retry
+	     << ", failures: " << stats.nr_fail
+	     << ", last latency: " << stats.last_latency_us
+	     << " us, max latency: " << stats.max_latency_us << " us" << endl;
 }
 
 
@@ -274,6 +285,13 @@ long atomic_update_bottom_line(long bottom_line, long ttl, bool extend_current)
 
 long get_tswap_memory_size(const char *tswap_stat_path)
 {
+	/* the binary stat sits next to the text one */
+	struct tswap_stat_snapshot snapshot;
+	if (tswap_stat_read((string(tswap_stat_path) + "_bin").c_str(), &snapshot) == 0) {
+		return tswap_stat_memory_pages(&snapshot, PAGE_SHIFT) << PAGE_SHIFT;
+	}
+
+	/* tswap without the binary stat */
 	ifstream in(tswap_stat_path);
 	if (!in) {
 		cout << "cannot open tswap stat file" << endl;
@@ -288,11 +306,25 @@ long get_tswap_memory_size(const char *tswap_stat_path)
 		    || key == "nr_in_memory_zombie_page:"
 		    || key == "nr_in_flight_page:") {
 			nr_memory_page += value;
+		} else if (key == "nr_compress_saved_page:") {
+			/* quarantined pages held compressed take less memory */
+			nr_memory_page -= value;
 		}
 	}
 	return nr_memory_page << PAGE_SHIFT;
 }
 
+/* tswap's auto mode may change it at any time */
+long get_tswap_quarantine_time()
+{
+	ifstream in("/sys/kernel/tswap/tswap_quarantine_time");
+	long quarantine_time;
+	if (!in || !(in >> quarantine_time)) {
+		return g_default_quarantine_time;
+	}
+	return quarantine_time;
+}
+
 void tswap_prefetch(long prefetch_size)
 {
 	ofstream file("/sys/kernel/tswap/tswap_prefetch");
@@ -357,7 +389,7 @@ void warrior_thread_fn()
 
 			/* perform MI */
 			g_cgroup_limit = min(g_physical_memory_size, (long) (g_mi * g_cgroup_limit));
-			set_cgroup_limit(g_cgroup_name, g_cgroup_limit);
+			set_cgroup_limit(g_cgroup_limit);
 
 			cout << "INC LOOP | promotion rate: " << (promotion_rate >> 20)
 			     << " MB, disk promotion rate: " << (disk_promotion_rate >> 10)
@@ -437,7 +469,9 @@ int main(int argc, char *argv[])
 	sscanf(argv[4], "%ld", &g_cgroup_limit);
 	g_cgroup_limit <<= 20;
 	g_cgroup_limit = min(g_physical_memory_size, g_cgroup_limit);
-	set_cgroup_limit(g_cgroup_name, g_cgroup_limit);
+	g_cgroup_actuator = new cgroup_actuator(g_cgroup_name, g_actuator_max_decrement,
+	                                        chrono::milliseconds(g_actuator_timeout));
+	set_cgroup_limit(g_cgroup_limit);
 	get_promotion_rate(g_promo_file_path);
 	g_bottom_line = -1;
 
@@ -502,7 +536,8 @@ int main(int argc, char *argv[])
 		/* update bottom line */
 		if (proposed_cgroup_limit < rss + g_touch_rss_bottom_line_threshold) {
 			bottom_line = max(g_min_cgroup_limit, rss - g_ad);
-			bottom_line = atomic_update_bottom_line(bottom_line, g_touch_rss_bottom_line_ttl, false);
+			bottom_line = atomic_update_bottom_line(bottom_line,
+			        g_touch_rss_bottom_line_ttl_factor * get_tswap_quarantine_time(), false);
 			proposed_cgroup_limit = max(proposed_cgroup_limit, bottom_line);
 		}
 
@@ -514,16 +549,18 @@ int main(int argc, char *argv[])
 		     << " MB, bottom line: " << (bottom_line >> 20)
 		     << " MB, " << op << endl;
 
-		int ret = set_cgroup_limit(g_cgroup_name, g_cgroup_limit);
+		int ret = set_cgroup_limit(g_cgroup_limit);
 		if (!ret) {
 			g_cgroup_limit = min(g_physical_memory_size, (long)(g_mi * g_cgroup_limit));
-			set_cgroup_limit(g_cgroup_name, g_cgroup_limit);
+			set_cgroup_limit(g_cgroup_limit);
 
 			cout << "DEC LOOP | cgroup limit failed, MI, cgroup limit: "
 			     << (g_cgroup_limit >> 20) << " MB, bottom line: "
 			     << (bottom_line >> 20) << " MB" << endl;
 		}
 		g_cgroup_limit_lock.unlock();
+
+		print_actuator_stats();
 	}
 	return 0;
 }
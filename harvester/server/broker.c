@@ -1,9 +1,18 @@
 /*
-    C socket server example, handles multiple clients using threads
+    Broker of the spot memory marketplace. Producers and consumers keep a
+    connection open; a few reactor threads, each with its own edge-triggered
+    epoll instance, read their frames (spot_proto.h) into per-connection
+    buffers. Frames to a peer are only queued on its connection, under the
+    global lock or not, and sent without blocking by its reactor on
+    EPOLLOUT, so a peer that stops reading stalls no one.
+    Every assignment is a lease that expires in a timing wheel unless the
+    consumer renews it, and gives its slabs back to the producer when it
+    ends.
     Compile
-    gcc server.c -lpthread -o server
+    gcc broker.c -lpthread -o broker
 */
- 
+
+#define _GNU_SOURCE //accept4
 #include<stdio.h>
 #include<string.h>    //strlen
 #include<stdlib.h>    //strlen
@@ -13,13 +22,28 @@
 #include<unistd.h>    //write
 #include<pthread.h> //for threading , link with lpthread
 #include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include "spot_proto.h"
+#include "placement.h"
+#include "registry.h"
+#include "timer_wheel.h"
+#include "matching.h"
+#include "stability.h"
 #define PORT 9700 
-#define MAX_PRODUCER 128
-#define MAX_CONSUMER 128
-#define MAX_CLIENT (MAX_PRODUCER + MAX_CONSUMER)
-#define BUFFER_SIZE 4096
 #define MAX_ID 4
 #define MIN_FREE 1 //Minimum of 1GB free in producer
+#define MAX_NUMA_NODES 16
+#define MAX_REACTORS 16
+#define REACTOR_EVENTS 256
+#define CONN_MAX_OUT (1 << 20) //queued for a peer that does not read, frames beyond are dropped
+#define LEASE_TICK_MS 100
+#define LEASE_UNIT 3600 //seconds per lease_time of a spot request, LEASE_TIME is in hours
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
@@ -29,46 +53,94 @@ enum role {
     CONSUMER = 1
 };
 
-enum msg_type {
-	CONNECTION_ACK = 0,
-	PRODUCER_REG = 1,
-	CONSUMER_REG = 2,
-	REGISTRATION_ACK = 3,
-    PRODUCER_AVAILABILITY = 4,
-	SPOT_REQUEST = 5,
-	SPOT_ASSIGNMENT_CONSUMER = 6,
-    SPOT_ASSIGNMENT_PRODUCER = 7,
-    PRODUCER_READY = 8
+struct lease_t {
+    int id;
+    int producer_id;
+    int consumer_id;
+    int slabs;
+    struct timer_entry timer; //expiry
+    struct lease_t* producer_next; //other leases of the producer
+    struct lease_t* consumer_next; //other leases of the consumer
 };
 
 struct producer_info_t {
-	char ip[200];
+	char ip[SPOT_PROTO_MAX_IP + 1];
 	int port;
 	int nslabs;
-	int available_slabs;
+	int available_slabs; //as reported, leased slabs included
+	int leased_slabs;
+	struct lease_t* leases;
+	struct stability stability; //history of its availability and revocations
 	int id;
-    int sock;
+    struct connection* conn; //NULL once gone
+    int nr_nodes;
+    int node_available_slabs[MAX_NUMA_NODES]; //harvested slabs offered per NUMA node
 };
 
 struct consumer_info_t {
-	char ip[200];
+	char ip[SPOT_PROTO_MAX_IP + 1];
 	int port;
     int id;
     int assigned_slabs;
-    char producer_map[4096]; //TODO: Update the max size or change it to a list
-    int sock;
+    struct lease_t* leases;
+    struct connection* conn; //NULL once gone
 };
 
-struct timeval ts[MAX_ID][4];
+//the bytes of a frame split across reads stay in in until the rest arrives,
+//the frames queued for the peer in out until its socket takes them
+struct connection {
+	int sock;
+	int role; //-1 until registered
+	int id;
+	int epfd; //of its reactor
+	struct spot_inbuf in;
+	pthread_mutex_t out_lock;
+	uint8_t* out;
+	int out_len;
+	int out_cap;
+	int writing; //EPOLLOUT watched, until out is empty
+};
 
-struct producer_info_t producer_list[MAX_PRODUCER + 2];
-struct consumer_info_t consumer_list[MAX_CONSUMER + 2];
+struct reactor {
+	int epfd;
+	pthread_t thread;
+};
+
+struct timeval ts[MAX_ID][4];
 
-atomic_int consumer_id = ATOMIC_VAR_INIT(0);
-atomic_int producer_id = ATOMIC_VAR_INIT(0);
+//registered producers and consumers, under lock
+struct registry producers;
+struct registry consumers;
 
 pthread_mutex_t lock; 
 
+struct reactor reactors[MAX_REACTORS];
+int nr_reactors = 1;
+int listen_sock;
+atomic_uint next_reactor = ATOMIC_VAR_INIT(0);
+
+//producers with available slabs by registry slot, under lock
+struct placement_index placement;
+int placement_policy = PLACEMENT_WORST_FIT;
+int placement_spread = PLACEMENT_DEFAULT_SPREAD;
+
+//live leases and their expiry, in ticks of LEASE_TICK_MS, under lock
+struct registry leases;
+struct timer_wheel lease_wheel;
+int lease_unit = LEASE_UNIT;
+int lease_timer_fd;
+
+//what the stable policy weighs the lifetime of producers against, under lock
+struct stability_ctx stability_ctx;
+
+//requests waiting for the end of the epoch in batch mode, under lock
+int batch_epoch_ms = 0; //0 places each request on arrival
+int batch_timer_fd = -1;
+struct match_request* batch;
+int batch_len, batch_cap;
+struct placement_pick* batch_picks;
+int batch_picks_cap;
+
 void find_placement(int client_id, int spot_size, int lease_time);
 
 void time_stamp(int id, int i){
@@ -84,250 +156,815 @@ int cmp(const void *a,const void *b) {
     return(*(uint32_t *)a-*(uint32_t *)b);
 }
 
-int comparator(const void* p, const void* q) { 
-	return ((struct producer_info_t*)p)->available_slabs < ((struct producer_info_t*)q)->available_slabs; 
-}  
+/* connection output */
+
+void watch_connection(struct connection* conn, uint32_t events) {
+	struct epoll_event ev;
 
-//the thread function
-void *connection_handler(void *);
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | events;
+	ev.data.ptr = conn;
+	if(epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->sock, &ev) < 0)
+		perror("epoll_ctl failed");
+}
+
+//queues the frame for the peer, its reactor sends it; never blocks, so it may be called under lock
+void conn_send(struct connection* conn, const struct spot_msg* msg) {
+	uint8_t* out;
+	int size, cap;
 
-void ip_parser(char* msg, char *ip, int* port) {
-	//portal format 1,192.168.0.12:8000
-	char* ptr = msg, s[] = ",:";
-	char* token = strtok(ptr, s);
-	int token_count = 0, msg_type;
-	
-	while( token != NULL ) {
-		if(token_count == 0) {
-			msg_type = atoi(token);
+	if(conn == NULL)
+		return;
+	pthread_mutex_lock(&conn->out_lock);
+	if(conn->out_cap - conn->out_len < SPOT_PROTO_MAX_FRAME) {
+		for(cap = MAX(conn->out_cap, 4 * SPOT_PROTO_MAX_FRAME); cap - conn->out_len < SPOT_PROTO_MAX_FRAME; cap *= 2);
+		out = cap <= CONN_MAX_OUT ? realloc(conn->out, cap) : NULL;
+		if(out == NULL) {
+			printf("connection %d does not read, message type %d dropped\n", conn->sock, msg->type);
+			pthread_mutex_unlock(&conn->out_lock);
+			return;
 		}
-		else if(token_count == 1) {
-			while(*token)
-				(*ip++)=(*token++);
-			*ip = '\0';
+		conn->out = out;
+		conn->out_cap = cap;
+	}
+	size = spot_encode(msg, conn->out + conn->out_len, conn->out_cap - conn->out_len);
+	if(size > 0) {
+		conn->out_len += size;
+		if(!conn->writing) {
+			conn->writing = 1;
+			watch_connection(conn, EPOLLOUT);
 		}
-		else if(token_count == 2){
-			*port = atoi(token);
+	}
+	pthread_mutex_unlock(&conn->out_lock);
+}
+
+//sends what the socket takes of the queued frames, on EPOLLOUT, and stops watching it once all are out
+void flush_connection(struct connection* conn) {
+	ssize_t n;
+	int off = 0;
+
+	pthread_mutex_lock(&conn->out_lock);
+	while(off < conn->out_len) {
+		n = send(conn->sock, conn->out + off, conn->out_len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n > 0) {
+			off += n;
+			continue;
 		}
-		token = strtok(NULL, s);
-		token_count++;
+		if(n < 0 && errno == EINTR)
+			continue;
+		//EAGAIN: the rest goes with the next EPOLLOUT; an error: the read side closes the connection
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			off = conn->out_len;
+		break;
+	}
+	memmove(conn->out, conn->out + off, conn->out_len - off);
+	conn->out_len -= off;
+	if(conn->out_len == 0 && conn->writing) {
+		conn->writing = 0;
+		watch_connection(conn, 0);
 	}
+	pthread_mutex_unlock(&conn->out_lock);
 }
 
 /* message process related functions */
 
-void send_connection_ack(int sock) {
-	char ack_msg[100];
-	sprintf(ack_msg, "%d", CONNECTION_ACK);
-	write(sock, ack_msg, sizeof(ack_msg));
+void send_connection_ack(struct connection* conn) {
+	struct spot_msg msg = { .type = CONNECTION_ACK };
+	conn_send(conn, &msg);
 }
 
-void send_register_ack(int sock, int id) { 
-	char ack_msg[100];
-	sprintf(ack_msg, "%d,%d", REGISTRATION_ACK, id);
-	write(sock, ack_msg, sizeof(ack_msg));
+void send_register_ack(struct connection* conn, int id) { 
+	struct spot_msg msg = { .type = REGISTRATION_ACK };
+	msg.ack.id = id;
+	conn_send(conn, &msg);
+}
+
+void send_producer_ready_msg(struct consumer_info_t* consumer, int producer_id, int manager_port) {
+	struct spot_msg msg = { .type = PRODUCER_READY };
+	msg.ready.producer_id = producer_id;
+	msg.ready.consumer_id = consumer->id;
+	msg.ready.port = manager_port;
+	conn_send(consumer->conn, &msg);
+}
+
+void set_assignment(struct spot_msg* msg, int type, char* ip, int port, int slabs, int id) {
+	msg->type = type;
+	msg->assignment.count = 1;
+	snprintf(msg->assignment.entries[0].ip, sizeof(msg->assignment.entries[0].ip), "%s", ip);
+	msg->assignment.entries[0].ip[SPOT_PROTO_MAX_IP] = '\0';
+	msg->assignment.entries[0].port = port;
+	msg->assignment.entries[0].slabs = slabs;
+	msg->assignment.entries[0].id = id;
+}
+
+/* lease related functions, all under lock */
+
+uint64_t lease_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / LEASE_TICK_MS;
+}
+
+uint32_t broker_seconds() {
+    return lease_now() * LEASE_TICK_MS / 1000;
+}
+
+uint64_t lease_ticks(int lease_time) {
+    return (uint64_t)MAX(lease_time, 1) * lease_unit * 1000 / LEASE_TICK_MS;
+}
+
+double producer_stability_score(void* ctx, int slot) {
+    struct stability_ctx* sc = ctx;
+    struct producer_info_t* producer = registry_slot_record(&producers, slot);
+
+    return stability_score(&producer->stability, sc->now, sc->lease_seconds);
+}
+
+//the producer can place what it offers minus what is leased out already
+void update_producer_placement(struct producer_info_t* producer) {
+    placement_update(&placement, registry_id_slot(producer->id), producer->available_slabs - producer->leased_slabs);
+}
+
+void send_lease_msg(struct connection* conn, int type, struct lease_t* lease, int reason) {
+    struct spot_msg msg = { .type = type };
+    uint64_t now = lease_now();
+
+    if(conn == NULL)
+        return;
+    msg.lease.lease_id = lease->id;
+    msg.lease.producer_id = lease->producer_id;
+    msg.lease.consumer_id = lease->consumer_id;
+    msg.lease.slabs = lease->slabs;
+    if(type == LEASE_GRANT && lease->timer.expires > now)
+        msg.lease.duration = (lease->timer.expires - now) * LEASE_TICK_MS / 1000;
+    msg.lease.reason = reason;
+    conn_send(conn, &msg);
+}
+
+//leases the slabs picked on the producer to the consumer, returns the lease id or -1
+int grant_lease(struct producer_info_t* producer, struct consumer_info_t* consumer, int slabs, int lease_time) {
+    struct lease_t* lease;
+    int id = registry_alloc(&leases, (void **)&lease);
+
+    if(id < 0)
+        return -1;
+    lease->id = id;
+    lease->producer_id = producer->id;
+    lease->consumer_id = consumer->id;
+    lease->slabs = slabs;
+    timer_wheel_add(&lease_wheel, &lease->timer, lease_now() + lease_ticks(lease_time));
+    lease->producer_next = producer->leases;
+    producer->leases = lease;
+    lease->consumer_next = consumer->leases;
+    consumer->leases = lease;
+    producer->leased_slabs += slabs;
+    consumer->assigned_slabs += slabs;
+    return id;
 }
 
-void send_assignment_msg(int id, char* msg, int role) {
-    if(role == PRODUCER){
-    	write(producer_list[id].sock, msg, strlen(msg));
+//credits the slabs back to the producer and tells both sides
+void end_lease(struct lease_t* lease, int reason) {
+    struct producer_info_t* producer = registry_get(&producers, lease->producer_id);
+    struct consumer_info_t* consumer = registry_get(&consumers, lease->consumer_id);
+    struct lease_t** p;
+
+    printf("lease %d of %d slabs from producer %d to consumer %d ended, reason %d\n", lease->id, lease->slabs, lease->producer_id, lease->consumer_id, reason);
+    timer_wheel_del(&lease_wheel, &lease->timer);
+    if(producer != NULL) {
+        for(p = &producer->leases; *p != lease; p = &(*p)->producer_next);
+        *p = lease->producer_next;
+        producer->leased_slabs -= lease->slabs;
+        //a producer going away is not placed on again
+        if(reason != LEASE_PRODUCER_GONE)
+            update_producer_placement(producer);
+        send_lease_msg(producer->conn, LEASE_END, lease, reason);
+    }
+    if(consumer != NULL) {
+        for(p = &consumer->leases; *p != lease; p = &(*p)->consumer_next);
+        *p = lease->consumer_next;
+        consumer->assigned_slabs -= lease->slabs;
+        send_lease_msg(consumer->conn, LEASE_END, lease, reason);
     }
-    else if(role == CONSUMER){
-        write(consumer_list[id].sock, msg, strlen(msg));
+    registry_free(&leases, lease->id);
+}
+
+void renew_lease(struct connection* conn, int lease_id, int lease_time) {
+    struct lease_t* lease = registry_get(&leases, lease_id);
+    struct consumer_info_t* consumer = registry_get(&consumers, conn->id);
+    struct producer_info_t* producer;
+    struct lease_t gone = { .id = lease_id, .producer_id = -1, .consumer_id = conn->id };
+
+    if(lease == NULL) {
+        //expired or released meanwhile, the consumer has to ask again
+        send_lease_msg(consumer->conn, LEASE_END, &gone, LEASE_EXPIRED);
+        return;
     }
+    if(lease->consumer_id != conn->id)
+        return;
+    timer_wheel_add(&lease_wheel, &lease->timer, lease_now() + lease_ticks(lease_time));
+    producer = registry_get(&producers, lease->producer_id);
+    if(producer != NULL)
+        send_lease_msg(producer->conn, LEASE_GRANT, lease, 0);
+    send_lease_msg(consumer->conn, LEASE_GRANT, lease, 0);
 }
 
-void send_producer_ready_msg(int producer_id, int consumer_id, int manager_port) {
-	char msg[200];
-	sprintf(msg, "%d,%d,%d,%d", PRODUCER_READY, producer_id, consumer_id, manager_port);
-	write(consumer_list[consumer_id].sock, msg, sizeof(msg));
+//either side may give a lease up early, the producer revokes it
+void release_lease(struct connection* conn, int lease_id) {
+    struct lease_t* lease = registry_get(&leases, lease_id);
+    struct producer_info_t* producer;
+
+    if(lease == NULL)
+        return;
+    if(conn->role == CONSUMER && lease->consumer_id == conn->id) {
+        end_lease(lease, LEASE_RELEASED);
+    }
+    else if(conn->role == PRODUCER && lease->producer_id == conn->id) {
+        producer = registry_get(&producers, conn->id);
+        stability_revocation(&producer->stability, broker_seconds());
+        end_lease(lease, LEASE_REVOKED);
+    }
 }
 
-void register_client(char* ip, int port, int role, int sock) {
+//the producer takes @slabs back from the consumer, its leases on the producer are cut newest first
+void shrink_leases(struct producer_info_t* producer, struct consumer_info_t* consumer, int slabs) {
+    struct lease_t *lease, *next;
+    int cut;
+
+    stability_revocation(&producer->stability, broker_seconds());
+    for(lease = consumer->leases; lease != NULL && slabs > 0; lease = next) {
+        next = lease->consumer_next;
+        if(lease->producer_id != producer->id)
+            continue;
+        cut = MIN(lease->slabs, slabs);
+        slabs -= cut;
+        if(cut == lease->slabs) {
+            end_lease(lease, LEASE_SHRUNK);
+            continue;
+        }
+        lease->slabs -= cut;
+        producer->leased_slabs -= cut;
+        consumer->assigned_slabs -= cut;
+    }
+    update_producer_placement(producer);
+}
+
+void expire_leases() {
+    struct timer_entry *t, *next;
+    uint64_t expirations;
+
+    //drain the timerfd, the wheel catches up on missed ticks by itself
+    while(read(lease_timer_fd, &expirations, sizeof(expirations)) > 0);
+    pthread_mutex_lock(&lock);
+    for(t = timer_wheel_advance(&lease_wheel, lease_now()); t != NULL; t = next) {
+        next = t->next;
+        end_lease((struct lease_t*)((char*)t - offsetof(struct lease_t, timer)), LEASE_EXPIRED);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void register_client(char* ip, int port, int role, struct connection* conn) {
+    struct producer_info_t* producer;
+    struct consumer_info_t* consumer;
+    int id = -1;
+
+    if(conn->role != -1) {
+        //registered already, a connection holds a single record
+        send_register_ack(conn, conn->id);
+        return;
+    }
+    pthread_mutex_lock(&lock);
     if(role == PRODUCER) {
-        int p_id = atomic_fetch_add_explicit(&producer_id, 1, memory_order_acquire);
-        memcpy(producer_list[p_id].ip, ip, strlen(ip));
-        producer_list[p_id].port = port;
-        producer_list[p_id].id = p_id;
-        producer_list[p_id].nslabs = 0;
-        producer_list[p_id].available_slabs = 0;
-        producer_list[p_id].sock = sock;
-	printf("producer registered with ip:port %s:%d\n", producer_list[p_id].ip, producer_list[p_id].port = port);
-        send_register_ack(sock, p_id);
+        id = registry_alloc(&producers, (void **)&producer);
+        if(id >= 0 && placement_reserve(&placement, producers.nr_slots) < 0) {
+            registry_free(&producers, id);
+            id = -1;
+        }
+        if(id >= 0) {
+            strcpy(producer->ip, ip);
+            producer->port = port;
+            producer->id = id;
+            producer->conn = conn;
+            stability_init(&producer->stability, broker_seconds());
+        }
     }
     else if (role == CONSUMER) {
-        int c_id = atomic_fetch_add_explicit(&consumer_id, 1, memory_order_acquire);
-        memcpy(consumer_list[c_id].ip, ip, strlen(ip));
-        consumer_list[c_id].port = port;
-        consumer_list[c_id].id = c_id;
-        consumer_list[c_id].assigned_slabs = 0;
-        consumer_list[c_id].sock = sock;
-	printf("consumer registered with ip:port %s:%d\n", consumer_list[c_id].ip, consumer_list[c_id].port);
-        send_register_ack(sock, c_id);
+        id = registry_alloc(&consumers, (void **)&consumer);
+        if(id >= 0) {
+            strcpy(consumer->ip, ip);
+            consumer->port = port;
+            consumer->id = id;
+            consumer->conn = conn;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    if(id < 0) {
+        printf("%s %s:%d rejected, registry full\n", role == PRODUCER ? "producer" : "consumer", ip, port);
+    }
+    else {
+        printf("%s registered with ip:port %s:%d, id %d\n", role == PRODUCER ? "producer" : "consumer", ip, port, id);
+        conn->role = role;
+        conn->id = id;
+    }
+    send_register_ack(conn, id);
+}
+
+void deregister_client(struct connection* conn) {
+    struct producer_info_t* producer;
+    struct consumer_info_t* consumer;
+
+    //its leases end first, the other sides are told and producers credited
+    //the id goes stale at once, its slot is reused with the next generation
+    if(conn->role == PRODUCER) {
+        producer = registry_get(&producers, conn->id);
+        producer->conn = NULL;
+        while(producer->leases != NULL)
+            end_lease(producer->leases, LEASE_PRODUCER_GONE);
+        placement_remove(&placement, registry_id_slot(conn->id));
+        registry_free(&producers, conn->id);
+    }
+    else if(conn->role == CONSUMER) {
+        consumer = registry_get(&consumers, conn->id);
+        consumer->conn = NULL;
+        while(consumer->leases != NULL)
+            end_lease(consumer->leases, LEASE_CONSUMER_GONE);
+        registry_free(&consumers, conn->id);
     }
+    conn->role = -1;
+    conn->id = -1;
 }
 
-void handle_message(char* msg, int sock) {
-	int type, port, spot_size, lease_time, client_id, nslab, available_slab;
-    int producer_id, consumer_id;
-	char ip[200], role[10];
-	
-	sscanf(msg, "%d,", &type);
-	printf("Message type: %d, %s\n", type, msg);
-	switch (type) {
+void handle_message(const struct spot_frame* frame, struct connection* conn) {
+	struct producer_info_t* producer;
+	struct consumer_info_t* consumer;
+	struct spot_msg msg;
+	int i, producer_id;
+
+	if(spot_decode(frame, &msg) < 0) {
+		printf("Message type: %d, malformed (%u bytes)\n", frame->type, frame->payload_len);
+		return;
+	}
+	switch (msg.type) {
 		case PRODUCER_REG:
-			ip_parser(msg, ip, &port);
-			printf("Message type: %d (producer-reg), ip: %s, port: %d\n", type, ip, port);
-            register_client(ip, port, PRODUCER, sock);
+			printf("Message type: %d (producer-reg), ip: %s, port: %d\n", msg.type, msg.reg.ip, msg.reg.port);
+            register_client(msg.reg.ip, msg.reg.port, PRODUCER, conn);
 			break;
 		case CONSUMER_REG:
-			ip_parser(msg, ip, &port);
-			printf("Message type: %d (consumer-reg), ip: %s, port: %d\n", type, ip, port);
-			register_client(ip, port, CONSUMER, sock);
+			printf("Message type: %d (consumer-reg), ip: %s, port: %d\n", msg.type, msg.reg.ip, msg.reg.port);
+			register_client(msg.reg.ip, msg.reg.port, CONSUMER, conn);
 			break;
         case PRODUCER_AVAILABILITY:
-            sscanf(msg, "%d,%d,%d,%d", &type, &producer_id, &available_slab, &nslab);
-	    printf("Message type: %d (producer_availability), id: %d, available: %d, total:%d\n", type, producer_id, available_slab, nslab);
-            producer_list[producer_id].nslabs = nslab;
-            producer_list[producer_id].available_slabs = available_slab;
+            producer_id = msg.availability.id;
+	    printf("Message type: %d (producer_availability), id: %d, available: %d, total:%d\n", msg.type, producer_id, msg.availability.available_slabs, msg.availability.total_slabs);
+            //only from the connection the id was handed to
+            if(conn->role != PRODUCER || conn->id != producer_id)
+                break;
+            pthread_mutex_lock(&lock);
+            producer = registry_get(&producers, producer_id);
+            producer->nslabs = msg.availability.total_slabs;
+            //taking back memory under its leases counts as a revocation
+            if(msg.availability.available_slabs < producer->leased_slabs && producer->available_slabs >= producer->leased_slabs)
+                stability_revocation(&producer->stability, broker_seconds());
+            stability_report(&producer->stability, msg.availability.available_slabs);
+            producer->available_slabs = msg.availability.available_slabs;
+            update_producer_placement(producer);
+            producer->nr_nodes = MIN(msg.availability.nr_nodes, MAX_NUMA_NODES);
+            for(i = 0; i < producer->nr_nodes; i++)
+                producer->node_available_slabs[i] = msg.availability.node_available_slabs[i];
+            pthread_mutex_unlock(&lock);
+            for(i = 0; i < msg.availability.nr_nodes; i++)
+                printf("    node slot %d available: %d\n", i, msg.availability.node_available_slabs[i]);
             break;
 		case SPOT_REQUEST:
-			sscanf(msg, "%d,%d,%d,%d", &type, &client_id, &spot_size, &lease_time);
-			printf("Message type: %d (spot-request), client id: %d, spot size: %d, lease time:%d\n", type, client_id, spot_size, lease_time);
-            find_placement(client_id, spot_size, lease_time);
+			printf("Message type: %d (spot-request), client id: %d, spot size: %d, lease time:%d\n", msg.type, msg.request.consumer_id, msg.request.spot_size, msg.request.lease_time);
+            if(conn->role != CONSUMER || conn->id != msg.request.consumer_id)
+                break;
+            find_placement(msg.request.consumer_id, msg.request.spot_size, msg.request.lease_time);
 			break;
         case PRODUCER_READY:
-            sscanf(msg, "%d,%d,%d,%d", &type, &producer_id, &consumer_id, &port);
-			printf("Message type: %d (producer-ready), from producer: %d to consumer %d at port %d\n", type, producer_id, consumer_id, port);
-			send_producer_ready_msg(producer_id, consumer_id, port);
+			printf("Message type: %d (producer-ready), from producer: %d to consumer %d at port %d\n", msg.type, msg.ready.producer_id, msg.ready.consumer_id, msg.ready.port);
+            if(conn->role != PRODUCER || conn->id != msg.ready.producer_id)
+                break;
+            pthread_mutex_lock(&lock);
+            consumer = registry_get(&consumers, msg.ready.consumer_id);
+            if(consumer != NULL)
+                send_producer_ready_msg(consumer, msg.ready.producer_id, msg.ready.port);
+            pthread_mutex_unlock(&lock);
 			break;
+        case LEASE_RENEW:
+            printf("Message type: %d (lease-renew), lease: %d, consumer: %d, lease time: %d\n", msg.type, msg.lease.lease_id, msg.lease.consumer_id, msg.lease.duration);
+            if(conn->role != CONSUMER || conn->id != msg.lease.consumer_id)
+                break;
+            pthread_mutex_lock(&lock);
+            renew_lease(conn, msg.lease.lease_id, msg.lease.duration);
+            pthread_mutex_unlock(&lock);
+            break;
+        case LEASE_RELEASE:
+            printf("Message type: %d (lease-release), lease: %d\n", msg.type, msg.lease.lease_id);
+            pthread_mutex_lock(&lock);
+            release_lease(conn, msg.lease.lease_id);
+            pthread_mutex_unlock(&lock);
+            break;
+        case SPOT_SHRINK:
+            printf("Message type: %d (spot-shrink), producer %d takes %d slabs back from consumer %d, %d left in %d ms\n", msg.type, msg.shrink.producer_id, msg.shrink.slabs, msg.shrink.consumer_id, msg.shrink.quota_slabs, msg.shrink.deadline_ms);
+            if(conn->role != PRODUCER || conn->id != msg.shrink.producer_id || msg.shrink.slabs <= 0)
+                break;
+            pthread_mutex_lock(&lock);
+            producer = registry_get(&producers, msg.shrink.producer_id);
+            consumer = registry_get(&consumers, msg.shrink.consumer_id);
+            if(consumer != NULL) {
+                //the consumer hears of it before the leases ending with it
+                conn_send(consumer->conn, &msg);
+                shrink_leases(producer, consumer, msg.shrink.slabs);
+            }
+            pthread_mutex_unlock(&lock);
+            break;
         default:
+            printf("Message type: %d, unexpected at the broker\n", msg.type);
             break;
 	}
 }
 
-void find_placement(int consumer_id, int spot_size, int lease_time) {
-    //TODO: make thread-safe
-    pthread_mutex_lock(&lock);
-    
-    int i, count = 0, allocated = 0, p_id, p_count = 0;
-    struct producer_info_t temp_producers[MAX_PRODUCER + 2];
-
-    for(i = 0, count =0; i<MAX_PRODUCER; i++) {
-        if(producer_list[i].available_slabs != 0) {
-            memcpy(&temp_producers[count], &producer_list[i], sizeof(struct producer_info_t));
-            count++;
+//sends the picks to both sides, each one leased on its own, under lock
+void assign_picks(struct consumer_info_t* consumer, struct placement_pick* picks, int nr_picks, int lease_time) {
+    struct spot_msg producer_assignment, consumer_assignment;
+    struct producer_info_t* producer;
+    int i, p_alloc, lease_id;
+
+    for(i = 0; i < nr_picks; i++) {
+        //placement works on registry slots
+        producer = registry_slot_record(&producers, picks[i].id);
+        p_alloc = picks[i].slabs;
+        lease_id = grant_lease(producer, consumer, p_alloc, lease_time);
+        if(lease_id < 0) {
+            printf("no memory for the lease of producer %d, slabs given back\n", producer->id);
+            update_producer_placement(producer);
+            continue;
         }
-    }
 
-    qsort(temp_producers, count, sizeof(struct producer_info_t), comparator);
+        //each side learns the other's ip:port, the slabs and its id
+        set_assignment(&producer_assignment, SPOT_ASSIGNMENT_PRODUCER, consumer->ip, consumer->port, p_alloc, consumer->id);
+        set_assignment(&consumer_assignment, SPOT_ASSIGNMENT_CONSUMER, producer->ip, producer->port, p_alloc, producer->id);
+        conn_send(producer->conn, &producer_assignment);
+        conn_send(consumer->conn, &consumer_assignment);
+        send_lease_msg(producer->conn, LEASE_GRANT, registry_get(&leases, lease_id), 0);
+        send_lease_msg(consumer->conn, LEASE_GRANT, registry_get(&leases, lease_id), 0);
+	printf("producer: %d consumer: %d slabs: %d\n", producer->id, consumer->id, p_alloc);
+    }
+}
 
-    for(i=0; i< count && allocated < spot_size; i++) {
-        char producer_assignment[1024], consumer_assignment[1024];
-        int has_picked = 0, p_alloc = 0;
+void find_placement(int consumer_id, int spot_size, int lease_time) {
+    struct placement_pick picks[SPOT_PROTO_MAX_ASSIGNMENTS];
+    struct match_request* request;
+    struct consumer_info_t* consumer;
+    int nr_picks;
 
-        p_id = temp_producers[i].id;
-        if(temp_producers[i].available_slabs >= (spot_size-allocated)) {
-            p_alloc = spot_size-allocated;
-            producer_list[p_id].available_slabs = MAX(0, temp_producers[i].available_slabs - p_alloc);
-            allocated += p_alloc;
-            has_picked = 1;
-        }
-        else {
-            p_alloc = spot_size - (temp_producers[i].available_slabs - MIN_FREE);
-            if(p_alloc >= 0) {
-                producer_list[p_id].available_slabs = MAX(0, temp_producers[i].available_slabs - p_alloc);
-                allocated += p_alloc;
-                has_picked = 1;
+    pthread_mutex_lock(&lock);
+    consumer = registry_get(&consumers, consumer_id);
+    if(consumer == NULL) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if(batch_epoch_ms > 0) {
+        //matched with the others of the epoch
+        if(batch_len == batch_cap) {
+            request = realloc(batch, MAX(2 * batch_cap, 64) * sizeof(struct match_request));
+            if(request == NULL) {
+                pthread_mutex_unlock(&lock);
+                return;
             }
+            batch = request;
+            batch_cap = MAX(2 * batch_cap, 64);
         }
+        request = &batch[batch_len];
+        request->consumer = consumer_id;
+        request->spot_size = spot_size;
+        request->lease_time = lease_time;
+        request->seq = batch_len++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    stability_ctx.now = broker_seconds();
+    stability_ctx.lease_seconds = (double)MAX(lease_time, 1) * lease_unit;
+    nr_picks = placement_place(&placement, placement_policy, placement_spread, spot_size, MIN_FREE, picks, SPOT_PROTO_MAX_ASSIGNMENTS);
+    assign_picks(consumer, picks, nr_picks, lease_time);
+    pthread_mutex_unlock(&lock);
+}
+
+//matches the requests of the epoch jointly, availability is up to date in the index
+void match_epoch() {
+    struct consumer_info_t* consumer;
+    struct placement_pick* picks;
+    struct timespec t0, t1;
+    uint64_t expirations;
+    int i, n = 0, nr_picks;
 
-        if(has_picked == 1) {
-            p_count++;
-            //<msg_type>,<consumer_count>,<ip:port:slab_size:id>, ...
-            sprintf(producer_assignment, "%d,%d,%s:%d:%d:%d\n", SPOT_ASSIGNMENT_PRODUCER, 1, consumer_list[consumer_id].ip, consumer_list[consumer_id].port, p_alloc, consumer_list[consumer_id].id);
-            sprintf(consumer_assignment, "%d,%d,%s:%d:%d:%d\n", SPOT_ASSIGNMENT_CONSUMER, 1, producer_list[p_id].ip, producer_list[p_id].port, p_alloc, producer_list[p_id].id);
-            send_assignment_msg(p_id, producer_assignment, PRODUCER);
-            send_assignment_msg(consumer_id, consumer_assignment, CONSUMER);
-		printf("producer: %s consumer: %s\n", producer_assignment, consumer_assignment);
+    while(read(batch_timer_fd, &expirations, sizeof(expirations)) > 0);
+    pthread_mutex_lock(&lock);
+    //consumers gone since their request are not placed on
+    for(i = 0; i < batch_len; i++) {
+        if(registry_get(&consumers, batch[i].consumer) != NULL)
+            batch[n++] = batch[i];
+    }
+    batch_len = 0;
+    if(n == 0) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if(n * SPOT_PROTO_MAX_ASSIGNMENTS > batch_picks_cap) {
+        picks = realloc(batch_picks, n * SPOT_PROTO_MAX_ASSIGNMENTS * sizeof(struct placement_pick));
+        if(picks == NULL) {
+            printf("no memory to match %d requests, dropped\n", n);
+            pthread_mutex_unlock(&lock);
+            return;
         }
+        batch_picks = picks;
+        batch_picks_cap = n * SPOT_PROTO_MAX_ASSIGNMENTS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    nr_picks = match_batch(&placement, batch, n, MIN_FREE, batch_picks, batch_picks_cap, SPOT_PROTO_MAX_ASSIGNMENTS);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for(i = 0; i < n; i++) {
+        if(batch[i].nr_picks == 0)
+            continue;
+        consumer = registry_get(&consumers, batch[i].consumer);
+        assign_picks(consumer, batch_picks + batch[i].first_pick, batch[i].nr_picks, batch[i].lease_time);
     }
     pthread_mutex_unlock(&lock);
+    printf("epoch: %d requests matched on %d producers in %ld us\n", n, nr_picks,
+           (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
 }
  
+/* network related functions */
+
+void raise_fd_limit() {
+	struct rlimit rl;
+
+	//one descriptor per producer and consumer
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+void close_connection(struct connection* conn) {
+	pthread_mutex_lock(&lock);
+	deregister_client(conn);
+	close(conn->sock);
+	pthread_mutex_unlock(&lock);
+	pthread_mutex_destroy(&conn->out_lock);
+	free(conn->out);
+	free(conn);
+}
+
+int dispatch_messages(struct connection* conn) {
+	struct spot_frame frame;
+	int ret;
+
+	while((ret = spot_inbuf_next(&conn->in, &frame)) == 1)
+		handle_message(&frame, conn);
+	return ret;
+}
+
+void read_connection(struct connection* conn) {
+	ssize_t read_size;
+
+	//edge-triggered: read until the socket is drained
+	while(1) {
+		read_size = spot_inbuf_recv(conn->sock, &conn->in, MSG_DONTWAIT);
+		if(read_size > 0) {
+			if(dispatch_messages(conn) < 0) {
+				printf("closing connection %d, not a spot protocol stream\n", conn->sock);
+				close_connection(conn);
+				return;
+			}
+		}
+		else if(read_size < 0 && errno == EINTR) {
+			continue;
+		}
+		else if(read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		else {
+			close_connection(conn);
+			return;
+		}
+	}
+}
+
+void accept_connections() {
+	struct sockaddr_in client;
+	socklen_t c = sizeof(struct sockaddr_in);
+	struct epoll_event ev;
+	struct connection* conn;
+	struct reactor* reactor;
+	int client_sock;
+
+	while((client_sock = accept4(listen_sock, (struct sockaddr *)&client, &c, SOCK_CLOEXEC)) >= 0) {
+		conn = malloc(sizeof(struct connection));
+		if(conn == NULL) {
+			close(client_sock);
+			continue;
+		}
+		reactor = &reactors[atomic_fetch_add(&next_reactor, 1) % nr_reactors];
+		conn->sock = client_sock;
+		conn->role = -1;
+		conn->id = -1;
+		conn->epfd = reactor->epfd;
+		spot_inbuf_init(&conn->in);
+		pthread_mutex_init(&conn->out_lock, NULL);
+		conn->out = NULL;
+		conn->out_len = conn->out_cap = 0;
+
+		//the ack goes out with the first EPOLLOUT, watched from the start
+		conn->writing = 1;
+		send_connection_ack(conn);
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLOUT;
+		ev.data.ptr = conn;
+		if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+			perror("epoll_ctl failed");
+			close(client_sock);
+			pthread_mutex_destroy(&conn->out_lock);
+			free(conn->out);
+			free(conn);
+		}
+	}
+	if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+		perror("accept failed");
+}
+
+void *reactor_loop(void *arg) {
+	struct reactor* reactor = arg;
+	struct epoll_event events[REACTOR_EVENTS];
+	int i, n;
+
+	while(1) {
+		n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("epoll_wait failed");
+			exit(1);
+		}
+		for(i = 0; i < n; i++) {
+			//the listening socket is the only one without a connection
+			if(events[i].data.ptr == NULL)
+				accept_connections();
+			else if(events[i].data.ptr == &lease_timer_fd)
+				expire_leases();
+			else if(events[i].data.ptr == &batch_timer_fd)
+				match_epoch();
+			else {
+				//a connection, written before it is read as reading may close it
+				if(events[i].events & EPOLLOUT)
+					flush_connection(events[i].data.ptr);
+				if(events[i].events & ~EPOLLOUT)
+					read_connection(events[i].data.ptr);
+			}
+		}
+	}
+	return NULL;
+}
+
+void usage() {
+	printf("Usage ./broker [-p port] [-t reactor-threads] [-P worst-fit|best-fit|p2c|spread|stable] [-k spread] [-L lease-unit] [-B epoch-ms]\n");
+	printf("Default port is %d, with 1 reactor thread (at most %d)\n", PORT, MAX_REACTORS);
+	printf("Default placement policy is %s, spread places on the k (default %d) largest producers\n", placement_policy_names[PLACEMENT_WORST_FIT], PLACEMENT_DEFAULT_SPREAD);
+	printf("stable prefers the producers least likely to revoke within the lease, judged by their availability history\n");
+	printf("With an epoch, the requests of each epoch are matched together, largest first on the fewest producers, instead of by the policy on arrival\n");
+	printf("Leases last lease_time times the lease unit, default %d seconds, unless renewed\n", LEASE_UNIT);
+	printf("\n");
+}
+
 int main(int argc , char *argv[]){
-    int socket_desc, client_sock, c;
-    struct sockaddr_in server, client;
-     
+    struct sockaddr_in server;
+    struct epoll_event ev;
+    struct itimerspec tick = { { 0, LEASE_TICK_MS * 1000000 }, { 0, LEASE_TICK_MS * 1000000 } };
+    struct itimerspec epoch;
+    int opt, i, port = PORT, reuse = 1;
+
+    while ((opt = getopt(argc, argv, "hp:t:P:k:L:B:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            nr_reactors = MAX(1, MIN(atoi(optarg), MAX_REACTORS));
+            break;
+        case 'P':
+            placement_policy = placement_policy_parse(optarg);
+            if (placement_policy < 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'k':
+            placement_spread = MAX(1, atoi(optarg));
+            break;
+        case 'L':
+            lease_unit = MAX(1, atoi(optarg));
+            break;
+        case 'B':
+            batch_epoch_ms = MAX(0, atoi(optarg));
+            break;
+        default:
+            break;
+        }
+    }
+
+    raise_fd_limit();
+    //a peer closing early must not kill the broker in write()
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&lock, NULL);
+    registry_init(&producers, sizeof(struct producer_info_t));
+    registry_init(&consumers, sizeof(struct consumer_info_t));
+    if (placement_init(&placement, REGISTRY_SLAB_RECORDS) < 0) {
+        printf("cannot allocate the placement index\n");
+        return 1;
+    }
+    placement.score = producer_stability_score;
+    placement.score_ctx = &stability_ctx;
+    registry_init(&leases, sizeof(struct lease_t));
+    timer_wheel_init(&lease_wheel, lease_now());
+
     //Create socket
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    if (socket_desc == -1){
-        printf("Could not create socket");
+    listen_sock = socket(AF_INET , SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC , 0);
+    if (listen_sock == -1){
+        perror("Could not create socket");
+        return 1;
     }
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     puts("Socket created");
      
     //Prepare the sockaddr_in structure
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons( PORT );
+    server.sin_port = htons( port );
      
     //Bind
-    if( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0) {
+    if( bind(listen_sock,(struct sockaddr *)&server , sizeof(server)) < 0) {
         //print the error message
         perror("bind failed. Error");
         return 1;
     }
     puts("bind done");
      
-    //Listen
-    listen(socket_desc , 3);
-     
-    //Accept and incoming connection
-    puts("Waiting for incoming connections...");
-    c = sizeof(struct sockaddr_in);
-     
-     
-    //Accept and incoming connection
-    puts("Waiting for incoming connections...");
-    c = sizeof(struct sockaddr_in);
-    pthread_t thread_id;
-	
-    while( (client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c)) ){
-        puts("Connection accepted");
-         
-        if( pthread_create( &thread_id , NULL,  connection_handler , (void*) &client_sock) < 0){
-            perror("could not create thread");
+    //Listen, connection storms queue in the kernel instead of being refused
+    if (listen(listen_sock , SOMAXCONN) < 0) {
+        perror("listen failed");
+        return 1;
+    }
+
+    for (i = 0; i < nr_reactors; i++) {
+        reactors[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epfd < 0) {
+            perror("epoll_create1 failed");
             return 1;
         }
-         
-        //Now join the thread , so that we dont terminate before the thread
-//        pthread_join( thread_id , NULL);
-        puts("Handler assigned");
     }
-     
-    if (client_sock < 0){
-        perror("accept failed");
+
+    //reactor 0 accepts and spreads the connections round-robin
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactors[0].epfd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
         return 1;
     }
+
+    //so does it expire the leases, every tick, and match the epochs
+    lease_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &lease_timer_fd;
+    if (lease_timer_fd < 0 || timerfd_settime(lease_timer_fd, 0, &tick, NULL) < 0 ||
+        epoll_ctl(reactors[0].epfd, EPOLL_CTL_ADD, lease_timer_fd, &ev) < 0) {
+        perror("lease timer failed");
+        return 1;
+    }
+    if (batch_epoch_ms > 0) {
+        epoch.it_interval.tv_sec = epoch.it_value.tv_sec = batch_epoch_ms / 1000;
+        epoch.it_interval.tv_nsec = epoch.it_value.tv_nsec = (batch_epoch_ms % 1000) * 1000000L;
+        batch_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &batch_timer_fd;
+        if (batch_timer_fd < 0 || timerfd_settime(batch_timer_fd, 0, &epoch, NULL) < 0 ||
+            epoll_ctl(reactors[0].epfd, EPOLL_CTL_ADD, batch_timer_fd, &ev) < 0) {
+            perror("epoch timer failed");
+            return 1;
+        }
+    }
+
+    for (i = 1; i < nr_reactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i]) != 0) {
+            perror("could not create reactor thread");
+            return 1;
+        }
+    }
+
+    puts("Waiting for incoming connections...");
+    reactor_loop(&reactors[0]);
      
     return 0;
 }
- 
-/*
- * This will handle connection for each client
- * */
-void *connection_handler(void *socket_desc) {
-    //Get the socket descriptor
-    int sock = *(int*)socket_desc;
-    int read_size;
-    char client_message[BUFFER_SIZE];
-
-    send_connection_ack(sock);
-    
-    //Receive a message from client
-    while( (read_size = recv(sock , client_message , BUFFER_SIZE , 0)) > 0 ){
-	    handle_message(client_message, sock);
-    } 
-
-    return 0;
-} 
@@ -0,0 +1,285 @@
+/*
+    Loopback load test of the broker: opens many producer and consumer
+    connections at once, registers each of them and keeps them open.
+    Reports registrations/sec and the latency of the broker's replies.
+    Compile
+    gcc broker_loadtest.c -o broker_loadtest
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "spot_proto.h"
+
+#define BROKER_IP "127.0.0.1"
+#define BROKER_PORT 9700
+#define NR_CLIENTS 10000
+#define MAX_PENDING 512 //clients connecting or registering at the same time
+#define MAX_EVENTS 256
+
+enum client_state {
+	IDLE = 0,
+	CONNECTING = 1,
+	WAIT_CONNECTION_ACK = 2,
+	WAIT_REGISTRATION_ACK = 3,
+	DONE = 4
+};
+
+struct client {
+	int sock;
+	int state;
+	uint64_t connect_ns;
+	uint64_t register_ns;
+	struct spot_inbuf in;
+};
+
+struct client *clients;
+uint64_t *ack_latency, *reg_latency; //ns
+int nr_clients = NR_CLIENTS, max_pending = MAX_PENDING;
+int nr_started, nr_done, nr_registered, nr_rejected, nr_failed, nr_ack, nr_reg;
+int epfd;
+struct sockaddr_in broker_addr;
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+uint64_t percentile(uint64_t *v, int n, double p) {
+	if(n == 0)
+		return 0;
+	return v[(int)((n - 1) * p)];
+}
+
+void finish_client(struct client *cl, int failed) {
+	cl->state = DONE;
+	nr_done++;
+	if(failed) {
+		nr_failed++;
+		close(cl->sock);
+	}
+	//registered clients stay connected, the broker keeps holding them
+}
+
+void start_client(int i) {
+	struct client *cl = &clients[i];
+	struct epoll_event ev;
+
+	cl->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(cl->sock < 0) {
+		perror("socket failed");
+		exit(1);
+	}
+	spot_inbuf_init(&cl->in);
+	cl->state = CONNECTING;
+	cl->connect_ns = now_ns();
+	nr_started++;
+	if(connect(cl->sock, (struct sockaddr *)&broker_addr, sizeof(broker_addr)) < 0 && errno != EINPROGRESS) {
+		finish_client(cl, 1);
+		return;
+	}
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.u32 = i;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, cl->sock, &ev) < 0) {
+		perror("epoll_ctl failed");
+		exit(1);
+	}
+}
+
+void send_registration(int i) {
+	struct client *cl = &clients[i];
+	struct spot_msg msg;
+
+	//even clients are producers, odd ones consumers
+	msg.type = i % 2 ? CONSUMER_REG : PRODUCER_REG;
+	strcpy(msg.reg.ip, "127.0.0.1");
+	msg.reg.port = 10000 + i % 50000;
+	cl->state = WAIT_REGISTRATION_ACK;
+	cl->register_ns = now_ns();
+	if(spot_send(cl->sock, &msg) < 0)
+		finish_client(cl, 1);
+}
+
+void handle_message(int i, const struct spot_frame *frame) {
+	struct client *cl = &clients[i];
+	struct spot_msg msg;
+
+	if(spot_decode(frame, &msg) < 0)
+		return;
+	if(msg.type == CONNECTION_ACK && cl->state == WAIT_CONNECTION_ACK) {
+		ack_latency[nr_ack++] = now_ns() - cl->connect_ns;
+		send_registration(i);
+	}
+	else if(msg.type == REGISTRATION_ACK && cl->state == WAIT_REGISTRATION_ACK) {
+		reg_latency[nr_reg++] = now_ns() - cl->register_ns;
+		if(msg.ack.id < 0)
+			nr_rejected++;
+		else
+			nr_registered++;
+		finish_client(cl, 0);
+	}
+}
+
+void read_client(int i) {
+	struct client *cl = &clients[i];
+	struct spot_frame frame;
+	ssize_t n;
+	int ret = 0;
+
+	while(cl->state != DONE) {
+		n = spot_inbuf_recv(cl->sock, &cl->in, 0);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(n <= 0) {
+			finish_client(cl, 1);
+			return;
+		}
+		while(cl->state != DONE && (ret = spot_inbuf_next(&cl->in, &frame)) == 1)
+			handle_message(i, &frame);
+		if(cl->state != DONE && ret < 0)
+			finish_client(cl, 1);
+	}
+}
+
+void handle_event(int i, uint32_t events) {
+	struct client *cl = &clients[i];
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(cl->state == DONE)
+		return;
+	if(cl->state == CONNECTING) {
+		if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+		getsockopt(cl->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+		if(err) {
+			finish_client(cl, 1);
+			return;
+		}
+		cl->state = WAIT_CONNECTION_ACK;
+	}
+	if(events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		read_client(i);
+}
+
+void raise_fd_limit() {
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nr_clients + 16)
+		printf("warning: only %ld descriptors, the broker needs as many\n", (long)rl.rlim_cur);
+}
+
+void usage() {
+	printf("Usage ./broker_loadtest [-b broker-ip] [-p broker-port] [-n clients] [-c pending-clients]\n");
+	printf("Default broker ip:port is %s:%d, %d clients, at most %d connecting at once\n", BROKER_IP, BROKER_PORT, NR_CLIENTS, MAX_PENDING);
+	printf("Half of the clients register as producers and half as consumers\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct epoll_event events[MAX_EVENTS];
+	char broker_ip[200] = BROKER_IP;
+	int opt, i, n, next = 0, broker_port = BROKER_PORT;
+	uint64_t start, elapsed;
+
+	while((opt = getopt(argc, argv, "hb:p:n:c:")) != -1) {
+		switch(opt) {
+		case 'h':
+			usage();
+			return 0;
+		case 'b':
+			strncpy(broker_ip, optarg, sizeof(broker_ip) - 1);
+			break;
+		case 'p':
+			broker_port = atoi(optarg);
+			break;
+		case 'n':
+			nr_clients = atoi(optarg);
+			break;
+		case 'c':
+			max_pending = atoi(optarg);
+			break;
+		default:
+			break;
+		}
+	}
+	if(nr_clients <= 0 || max_pending <= 0) {
+		usage();
+		return 1;
+	}
+
+	raise_fd_limit();
+	clients = calloc(nr_clients, sizeof(struct client));
+	ack_latency = calloc(nr_clients, sizeof(uint64_t));
+	reg_latency = calloc(nr_clients, sizeof(uint64_t));
+	if(!clients || !ack_latency || !reg_latency) {
+		printf("cannot allocate %d clients\n", nr_clients);
+		return 1;
+	}
+
+	memset(&broker_addr, 0, sizeof(broker_addr));
+	broker_addr.sin_family = AF_INET;
+	broker_addr.sin_port = htons(broker_port);
+	if(inet_pton(AF_INET, broker_ip, &broker_addr.sin_addr) <= 0) {
+		printf("invalid broker address %s\n", broker_ip);
+		return 1;
+	}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0) {
+		perror("epoll_create1 failed");
+		return 1;
+	}
+
+	start = now_ns();
+	while(nr_done < nr_clients) {
+		while(next < nr_clients && nr_started - nr_done < max_pending)
+			start_client(next++);
+		n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+		if(n < 0 && errno != EINTR) {
+			perror("epoll_wait failed");
+			return 1;
+		}
+		if(n == 0) {
+			printf("no reply for 1s, %d of %d clients done\n", nr_done, nr_clients);
+			break;
+		}
+		for(i = 0; i < n; i++)
+			handle_event(events[i].data.u32, events[i].events);
+	}
+	elapsed = now_ns() - start;
+
+	qsort(ack_latency, nr_ack, sizeof(uint64_t), cmp);
+	qsort(reg_latency, nr_reg, sizeof(uint64_t), cmp);
+	printf("clients: %d, registered: %d, rejected: %d, failed: %d, in %.3f s\n",
+	       nr_clients, nr_registered, nr_rejected, nr_failed, elapsed / 1e9);
+	printf("registrations/sec: %.0f\n", nr_reg / (elapsed / 1e9));
+	printf("connection ack latency (us): p50 %.1f p99 %.1f max %.1f\n",
+	       percentile(ack_latency, nr_ack, 0.5) / 1e3, percentile(ack_latency, nr_ack, 0.99) / 1e3,
+	       percentile(ack_latency, nr_ack, 1.0) / 1e3);
+	printf("registration latency (us): p50 %.1f p99 %.1f max %.1f\n",
+	       percentile(reg_latency, nr_reg, 0.5) / 1e3, percentile(reg_latency, nr_reg, 0.99) / 1e3,
+	       percentile(reg_latency, nr_reg, 1.0) / 1e3);
+	return 0;
+}
@@ -6,30 +6,27 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "spot_proto.h"
+#include "spot_client.h"
 
 #define BROKER_IP "192.168.122.91"
 #define BROKER_PORT 9700 
 #define CONSUMER_IP "192.168.122.202"
 #define CONSUMER_PORT 9704 
 #define MAX_CLIENT 128
-#define MAX_PRODUCER 128
+#define MAX_PRODUCER 128 // serving at once, producer_list is searched by broker id
 #define PAGE_SIZE 4096
 #define BUFFER_SIZE 8192
 #define SPOT_SIZE 5 // interms of GB
 #define LEASE_TIME 1 // interms of hour
+#define MAX_LEASE 256
+#define LEASE_CHECK_INTERVAL 1 // seconds between checks for leases to renew
 #define REMOTE_RATIO 0 //all local; ranges from 0-10; multiple of 10%; eg, 3 means 30% in remote
-
-enum msg_type {
-	CONNECTION_ACK = 0,
-	PRODUCER_REG = 1,
-	CONSUMER_REG = 2,
-	REGISTRATION_ACK = 3,
-    PRODUCER_AVAILABILITY = 4,
-	SPOT_REQUEST = 5,
-	SPOT_ASSIGNMENT_CONSUMER = 6,
-    SPOT_ASSIGNMENT_PRODUCER = 7,
-	PRODUCER_READY = 8
-};
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
 enum manager_state {
 	STOP = 0,
@@ -43,6 +40,16 @@ struct producer_info_t {
 	int id;
 	int manager_port;
 	int manager_state;
+	pid_t app_pid; // the application using the producer, 0 if none
+};
+
+struct lease_info_t {
+	int id; // -1 if free
+	int producer_id;
+	int slabs;
+	int duration; // seconds granted
+	time_t expires; // on the monotonic clock
+	int renewing;
 };
 
 struct {
@@ -59,89 +66,223 @@ struct {
 	int lease_time;
 	int remote_ratio;
 	struct producer_info_t producer_list[MAX_PRODUCER + 2];
+	struct lease_info_t lease_list[MAX_LEASE];
 } consumer;
 
+struct spot_client spot_client; // keys spread over the running producers by their slabs
+
 void run_consumer_redis();
-void run_consumer_app(int producer_id);
+void run_consumer_app(int slot);
+void stop_consumer_app(int slot);
 
-void portal_parser(char* msg) {
-	//portal format 1,2,192.168.0.12:8000:10,192.168.0.11:9400:20
-	//<msg_type>,<producer_count>,<ip:port:slab_size:id>, ...
+// slot of producer @id in producer_list, a free one if @add and it has none, else -1
+int producer_slot(int id, int add) {
+	int i, free_slot = -1;
 
-	char ptr[1024], s[] = ",:", addr[200];
-	memcpy(ptr, msg, strlen(msg));
-	char* token = strtok(ptr, s);
-	int token_count = 0, type, producer_count = 0, port, size, id;
-	
-	while( token != NULL ) {
-		if(token_count == 0) {
-			type = atoi(token);
-		}
-		else if(token_count == 1) {
-			producer_count = atoi(token);
-		}
-		else if(token_count % 4 == 2) {
-			memcpy(addr, token, strlen(token));
-		}
-		else if(token_count % 4 == 3){
-			port = atoi(token); 
-		}
-		else if(token_count % 4 == 0){
-			size = atoi(token); 
-		}
-		else {
-			id = atoi(token);
-			consumer.producer_list[id].id = id;
-			consumer.producer_list[id].port = port;
-			consumer.producer_list[id].nslabs = consumer.producer_list[id].nslabs + size;
-			memcpy(consumer.producer_list[id].ip, addr, strlen(addr));
-			printf("Msg type: %d, producer ip: %s, port: %d, slab size: %d, id: %d\n", type, addr, port, size, id);
+	if(id < 0)
+		return -1;
+	for(i = 0; i < MAX_PRODUCER; i++) {
+		if(consumer.producer_list[i].id == id)
+			return i;
+		if(free_slot < 0 && consumer.producer_list[i].id < 0)
+			free_slot = i;
+	}
+	if(add && free_slot >= 0)
+		consumer.producer_list[free_slot].id = id;
+	return add ? free_slot : -1;
+}
+
+// follows the slabs of the producer in slot @slot once its spot store is up
+void sync_spot_client(int slot) {
+	struct producer_info_t* producer = &consumer.producer_list[slot];
+	int slabs = producer->manager_state == RUNNING ? producer->nslabs : 0;
+
+	if(spot_client_update(&spot_client, producer->id, producer->ip, producer->manager_port, slabs, NULL, NULL) < 0) {
+		printf("cannot route keys to producer %d\n", producer->id);
+		return;
+	}
+	if(slabs > 0)
+		printf("producer %d holds %.1f%% of the keys\n", producer->id, 100 * spot_client_share(&spot_client, spot_client_slot(&spot_client, producer->id)));
+}
+
+void assignment_parser(struct spot_msg_assignment* assignment) {
+	struct spot_assignment* entry;
+	int i, slot;
+
+	for(i = 0; i < assignment->count; i++) {
+		entry = &assignment->entries[i];
+		slot = producer_slot(entry->id, 1);
+		if(slot < 0) {
+			printf("no room for producer %d, %d producers in use\n", entry->id, MAX_PRODUCER);
+			continue;
 		}
-		token = strtok(NULL, s);
-		token_count++;
+		consumer.producer_list[slot].port = entry->port;
+		consumer.producer_list[slot].nslabs = consumer.producer_list[slot].nslabs + entry->slabs;
+		strcpy(consumer.producer_list[slot].ip, entry->ip);
+		sync_spot_client(slot);
+		printf("producer ip: %s, port: %d, slab size: %d, id: %d\n", entry->ip, entry->port, entry->slabs, entry->id);
 	}
 }
 
 void send_registration_msg() {
-	char msg[300];
-	sprintf(msg, "%d,%s,%d", CONSUMER_REG, consumer.ip, consumer.port);
-	write(broker.sock, msg, sizeof(msg));
+	struct spot_msg msg = { .type = CONSUMER_REG };
+	if(snprintf(msg.reg.ip, sizeof(msg.reg.ip), "%s", consumer.ip) >= (int) sizeof(msg.reg.ip))
+		printf("ip %s is longer than %d characters, registering as %s\n", consumer.ip, SPOT_PROTO_MAX_IP, msg.reg.ip);
+	msg.reg.port = consumer.port;
+	spot_send(broker.sock, &msg);
 }
 
 void send_spot_request() {
-	char msg[200];
-	sprintf(msg, "%d,%d,%d,%d", SPOT_REQUEST, consumer.id, consumer.spot_size, consumer.lease_time);
-	write(broker.sock, msg, sizeof(msg));
+	struct spot_msg msg = { .type = SPOT_REQUEST };
+	msg.request.consumer_id = consumer.id;
+	msg.request.spot_size = consumer.spot_size;
+	msg.request.lease_time = consumer.lease_time;
+	spot_send(broker.sock, &msg);
+}
+
+time_t monotonic_seconds() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+// slot of lease @id in lease_list, a free one if @add and it has none, else -1
+int lease_slot(int id, int add) {
+	int i, free_slot = -1;
+
+	if(id < 0)
+		return -1;
+	for(i = 0; i < MAX_LEASE; i++) {
+		if(consumer.lease_list[i].id == id)
+			return i;
+		if(free_slot < 0 && consumer.lease_list[i].id < 0)
+			free_slot = i;
+	}
+	if(add && free_slot >= 0)
+		consumer.lease_list[free_slot].id = id;
+	return add ? free_slot : -1;
+}
+
+void grant_lease(struct spot_msg_lease* grant) {
+	int slot = lease_slot(grant->lease_id, 1);
+
+	if(slot < 0) {
+		printf("no room for lease %d, %d leases held\n", grant->lease_id, MAX_LEASE);
+		return;
+	}
+	consumer.lease_list[slot].producer_id = grant->producer_id;
+	consumer.lease_list[slot].slabs = grant->slabs;
+	consumer.lease_list[slot].duration = grant->duration;
+	consumer.lease_list[slot].expires = monotonic_seconds() + grant->duration;
+	consumer.lease_list[slot].renewing = 0;
 }
 
-void handle_message(char* msg) {
-	int type, i, producer_id, consumer_id, manager_port;
+// the broker took the lease back, the producer's slabs with it
+void end_lease(struct spot_msg_lease* lease) {
+	int slot = lease_slot(lease->lease_id, 0), producer;
+
+	if(slot >= 0)
+		consumer.lease_list[slot].id = -1;
+	producer = producer_slot(lease->producer_id, 0);
+	// slabs taken back by a shrink are accounted for already
+	if(producer < 0 || lease->reason == LEASE_SHRUNK)
+		return;
+	consumer.producer_list[producer].nslabs = MAX(consumer.producer_list[producer].nslabs - lease->slabs, 0);
+	sync_spot_client(producer);
+	if(consumer.producer_list[producer].nslabs == 0) {
+		stop_consumer_app(producer);
+		consumer.producer_list[producer].id = -1;
+		consumer.producer_list[producer].manager_state = STOP;
+	}
+}
+
+// the producer takes slabs back; its store drops its coldest items to fit by the deadline,
+// no keys are moved off it, so the application misses on them afterwards
+void shrink_spot(struct spot_msg_shrink* shrink) {
+	int producer = producer_slot(shrink->producer_id, 0);
+
+	if(producer < 0)
+		return;
+	consumer.producer_list[producer].nslabs = MAX(consumer.producer_list[producer].nslabs - shrink->slabs, 0);
+	sync_spot_client(producer);
+	if(consumer.producer_list[producer].nslabs == 0) {
+		stop_consumer_app(producer);
+		consumer.producer_list[producer].id = -1;
+		consumer.producer_list[producer].manager_state = STOP;
+	}
+}
+
+// renews the leases with less than a quarter of their time left
+void renew_leases() {
+	struct spot_msg msg = { .type = LEASE_RENEW };
+	time_t now = monotonic_seconds();
+	struct lease_info_t* lease;
+	int i;
+
+	for(i = 0; i < MAX_LEASE; i++) {
+		lease = &consumer.lease_list[i];
+		if(lease->id < 0 || lease->renewing || lease->expires - now > lease->duration / 4)
+			continue;
+		msg.lease.lease_id = lease->id;
+		msg.lease.producer_id = lease->producer_id;
+		msg.lease.consumer_id = consumer.id;
+		msg.lease.slabs = lease->slabs;
+		msg.lease.duration = consumer.lease_time;
+		if(spot_send(broker.sock, &msg) == 0)
+			lease->renewing = 1;
+	}
+}
+
+void handle_message(const struct spot_frame* frame) {
+	struct spot_msg msg;
+	int i, producer_id, slot;
 	
-	sscanf(msg, "%d,", &type);
-	printf("Message type: %d, %s\n", type, msg);
-	switch (type) {
+	if(spot_decode(frame, &msg) < 0) {
+		printf("Message type: %d, malformed (%u bytes)\n", frame->type, frame->payload_len);
+		return;
+	}
+	printf("Message type: %d\n", msg.type);
+	switch (msg.type) {
 		case CONNECTION_ACK:
 			send_registration_msg();
 			break;
 		case REGISTRATION_ACK:
-			sscanf(msg, "%d,%d", &type, &consumer.id);
-			printf("Message type: %d (register-ack), id at broker: %d\n", type, consumer.id);
-			send_spot_request();
+			consumer.id = msg.ack.id;
+			printf("Message type: %d (register-ack), id at broker: %d\n", msg.type, consumer.id);
+			if(consumer.id >= 0)
+				send_spot_request();
 			break;
 		case SPOT_ASSIGNMENT_CONSUMER:
-			portal_parser(msg);
+			assignment_parser(&msg.assignment);
 			for(i = 0; i < MAX_PRODUCER; i++ ) {
-				if(consumer.producer_list[i].nslabs != 0) {
-					printf("#%d <ip:port:size> = <%s:%d:%d>\n", i, consumer.producer_list[i].ip, consumer.producer_list[i].port, consumer.producer_list[i].nslabs);
+				if(consumer.producer_list[i].id >= 0 && consumer.producer_list[i].nslabs != 0) {
+					printf("#%d <ip:port:size> = <%s:%d:%d>\n", consumer.producer_list[i].id, consumer.producer_list[i].ip, consumer.producer_list[i].port, consumer.producer_list[i].nslabs);
 				}
 			}
+			break;
 		case PRODUCER_READY:
-            sscanf(msg, "%d,%d,%d,%d", &type, &producer_id, &consumer_id, &manager_port);
-			printf("Message type: %d (producer-ready), from producer: %d to consumer %d at manager port %d\n", type, producer_id, consumer_id, manager_port);
-			consumer.producer_list[producer_id].manager_port = manager_port;
-			consumer.producer_list[producer_id].manager_state = RUNNING;
-			//TODO: check for the correctness of the remote-local ratio; especially when multiple producers are mapped for a single request 
-			run_consumer_app(producer_id);
+			producer_id = msg.ready.producer_id;
+			printf("Message type: %d (producer-ready), from producer: %d to consumer %d at manager port %d\n", msg.type, producer_id, msg.ready.consumer_id, msg.ready.port);
+			slot = producer_slot(producer_id, 0);
+			if(slot < 0)
+				break;
+			consumer.producer_list[slot].manager_port = msg.ready.port;
+			consumer.producer_list[slot].manager_state = RUNNING;
+			sync_spot_client(slot);
+			run_consumer_app(slot);
+			break;
+		case LEASE_GRANT:
+			printf("Message type: %d (lease-grant), lease %d of %d slabs on producer %d for %d s\n", msg.type, msg.lease.lease_id, msg.lease.slabs, msg.lease.producer_id, msg.lease.duration);
+			grant_lease(&msg.lease);
+			break;
+		case LEASE_END:
+			printf("Message type: %d (lease-end), lease %d of %d slabs on producer %d, reason %d\n", msg.type, msg.lease.lease_id, msg.lease.slabs, msg.lease.producer_id, msg.lease.reason);
+			end_lease(&msg.lease);
+			break;
+		case SPOT_SHRINK:
+			printf("Message type: %d (spot-shrink), producer %d takes %d slabs back, %d left in %d ms\n", msg.type, msg.shrink.producer_id, msg.shrink.slabs, msg.shrink.quota_slabs, msg.shrink.deadline_ms);
+			shrink_spot(&msg.shrink);
 			break;
 		default:
 			break;
@@ -149,13 +290,52 @@ void handle_message(char* msg) {
 	
 }
 
-void run_consumer_app(int producer_id) {
+void run_consumer_app(int slot) {
 	char consumer_cmd[1024];
-	sprintf(consumer_cmd, "cd /root/YCSB && ./bin/ycsb load redis -s -P workloads/workloada -p \"redis.consumer_host=127.0.0.1\" -p \"redis.consumer_port=6379\"  -p \"redis.host=%s\" -p \"redis.port=%d\" -p \"redis.remote_ratio=%d\" 2>&1 | tee /root/ycsb.txt", consumer.producer_list[producer_id].ip, consumer.producer_list[producer_id].manager_port, consumer.remote_ratio);
+	sprintf(consumer_cmd, "cd /root/YCSB && ./bin/ycsb load redis -s -P workloads/workloada -p \"redis.consumer_host=127.0.0.1\" -p \"redis.consumer_port=6379\"  -p \"redis.host=%s\" -p \"redis.port=%d\" -p \"redis.remote_ratio=%d\" 2>&1 | tee /root/ycsb.txt", consumer.producer_list[slot].ip, consumer.producer_list[slot].manager_port, consumer.remote_ratio);
 
 	printf("%s\n", consumer_cmd);
-	FILE* _pipe = popen(consumer_cmd, "r");
-	//TODO: check the status of the application from the _pipe
+	//one per producer, in a process group of its own, so that stopping it stops the whole pipeline
+	stop_consumer_app(slot);
+	pid_t pid = fork();
+	if(pid == 0) {
+		setpgid(0, 0);
+		execl("/bin/sh", "sh", "-c", consumer_cmd, (char*) NULL);
+		_exit(127);
+	}
+	if(pid < 0) {
+		printf("cannot start the application for producer %d\n", consumer.producer_list[slot].id);
+		return;
+	}
+	setpgid(pid, pid);
+	consumer.producer_list[slot].app_pid = pid;
+}
+
+// the producer is gone, so is the application using it; reap_consumer_apps() collects it
+void stop_consumer_app(int slot) {
+	pid_t pid = consumer.producer_list[slot].app_pid;
+
+	if(pid <= 0)
+		return;
+	printf("stopping the application using producer %d (pid %d)\n", consumer.producer_list[slot].id, pid);
+	kill(-pid, SIGTERM);
+	consumer.producer_list[slot].app_pid = 0;
+}
+
+void reap_consumer_apps() {
+	int i, status;
+	pid_t pid;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for(i = 0; i < MAX_PRODUCER; i++) {
+			if(consumer.producer_list[i].app_pid == pid)
+				consumer.producer_list[i].app_pid = 0;
+		}
+		if(WIFEXITED(status))
+			printf("process %d exited with status %d\n", pid, WEXITSTATUS(status));
+		else if(WIFSIGNALED(status))
+			printf("process %d killed by signal %d\n", pid, WTERMSIG(status));
+	}
 }
 
 void run_consumer_redis() {
@@ -177,9 +357,14 @@ void init() {
 	consumer.remote_ratio = REMOTE_RATIO;
 
 	for(i=0; i<MAX_PRODUCER; i++) {
+		consumer.producer_list[i].id = -1; // free slot
 		consumer.producer_list[i].nslabs = 0;
 		consumer.producer_list[i].manager_state = STOP;
+		consumer.producer_list[i].app_pid = 0;
 	}
+	for(i=0; i<MAX_LEASE; i++)
+		consumer.lease_list[i].id = -1; // free slot
+	spot_client_init(&spot_client);
 
 	run_consumer_redis();
 }
@@ -187,14 +372,17 @@ void init() {
 void usage() {
 	printf("Usage ./client [-b broker-ip] [-p broker-port] [-c consumer-ip] [-q consumer-port] [-s spot-size] [-t lease-time] [-r remote-ratio]\n");
 	printf("Default broker ip:port is %s:%d, consumer ip:port is %s:%d\n", BROKER_IP, BROKER_PORT, CONSUMER_IP, CONSUMER_PORT);
+	printf("Leases are renewed by lease-time (hours, unless the broker runs with -L) while the consumer runs\n");
 	printf("\n");
 }
 
 int main(int argc, char *argv[]) { 
 	struct sockaddr_in address; 
-	int i, len, opt; 
+	int i, len, opt, ret; 
 	struct sockaddr_in serv_addr; 
-	char buffer[BUFFER_SIZE] = {0}; 
+	static struct spot_inbuf in;
+	struct spot_frame frame;
+	struct timeval renew_check = { LEASE_CHECK_INTERVAL, 0 };
 
 	init();
 
@@ -247,10 +435,20 @@ int main(int argc, char *argv[]) {
 		return -1; 
 	} 
 	printf("connect done\n");
+	//wake up now and then to renew the leases
+	setsockopt(broker.sock, SOL_SOCKET, SO_RCVTIMEO, &renew_check, sizeof(renew_check));
 
-	while((len = recv(broker.sock , buffer , BUFFER_SIZE , 0)) > 0) {
-		//message received from the server
-		handle_message(buffer);
+	spot_inbuf_init(&in);
+	while((len = spot_inbuf_recv(broker.sock, &in, 0)) > 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+		//frames received from the server, possibly several or a partial one
+		while(len > 0 && (ret = spot_inbuf_next(&in, &frame)) == 1)
+			handle_message(&frame);
+		if(len > 0 && ret < 0) {
+			printf("broker sent a malformed frame\n");
+			break;
+		}
+		renew_leases();
+		reap_consumer_apps();
 	}
 	return 0; 
 } 
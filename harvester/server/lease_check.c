@@ -0,0 +1,202 @@
+/*
+    Checks the broker's leases end to end over loopback, as one producer
+    and one consumer: a lease expires unless renewed and gives its slabs
+    back, a renewal keeps it, a release ends it early, renewing an ended
+    lease is refused, and a consumer going away ends its leases at the
+    producer. The broker must run with one-second leases (-L 1):
+    ./broker -p 9800 -L 1 &
+    ./lease_check -p 9800
+    Compile
+    gcc lease_check.c -o lease_check
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "spot_proto.h"
+
+#define BROKER_IP "127.0.0.1"
+#define BROKER_PORT 9700
+#define TIMEOUT_MS 1000
+#define PRODUCER_SLABS 100
+
+struct peer {
+	int sock;
+	struct spot_inbuf in;
+};
+
+struct peer producer, consumer;
+
+void connect_peer(struct peer* peer, const char* ip, int port) {
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
+		printf("invalid broker ip %s\n", ip);
+		exit(1);
+	}
+	peer->sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(peer->sock < 0 || connect(peer->sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		perror("cannot connect to the broker");
+		exit(1);
+	}
+	spot_inbuf_init(&peer->in);
+}
+
+//type of the next message, -1 if none arrives within @ms
+int next_msg(struct peer* peer, struct spot_msg* msg, int ms) {
+	struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+	struct spot_frame frame;
+
+	setsockopt(peer->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while(spot_inbuf_next(&peer->in, &frame) != 1) {
+		if(spot_inbuf_recv(peer->sock, &peer->in, 0) <= 0)
+			return -1;
+	}
+	if(spot_decode(&frame, msg) < 0)
+		return -1;
+	return msg->type;
+}
+
+void expect(int got, int want, const char* what) {
+	if(got != want) {
+		printf("FAIL: %s, got %d instead of %d\n", what, got, want);
+		exit(1);
+	}
+}
+
+int register_peer(struct peer* peer, int type, const char* ip, int port) {
+	struct spot_msg msg;
+
+	expect(next_msg(peer, &msg, TIMEOUT_MS), CONNECTION_ACK, "connection ack");
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	snprintf(msg.reg.ip, sizeof(msg.reg.ip), "%s", ip);
+	msg.reg.port = port;
+	spot_send(peer->sock, &msg);
+	expect(next_msg(peer, &msg, TIMEOUT_MS), REGISTRATION_ACK, "registration ack");
+	return msg.ack.id;
+}
+
+void request_spot(int consumer_id, int spot_size, int lease_time) {
+	struct spot_msg msg = { .type = SPOT_REQUEST };
+
+	msg.request.consumer_id = consumer_id;
+	msg.request.spot_size = spot_size;
+	msg.request.lease_time = lease_time;
+	spot_send(consumer.sock, &msg);
+}
+
+void send_lease(int type, int lease_id, int consumer_id, int lease_time) {
+	struct spot_msg msg = { .type = type };
+
+	msg.lease.lease_id = lease_id;
+	msg.lease.consumer_id = consumer_id;
+	msg.lease.duration = lease_time;
+	spot_send(consumer.sock, &msg);
+}
+
+//the assignment and the grant of a new lease, on both sides; returns the slabs assigned
+int expect_lease(struct spot_msg* grant) {
+	struct spot_msg msg;
+	int slabs;
+
+	expect(next_msg(&consumer, &msg, TIMEOUT_MS), SPOT_ASSIGNMENT_CONSUMER, "consumer assignment");
+	slabs = msg.assignment.entries[0].slabs;
+	expect(next_msg(&consumer, grant, TIMEOUT_MS), LEASE_GRANT, "consumer lease grant");
+	expect(next_msg(&producer, &msg, TIMEOUT_MS), SPOT_ASSIGNMENT_PRODUCER, "producer assignment");
+	expect(next_msg(&producer, &msg, TIMEOUT_MS), LEASE_GRANT, "producer lease grant");
+	return slabs;
+}
+
+void usage() {
+	printf("Usage ./lease_check [-b broker-ip] [-p broker-port]\n");
+	printf("Default broker ip:port is %s:%d, which must run with -L 1\n", BROKER_IP, BROKER_PORT);
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	const char* broker_ip = BROKER_IP;
+	struct spot_msg msg, grant;
+	int opt, port = BROKER_PORT, producer_id, consumer_id;
+	int first_slabs, second_slabs, second_lease, third_lease;
+
+	while((opt = getopt(argc, argv, "hb:p:")) != -1) {
+		switch(opt) {
+		case 'b':
+			broker_ip = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+
+	connect_peer(&producer, broker_ip, port);
+	connect_peer(&consumer, broker_ip, port);
+	producer_id = register_peer(&producer, PRODUCER_REG, "10.0.0.1", 9702);
+	consumer_id = register_peer(&consumer, CONSUMER_REG, "10.0.0.2", 9704);
+	expect(producer_id >= 0 && consumer_id >= 0, 1, "registered");
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = PRODUCER_AVAILABILITY;
+	msg.availability.id = producer_id;
+	msg.availability.available_slabs = PRODUCER_SLABS;
+	msg.availability.total_slabs = 2 * PRODUCER_SLABS;
+	spot_send(producer.sock, &msg);
+
+	//a 2 s lease, and a long one that only gets the slabs left
+	request_spot(consumer_id, 60, 2);
+	first_slabs = expect_lease(&grant);
+	printf("lease %d: %d slabs for %d s\n", grant.lease.lease_id, first_slabs, grant.lease.duration);
+	request_spot(consumer_id, 60, 100);
+	second_slabs = expect_lease(&grant);
+	second_lease = grant.lease.lease_id;
+	printf("lease %d: %d slabs, what was left\n", second_lease, second_slabs);
+
+	//the first expires and its slabs go back to the producer
+	expect(next_msg(&consumer, &msg, TIMEOUT_MS), -1, "nothing before the lease expires");
+	expect(next_msg(&consumer, &msg, 2 * TIMEOUT_MS), LEASE_END, "lease end at the consumer");
+	expect(msg.lease.reason, LEASE_EXPIRED, "lease end reason");
+	expect(next_msg(&producer, &msg, TIMEOUT_MS), LEASE_END, "lease end at the producer");
+	request_spot(consumer_id, 60, 2);
+	expect(expect_lease(&grant), first_slabs, "slabs given back by the expired lease");
+	third_lease = grant.lease.lease_id;
+	printf("lease expired, its %d slabs were leased again\n", first_slabs);
+
+	//a renewal keeps it past its first expiry
+	usleep(1500000);
+	send_lease(LEASE_RENEW, third_lease, consumer_id, 2);
+	expect(next_msg(&consumer, &msg, TIMEOUT_MS), LEASE_GRANT, "renewal grant");
+	expect(next_msg(&producer, &msg, TIMEOUT_MS), LEASE_GRANT, "renewal grant at the producer");
+	expect(next_msg(&consumer, &msg, 1200), -1, "no expiry after the renewal");
+	printf("lease %d renewed\n", third_lease);
+
+	//a release ends it, renewing it afterwards is refused
+	send_lease(LEASE_RELEASE, third_lease, consumer_id, 0);
+	expect(next_msg(&consumer, &msg, TIMEOUT_MS), LEASE_END, "release");
+	expect(msg.lease.reason, LEASE_RELEASED, "release reason");
+	expect(next_msg(&producer, &msg, TIMEOUT_MS), LEASE_END, "release at the producer");
+	send_lease(LEASE_RENEW, third_lease, consumer_id, 2);
+	expect(next_msg(&consumer, &msg, TIMEOUT_MS), LEASE_END, "renewal of a released lease");
+	printf("lease %d released\n", third_lease);
+
+	//the consumer going away ends its remaining lease at the producer
+	close(consumer.sock);
+	expect(next_msg(&producer, &msg, TIMEOUT_MS), LEASE_END, "lease end when the consumer is gone");
+	expect(msg.lease.reason, LEASE_CONSUMER_GONE, "consumer gone reason");
+	expect(msg.lease.lease_id, second_lease, "lease ended with the consumer");
+	printf("lease %d ended with the consumer\n", second_lease);
+
+	printf("OK\n");
+	return 0;
+}
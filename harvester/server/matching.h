@@ -0,0 +1,93 @@
+#ifndef __MATCHING_H_
+#define __MATCHING_H_
+
+/*
+ * Batch matching of the spot requests gathered over an epoch against the
+ * placement index (placement.h), as an alternative to placing each
+ * request on arrival.
+ *
+ * Requests of the same consumer and lease time are merged first, then
+ * placed largest first (best-fit decreasing): each on the smallest
+ * producer that holds it whole, and only if none does, over the largest
+ * producers. The large requests thus get the few producers they need
+ * before small ones fragment them, the small ones fill the gaps left, and
+ * the result does not depend on the arrival order within the epoch.
+ * Producers never give more than their available slabs minus min_free.
+ */
+
+#include <stdlib.h>
+#include "placement.h"
+
+struct match_request {
+	int consumer;
+	int spot_size;  /* slabs, 0 once merged into another request */
+	int lease_time;
+	int seq;  /* arrival order, for a stable order among equals */
+	int first_pick;  /* picks of the request, filled by match_batch() */
+	int nr_picks;
+};
+
+static inline int match_cmp_consumer(const void *a, const void *b)
+{
+	const struct match_request *p = (const struct match_request *) a, *q = (const struct match_request *) b;
+
+	if (p->consumer != q->consumer)
+		return p->consumer < q->consumer ? -1 : 1;
+	if (p->lease_time != q->lease_time)
+		return p->lease_time < q->lease_time ? -1 : 1;
+	return p->seq - q->seq;
+}
+
+static inline int match_cmp_size(const void *a, const void *b)
+{
+	const struct match_request *p = (const struct match_request *) a, *q = (const struct match_request *) b;
+
+	if (p->spot_size != q->spot_size)
+		return p->spot_size > q->spot_size ? -1 : 1;
+	return p->seq - q->seq;
+}
+
+/* merges the requests of the same consumer and lease time into the first of them */
+static inline void match_coalesce(struct match_request *reqs, int n)
+{
+	int i, head = 0;
+
+	qsort(reqs, n, sizeof(*reqs), match_cmp_consumer);
+	for (i = 1; i < n; i++) {
+		if (reqs[i].consumer == reqs[head].consumer && reqs[i].lease_time == reqs[head].lease_time) {
+			reqs[head].spot_size += reqs[i].spot_size;
+			reqs[i].spot_size = 0;
+		} else {
+			head = i;
+		}
+	}
+}
+
+/*
+ * Matches the @n requests jointly, reordering them, and updates the index
+ * with what is left on each producer. A request gets at most
+ * @max_picks_per_request picks, all of them stored in @picks (room for
+ * @cap) at reqs[i].first_pick. Returns the number of picks; merged
+ * requests and those nothing was found for have none.
+ */
+static inline int match_batch(struct placement_index *idx, struct match_request *reqs, int n, int min_free,
+                              struct placement_pick *picks, int cap, int max_picks_per_request)
+{
+	int i, nr_picks = 0, max;
+
+	match_coalesce(reqs, n);
+	qsort(reqs, n, sizeof(*reqs), match_cmp_size);
+	for (i = 0; i < n; i++) {
+		reqs[i].first_pick = nr_picks;
+		reqs[i].nr_picks = 0;
+		max = cap - nr_picks < max_picks_per_request ? cap - nr_picks : max_picks_per_request;
+		if (reqs[i].spot_size <= 0 || max <= 0)
+			continue;
+		reqs[i].nr_picks = placement_place(idx, PLACEMENT_BEST_FIT, 0, reqs[i].spot_size, min_free,
+		                                   picks + nr_picks, max);
+		nr_picks += reqs[i].nr_picks;
+	}
+	return nr_picks;
+}
+
+#endif
@@ -0,0 +1,220 @@
+/*
+    Batch matching (matching.h) against placing each spot request on
+    arrival, over the same stream of requests and availability updates.
+    Consumers send their requests in bursts of 1-4, as a consumer asking
+    again for more slabs would. For each batch size, reports the time to
+    match a batch, the producers each burst ends up spread over and the
+    slabs placed, so that the broker's epoch (-B) can be chosen from the
+    request rate. A batch sees the availability of the end of its epoch
+    only, so large batches place less when requests outrun the updates.
+    Compile
+    gcc -O2 matching_bench.c -o matching_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "matching.h"
+
+#define NR_PRODUCERS 10000
+#define NR_REQUESTS 100000
+#define MAX_AVAILABLE 128 //slabs offered by a producer
+#define MAX_SPOT_SIZE 64
+#define MAX_BURST 4
+#define MIN_FREE 1
+#define MAX_PICKS 64
+
+struct request {
+	int burst;
+	int spot_size;
+};
+
+int nr_producers = NR_PRODUCERS, nr_requests = NR_REQUESTS;
+struct request *stream;
+int *update_id, *update_available;
+int *seen; //last burst a producer was counted for
+uint64_t rng_state;
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* the requests and, after each of them, the availability update of a random producer */
+void make_stream() {
+	int i = 0, burst = 0, n;
+
+	rng_state = 0x9e3779b97f4a7c15ull;
+	while(i < nr_requests) {
+		for(n = 1 + rng() % MAX_BURST; n > 0 && i < nr_requests; n--, i++) {
+			stream[i].burst = burst;
+			stream[i].spot_size = 1 + rng() % MAX_SPOT_SIZE;
+			update_id[i] = rng() % nr_producers;
+			update_available[i] = rng() % (MAX_AVAILABLE + 1);
+		}
+		burst++;
+	}
+}
+
+int fill(struct placement_index *idx) {
+	int i;
+
+	if(placement_init(idx, nr_producers) < 0)
+		return -1;
+	rng_state = 0x2545f4914f6cdd1dull;
+	for(i = 0; i < nr_producers; i++)
+		placement_update(idx, i, rng() % (MAX_AVAILABLE + 1));
+	return 0;
+}
+
+/* counts the producers of @picks not counted for @burst yet */
+long count_producers(struct placement_pick *picks, int n, int burst) {
+	long count = 0;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(seen[picks[i].id] != burst) {
+			seen[picks[i].id] = burst;
+			count++;
+		}
+	}
+	return count;
+}
+
+void report(const char *name, int batch, uint64_t *latency, int nr_batches, uint64_t total_ns, long producers, long slabs, long asked) {
+	int nr_bursts = stream[nr_requests - 1].burst + 1;
+
+	qsort(latency, nr_batches, sizeof(uint64_t), cmp_u64);
+	printf("%-9s %6d %10.1f %10.1f %9.0f %16.3f %8.1f%%\n", name, batch,
+	       latency[nr_batches / 2] / 1e3, latency[(nr_batches * 99 + 99) / 100 - 1] / 1e3,
+	       (double) total_ns / nr_requests, (double) producers / nr_bursts, 100.0 * slabs / asked);
+}
+
+/* places each request on arrival with @policy, as the broker without -B */
+void run_greedy(const char *name, int policy, uint64_t *latency) {
+	struct placement_pick picks[MAX_PICKS];
+	struct placement_index idx;
+	long producers = 0, slabs = 0, asked = 0;
+	uint64_t t0, total_ns = 0;
+	int i, j, n;
+
+	if(fill(&idx) < 0) {
+		printf("cannot allocate the index\n");
+		exit(1);
+	}
+	memset(seen, -1, nr_producers * sizeof(int));
+	for(i = 0; i < nr_requests; i++) {
+		t0 = now_ns();
+		n = placement_place(&idx, policy, PLACEMENT_DEFAULT_SPREAD, stream[i].spot_size, MIN_FREE, picks, MAX_PICKS);
+		latency[i] = now_ns() - t0;
+		total_ns += latency[i];
+		for(j = 0; j < n; j++)
+			slabs += picks[j].slabs;
+		producers += count_producers(picks, n, stream[i].burst);
+		asked += stream[i].spot_size;
+		placement_update(&idx, update_id[i], update_available[i]);
+	}
+	report(name, 1, latency, nr_requests, total_ns, producers, slabs, asked);
+	placement_destroy(&idx);
+}
+
+/* gathers @batch requests, with the updates arriving meanwhile applied, then matches them */
+void run_batch(int batch, uint64_t *latency) {
+	struct match_request *reqs = calloc(batch, sizeof(struct match_request));
+	struct placement_pick *picks = calloc((size_t) batch * MAX_PICKS, sizeof(struct placement_pick));
+	struct placement_index idx;
+	long producers = 0, slabs = 0, asked = 0;
+	uint64_t t0, total_ns = 0;
+	int i, j, n = 0, nr_batches = 0;
+
+	if(!reqs || !picks || fill(&idx) < 0) {
+		printf("cannot allocate a batch of %d\n", batch);
+		exit(1);
+	}
+	memset(seen, -1, nr_producers * sizeof(int));
+	for(i = 0; i < nr_requests; i++) {
+		//the burst stands in for the consumer
+		reqs[n].consumer = stream[i].burst;
+		reqs[n].spot_size = stream[i].spot_size;
+		reqs[n].lease_time = 1;
+		reqs[n].seq = n;
+		n++;
+		asked += stream[i].spot_size;
+		placement_update(&idx, update_id[i], update_available[i]);
+		if(n < batch && i < nr_requests - 1)
+			continue;
+		t0 = now_ns();
+		match_batch(&idx, reqs, n, MIN_FREE, picks, batch * MAX_PICKS, MAX_PICKS);
+		latency[nr_batches] = now_ns() - t0;
+		total_ns += latency[nr_batches++];
+		for(j = 0; j < n; j++) {
+			producers += count_producers(picks + reqs[j].first_pick, reqs[j].nr_picks, reqs[j].consumer);
+			while(reqs[j].nr_picks-- > 0)
+				slabs += picks[reqs[j].first_pick + reqs[j].nr_picks].slabs;
+		}
+		n = 0;
+	}
+	report("batch", batch, latency, nr_batches, total_ns, producers, slabs, asked);
+	placement_destroy(&idx);
+	free(reqs);
+	free(picks);
+}
+
+int main(int argc, char *argv[]) {
+	int batches[] = { 10, 100, 1000, 10000 };
+	uint64_t *latency;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "hp:r:")) != -1) {
+		switch(opt) {
+		case 'p':
+			nr_producers = atoi(optarg);
+			break;
+		case 'r':
+			nr_requests = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./matching_bench [-p producers] [-r requests]\n");
+			return 0;
+		}
+	}
+	stream = calloc(nr_requests, sizeof(struct request));
+	update_id = calloc(nr_requests, sizeof(int));
+	update_available = calloc(nr_requests, sizeof(int));
+	seen = calloc(nr_producers, sizeof(int));
+	latency = calloc(nr_requests, sizeof(uint64_t));
+	if(!stream || !update_id || !update_available || !seen || !latency || nr_requests <= 0) {
+		printf("cannot allocate %d requests\n", nr_requests);
+		return 1;
+	}
+	make_stream();
+	printf("%d producers with up to %d slabs, %d requests of up to %d slabs in bursts of up to %d\n",
+	       nr_producers, MAX_AVAILABLE, nr_requests, MAX_SPOT_SIZE, MAX_BURST);
+	printf("%-9s %6s %10s %10s %9s %16s %9s\n", "matching", "batch", "p50 us", "p99 us", "ns/req", "producers/burst", "placed");
+
+	run_greedy("worst-fit", PLACEMENT_WORST_FIT, latency);
+	run_greedy("best-fit", PLACEMENT_BEST_FIT, latency);
+	for(i = 0; i < (int)(sizeof(batches) / sizeof(batches[0])); i++) {
+		if(batches[i] <= nr_requests)
+			run_batch(batches[i], latency);
+	}
+	return 0;
+}
@@ -0,0 +1,373 @@
+#ifndef __PLACEMENT_H_
+#define __PLACEMENT_H_
+
+/*
+ * Placement index of the broker: the producers with available slabs,
+ * ordered by (available slabs, id) in a treap with subtree sizes, so that
+ * an availability update, the largest producer, the smallest one fitting
+ * a request and the i-th smallest are all O(log P).
+ *
+ * Nodes are indexed by producer id and allocated up front for the ids in
+ * use, so updates never allocate on the placement path.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLACEMENT_NIL -1
+#define PLACEMENT_DEFAULT_SPREAD 4
+#define PLACEMENT_STABLE_CHOICES 4
+
+enum placement_policy {
+	PLACEMENT_WORST_FIT = 0,  /* largest producers first, the original greedy order */
+	PLACEMENT_BEST_FIT = 1,  /* the smallest producer holding the rest, else the largest */
+	PLACEMENT_P2C = 2,  /* the larger of two random producers holding the rest */
+	PLACEMENT_SPREAD = 3,  /* an equal share on each of the k largest producers */
+	PLACEMENT_STABLE = 4,  /* the best scored of a few random producers holding the rest */
+	NR_PLACEMENT_POLICIES
+};
+
+struct placement_node {
+	int key;  /* available slabs */
+	uint32_t prio;
+	int left;
+	int right;
+	int size;  /* of the subtree, 0 while not in the index */
+};
+
+/* higher is better, for PLACEMENT_STABLE */
+typedef double (*placement_score_fn)(void *ctx, int id);
+
+struct placement_index {
+	struct placement_node *nodes;
+	int capacity;
+	int root;
+	uint64_t rng;
+	placement_score_fn score;  /* NULL scores every producer the same */
+	void *score_ctx;
+};
+
+struct placement_pick {
+	int id;
+	int slabs;
+};
+
+static const char *placement_policy_names[NR_PLACEMENT_POLICIES] = {
+	"worst-fit", "best-fit", "p2c", "spread", "stable",
+};
+
+/* returns the policy called @name, or -1 */
+static inline int placement_policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_PLACEMENT_POLICIES; i++) {
+		if (strcmp(name, placement_policy_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static inline uint32_t placement_rand(struct placement_index *idx)
+{
+	/* xorshift64* */
+	idx->rng ^= idx->rng >> 12;
+	idx->rng ^= idx->rng << 25;
+	idx->rng ^= idx->rng >> 27;
+	return (idx->rng * 2685821657736338717ull) >> 32;
+}
+
+/* makes room for ids below @capacity, returns 0 or -1 */
+static inline int placement_reserve(struct placement_index *idx, int capacity)
+{
+	struct placement_node *nodes;
+
+	if (capacity <= idx->capacity)
+		return 0;
+	nodes = (struct placement_node *) realloc(idx->nodes, capacity * sizeof(struct placement_node));
+	if (nodes == NULL)
+		return -1;
+	memset(nodes + idx->capacity, 0, (capacity - idx->capacity) * sizeof(struct placement_node));
+	idx->nodes = nodes;
+	idx->capacity = capacity;
+	return 0;
+}
+
+static inline int placement_init(struct placement_index *idx, int capacity)
+{
+	idx->nodes = NULL;
+	idx->capacity = 0;
+	idx->root = PLACEMENT_NIL;
+	idx->rng = 0x9e3779b97f4a7c15ull;
+	idx->score = NULL;
+	idx->score_ctx = NULL;
+	return placement_reserve(idx, capacity);
+}
+
+static inline void placement_destroy(struct placement_index *idx)
+{
+	free(idx->nodes);
+	idx->nodes = NULL;
+	idx->capacity = 0;
+	idx->root = PLACEMENT_NIL;
+}
+
+static inline int placement_size(struct placement_index *idx, int t)
+{
+	return t == PLACEMENT_NIL ? 0 : idx->nodes[t].size;
+}
+
+static inline void placement_fix(struct placement_index *idx, int t)
+{
+	struct placement_node *n = &idx->nodes[t];
+
+	n->size = 1 + placement_size(idx, n->left) + placement_size(idx, n->right);
+}
+
+/* whether node a orders before node b */
+static inline int placement_less(struct placement_index *idx, int a, int b)
+{
+	int ka = idx->nodes[a].key, kb = idx->nodes[b].key;
+
+	return ka < kb || (ka == kb && a < b);
+}
+
+/* splits @t into the nodes ordering before node @at and the others */
+static inline void placement_split(struct placement_index *idx, int t, int at, int *l, int *r)
+{
+	if (t == PLACEMENT_NIL) {
+		*l = *r = PLACEMENT_NIL;
+		return;
+	}
+	if (placement_less(idx, t, at)) {
+		placement_split(idx, idx->nodes[t].right, at, &idx->nodes[t].right, r);
+		*l = t;
+	} else {
+		placement_split(idx, idx->nodes[t].left, at, l, &idx->nodes[t].left);
+		*r = t;
+	}
+	placement_fix(idx, t);
+}
+
+static inline int placement_merge(struct placement_index *idx, int l, int r)
+{
+	if (l == PLACEMENT_NIL)
+		return r;
+	if (r == PLACEMENT_NIL)
+		return l;
+	if (idx->nodes[l].prio > idx->nodes[r].prio) {
+		idx->nodes[l].right = placement_merge(idx, idx->nodes[l].right, r);
+		placement_fix(idx, l);
+		return l;
+	}
+	idx->nodes[r].left = placement_merge(idx, l, idx->nodes[r].left);
+	placement_fix(idx, r);
+	return r;
+}
+
+static inline int placement_erase_node(struct placement_index *idx, int t, int id)
+{
+	struct placement_node *n = &idx->nodes[t];
+
+	if (t == id)
+		return placement_merge(idx, n->left, n->right);
+	if (placement_less(idx, id, t))
+		n->left = placement_erase_node(idx, n->left, id);
+	else
+		n->right = placement_erase_node(idx, n->right, id);
+	n->size--;
+	return t;
+}
+
+static inline void placement_remove(struct placement_index *idx, int id)
+{
+	if (id < 0 || id >= idx->capacity || idx->nodes[id].size == 0)
+		return;
+	idx->root = placement_erase_node(idx, idx->root, id);
+	idx->nodes[id].size = 0;
+}
+
+/* sets the available slabs of producer @id, which leaves the index at 0; returns 0 or -1 */
+static inline int placement_update(struct placement_index *idx, int id, int available)
+{
+	struct placement_node *n;
+	int l, r;
+
+	if (id < 0 || placement_reserve(idx, id + 1) < 0)
+		return -1;
+	placement_remove(idx, id);
+	if (available <= 0)
+		return 0;
+	n = &idx->nodes[id];
+	n->key = available;
+	n->prio = placement_rand(idx);
+	n->left = n->right = PLACEMENT_NIL;
+	n->size = 1;
+	placement_split(idx, idx->root, id, &l, &r);
+	idx->root = placement_merge(idx, placement_merge(idx, l, id), r);
+	return 0;
+}
+
+static inline int placement_available(struct placement_index *idx, int id)
+{
+	if (id < 0 || id >= idx->capacity || idx->nodes[id].size == 0)
+		return 0;
+	return idx->nodes[id].key;
+}
+
+static inline int placement_max(struct placement_index *idx)
+{
+	int t = idx->root;
+
+	while (t != PLACEMENT_NIL && idx->nodes[t].right != PLACEMENT_NIL)
+		t = idx->nodes[t].right;
+	return t;
+}
+
+/* the producer with the fewest available slabs, at least @slabs, or PLACEMENT_NIL */
+static inline int placement_lower_bound(struct placement_index *idx, int slabs)
+{
+	int t = idx->root, found = PLACEMENT_NIL;
+
+	while (t != PLACEMENT_NIL) {
+		if (idx->nodes[t].key >= slabs) {
+			found = t;
+			t = idx->nodes[t].left;
+		} else {
+			t = idx->nodes[t].right;
+		}
+	}
+	return found;
+}
+
+/* the number of producers with fewer than @slabs available */
+static inline int placement_rank(struct placement_index *idx, int slabs)
+{
+	int t = idx->root, rank = 0;
+
+	while (t != PLACEMENT_NIL) {
+		if (idx->nodes[t].key >= slabs) {
+			t = idx->nodes[t].left;
+		} else {
+			rank += placement_size(idx, idx->nodes[t].left) + 1;
+			t = idx->nodes[t].right;
+		}
+	}
+	return rank;
+}
+
+/* the producer with the @rank-th fewest available slabs, from 0 */
+static inline int placement_select(struct placement_index *idx, int rank)
+{
+	int t = idx->root, left;
+
+	while (t != PLACEMENT_NIL) {
+		left = placement_size(idx, idx->nodes[t].left);
+		if (rank == left)
+			return t;
+		if (rank < left) {
+			t = idx->nodes[t].left;
+		} else {
+			rank -= left + 1;
+			t = idx->nodes[t].right;
+		}
+	}
+	return PLACEMENT_NIL;
+}
+
+/*
+ * The best scored of PLACEMENT_STABLE_CHOICES random producers holding
+ * @remaining slabs, or of as many of the largest if none does. Ties go to
+ * the larger producer.
+ */
+static inline int placement_stable_candidate(struct placement_index *idx, int remaining)
+{
+	int size = placement_size(idx, idx->root), count = size - placement_rank(idx, remaining);
+	int i, t, best = PLACEMENT_NIL;
+	double score, best_score = 0;
+
+	for (i = 0; i < PLACEMENT_STABLE_CHOICES; i++) {
+		if (count > 0)
+			t = placement_select(idx, size - count + placement_rand(idx) % count);
+		else if (i < size)
+			t = placement_select(idx, size - 1 - i);
+		else
+			break;
+		score = idx->score ? idx->score(idx->score_ctx, t) : 0;
+		if (best == PLACEMENT_NIL || score > best_score ||
+		    (score == best_score && placement_less(idx, best, t))) {
+			best = t;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* the next producer to take slabs from for @remaining slabs */
+static inline int placement_candidate(struct placement_index *idx, int policy, int remaining)
+{
+	int t, count, a, b;
+
+	switch (policy) {
+	case PLACEMENT_BEST_FIT:
+		t = placement_lower_bound(idx, remaining);
+		return t != PLACEMENT_NIL ? t : placement_max(idx);
+	case PLACEMENT_P2C:
+		count = placement_size(idx, idx->root) - placement_rank(idx, remaining);
+		if (count == 0)
+			return placement_max(idx);
+		a = placement_select(idx, placement_size(idx, idx->root) - count + placement_rand(idx) % count);
+		b = placement_select(idx, placement_size(idx, idx->root) - count + placement_rand(idx) % count);
+		return placement_less(idx, a, b) ? b : a;
+	case PLACEMENT_STABLE:
+		return placement_stable_candidate(idx, remaining);
+	default:  /* worst-fit, and the k largest for spread */
+		return placement_max(idx);
+	}
+}
+
+/*
+ * Places @spot_size slabs on at most @max_picks distinct producers
+ * following @policy (@spread is the k of PLACEMENT_SPREAD). A producer
+ * either holds all the remaining slabs or gives all but @min_free of its
+ * own. The index is updated with what is left on each picked producer.
+ * Returns the number of picks, which may hold fewer slabs than asked if
+ * the producers run out.
+ */
+static inline int placement_place(struct placement_index *idx, int policy, int spread, int spot_size,
+                                  int min_free, struct placement_pick *picks, int max_picks)
+{
+	int n = 0, remaining = spot_size, t, available, share, take, i;
+
+	while (remaining > 0 && n < max_picks && idx->root != PLACEMENT_NIL) {
+		t = placement_candidate(idx, policy, remaining);
+		available = idx->nodes[t].key;
+		if (policy == PLACEMENT_SPREAD && n < spread)
+			share = (remaining + spread - n - 1) / (spread - n);
+		else
+			share = remaining;
+		take = available >= share ? share : available - min_free;
+		/* taken out so that no producer is picked twice */
+		placement_remove(idx, t);
+		picks[n].id = t;
+		picks[n].slabs = take > 0 ? take : 0;
+		n++;
+		if (take <= 0 && policy != PLACEMENT_SPREAD)
+			break;  /* the largest producer cannot give anything */
+		remaining -= picks[n - 1].slabs;
+	}
+	/* put the picked producers back with what they have left */
+	for (i = 0; i < n; i++) {
+		available = idx->nodes[picks[i].id].key;
+		placement_update(idx, picks[i].id, available - picks[i].slabs);
+	}
+	/* drop the picks that gave nothing */
+	for (i = 0, t = 0; i < n; i++) {
+		if (picks[i].slabs > 0)
+			picks[t++] = picks[i];
+	}
+	return t;
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+    Placement latency of the broker's placement index (placement.h) for
+    each policy, against copying and sorting every producer per request as
+    find_placement used to. Every spot request is followed by an
+    availability update of a random producer, as producers keep sending.
+    Compile
+    gcc -O2 placement_bench.c -o placement_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "placement.h"
+
+#define NR_PRODUCERS 100000
+#define NR_REQUESTS 100000
+#define NR_BASELINE_REQUESTS 200 //the sort is too slow for more
+#define MAX_AVAILABLE 512 //slabs offered by a producer
+#define MAX_SPOT_SIZE 64
+#define MIN_FREE 1
+#define MAX_PICKS 64
+
+struct producer {
+	int id;
+	int available_slabs;
+};
+
+int nr_producers = NR_PRODUCERS, nr_requests = NR_REQUESTS;
+int *available; //mirror of the index
+uint64_t rng_state = 0x2545f4914f6cdd1dull;
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+int cmp_producer(const void *a, const void *b) {
+	const struct producer *p = a, *q = b;
+
+	return (q->available_slabs > p->available_slabs) - (q->available_slabs < p->available_slabs);
+}
+
+/* the former find_placement: copy the producers with slabs, sort them, walk them */
+int baseline_place(struct producer *scratch, int spot_size, struct placement_pick *picks) {
+	int i, count = 0, n = 0, remaining = spot_size, take;
+
+	for(i = 0; i < nr_producers; i++) {
+		if(available[i] > 0) {
+			scratch[count].id = i;
+			scratch[count].available_slabs = available[i];
+			count++;
+		}
+	}
+	qsort(scratch, count, sizeof(struct producer), cmp_producer);
+	for(i = 0; i < count && remaining > 0 && n < MAX_PICKS; i++) {
+		take = scratch[i].available_slabs >= remaining ? remaining : scratch[i].available_slabs - MIN_FREE;
+		if(take <= 0)
+			break;
+		available[scratch[i].id] -= take;
+		picks[n].id = scratch[i].id;
+		picks[n++].slabs = take;
+		remaining -= take;
+	}
+	return n;
+}
+
+/* walks the treap, checking order and subtree sizes against the mirror */
+int check_node(struct placement_index *idx, int t, int *prev) {
+	struct placement_node *n;
+	int size;
+
+	if(t == PLACEMENT_NIL)
+		return 0;
+	n = &idx->nodes[t];
+	size = check_node(idx, n->left, prev);
+	if(*prev != PLACEMENT_NIL && !placement_less(idx, *prev, t)) {
+		printf("FAIL: index out of order at producer %d\n", t);
+		exit(1);
+	}
+	if(n->key != available[t]) {
+		printf("FAIL: producer %d has %d slabs in the index, %d expected\n", t, n->key, available[t]);
+		exit(1);
+	}
+	*prev = t;
+	size += 1 + check_node(idx, n->right, prev);
+	if(size != n->size) {
+		printf("FAIL: subtree size of producer %d\n", t);
+		exit(1);
+	}
+	return size;
+}
+
+void check_index(struct placement_index *idx) {
+	int i, nr_available = 0, prev = PLACEMENT_NIL;
+
+	for(i = 0; i < nr_producers; i++)
+		nr_available += available[i] > 0;
+	if(check_node(idx, idx->root, &prev) != nr_available) {
+		printf("FAIL: index holds a different number of producers\n");
+		exit(1);
+	}
+}
+
+void fill(struct placement_index *idx) {
+	int i;
+
+	rng_state = 0x2545f4914f6cdd1dull;
+	for(i = 0; i < nr_producers; i++) {
+		available[i] = rng() % (MAX_AVAILABLE + 1);
+		if(idx)
+			placement_update(idx, i, available[i]);
+	}
+}
+
+void report(const char *name, uint64_t *latency, int n, long nr_picks, long slabs, long asked, uint64_t update_ns) {
+	qsort(latency, n, sizeof(uint64_t), cmp_u64);
+	printf("%-10s p50 %8.2f us  p99 %8.2f us  update %6.3f us  producers/request %5.2f  placed %5.1f%%\n",
+	       name, latency[n / 2] / 1e3, latency[(int)((n - 1) * 0.99)] / 1e3, update_ns / 1e3,
+	       (double) nr_picks / n, 100.0 * slabs / asked);
+}
+
+int main(int argc, char *argv[]) {
+	struct placement_pick picks[MAX_PICKS];
+	struct placement_index idx;
+	struct producer *scratch;
+	uint64_t *latency, t0, update_ns;
+	long nr_picks, slabs, asked;
+	int opt, policy, i, j, n, id, spot_size, spread = PLACEMENT_DEFAULT_SPREAD;
+
+	while((opt = getopt(argc, argv, "hp:r:k:")) != -1) {
+		switch(opt) {
+		case 'p':
+			nr_producers = atoi(optarg);
+			break;
+		case 'r':
+			nr_requests = atoi(optarg);
+			break;
+		case 'k':
+			spread = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./placement_bench [-p producers] [-r requests] [-k spread]\n");
+			return 0;
+		}
+	}
+	available = calloc(nr_producers, sizeof(int));
+	scratch = calloc(nr_producers, sizeof(struct producer));
+	latency = calloc(nr_requests, sizeof(uint64_t));
+	if(!available || !scratch || !latency) {
+		printf("cannot allocate %d producers\n", nr_producers);
+		return 1;
+	}
+	printf("%d producers with up to %d slabs, %d requests of up to %d slabs\n",
+	       nr_producers, MAX_AVAILABLE, nr_requests, MAX_SPOT_SIZE);
+
+	for(policy = 0; policy < NR_PLACEMENT_POLICIES; policy++) {
+		if(placement_init(&idx, nr_producers) < 0) {
+			printf("cannot allocate the index\n");
+			return 1;
+		}
+		fill(&idx);
+		nr_picks = slabs = asked = 0;
+		update_ns = 0;
+		for(i = 0; i < nr_requests; i++) {
+			spot_size = 1 + rng() % MAX_SPOT_SIZE;
+			t0 = now_ns();
+			n = placement_place(&idx, policy, spread, spot_size, MIN_FREE, picks, MAX_PICKS);
+			latency[i] = now_ns() - t0;
+			for(j = 0; j < n; j++) {
+				available[picks[j].id] -= picks[j].slabs;
+				slabs += picks[j].slabs;
+			}
+			nr_picks += n;
+			asked += spot_size;
+
+			id = rng() % nr_producers;
+			available[id] = rng() % (MAX_AVAILABLE + 1);
+			t0 = now_ns();
+			placement_update(&idx, id, available[id]);
+			update_ns += now_ns() - t0;
+		}
+		check_index(&idx);
+		report(placement_policy_names[policy], latency, nr_requests, nr_picks, slabs, asked, update_ns / nr_requests);
+		placement_destroy(&idx);
+	}
+
+	fill(NULL);
+	nr_picks = slabs = asked = 0;
+	n = nr_requests < NR_BASELINE_REQUESTS ? nr_requests : NR_BASELINE_REQUESTS;
+	for(i = 0; i < n; i++) {
+		spot_size = 1 + rng() % MAX_SPOT_SIZE;
+		t0 = now_ns();
+		j = baseline_place(scratch, spot_size, picks);
+		latency[i] = now_ns() - t0;
+		nr_picks += j;
+		while(j-- > 0)
+			slabs += picks[j].slabs;
+		asked += spot_size;
+		id = rng() % nr_producers;
+		available[id] = rng() % (MAX_AVAILABLE + 1);
+	}
+	report("copy+sort", latency, n, nr_picks, slabs, asked, 0);
+	return 0;
+}
@@ -10,167 +10,382 @@
 #include "producer.h"
 
 int nslab, available_slab;
+struct spot_server spot_server; // embedded spot store, a tenant per consumer slot
+// the consumer table and the harvested sizes, shared by the network and harvest threads; also keeps their frames to the broker whole
+pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void portal_parser(char* msg) {
-	//portal format 1,2,192.168.0.12:8000:10:1,192.168.0.11:9400:20
-	//<msg_type>,<consumer_count>,<ip:port:slab_size:id>, ...
+// whether slot @slot can take a consumer; a draining one can once its store is closed, as its port is then free
+int consumer_slot_free(int slot) {
+	struct consumer_info_t* consumer = &producer.consumer_list[slot];
 
-	char ptr[1024], s[] = ",:", addr[200];
-	memcpy(ptr, msg, strlen(msg));
-	char* token = strtok(ptr, s);
-	int token_count = 0, type, consumer_count = 0, port, size, id;
-	
-	while( token != NULL ) {
-		if(token_count == 0) {
-			type = atoi(token);
-		}
-		else if(token_count == 1) {
-			consumer_count = atoi(token);
-			//TODO: check whether same consumer is added multiple time
-			producer.consumer_count = producer.consumer_count + consumer_count;
-		}
-		else if(token_count % 4 == 2) {
-			memcpy(addr, token, strlen(token)); 
-		}
-		else if(token_count % 4 == 3){
-			port = atoi(token); 
-		}
-		else if(token_count % 4 == 0){
-			size = atoi(token); 
-		}
-		else {
-			printf("all parsed\n");
-			id = atoi(token);
-			producer.consumer_list[id].id = id;
-			producer.consumer_list[id].port = port;
-			producer.consumer_list[id].nslabs = producer.consumer_list[id].nslabs + size;
-			memcpy(producer.consumer_list[id].ip, addr, strlen(addr));
-			printf("Msg type: %d, consumer ip: %s, port: %d, spot request: %d, id: %d\n", type, addr, port, size, id);
+	if(consumer->manager_state == DRAINING && !spot_server_serving(&spot_server, slot))
+		consumer->manager_state = STOP;
+	return consumer->id < 0 && consumer->manager_state != DRAINING;
+}
+
+// slot of consumer @id in consumer_list, a free one if @add and it has none, else -1
+int consumer_slot(int id, int add) {
+	int i, free_slot = -1;
+
+	if(id < 0)
+		return -1;
+	for(i = 0; i < MAX_CONSUMER; i++) {
+		if(producer.consumer_list[i].id == id)
+			return i;
+		if(free_slot < 0 && consumer_slot_free(i))
+			free_slot = i;
+	}
+	if(add && free_slot >= 0)
+		producer.consumer_list[free_slot].id = id;
+	return add ? free_slot : -1;
+}
+
+void assignment_parser(struct spot_msg_assignment* assignment) {
+	struct spot_assignment* entry;
+	int i, slot;
+
+	producer.consumer_count = producer.consumer_count + assignment->count;
+	for(i = 0; i < assignment->count; i++) {
+		entry = &assignment->entries[i];
+		slot = consumer_slot(entry->id, 1);
+		if(slot < 0) {
+			printf("no room for consumer %d, %d consumers served\n", entry->id, MAX_CONSUMER);
+			continue;
 		}
-		token = strtok(NULL, s);
-		token_count++;
+		producer.consumer_list[slot].port = entry->port;
+		producer.consumer_list[slot].nslabs = producer.consumer_list[slot].nslabs + entry->slabs;
+		if(producer.consumer_list[slot].manager_state == RUNNING)
+			producer.node_assigned_memory[producer.consumer_list[slot].numa_node] += entry->slabs * g_node_size;
+		strcpy(producer.consumer_list[slot].ip, entry->ip);
+		printf("consumer ip: %s, port: %d, spot request: %d, id: %d\n", entry->ip, entry->port, entry->slabs, entry->id);
 	}
 }
 
 void send_registration_msg() {
-	char msg[300];
-	sprintf(msg, "%d,%s,%d", PRODUCER_REG, producer.ip, producer.port);
-	write(broker.sock, msg, sizeof(msg));
+	struct spot_msg msg = { .type = PRODUCER_REG };
+	if(snprintf(msg.reg.ip, sizeof(msg.reg.ip), "%s", producer.ip) >= (int) sizeof(msg.reg.ip))
+		printf("ip %s is longer than %d characters, registering as %s\n", producer.ip, SPOT_PROTO_MAX_IP, msg.reg.ip);
+	msg.reg.port = producer.port;
+	spot_send(broker.sock, &msg);
 }
 
 void send_producer_availability_msg(){
-	char msg[200];
-	sprintf(msg, "%d,%d,%d,%d",PRODUCER_AVAILABILITY, producer.id, (int)(producer.harvested_memory/g_node_size), (int)(producer.total_memory/g_node_size));
-	write(broker.sock, msg, sizeof(msg));
+	struct spot_msg msg = { .type = PRODUCER_AVAILABILITY };
+	int i;
+
+	msg.availability.id = producer.id;
+	msg.availability.available_slabs = (int)(producer.harvested_memory/g_node_size);
+	msg.availability.total_slabs = (int)(producer.total_memory/g_node_size);
+	msg.availability.nr_nodes = MIN(producer.numa.nr_nodes, SPOT_PROTO_MAX_NODES);
+	for(i = 0; i < msg.availability.nr_nodes; i++)
+		msg.availability.node_available_slabs[i] = (int)(producer.node_harvested_memory[i]/g_node_size);
+	spot_send(broker.sock, &msg);
+}
+
+void send_producer_ready_msg(int slot) {
+	struct spot_msg msg = { .type = PRODUCER_READY };
+	msg.ready.producer_id = producer.id;
+	msg.ready.consumer_id = producer.consumer_list[slot].id;
+	msg.ready.port = producer.consumer_list[slot].manager_port;
+	spot_send(broker.sock, &msg);
+}
+
+// has the consumer's redis-server exit and waits for its port, handed to the slot's next consumer, to close
+void stop_redis_server(int slot) {
+	static const char shutdown_cmd[] = "*2\r\n$8\r\nSHUTDOWN\r\n$6\r\nNOSAVE\r\n";
+	struct sockaddr_in addr;
+	int i, sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(producer.consumer_list[slot].manager_port);
+	if(inet_pton(AF_INET, producer.ip, &addr.sin_addr) <= 0)
+		return;
+	for(i = 0; i < REDIS_STOP_TRIES; i++) {
+		if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			break;
+		if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			// nothing listens on the port any more
+			close(sock);
+			return;
+		}
+		if(send(sock, shutdown_cmd, sizeof(shutdown_cmd) - 1, MSG_NOSIGNAL) < 0)
+			perror("redis-server shutdown");
+		close(sock);
+		usleep(REDIS_STOP_WAIT);
+	}
+	printf("redis-server of consumer slot %d still holds port %d\n", slot, producer.consumer_list[slot].manager_port);
 }
 
-void send_producer_ready_msg(int consumer_id) {
-	char msg[200];
-	sprintf(msg, "%d,%d,%d,%d", PRODUCER_READY, producer.id, consumer_id, producer.consumer_list[consumer_id].manager_port);
-	write(broker.sock, msg, sizeof(msg));
+// the quota of the consumer's spot store follows its slabs
+void set_spot_quota(int slot) {
+	if(!producer.redis_path[0])
+		spot_server_set_quota(&spot_server, slot, producer.consumer_list[slot].nslabs * g_node_size);
 }
 
-void run_spot_manager(int consumer_id) {
-	char *producer_cmd;
+void send_spot_shrink_msg(int slot, int slabs) {
+	struct spot_msg msg = { .type = SPOT_SHRINK };
+	msg.shrink.producer_id = producer.id;
+	msg.shrink.consumer_id = producer.consumer_list[slot].id;
+	msg.shrink.slabs = slabs;
+	msg.shrink.quota_slabs = producer.consumer_list[slot].nslabs;
+	msg.shrink.deadline_ms = producer.shrink_deadline_ms;
+	spot_send(broker.sock, &msg);
+}
 
-	if(producer.consumer_list[consumer_id].manager_state == RUNNING) {
-		send_producer_ready_msg(consumer_id);
+// takes @slabs back from the consumer: it is told at once, its store cut down at the deadline
+void shrink_spot_store(int slot, int slabs) {
+	struct consumer_info_t* consumer = &producer.consumer_list[slot];
+
+	consumer->nslabs -= slabs;
+	producer.node_assigned_memory[consumer->numa_node] -= slabs * g_node_size;
+	printf("consumer %d gives %d slabs back, %d left in %d ms\n", consumer->id, slabs, consumer->nslabs, producer.shrink_deadline_ms);
+	if(!producer.redis_path[0])
+		spot_server_shrink(&spot_server, slot, consumer->nslabs * g_node_size, producer.shrink_deadline_ms);
+	if(producer.status == REGISTERED)
+		send_spot_shrink_msg(slot, slabs);
+	if(consumer->nslabs == 0) {
+		// a redis-server has no deadline to wait for; a store closes at it, the slot and port stay taken until then
+		if(producer.redis_path[0]) {
+			stop_redis_server(slot);
+			consumer->manager_state = STOP;
+		} else {
+			consumer->manager_state = DRAINING;
+		}
+		consumer->id = -1;
 	}
-	else {
-		char redis_cmd[1024];
-/*		sprintf(redis_cmd, "ps -aux | grep redis-server | grep -v grep | awk '{ print $2 }' | xargs kill -9 &&  cgexec -g memory:%s /newdir/spot/redis/src/redis-server --bind %s --port %d --save \"\"", producer.cgroup_name, producer.ip, producer.consumer_list[consumer_id].manager_port);
-*/
-		long long consumer_size = producer.consumer_list[consumer_id].nslabs * g_node_size;
-		sprintf(redis_cmd, /*"ps -aux | grep redis-server | grep -v grep | awk '{ print $2 }' | xargs kill -9 &&*/ "cgexec -g memory:%s /root/redis/src/redis-server --bind %s --port %d --save \"\" --maxmemory %lld --maxmemory-policy allkeys-lru", producer.cgroup_name, producer.ip, producer.consumer_list[consumer_id].manager_port, consumer_size);
-		printf("%s", redis_cmd);
-		FILE* _pipe = popen(redis_cmd, "r");
-		//TODO: check redis status from the _pipe
-		producer.consumer_list[consumer_id].manager_state = RUNNING;
-		send_producer_ready_msg(consumer_id);
+}
+
+// when a node harvests less than it handed out, the stores idle the longest give slabs back first
+void reclaim_spot_memory() {
+	struct consumer_info_t* consumer;
+	long long deficit;
+	uint64_t idle, max_idle = 0;
+	int i, node, slot, slabs;
+
+	for(node = 0; node < producer.numa.nr_nodes; node++) {
+		deficit = producer.node_assigned_memory[node] - producer.node_harvested_memory[node];
+		while(deficit > 0) {
+			slot = -1;
+			for(i = 0; i < MAX_CONSUMER; i++) {
+				consumer = &producer.consumer_list[i];
+				if(consumer->manager_state != RUNNING || consumer->numa_node != node || consumer->nslabs == 0)
+					continue;
+				idle = producer.redis_path[0] ? 0 : spot_server_idle(&spot_server, i);
+				if(slot < 0 || idle > max_idle) {
+					slot = i;
+					max_idle = idle;
+				}
+			}
+			if(slot < 0)
+				break;
+			slabs = (int) MIN(producer.consumer_list[slot].nslabs, (deficit + g_node_size - 1) / g_node_size);
+			shrink_spot_store(slot, slabs);
+			deficit -= slabs * g_node_size;
+		}
 	}
 }
 
+void run_redis_server(int slot, int node) {
+	char redis_cmd[1024], numa_cmd[64] = "";
+
+	if(producer.numa.nr_nodes > 1)
+		sprintf(numa_cmd, "numactl --membind=%d ", producer.numa.node_id[node]);
+	sprintf(redis_cmd, "cgexec -g memory:%s %s%s --bind %s --port %d --save \"\" --maxmemory %lld --maxmemory-policy allkeys-lru", producer.cgroup_name, numa_cmd, producer.redis_path, producer.ip, producer.consumer_list[slot].manager_port, producer.consumer_list[slot].nslabs * g_node_size);
+	printf("%s\n", redis_cmd);
+	FILE* _pipe = popen(redis_cmd, "r");
+	//TODO: check redis status from the _pipe
+}
+
+void run_spot_manager(int slot) {
+	struct consumer_info_t* consumer = &producer.consumer_list[slot];
+	long long consumer_size = consumer->nslabs * g_node_size;
+	long long node_headroom[MAX_NUMA_NODES];
+	int i, node;
+
+	if(consumer->manager_state == RUNNING) {
+		// the quota follows the slabs added by the assignment
+		set_spot_quota(slot);
+		send_producer_ready_msg(slot);
+		return;
+	}
+
+	// serve the consumer from the node with the most unassigned harvested memory
+	for(i = 0; i < producer.numa.nr_nodes; i++)
+		node_headroom[i] = producer.node_harvested_memory[i] - producer.node_assigned_memory[i];
+	node = numa_max_node(&producer.numa, node_headroom);
+	if(producer.redis_path[0]) {
+		run_redis_server(slot, node);
+	} else if(spot_server_open(&spot_server, slot, producer.ip, consumer->manager_port, consumer_size,
+	                           producer.numa.nr_nodes > 1 ? producer.numa.node_id[node] : -1) < 0) {
+		printf("cannot open the spot store of consumer %d on %s:%d\n", consumer->id, producer.ip, consumer->manager_port);
+		return;
+	}
+	consumer->numa_node = node;
+	producer.node_assigned_memory[node] += consumer_size;
+	consumer->manager_state = RUNNING;
+	send_producer_ready_msg(slot);
+}
+
+// the lease is over, its slabs go back to the harvested memory on offer
+void end_lease(struct spot_msg_lease* lease) {
+	int slot = consumer_slot(lease->consumer_id, 0);
+	struct consumer_info_t* consumer;
+
+	// slabs taken back by a shrink are accounted for already
+	if(slot < 0 || lease->reason == LEASE_SHRUNK)
+		return;
+	consumer = &producer.consumer_list[slot];
+	consumer->nslabs = MAX(consumer->nslabs - lease->slabs, 0);
+	if(consumer->manager_state == RUNNING)
+		producer.node_assigned_memory[consumer->numa_node] -= lease->slabs * g_node_size;
+	if(consumer->nslabs == 0 && consumer->manager_state == RUNNING) {
+		if(producer.redis_path[0])
+			stop_redis_server(slot);
+		else
+			spot_server_close(&spot_server, slot);
+		consumer->manager_state = STOP;
+	}
+	if(consumer->nslabs == 0 && consumer->manager_state == STOP)
+		consumer->id = -1;
+	else
+		set_spot_quota(slot);
+}
+
 void run_dstat() {
 	char* DSTAT_CMD = "dstat -m 2>&1 | tee /root/dstat.txt";
 	FILE* _pipe = popen(DSTAT_CMD, "r");
 }
 
-void handle_message(char* msg) {
-	int type, i;
+void handle_message(const struct spot_frame* frame) {
+	struct spot_msg msg;
+	int i;
 	
-	sscanf(msg, "%d,", &type);
-	printf("Message type: %d, %s\n", type, msg);
-	switch (type) {
+	if(spot_decode(frame, &msg) < 0) {
+		printf("Message type: %d, malformed (%u bytes)\n", frame->type, frame->payload_len);
+		return;
+	}
+	printf("Message type: %d\n", msg.type);
+	switch (msg.type) {
 		case CONNECTION_ACK:
 			producer.status = CONNECTED;
 			send_registration_msg();
 			break;
 		case REGISTRATION_ACK:
-			sscanf(msg, "%d,%d", &type, &producer.id);
-			printf("Message type: %d (register-ack), id at broker: %d\n", type, producer.id);
-			producer.status = REGISTERED;
+			producer.id = msg.ack.id;
+			printf("Message type: %d (register-ack), id at broker: %d\n", msg.type, producer.id);
+			if(producer.id >= 0)
+				producer.status = REGISTERED;
 			break;
 		case SPOT_ASSIGNMENT_PRODUCER:
-			portal_parser(msg);
-			for(i = 0; i < producer.consumer_count; i++ ) {
-				if(producer.consumer_list[i].nslabs != 0) {
-					printf("#%d <ip:port:size> = <%s:%d:%d>\n", i, producer.consumer_list[i].ip, producer.consumer_list[i].port, producer.consumer_list[i].nslabs);
-					run_spot_manager(producer.consumer_list[i].id);
+			assignment_parser(&msg.assignment);
+			for(i = 0; i < MAX_CONSUMER; i++ ) {
+				if(producer.consumer_list[i].id >= 0 && producer.consumer_list[i].nslabs != 0) {
+					printf("#%d <ip:port:size> = <%s:%d:%d>\n", producer.consumer_list[i].id, producer.consumer_list[i].ip, producer.consumer_list[i].port, producer.consumer_list[i].nslabs);
+					run_spot_manager(i);
 				}
 			}
+			break;
+		case LEASE_GRANT:
+			printf("Message type: %d (lease-grant), lease %d of %d slabs to consumer %d for %d s\n", msg.type, msg.lease.lease_id, msg.lease.slabs, msg.lease.consumer_id, msg.lease.duration);
+			break;
+		case LEASE_END:
+			printf("Message type: %d (lease-end), lease %d of %d slabs to consumer %d, reason %d\n", msg.type, msg.lease.lease_id, msg.lease.slabs, msg.lease.consumer_id, msg.lease.reason);
+			end_lease(&msg.lease);
+			break;
 		default:
 			break;
 	}
 }
 
+void sum_node_harvested_memory() {
+	int i;
+
+	producer.harvested_memory = 0;
+	for(i = 0; i < producer.numa.nr_nodes; i++)
+		producer.harvested_memory += producer.node_harvested_memory[i];
+	if(producer.harvested_memory < MIN_SPOT_SIZE) {
+		// keep offering the minimum spot from the node with the most headroom
+		i = numa_max_node(&producer.numa, producer.node_est_available_memory);
+		producer.node_harvested_memory[i] += MIN_SPOT_SIZE - producer.harvested_memory;
+		producer.harvested_memory = MIN_SPOT_SIZE;
+	}
+}
+
+void follow_balloon_decision(){
+	struct harvest_snapshot snapshot;
+	uint32_t seq;
+	int i, j;
+
+	// no syscall on the read path; sleep on the balloon's futex between publications
+	while(1) {
+		seq = harvest_shm_read(producer.balloon_shm, &snapshot);
+		pthread_mutex_lock(&consumer_lock);
+		producer.est_available_memory = snapshot.est_available_memory;
+		for(i = 0; i < producer.numa.nr_nodes; i++) {
+			producer.node_harvested_memory[i] = 0;
+			for(j = 0; j < snapshot.nr_nodes; j++) {
+				if(snapshot.node_id[j] == producer.numa.node_id[i])
+					producer.node_harvested_memory[i] = snapshot.node_harvested_memory[j];
+			}
+		}
+		sum_node_harvested_memory();
+		reclaim_spot_memory();
+		if(producer.status == REGISTERED)
+			send_producer_availability_msg();
+		pthread_mutex_unlock(&consumer_lock);
+		harvest_shm_wait(producer.balloon_shm, seq, SLEEP_TIME / 1000);
+	}
+}
+
 void harvest_decision(){
 	long long available_memory, cur_est_available_memory, evict_count, diff;
+	long long node_available_memory[MAX_NUMA_NODES], alloc_threshold, evict_threshold;
+	int node;
+
+	if(producer.balloon_shm != NULL) {
+		follow_balloon_decision();
+		return;
+	}
 
     while(1) {
-        available_memory = get_available_memory();
-        cur_est_available_memory = update_est_available_memory(available_memory);
-//        printf("available memory: %lld, estimated: %lld, harvested: %lld\n", available_memory, cur_est_available_memory, g_harvested_memory);
-        if (cur_est_available_memory - producer.harvested_memory < g_evict_threshold) {
-            diff = g_evict_threshold - (cur_est_available_memory - producer.harvested_memory);
-            evict_count = 0;
-
-            while (diff > 0 && producer.harvested_memory > MIN_SPOT_SIZE) {
-                producer.harvested_memory -= g_node_size;
-                diff = g_evict_threshold - (cur_est_available_memory - producer.harvested_memory);
-                ++evict_count;
+        get_node_available_memory(node_available_memory);
+        pthread_mutex_lock(&consumer_lock);
+        producer.est_available_memory = 0;
+
+        // harvest from each node separately so spot stores can be bound to local memory
+        for(node = 0; node < producer.numa.nr_nodes; node++) {
+            available_memory = node_available_memory[node];
+            cur_est_available_memory = update_node_est_available_memory(node, available_memory);
+            producer.est_available_memory += cur_est_available_memory;
+            alloc_threshold = g_alloc_threshold * producer.numa.total[node] / producer.total_memory;
+            evict_threshold = g_evict_threshold * producer.numa.total[node] / producer.total_memory;
+
+            if (cur_est_available_memory - producer.node_harvested_memory[node] < evict_threshold) {
+                diff = evict_threshold - (cur_est_available_memory - producer.node_harvested_memory[node]);
+                evict_count = 0;
+
+                while (diff > 0 && producer.node_harvested_memory[node] > 0) {
+                    producer.node_harvested_memory[node] -= g_node_size;
+                    diff -= g_node_size;
+                    ++evict_count;
+                }
+                producer.node_harvested_memory[node] = MAX(producer.node_harvested_memory[node], 0);
             }
-
-            producer.harvested_memory = MAX(producer.harvested_memory, MIN_SPOT_SIZE);
-			
-			if(producer.status == REGISTERED)
-				send_producer_availability_msg();
-			//TODO: add concrete evict/resize logic
-            //set_spot_size(producer.harvested_memory, producer_server);
-
-/*            printf("EVICT | available memory: %lld MB ", (available_memory >> 20));
+            else if (cur_est_available_memory - producer.node_harvested_memory[node] > alloc_threshold) {
+                producer.node_harvested_memory[node] += g_node_size;
+            }
+/*            printf("node %d | available memory: %lld MB ", producer.numa.node_id[node], (available_memory >> 20));
             printf("estimated available memory: %lld MB ", (cur_est_available_memory >> 20));
-            printf("allocated memory: %lld MB ", (producer.harvested_memory >> 20));
-            printf("evicted: %lld MB\n", ((evict_count * g_node_size) >> 20));
+            printf("allocated memory: %lld MB\n", (producer.node_harvested_memory[node] >> 20));
 */        }
-        else if (cur_est_available_memory - producer.harvested_memory > g_alloc_threshold) {
-            producer.harvested_memory += g_node_size;
 
-			//TODO: add concrete evict/resize logic
-            //set_spot_size(producer.harvested_memory, producer_server);
-			if(producer.status == REGISTERED)
-				send_producer_availability_msg();
-
-  /*          printf("ALLOC | available memory: %lld MB ", (available_memory >> 20));
-            printf("estimated available memory: %lld MB ", (cur_est_available_memory >> 20));
-            printf("allocated memory: %lld MB ", (producer.harvested_memory >> 20));
-*/        } 
-        else {
-		if(producer.status == REGISTERED)
-			send_producer_availability_msg();
-  /*          printf("SKIP  | available memory: %lld MB ", (available_memory >> 20));
-            printf("estimated available memory: %lld MB ", (cur_est_available_memory >> 20));
-            printf("allocated memory: %lld MB\n", (producer.harvested_memory >> 20));
-*/        }
+        // consumers are told of a shrink before the broker hears of the availability
+        sum_node_harvested_memory();
+        reclaim_spot_memory();
+        if(producer.status == REGISTERED)
+            send_producer_availability_msg();
+        pthread_mutex_unlock(&consumer_lock);
         usleep(SLEEP_TIME);
     }
 }
@@ -178,8 +393,9 @@ void harvest_decision(){
 void init_network(){
 	struct sockaddr_in address; 
 	struct sockaddr_in serv_addr; 
-	char buffer[BUFFER_SIZE] = {0}; 
-	int i, len;
+	static struct spot_inbuf in;
+	struct spot_frame frame;
+	int i, len, ret;
 
 	if ((broker.sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
 		printf("\n Socket creation error \n"); 
@@ -202,9 +418,18 @@ void init_network(){
 	} 
 	printf("producer's connection to broker successful\n");
 
-	while((len = recv(broker.sock , buffer , BUFFER_SIZE , 0)) > 0) {
-		//message received from the server
-		handle_message(buffer);
+	spot_inbuf_init(&in);
+	while((len = spot_inbuf_recv(broker.sock, &in, 0)) > 0) {
+		//frames received from the server, possibly several or a partial one
+		while((ret = spot_inbuf_next(&in, &frame)) == 1) {
+			pthread_mutex_lock(&consumer_lock);
+			handle_message(&frame);
+			pthread_mutex_unlock(&consumer_lock);
+		}
+		if(ret < 0) {
+			printf("broker sent a malformed frame\n");
+			break;
+		}
 	}
 }
 
@@ -217,23 +442,54 @@ void init() {
 	producer.port = PRODUCER_PORT;
 	producer.status = INIT;
 	strcpy(producer.cgroup_name, "spot");
+	producer.app_cgroup_name[0] = '\0';
+	producer.balloon_shm = NULL;
+	producer.redis_path[0] = '\0';
+	producer.shrink_deadline_ms = SHRINK_DEADLINE_MS;
 
 	producer.consumer_count = MAX_CONSUMER;
 	for(i=0; i<producer.consumer_count; i++) {
+		producer.consumer_list[i].id = -1; // free slot
 		producer.consumer_list[i].nslabs = 0;
 		producer.consumer_list[i].manager_state = STOP;
 		producer.consumer_list[i].manager_port = MANAGER_PORT_INIT + i*2;
+		producer.consumer_list[i].numa_node = 0;
 	}
 
 	producer.total_memory = get_total_memory_size();
 	producer.harvested_memory = 0;
+	if(numa_read_meminfo(&producer.numa) < 0) {
+		printf("cannot read NUMA node meminfo\n");
+		exit(1);
+	}
+	if(producer.numa.nr_nodes == 1)
+		producer.numa.total[0] = producer.total_memory;
+	for(i = 0; i < producer.numa.nr_nodes; i++) {
+		producer.node_harvested_memory[i] = 0;
+		producer.node_est_available_memory[i] = 0;
+		producer.node_assigned_memory[i] = 0;
+	}
 	nslab = 40;
 	available_slab = 20;
 	run_dstat();
 }
 
+// spot store memory is charged to the spot cgroup, as the redis-servers run in it were
+void join_spot_cgroup() {
+	char path[CGROUP_PATH_MAX_LEN];
+	FILE* procs;
+
+	sprintf(path, "/sys/fs/cgroup/memory/%s/cgroup.procs", producer.cgroup_name);
+	procs = fopen(path, "w");
+	if(!procs || fprintf(procs, "%d\n", getpid()) < 0)
+		printf("cannot join cgroup %s, spot store memory counts as the host's\n", producer.cgroup_name);
+	if(procs)
+		fclose(procs);
+}
+
 void usage() {
-	printf("Usage ./producer [-b broker-ip] [-p broker-port] [-c producer-ip] [-q producer-port] [-g cgroup-name]\n");
+	printf("Usage ./producer [-b broker-ip] [-p broker-port] [-c producer-ip] [-q producer-port] [-g cgroup-name] [-a app-cgroup-name] [-m balloon-shm-name] [-r redis-server-path] [-d shrink-deadline-ms]\n");
+	printf("Spot stores are served in-process unless -r runs a redis-server per consumer\n");
 	printf("Default broker ip:port is %s:%d, producer ip:port is %s:%d\n", BROKER_IP, BROKER_PORT, PRODUCER_IP, PRODUCER_PORT);
 	printf("\n");
 }
@@ -244,7 +500,7 @@ int main(int argc, char *argv[]) {
 	
 	init();
 
-	while ((opt = getopt(argc, argv, "hb:p:c:q:g")) != -1) {
+	while ((opt = getopt(argc, argv, "hb:p:c:q:ga:m:r:d:")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -265,11 +521,35 @@ int main(int argc, char *argv[]) {
 			//producer.cgroup_name = optarg;
 			//printf("%s\n",optarg);
 			break;
+		case 'a':
+			strncpy(producer.app_cgroup_name, optarg, sizeof(producer.app_cgroup_name) - 1);
+			break;
+		case 'm':
+			producer.balloon_shm = harvest_shm_attach(optarg);
+			if(producer.balloon_shm == NULL) {
+				printf("cannot attach to balloon shared memory %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			strncpy(producer.redis_path, optarg, sizeof(producer.redis_path) - 1);
+			break;
+		case 'd':
+			producer.shrink_deadline_ms = atoi(optarg);
+			break;
 		default:
 			break;
 		}
 	}
 
+	if(!producer.redis_path[0]) {
+		join_spot_cgroup();
+		if(spot_server_start(&spot_server, MAX_CONSUMER) < 0) {
+			printf("cannot start the spot store\n");
+			return 1;
+		}
+	}
+
 	pthread_create(&harvest_thread, NULL, (void *)harvest_decision, NULL);
 
 	init_network();
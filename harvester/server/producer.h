@@ -10,6 +10,11 @@
 #include <assert.h>
 #include <stdatomic.h>
 #include <arpa/inet.h>
+#include "../common/harvest_shm.h"
+#include "../common/numa_mem.h"
+#include "../common/availability.h"
+#include "spot_proto.h"
+#include "spot_server.h"
 // #include <openssl/rand.h>
 // #include <openssl/sha.h>
 // #include <openssl/evp.h>
@@ -27,27 +32,16 @@
 #define PRODUCER_IP "192.168.122.141"
 #define PRODUCER_PORT 9702 
 #define MANAGER_PORT_INIT 9704 
-#define MAX_CONSUMER 128
+#define MAX_CONSUMER 128 // served at once, consumer_list is searched by broker id
 #define PAGE_SIZE 4096
 #define BUFFER_SIZE 4096
 #define SPOT_SIZE 5 // interms of GB
 #define LEASE_TIME 1 // interms of hour
 
-enum msg_type {
-	CONNECTION_ACK = 0,
-	PRODUCER_REG = 1,
-	CONSUMER_REG = 2,
-	REGISTRATION_ACK = 3,
-    PRODUCER_AVAILABILITY = 4,
-	SPOT_REQUEST = 5,
-	SPOT_ASSIGNMENT_CONSUMER = 6,
-    SPOT_ASSIGNMENT_PRODUCER = 7,
-	PRODUCER_READY = 8
-};
-
 enum manager_state {
 	STOP = 0,
-	RUNNING = 1
+	RUNNING = 1,
+	DRAINING = 2 // shrunk to no slabs, the slot is kept until its store closes at the deadline
 };
 
 enum producer_state {
@@ -63,6 +57,7 @@ struct consumer_info_t {
 	int nslabs;
 	int manager_state;
     int manager_port;
+    int numa_node; // node slot the spot store memory is bound to
 };
 
 struct {
@@ -77,10 +72,18 @@ struct {
 	int id;
 	int consumer_count;
 	char cgroup_name[20];
+    char app_cgroup_name[64]; // cgroup of the producer's own application, empty if unknown
     long long total_memory;
     long long harvested_memory;
     long long est_available_memory;
     int status;
+    struct harvest_shm *balloon_shm; // harvested size published by the balloon, if attached
+    struct numa_mem numa;
+    long long node_harvested_memory[MAX_NUMA_NODES];
+    long long node_est_available_memory[MAX_NUMA_NODES];
+    long long node_assigned_memory[MAX_NUMA_NODES]; // harvested memory handed to spot stores
+    char redis_path[256]; // redis-server run per consumer instead of the embedded spot store, empty if none
+    int shrink_deadline_ms; // notice given to a consumer before its spot store is cut down
 	struct consumer_info_t consumer_list[MAX_CONSUMER + 2];
 } producer;
 
@@ -89,6 +92,9 @@ struct {
 #define PAGE_SHIFT 12
 #define MIN_SPOT_SIZE (50l << 20)
 #define SLEEP_TIME 60000000 // in microseconds 1sec = 1000000 us
+#define SHRINK_DEADLINE_MS 2000
+#define REDIS_STOP_TRIES 10 // SHUTDOWN requests before giving up on a redis-server
+#define REDIS_STOP_WAIT 100000 // in microseconds, for a redis-server to exit
 #define UNUSED(x) ((void)(x))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
@@ -210,8 +216,8 @@ long long get_cgroup_rss() {
 long long get_tswap_memory_size() {
     FILE* tswap_stat = fopen("/sys/kernel/tswap/tswap_stat", "r");
     if (!tswap_stat) {
-        printf("cannot open tswap stat file\n");
-        exit(1);
+        // tswap is optional on the producer
+        return 0;
     }
 
     long nr_memory_page = 0;
@@ -221,18 +227,52 @@ long long get_tswap_memory_size() {
     while( fscanf(tswap_stat, "%s %ld", key, &value) != EOF) {
         if( (strcmp(key, "nr_zombie_page:") == 0) || (strcmp(key, "nr_in_memory_page:") == 0) || (strcmp(key, "nr_in_memory_zombie_page:") == 0) || (strcmp(key, "nr_in_flight_page:") == 0)) {
             nr_memory_page += value;
+        } else if (strcmp(key, "nr_compress_saved_page:") == 0) {
+            // quarantined pages held compressed take less memory
+            nr_memory_page -= value;
         }
     }
+    fclose(tswap_stat);
 //    printf("tswap page size: %lld\n", nr_memory_page << PAGE_SHIFT);
     return nr_memory_page << PAGE_SHIFT;
 }
 
+// pressure-aware safe-to-harvest estimate; spot stores' usage counts as available
 long long get_available_memory() {
-    return get_free_memory_size() + get_cgroup_rss();
+    struct availability_estimate est;
+
+    if (estimate_availability(producer.app_cgroup_name[0] ? producer.app_cgroup_name : NULL,
+                              get_cgroup_rss(), get_tswap_memory_size(), &est) < 0) {
+        // kernels without MemAvailable
+        return get_free_memory_size() + get_cgroup_rss();
+    }
+    return est.safe;
+}
+
+// host estimate split across nodes by per-node MemFree plus the spot cgroup's usage on that node,
+// indexed like producer.numa.node_id
+long long get_node_available_memory(long long node_available[]) {
+    long long node_usage[MAX_NUMA_NODES], available, node_sum = 0;
+    int i;
+
+    available = get_available_memory();
+    if (producer.numa.nr_nodes == 1 || numa_read_meminfo(&producer.numa) < 0
+        || numa_read_cgroup_usage(producer.cgroup_name, &producer.numa, node_usage) < 0) {
+        // single node (or no per-node stats): split by node size
+        for (i = 0; i < producer.numa.nr_nodes; i++)
+            node_available[i] = available * producer.numa.total[i] / producer.total_memory;
+        return available;
+    }
+
+    for (i = 0; i < producer.numa.nr_nodes; i++)
+        node_sum += producer.numa.free[i] + node_usage[i];
+    for (i = 0; i < producer.numa.nr_nodes; i++)
+        node_available[i] = (node_sum > 0) ? (long long) ((double) available * (producer.numa.free[i] + node_usage[i]) / node_sum) : 0;
+    return available;
 }
 
-long update_est_available_memory(long available_memory) {
-    producer.est_available_memory = (long) (g_ewma_beta * available_memory + (1 - g_ewma_beta) * producer.est_available_memory);
-    return MIN(producer.est_available_memory, available_memory);
+long long update_node_est_available_memory(int node, long long available_memory) {
+    producer.node_est_available_memory[node] = (long long) (g_ewma_beta * available_memory + (1 - g_ewma_beta) * producer.node_est_available_memory[node]);
+    return MIN(producer.node_est_available_memory[node], available_memory);
 }
 #endif
@@ -0,0 +1,176 @@
+#ifndef __REGISTRY_H_
+#define __REGISTRY_H_
+
+/*
+ * Growable registry of the broker's producers and consumers.
+ *
+ * Records live in slabs of REGISTRY_SLAB_RECORDS that are never moved or
+ * freed, so a record's address is stable. A freed slot is reused for the
+ * next registration with its generation bumped, and ids carry both: the
+ * slot in the low REGISTRY_SLOT_BITS and the generation above them, so a
+ * stale id never resolves to the record that reused its slot. The live
+ * slots are also kept packed in dense[] for scans over all records.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGISTRY_SLOT_BITS 22  /* 4M records */
+#define REGISTRY_MAX_SLOTS (1 << REGISTRY_SLOT_BITS)
+#define REGISTRY_GENERATION_MASK 0x1ff  /* ids stay positive int32 */
+#define REGISTRY_SLAB_SHIFT 10
+#define REGISTRY_SLAB_RECORDS (1 << REGISTRY_SLAB_SHIFT)
+
+struct registry_slot {
+	uint32_t generation;  /* of the current or the next record in the slot */
+	int dense;  /* position in dense[], -1 if free */
+};
+
+struct registry {
+	size_t record_size;
+	char **slabs;
+	int nr_slabs;
+	struct registry_slot *slots;
+	int nr_slots;  /* ever used */
+	int *free_slots;  /* stack of freed slots */
+	int nr_free;
+	int *dense;  /* slots of the live records */
+	int nr_live;
+};
+
+static inline int registry_id_slot(int id)
+{
+	return id & (REGISTRY_MAX_SLOTS - 1);
+}
+
+static inline int registry_make_id(int slot, uint32_t generation)
+{
+	return (int)(generation << REGISTRY_SLOT_BITS) | slot;
+}
+
+static inline void registry_init(struct registry *reg, size_t record_size)
+{
+	memset(reg, 0, sizeof(*reg));
+	reg->record_size = record_size;
+}
+
+static inline void *registry_slot_record(struct registry *reg, int slot)
+{
+	return reg->slabs[slot >> REGISTRY_SLAB_SHIFT] +
+	       (size_t)(slot & (REGISTRY_SLAB_RECORDS - 1)) * reg->record_size;
+}
+
+/* the record of @id, or NULL if @id was never handed out or was freed since */
+static inline void *registry_get(struct registry *reg, int id)
+{
+	int slot = registry_id_slot(id);
+
+	if (id < 0 || slot >= reg->nr_slots || reg->slots[slot].dense < 0 ||
+	    registry_make_id(slot, reg->slots[slot].generation) != id)
+		return NULL;
+	return registry_slot_record(reg, slot);
+}
+
+/* adds a slab and the slot metadata for its records, returns 0 or -1 */
+static inline int registry_grow(struct registry *reg)
+{
+	int capacity = (reg->nr_slabs + 1) * REGISTRY_SLAB_RECORDS;
+	struct registry_slot *slots;
+	char **slabs, *slab;
+	int *free_slots, *dense;
+
+	if (capacity > REGISTRY_MAX_SLOTS)
+		return -1;
+	slab = (char *) calloc(REGISTRY_SLAB_RECORDS, reg->record_size);
+	slabs = (char **) realloc(reg->slabs, (reg->nr_slabs + 1) * sizeof(char *));
+	if (slab == NULL || slabs == NULL) {
+		free(slab);
+		if (slabs)
+			reg->slabs = slabs;
+		return -1;
+	}
+	reg->slabs = slabs;
+	slots = (struct registry_slot *) realloc(reg->slots, capacity * sizeof(struct registry_slot));
+	if (slots)
+		reg->slots = slots;
+	free_slots = (int *) realloc(reg->free_slots, capacity * sizeof(int));
+	if (free_slots)
+		reg->free_slots = free_slots;
+	dense = (int *) realloc(reg->dense, capacity * sizeof(int));
+	if (dense)
+		reg->dense = dense;
+	if (!slots || !free_slots || !dense) {
+		free(slab);
+		return -1;
+	}
+	reg->slabs[reg->nr_slabs++] = slab;
+	return 0;
+}
+
+/*
+ * Allocates a zeroed record and returns its id, or -1 if out of memory or
+ * of slots. Freed slots are reused first, most recently freed first.
+ */
+static inline int registry_alloc(struct registry *reg, void **record)
+{
+	struct registry_slot *s;
+	int slot;
+
+	if (reg->nr_free > 0) {
+		slot = reg->free_slots[--reg->nr_free];
+	} else {
+		if (reg->nr_slots == reg->nr_slabs * REGISTRY_SLAB_RECORDS && registry_grow(reg) < 0)
+			return -1;
+		slot = reg->nr_slots++;
+		reg->slots[slot].generation = 1;
+	}
+	s = &reg->slots[slot];
+	s->dense = reg->nr_live;
+	reg->dense[reg->nr_live++] = slot;
+	*record = registry_slot_record(reg, slot);
+	memset(*record, 0, reg->record_size);
+	return registry_make_id(slot, s->generation);
+}
+
+/* frees the record of @id, returns 0, or -1 if @id is not live */
+static inline int registry_free(struct registry *reg, int id)
+{
+	struct registry_slot *s;
+	int slot = registry_id_slot(id), last;
+
+	if (registry_get(reg, id) == NULL)
+		return -1;
+	s = &reg->slots[slot];
+	/* keep dense[] packed: the last live slot takes the freed position */
+	last = reg->dense[--reg->nr_live];
+	reg->dense[s->dense] = last;
+	reg->slots[last].dense = s->dense;
+	s->dense = -1;
+	s->generation = (s->generation + 1) & REGISTRY_GENERATION_MASK;
+	if (s->generation == 0)
+		s->generation = 1;
+	reg->free_slots[reg->nr_free++] = slot;
+	return 0;
+}
+
+/* the @i-th live record, for 0 <= @i < reg->nr_live, in no particular order */
+static inline void *registry_live_record(struct registry *reg, int i)
+{
+	return registry_slot_record(reg, reg->dense[i]);
+}
+
+static inline void registry_destroy(struct registry *reg)
+{
+	int i;
+
+	for (i = 0; i < reg->nr_slabs; i++)
+		free(reg->slabs[i]);
+	free(reg->slabs);
+	free(reg->slots);
+	free(reg->free_slots);
+	free(reg->dense);
+	memset(reg, 0, sizeof(*reg));
+}
+
+#endif
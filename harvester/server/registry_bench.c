@@ -0,0 +1,141 @@
+/*
+    Benchmark of the broker's producer/consumer registry (registry.h):
+    registrations, lookups by id, churn of deregistrations and
+    re-registrations reusing the freed slots, and scans over the live
+    records. Stale ids of freed records must never resolve again.
+    Compile
+    gcc -O2 registry_bench.c -o registry_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "registry.h"
+
+#define NR_RECORDS 1000000
+#define NR_LOOKUPS 10000000
+#define NR_CHURN 1000000
+
+/* about the size of the broker's producer_info_t */
+struct record {
+	int id;
+	int port;
+	int available_slabs;
+	int total_slabs;
+	char ip[64];
+	int node_available_slabs[16];
+};
+
+uint64_t rng_state = 0x2545f4914f6cdd1dull;
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+void fail(const char *what, int id) {
+	printf("FAIL: %s, id %d\n", what, id);
+	exit(1);
+}
+
+void report(const char *name, uint64_t ns, long n) {
+	printf("%-10s %8.1f ns/op  %8.2f Mop/s\n", name, (double) ns / n, n / (ns / 1e3));
+}
+
+int main(int argc, char *argv[]) {
+	struct registry reg;
+	struct record *r;
+	int *ids, opt, i, j, id, nr_records = NR_RECORDS;
+	long nr_lookups = NR_LOOKUPS, nr_churn = NR_CHURN, stale = 0;
+	uint64_t t0, t1, sum = 0;
+
+	while((opt = getopt(argc, argv, "hn:l:c:")) != -1) {
+		switch(opt) {
+		case 'n':
+			nr_records = atoi(optarg);
+			break;
+		case 'l':
+			nr_lookups = atol(optarg);
+			break;
+		case 'c':
+			nr_churn = atol(optarg);
+			break;
+		default:
+			printf("Usage ./registry_bench [-n records] [-l lookups] [-c churn]\n");
+			return 0;
+		}
+	}
+	ids = calloc(nr_records, sizeof(int));
+	if(!ids || nr_records <= 0) {
+		printf("cannot allocate %d records\n", nr_records);
+		return 1;
+	}
+	printf("%d records of %zu bytes, %ld lookups, %ld deregistrations and re-registrations\n",
+	       nr_records, sizeof(struct record), nr_lookups, nr_churn);
+	registry_init(&reg, sizeof(struct record));
+
+	t0 = now_ns();
+	for(i = 0; i < nr_records; i++) {
+		ids[i] = registry_alloc(&reg, (void **) &r);
+		if(ids[i] < 0)
+			fail("registry full", i);
+		r->id = ids[i];
+	}
+	t1 = now_ns();
+	report("register", t1 - t0, nr_records);
+
+	t0 = now_ns();
+	for(i = 0; i < nr_lookups; i++) {
+		id = ids[rng() % nr_records];
+		r = registry_get(&reg, id);
+		if(r == NULL || r->id != id)
+			fail("lookup", id);
+		sum += r->port;
+	}
+	t1 = now_ns();
+	report("lookup", t1 - t0, nr_lookups);
+
+	t0 = now_ns();
+	for(i = 0; i < nr_churn; i++) {
+		j = rng() % nr_records;
+		id = ids[j];
+		if(registry_free(&reg, id) < 0)
+			fail("deregister", id);
+		ids[j] = registry_alloc(&reg, (void **) &r);
+		r->id = ids[j];
+		/* the slot was reused, the old id must not reach the new record */
+		if(ids[j] == id || registry_get(&reg, id) != NULL)
+			fail("stale id resolved", id);
+		stale++;
+	}
+	t1 = now_ns();
+	report("churn", t1 - t0, nr_churn);
+
+	t0 = now_ns();
+	for(i = 0; i < reg.nr_live; i++) {
+		r = registry_live_record(&reg, i);
+		sum += r->available_slabs;
+	}
+	t1 = now_ns();
+	report("scan", t1 - t0, reg.nr_live);
+
+	if(reg.nr_live != nr_records || reg.nr_slots != nr_records)
+		fail("slots leaked", reg.nr_slots);
+	printf("%ld stale ids rejected, %d slots in %d slabs, checksum %lu\n",
+	       stale, reg.nr_slots, reg.nr_slabs, (unsigned long) sum);
+	registry_destroy(&reg);
+	free(ids);
+	return 0;
+}
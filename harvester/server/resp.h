@@ -0,0 +1,303 @@
+#ifndef __RESP_H_
+#define __RESP_H_
+
+/*
+ * The subset of the Redis serialization protocol (RESP2) spoken by the
+ * embedded spot store: requests are arrays of bulk strings, or inline
+ * commands split on spaces as redis-cli and telnet send them, and replies
+ * are built in a growable buffer. Parsing does not copy, the arguments
+ * point into the input buffer. Replies are parsed the same way for the
+ * consumer's client (spot_client.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define RESP_MAX_ARGS 1024
+#define RESP_MAX_BULK (512 << 20)  /* as redis' proto-max-bulk-len */
+#define RESP_MAX_INLINE (64 << 10)
+
+struct resp_cmd {
+	int argc;
+	const char *argv[RESP_MAX_ARGS];
+	size_t argl[RESP_MAX_ARGS];
+};
+
+struct resp_reply {
+	char type;  /* '+', '-', ':', '$' or '*' */
+	long long integer;
+	const char *str;  /* of a status, an error or a bulk, the first element of an array */
+	long len;  /* of str, the elements of an array, -1 for a null */
+};
+
+struct resp_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+/* the end of the line starting at @p, NULL if not complete yet */
+static inline const char *resp_line_end(const char *p, const char *end)
+{
+	const char *cr = (const char *) memchr(p, '\r', end - p);
+
+	if (cr == NULL || cr + 1 >= end)
+		return NULL;
+	return cr;
+}
+
+/* the decimal in [p, e), -1 if it is not one */
+static inline long resp_number(const char *p, const char *e)
+{
+	long n = 0;
+
+	if (p == e)
+		return -1;
+	for (; p < e; p++) {
+		if (*p < '0' || *p > '9')
+			return -1;
+		n = n * 10 + (*p - '0');
+		if (n > RESP_MAX_BULK)
+			return -1;
+	}
+	return n;
+}
+
+static inline long resp_parse_inline(const char *buf, size_t len, struct resp_cmd *cmd)
+{
+	const char *p = buf, *eol = (const char *) memchr(buf, '\n', len);
+
+	if (eol == NULL)
+		return len > RESP_MAX_INLINE ? -1 : 0;
+	cmd->argc = 0;
+	while (p < eol) {
+		while (p < eol && (*p == ' ' || *p == '\r'))
+			p++;
+		if (p == eol)
+			break;
+		if (cmd->argc == RESP_MAX_ARGS)
+			return -1;
+		cmd->argv[cmd->argc] = p;
+		while (p < eol && *p != ' ' && *p != '\r')
+			p++;
+		cmd->argl[cmd->argc] = p - cmd->argv[cmd->argc];
+		cmd->argc++;
+	}
+	return eol + 1 - buf;
+}
+
+/*
+ * Parses the request at the start of @buf into @cmd. Returns the bytes it
+ * takes, 0 if it is not complete yet, or -1 on a protocol error; an empty
+ * inline line parses to argc 0.
+ */
+static inline long resp_parse(const char *buf, size_t len, struct resp_cmd *cmd)
+{
+	const char *p = buf, *end = buf + len, *e;
+	long n, l;
+	int i;
+
+	if (len == 0)
+		return 0;
+	if (*p != '*')
+		return resp_parse_inline(buf, len, cmd);
+	if ((e = resp_line_end(p, end)) == NULL)
+		return 0;
+	n = resp_number(p + 1, e);
+	if (n < 0 || n > RESP_MAX_ARGS || e[1] != '\n')
+		return -1;
+	p = e + 2;
+	for (i = 0; i < n; i++) {
+		if (p >= end)
+			return 0;
+		if (*p != '$')
+			return -1;
+		if ((e = resp_line_end(p, end)) == NULL)
+			return 0;
+		l = resp_number(p + 1, e);
+		if (l < 0 || e[1] != '\n')
+			return -1;
+		p = e + 2;
+		if (end - p < l + 2)
+			return 0;
+		if (p[l] != '\r' || p[l + 1] != '\n')
+			return -1;
+		cmd->argv[i] = p;
+		cmd->argl[i] = l;
+		p += l + 2;
+	}
+	cmd->argc = n;
+	return p - buf;
+}
+
+/* the signed decimal in [p, e), for replies; sets *ok to 0 if it is not one */
+static inline long long resp_reply_number(const char *p, const char *e, int *ok)
+{
+	int neg = p < e && *p == '-';
+	long long n = 0;
+
+	*ok = 0;
+	if (p + neg == e)
+		return 0;
+	for (p += neg; p < e; p++) {
+		if (*p < '0' || *p > '9' || n > (long long) 1e17)
+			return 0;
+		n = n * 10 + (*p - '0');
+	}
+	*ok = 1;
+	return neg ? -n : n;
+}
+
+/*
+ * Parses the reply at the start of @buf into @reply. Returns the bytes it
+ * takes, nested arrays included, 0 if it is not complete yet, or -1 on a
+ * protocol error. A null bulk or array has len -1; the elements of an
+ * array are the replies following reply->str.
+ */
+static inline long resp_parse_reply(const char *buf, size_t len, struct resp_reply *reply)
+{
+	const char *end = buf + len, *e;
+	struct resp_reply elem;
+	long used, n;
+	int ok;
+
+	if (len == 0)
+		return 0;
+	if ((e = resp_line_end(buf, end)) == NULL)
+		return len > RESP_MAX_INLINE ? -1 : 0;
+	if (e[1] != '\n')
+		return -1;
+	reply->type = *buf;
+	reply->str = buf + 1;
+	reply->len = e - buf - 1;
+	reply->integer = 0;
+	switch (*buf) {
+	case '+':
+	case '-':
+		return e + 2 - buf;
+	case ':':
+		reply->integer = resp_reply_number(buf + 1, e, &ok);
+		return ok ? e + 2 - buf : -1;
+	case '$':
+		reply->len = resp_reply_number(buf + 1, e, &ok);
+		reply->str = e + 2;
+		if (!ok || reply->len < -1 || reply->len > RESP_MAX_BULK)
+			return -1;
+		if (reply->len < 0)
+			return e + 2 - buf;
+		if (end - reply->str < reply->len + 2)
+			return 0;
+		if (reply->str[reply->len] != '\r' || reply->str[reply->len + 1] != '\n')
+			return -1;
+		return reply->str + reply->len + 2 - buf;
+	case '*':
+		reply->len = resp_reply_number(buf + 1, e, &ok);
+		reply->str = e + 2;
+		if (!ok || reply->len < -1 || reply->len > RESP_MAX_ARGS)
+			return -1;
+		used = e + 2 - buf;
+		for (n = 0; n < reply->len; n++) {
+			long l = resp_parse_reply(buf + used, len - used, &elem);
+
+			if (l <= 0)
+				return l;
+			used += l;
+		}
+		return used;
+	}
+	return -1;
+}
+
+/* whether argument @i is @name, in any case */
+static inline int resp_is(const struct resp_cmd *cmd, int i, const char *name)
+{
+	return i < cmd->argc && cmd->argl[i] == strlen(name) && strncasecmp(cmd->argv[i], name, cmd->argl[i]) == 0;
+}
+
+/* makes room for @len more bytes, returns where they go or NULL */
+static inline char *resp_reserve(struct resp_buf *b, size_t len)
+{
+	size_t cap = b->cap ? b->cap : 4096;
+	char *data;
+
+	while (b->len + len > cap)
+		cap *= 2;
+	if (cap != b->cap) {
+		data = (char *) realloc(b->data, cap);
+		if (data == NULL)
+			return NULL;
+		b->data = data;
+		b->cap = cap;
+	}
+	return b->data + b->len;
+}
+
+static inline void resp_append(struct resp_buf *b, const void *data, size_t len)
+{
+	char *p = resp_reserve(b, len);
+
+	if (p == NULL)
+		return;
+	memcpy(p, data, len);
+	b->len += len;
+}
+
+static inline void resp_header(struct resp_buf *b, char type, long long n)
+{
+	char line[32];
+	int len = snprintf(line, sizeof(line), "%c%lld\r\n", type, n);
+
+	resp_append(b, line, len);
+}
+
+static inline void resp_simple(struct resp_buf *b, const char *s)
+{
+	resp_append(b, "+", 1);
+	resp_append(b, s, strlen(s));
+	resp_append(b, "\r\n", 2);
+}
+
+static inline void resp_error(struct resp_buf *b, const char *s)
+{
+	resp_append(b, "-", 1);
+	resp_append(b, s, strlen(s));
+	resp_append(b, "\r\n", 2);
+}
+
+static inline void resp_integer(struct resp_buf *b, long long n)
+{
+	resp_header(b, ':', n);
+}
+
+static inline void resp_array(struct resp_buf *b, long long n)
+{
+	resp_header(b, '*', n);
+}
+
+static inline void resp_bulk(struct resp_buf *b, const void *data, size_t len)
+{
+	resp_header(b, '$', len);
+	resp_append(b, data, len);
+	resp_append(b, "\r\n", 2);
+}
+
+static inline void resp_null(struct resp_buf *b)
+{
+	resp_append(b, "$-1\r\n", 5);
+}
+
+static inline void resp_consume(struct resp_buf *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static inline void resp_buf_free(struct resp_buf *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
+
+#endif
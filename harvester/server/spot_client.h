@@ -0,0 +1,445 @@
+#ifndef __SPOT_CLIENT_H_
+#define __SPOT_CLIENT_H_
+
+/*
+ * Client of a consumer for the spot stores of all the producers it is
+ * assigned. Keys are spread over the producers by a consistent hash ring
+ * weighted by their slabs: each slab of a producer places
+ * SPOT_CLIENT_POINTS_PER_SLAB points on the ring, at positions that only
+ * depend on the producer id and the point's rank, and a key belongs to the
+ * first point at or after its hash. When a producer gains or loses slabs
+ * only its own points come or go, so the keys that change producers are
+ * those of the slabs added or taken back, about their share of the ring;
+ * the stores are caches, a moved key is a miss on its new producer.
+ *
+ * Commands on one key are queued on the connection to their producer and
+ * sent together by spot_client_exec(), which waits for all the replies of
+ * all the producers at once and hands them over in the order of each
+ * connection. A connection that fails answers its pending commands with a
+ * NULL reply and is opened again for the next batch. Connections are
+ * opened without blocking and finished by the same poll, so a producer
+ * that does not answer only holds up its own commands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "resp.h"
+
+#define SPOT_CLIENT_MAX_PRODUCERS 128
+#define SPOT_CLIENT_POINTS_PER_SLAB 16
+#define SPOT_CLIENT_READ_SIZE 65536
+#define SPOT_CLIENT_MAX_IP 63
+
+struct spot_client_conn {
+	int sock;  /* -1 while closed */
+	int connecting;  /* until the socket is writable */
+	struct resp_buf out;  /* commands queued */
+	size_t sent;  /* of out */
+	struct resp_buf in;  /* replies not handed over yet */
+	uint32_t *pending;  /* requests waiting for a reply, oldest at head */
+	size_t head;
+	size_t nr_pending;
+	size_t cap_pending;
+};
+
+struct spot_client_producer {
+	int id;  /* at the broker, -1 for a free slot */
+	int slabs;
+	char ip[SPOT_CLIENT_MAX_IP + 1];
+	int port;
+	struct spot_client_conn conn;
+};
+
+struct spot_client_point {
+	uint32_t hash;
+	int producer;  /* slot */
+};
+
+/* @reply is NULL if the connection failed before it came */
+typedef void (*spot_client_reply_fn)(void *ctx, uint32_t request, const struct resp_reply *reply);
+
+struct spot_client {
+	struct spot_client_producer producers[SPOT_CLIENT_MAX_PRODUCERS];
+	struct spot_client_point *ring;  /* by hash */
+	int nr_points;
+	uint32_t next_request;
+};
+
+static inline uint64_t spot_client_mix(uint64_t x)
+{
+	/* the finalizer of splitmix64 */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+static inline uint32_t spot_client_hash(const void *key, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) key;
+	uint64_t h = 0xcbf29ce484222325ull;  /* FNV-1a, mixed so that similar keys spread */
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	return spot_client_mix(h) >> 32;
+}
+
+static inline uint32_t spot_client_point_hash(int id, int rank)
+{
+	return spot_client_mix(((uint64_t) (uint32_t) id << 32 | (uint32_t) rank) + 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static inline void spot_client_init(struct spot_client *c)
+{
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	for (i = 0; i < SPOT_CLIENT_MAX_PRODUCERS; i++) {
+		c->producers[i].id = -1;
+		c->producers[i].conn.sock = -1;
+	}
+}
+
+/* the slot of producer @id, -1 if it has none */
+static inline int spot_client_slot(struct spot_client *c, int id)
+{
+	int i;
+
+	for (i = 0; id >= 0 && i < SPOT_CLIENT_MAX_PRODUCERS; i++) {
+		if (c->producers[i].id == id)
+			return i;
+	}
+	return -1;
+}
+
+static inline int spot_client_cmp_point(const void *a, const void *b)
+{
+	const struct spot_client_point *x = (const struct spot_client_point *) a;
+	const struct spot_client_point *y = (const struct spot_client_point *) b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->producer - y->producer;
+}
+
+/* places the points of every producer again, returns 0 or -1 */
+static inline int spot_client_build_ring(struct spot_client *c)
+{
+	struct spot_client_point *ring;
+	int i, j, n = 0;
+
+	for (i = 0; i < SPOT_CLIENT_MAX_PRODUCERS; i++) {
+		if (c->producers[i].id >= 0)
+			n += c->producers[i].slabs * SPOT_CLIENT_POINTS_PER_SLAB;
+	}
+	ring = (struct spot_client_point *) malloc((n ? n : 1) * sizeof(*ring));
+	if (ring == NULL)
+		return -1;
+	n = 0;
+	for (i = 0; i < SPOT_CLIENT_MAX_PRODUCERS; i++) {
+		if (c->producers[i].id < 0)
+			continue;
+		for (j = 0; j < c->producers[i].slabs * SPOT_CLIENT_POINTS_PER_SLAB; j++) {
+			ring[n].hash = spot_client_point_hash(c->producers[i].id, j);
+			ring[n++].producer = i;
+		}
+	}
+	qsort(ring, n, sizeof(*ring), spot_client_cmp_point);
+	free(c->ring);
+	c->ring = ring;
+	c->nr_points = n;
+	return 0;
+}
+
+/* the slot of the producer holding @key, -1 if there is none */
+static inline int spot_client_route(struct spot_client *c, const void *key, size_t len)
+{
+	uint32_t h = spot_client_hash(key, len);
+	int lo = 0, hi = c->nr_points, mid;
+
+	if (c->nr_points == 0)
+		return -1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (c->ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return c->ring[lo == c->nr_points ? 0 : lo].producer;
+}
+
+/* the part of the keys producer slot @slot holds */
+static inline double spot_client_share(struct spot_client *c, int slot)
+{
+	uint64_t owned = 0;
+	uint32_t prev;
+	int i;
+
+	if (c->nr_points == 0)
+		return 0;
+	prev = c->ring[c->nr_points - 1].hash;
+	for (i = 0; i < c->nr_points; i++) {
+		/* the arc before a point is its own, wrapping around from the last one */
+		if (c->ring[i].producer == slot)
+			owned += (uint32_t) (c->ring[i].hash - prev);
+		prev = c->ring[i].hash;
+	}
+	if (c->nr_points == 1)
+		return c->ring[0].producer == slot;
+	return owned / 4294967296.0;
+}
+
+/* answers the requests pending on @conn with NULL and closes it */
+static inline void spot_client_fail(struct spot_client_conn *conn, spot_client_reply_fn fn, void *ctx)
+{
+	while (conn->nr_pending > 0) {
+		if (fn != NULL)
+			fn(ctx, conn->pending[conn->head], NULL);
+		conn->head = (conn->head + 1) % conn->cap_pending;
+		conn->nr_pending--;
+	}
+	conn->head = 0;
+	conn->out.len = 0;
+	conn->sent = 0;
+	conn->in.len = 0;
+	conn->connecting = 0;
+	if (conn->sock >= 0)
+		close(conn->sock);
+	conn->sock = -1;
+}
+
+/* starts connecting to @p, spot_client_connected() tells when it is done */
+static inline int spot_client_connect(struct spot_client_producer *p)
+{
+	struct sockaddr_in addr;
+	int sock, one = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(p->port);
+	if (inet_pton(AF_INET, p->ip, &addr.sin_addr) <= 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+	    (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+		close(sock);
+		return -1;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	p->conn.sock = sock;
+	p->conn.connecting = 1;
+	return 0;
+}
+
+/* once the socket of @conn is writable: 0 if its connect succeeded, -1 if it failed */
+static inline int spot_client_connected(struct spot_client_conn *conn)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		return -1;
+	conn->connecting = 0;
+	return 0;
+}
+
+/*
+ * Sets the slabs of producer @id, serving its spot store at @ip:@port, as
+ * its assignment changes; 0 slabs removes it, failing its pending requests
+ * through @fn. Returns 0, or -1 if there is no room for it.
+ */
+static inline int spot_client_update(struct spot_client *c, int id, const char *ip, int port, int slabs,
+                                     spot_client_reply_fn fn, void *ctx)
+{
+	struct spot_client_producer *p;
+	int slot = spot_client_slot(c, id);
+
+	if (slot < 0 && slabs <= 0)
+		return 0;
+	if (slot < 0) {
+		for (slot = 0; slot < SPOT_CLIENT_MAX_PRODUCERS && c->producers[slot].id >= 0; slot++);
+		if (slot == SPOT_CLIENT_MAX_PRODUCERS)
+			return -1;
+	}
+	p = &c->producers[slot];
+	if (slabs <= 0 || p->port != port || strncmp(p->ip, ip, SPOT_CLIENT_MAX_IP) != 0)
+		spot_client_fail(&p->conn, fn, ctx);
+	p->id = slabs > 0 ? id : -1;
+	p->slabs = slabs > 0 ? slabs : 0;
+	snprintf(p->ip, sizeof(p->ip), "%s", ip);
+	p->port = port;
+	return spot_client_build_ring(c);
+}
+
+/*
+ * Queues the command of @argc arguments, whose key is argv[1], on the
+ * connection to the producer holding the key. Returns its request number,
+ * handed back with the reply, or -1 if no producer is assigned.
+ */
+static inline long spot_client_command(struct spot_client *c, int argc, const char **argv, const size_t *argl)
+{
+	struct spot_client_conn *conn;
+	uint32_t *pending;
+	size_t cap, i;
+	int slot = spot_client_route(c, argv[argc > 1], argl[argc > 1]);
+
+	if (slot < 0)
+		return -1;
+	conn = &c->producers[slot].conn;
+	if (conn->nr_pending == conn->cap_pending) {
+		/* unwrap into a larger ring of request numbers */
+		cap = conn->cap_pending ? conn->cap_pending * 2 : 64;
+		pending = (uint32_t *) malloc(cap * sizeof(*pending));
+		if (pending == NULL)
+			return -1;
+		for (i = 0; i < conn->nr_pending; i++)
+			pending[i] = conn->pending[(conn->head + i) % conn->cap_pending];
+		free(conn->pending);
+		conn->pending = pending;
+		conn->cap_pending = cap;
+		conn->head = 0;
+	}
+	resp_array(&conn->out, argc);
+	for (i = 0; i < (size_t) argc; i++)
+		resp_bulk(&conn->out, argv[i], argl[i]);
+	conn->pending[(conn->head + conn->nr_pending++) % conn->cap_pending] = c->next_request;
+	return c->next_request++;
+}
+
+static inline long spot_client_get(struct spot_client *c, const char *key, size_t len)
+{
+	const char *argv[2] = { "GET", key };
+	size_t argl[2] = { 3, len };
+
+	return spot_client_command(c, 2, argv, argl);
+}
+
+static inline long spot_client_set(struct spot_client *c, const char *key, size_t len, const void *value, size_t vlen)
+{
+	const char *argv[3] = { "SET", key, (const char *) value };
+	size_t argl[3] = { 3, len, vlen };
+
+	return spot_client_command(c, 3, argv, argl);
+}
+
+/* hands over the complete replies read on @conn, returns 0 or -1 on a protocol error */
+static inline int spot_client_replies(struct spot_client_conn *conn, spot_client_reply_fn fn, void *ctx)
+{
+	struct resp_reply reply;
+	size_t off = 0;
+	long used = 0;
+
+	while (conn->nr_pending > 0 && (used = resp_parse_reply(conn->in.data + off, conn->in.len - off, &reply)) > 0) {
+		if (fn != NULL)
+			fn(ctx, conn->pending[conn->head], &reply);
+		conn->head = (conn->head + 1) % conn->cap_pending;
+		conn->nr_pending--;
+		off += used;
+	}
+	resp_consume(&conn->in, off);
+	return used < 0 || (conn->nr_pending == 0 && conn->in.len > 0) ? -1 : 0;
+}
+
+/*
+ * Sends the queued commands to all the producers and waits for all their
+ * replies, handed to @fn as they come. Returns 0, or -1 if a connection
+ * failed; its requests got a NULL reply.
+ */
+static inline int spot_client_exec(struct spot_client *c, spot_client_reply_fn fn, void *ctx)
+{
+	struct pollfd fds[SPOT_CLIENT_MAX_PRODUCERS];
+	int slots[SPOT_CLIENT_MAX_PRODUCERS];
+	struct spot_client_conn *conn;
+	int i, n, ret = 0;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < SPOT_CLIENT_MAX_PRODUCERS; i++) {
+			conn = &c->producers[i].conn;
+			if (c->producers[i].id < 0 || conn->nr_pending == 0)
+				continue;
+			if (conn->sock < 0 && spot_client_connect(&c->producers[i]) < 0) {
+				spot_client_fail(conn, fn, ctx);
+				ret = -1;
+				continue;
+			}
+			fds[n].fd = conn->sock;
+			if (conn->connecting)
+				fds[n].events = POLLOUT;
+			else
+				fds[n].events = POLLIN | (conn->sent < conn->out.len ? POLLOUT : 0);
+			slots[n++] = i;
+		}
+		if (n == 0)
+			return ret;
+		if (poll(fds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			for (i = 0; i < n; i++)
+				spot_client_fail(&c->producers[slots[i]].conn, fn, ctx);
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			conn = &c->producers[slots[i]].conn;
+			if (conn->connecting) {
+				if (fds[i].revents == 0)
+					continue;
+				if (spot_client_connected(conn) < 0)
+					goto fail;
+			}
+			if (fds[i].revents & POLLOUT) {
+				len = send(conn->sock, conn->out.data + conn->sent, conn->out.len - conn->sent, MSG_NOSIGNAL);
+				if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					goto fail;
+				if (len > 0 && (conn->sent += len) == conn->out.len)
+					conn->sent = conn->out.len = 0;
+			}
+			if (!(fds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+				continue;
+			if ((p = resp_reserve(&conn->in, SPOT_CLIENT_READ_SIZE)) == NULL)
+				goto fail;
+			len = recv(conn->sock, p, SPOT_CLIENT_READ_SIZE, 0);
+			if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				continue;
+			if (len <= 0)
+				goto fail;
+			conn->in.len += len;
+			if (spot_client_replies(conn, fn, ctx) == 0)
+				continue;
+fail:
+			spot_client_fail(conn, fn, ctx);
+			ret = -1;
+		}
+	}
+}
+
+static inline void spot_client_destroy(struct spot_client *c)
+{
+	int i;
+
+	for (i = 0; i < SPOT_CLIENT_MAX_PRODUCERS; i++) {
+		spot_client_fail(&c->producers[i].conn, NULL, NULL);
+		resp_buf_free(&c->producers[i].conn.out);
+		resp_buf_free(&c->producers[i].conn.in);
+		free(c->producers[i].conn.pending);
+	}
+	free(c->ring);
+	memset(c, 0, sizeof(*c));
+}
+
+#endif
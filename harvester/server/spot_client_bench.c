@@ -0,0 +1,218 @@
+/*
+    Benchmark of the consumer's client (spot_client.h). Routes a million
+    keys over producers of random slab counts and reports how evenly the
+    keys follow the slabs, and the keys that move when a producer joins,
+    leaves, grows or shrinks, with the weighted ring and with a weighted
+    modulo of the key hash. Then serves that many in-process spot stores
+    (spot_server.h) on loopback and reports the get/set throughput through
+    the client, a batch of commands at a time.
+    Compile
+    gcc -O2 spot_client_bench.c -lpthread -lm -o spot_client_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "spot_client.h"
+#include "spot_server.h"
+
+#define NR_PRODUCERS 8
+#define NR_KEYS 1000000
+#define NR_OPS 1000000
+#define BATCH 64
+#define VALUE_SIZE 1000
+#define BASE_PORT 19900
+#define QUOTA_MB 64 //of each store
+
+int nr_producers = NR_PRODUCERS, batch = BATCH, nr_ops = NR_OPS, base_port = BASE_PORT;
+int slabs[SPOT_CLIENT_MAX_PRODUCERS];
+uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+long nr_replies, nr_failed, nr_hits;
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+int make_key(char *key, int i) {
+	return sprintf(key, "user%d", i);
+}
+
+/* the producer of @key by a modulo of its hash over all the slabs */
+int modulo_route(const char *key, int len) {
+	int total = 0, i, s;
+
+	for(i = 0; i < nr_producers; i++)
+		total += slabs[i];
+	s = spot_client_hash(key, len) % total;
+	for(i = 0; i < nr_producers && (s -= slabs[i]) >= 0; i++);
+	return i;
+}
+
+/* the producers of all the keys, by the ring or by the modulo */
+void route_all(struct spot_client *c, unsigned char *owner, int ring) {
+	char key[32];
+	int i, len, slot;
+
+	for(i = 0; i < NR_KEYS; i++) {
+		len = make_key(key, i);
+		slot = ring ? spot_client_route(c, key, len) : modulo_route(key, len);
+		owner[i] = ring ? c->producers[slot].id : slot;
+	}
+}
+
+void set_slabs(struct spot_client *c, int producer, int n) {
+	slabs[producer] = n;
+	spot_client_update(c, producer, "127.0.0.1", base_port + producer, n, NULL, NULL);
+}
+
+double moved(const unsigned char *a, const unsigned char *b) {
+	long n = 0;
+	int i;
+
+	for(i = 0; i < NR_KEYS; i++)
+		n += a[i] != b[i];
+	return 100.0 * n / NR_KEYS;
+}
+
+/* changes the slabs of @producer, reports the keys moved, then changes them back */
+void report_change(struct spot_client *c, const char *name, int producer, int n) {
+	static unsigned char ring_before[NR_KEYS], ring_after[NR_KEYS], mod_before[NR_KEYS], mod_after[NR_KEYS];
+	int total = 0, old = slabs[producer], i;
+
+	for(i = 0; i < nr_producers; i++)
+		total += slabs[i];
+	route_all(c, ring_before, 1);
+	route_all(c, mod_before, 0);
+	if(producer == nr_producers)
+		nr_producers++; //joins at the end, after the modulo's producers
+	set_slabs(c, producer, n);
+	route_all(c, ring_after, 1);
+	route_all(c, mod_after, 0);
+	printf("%-26s %9.2f%% %9.2f%% %9.2f%%\n", name, 100.0 * abs(n - old) / (total + (n > old ? n - old : 0)),
+	       moved(ring_before, ring_after), moved(mod_before, mod_after));
+	set_slabs(c, producer, old);
+	if(producer == nr_producers - 1 && old == 0)
+		nr_producers--;
+}
+
+void report_balance(struct spot_client *c) {
+	static unsigned char owner[NR_KEYS];
+	long keys[SPOT_CLIENT_MAX_PRODUCERS] = { 0 };
+	int total = 0, i;
+	double dev, worst = 0;
+
+	for(i = 0; i < nr_producers; i++)
+		total += slabs[i];
+	route_all(c, owner, 1);
+	for(i = 0; i < NR_KEYS; i++)
+		keys[owner[i]]++;
+	for(i = 0; i < nr_producers; i++) {
+		dev = (double) keys[i] / NR_KEYS / ((double) slabs[i] / total) - 1;
+		if(fabs(dev) > fabs(worst))
+			worst = dev;
+	}
+	printf("%d producers, %d slabs, %d ring points; keys off their slab share by at most %.2f%%\n",
+	       nr_producers, total, c->nr_points, 100 * worst);
+}
+
+void count_reply(void *ctx, uint32_t request, const struct resp_reply *reply) {
+	nr_replies++;
+	if(reply == NULL || reply->type == '-')
+		nr_failed++;
+	else if(reply->type == '$' && reply->len >= 0)
+		nr_hits++;
+}
+
+/* sets or gets random keys through the client, @size commands per batch */
+void run_batches(struct spot_client *c, int size, int set_percent, const char *name) {
+	static char value[VALUE_SIZE];
+	uint64_t t0 = now_ns();
+	char key[32];
+	int i, len;
+
+	nr_replies = nr_failed = nr_hits = 0;
+	memset(value, 'v', VALUE_SIZE);
+	for(i = 0; i < nr_ops; i++) {
+		len = make_key(key, rng() % (NR_KEYS / 10));
+		if(rng() % 100 < set_percent)
+			spot_client_set(c, key, len, value, VALUE_SIZE);
+		else
+			spot_client_get(c, key, len);
+		if((i + 1) % size == 0 || i == nr_ops - 1)
+			spot_client_exec(c, count_reply, NULL);
+	}
+	printf("%-26s %10.2f Kops/s %8.2f%% hits %6ld failed\n", name, nr_ops * 1e6 / (now_ns() - t0),
+	       100.0 * nr_hits / nr_replies, nr_failed);
+}
+
+int main(int argc, char *argv[]) {
+	static struct spot_client c;
+	static struct spot_server srv;
+	char name[64];
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "hp:b:n:P:")) != -1) {
+		switch(opt) {
+		case 'p':
+			nr_producers = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'n':
+			nr_ops = atoi(optarg);
+			break;
+		case 'P':
+			base_port = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./spot_client_bench [-p producers] [-b batch] [-n ops] [-P base-port]\n");
+			return 0;
+		}
+	}
+	if(nr_producers < 2 || nr_producers > 64 || batch < 1) {
+		printf("2 to 64 producers and a batch of at least 1\n");
+		return 1;
+	}
+	spot_client_init(&c);
+	for(i = 0; i < nr_producers; i++)
+		set_slabs(&c, i, 16 + rng() % 113);
+	report_balance(&c);
+	printf("%-26s %10s %10s %10s\n", "change", "ideal", "ring", "modulo");
+	report_change(&c, "a producer leaves", nr_producers - 1, 0);
+	report_change(&c, "a producer joins", nr_producers, 64);
+	report_change(&c, "a producer loses half", 0, slabs[0] / 2);
+	report_change(&c, "a producer doubles", 0, slabs[0] * 2);
+	report_change(&c, "a producer loses a slab", 0, slabs[0] - 1);
+
+	if(spot_server_start(&srv, nr_producers) < 0) {
+		printf("cannot start the spot server\n");
+		return 1;
+	}
+	for(i = 0; i < nr_producers; i++) {
+		if(spot_server_open(&srv, i, "127.0.0.1", base_port + i, (long) QUOTA_MB << 20, -1) < 0) {
+			printf("cannot listen on port %d\n", base_port + i);
+			return 1;
+		}
+	}
+	run_batches(&c, batch, 100, "load");
+	run_batches(&c, 1, 5, "95% gets, unbatched");
+	sprintf(name, "95%% gets, batches of %d", batch);
+	run_batches(&c, batch, 5, name);
+	spot_client_destroy(&c);
+	return 0;
+}
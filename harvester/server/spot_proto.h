@@ -0,0 +1,534 @@
+#ifndef __SPOT_PROTO_H_
+#define __SPOT_PROTO_H_
+
+/*
+ * Wire protocol between the broker, producers and consumers.
+ *
+ * Every message is a frame: an 8-byte header (magic "SP", version, type,
+ * payload length) followed by the payload, all integers big-endian.
+ * Strings are a length byte followed by that many bytes, without NUL.
+ * Decoders ignore bytes past the fields they know, so fields are only
+ * ever appended to a payload; anything else bumps SPOT_PROTO_VERSION.
+ *
+ * struct spot_inbuf collects a byte stream; spot_inbuf_next() hands out
+ * each complete frame in place, pointing into the buffer, however the
+ * stream was split into reads. spot_decode() then turns a frame into a
+ * struct spot_msg, and spot_encode()/spot_send() go the other way.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define SPOT_PROTO_MAGIC 0x5350  /* "SP" */
+#define SPOT_PROTO_VERSION 1
+#define SPOT_PROTO_HEADER_SIZE 8
+#define SPOT_PROTO_MAX_FRAME 8192
+#define SPOT_PROTO_MAX_PAYLOAD (SPOT_PROTO_MAX_FRAME - SPOT_PROTO_HEADER_SIZE)
+#define SPOT_PROTO_MAX_IP 63
+#define SPOT_PROTO_MAX_NODES 16
+#define SPOT_PROTO_MAX_ASSIGNMENTS 64
+
+enum msg_type {
+	CONNECTION_ACK = 0,
+	PRODUCER_REG = 1,
+	CONSUMER_REG = 2,
+	REGISTRATION_ACK = 3,
+	PRODUCER_AVAILABILITY = 4,
+	SPOT_REQUEST = 5,
+	SPOT_ASSIGNMENT_CONSUMER = 6,
+	SPOT_ASSIGNMENT_PRODUCER = 7,
+	PRODUCER_READY = 8,
+	LEASE_GRANT = 9,
+	LEASE_RENEW = 10,
+	LEASE_RELEASE = 11,
+	LEASE_END = 12,
+	SPOT_SHRINK = 13,
+	NR_MSG_TYPES
+};
+
+enum lease_end_reason {
+	LEASE_EXPIRED = 0,
+	LEASE_RELEASED = 1,  /* by the consumer */
+	LEASE_REVOKED = 2,  /* by the producer */
+	LEASE_PRODUCER_GONE = 3,
+	LEASE_CONSUMER_GONE = 4,
+	LEASE_SHRUNK = 5,  /* taken back by a SPOT_SHRINK */
+};
+
+struct spot_msg_register {  /* PRODUCER_REG, CONSUMER_REG */
+	char ip[SPOT_PROTO_MAX_IP + 1];
+	int port;
+};
+
+struct spot_msg_ack {  /* REGISTRATION_ACK */
+	int id;  /* -1 if rejected */
+};
+
+struct spot_msg_availability {  /* PRODUCER_AVAILABILITY */
+	int id;
+	int available_slabs;
+	int total_slabs;
+	int nr_nodes;
+	int node_available_slabs[SPOT_PROTO_MAX_NODES];
+};
+
+struct spot_msg_request {  /* SPOT_REQUEST */
+	int consumer_id;
+	int spot_size;  /* slabs */
+	int lease_time;
+};
+
+struct spot_assignment {
+	char ip[SPOT_PROTO_MAX_IP + 1];
+	int port;
+	int slabs;
+	int id;  /* of the peer */
+};
+
+struct spot_msg_assignment {  /* SPOT_ASSIGNMENT_CONSUMER, SPOT_ASSIGNMENT_PRODUCER */
+	int count;
+	struct spot_assignment entries[SPOT_PROTO_MAX_ASSIGNMENTS];
+};
+
+struct spot_msg_ready {  /* PRODUCER_READY */
+	int producer_id;
+	int consumer_id;
+	int port;  /* of the spot store */
+};
+
+/*
+ * LEASE_GRANT (broker to both sides, on assignment and renewal),
+ * LEASE_RENEW (consumer), LEASE_RELEASE (either side), LEASE_END (broker
+ * to the sides still connected)
+ */
+struct spot_msg_lease {
+	int lease_id;
+	int producer_id;
+	int consumer_id;
+	int slabs;
+	int duration;  /* seconds left when granted, lease_time asked when renewing */
+	int reason;  /* of LEASE_END */
+};
+
+/*
+ * SPOT_SHRINK (producer to broker, forwarded to the consumer): the producer
+ * takes slabs back from a consumer's spot store, cutting it down to its
+ * new quota once the deadline is past. The broker cuts the consumer's
+ * leases on the producer by as much, newest first.
+ */
+struct spot_msg_shrink {
+	int producer_id;
+	int consumer_id;
+	int slabs;  /* taken back */
+	int quota_slabs;  /* left to the consumer on the producer */
+	int deadline_ms;  /* from when the producer sent it */
+};
+
+struct spot_msg {
+	int type;
+	union {
+		struct spot_msg_register reg;
+		struct spot_msg_ack ack;
+		struct spot_msg_availability availability;
+		struct spot_msg_request request;
+		struct spot_msg_assignment assignment;
+		struct spot_msg_ready ready;
+		struct spot_msg_lease lease;
+		struct spot_msg_shrink shrink;
+	};
+};
+
+/* a complete frame, pointing into the buffer it was parsed from */
+struct spot_frame {
+	int version;
+	int type;
+	uint32_t size;  /* header included */
+	uint32_t payload_len;
+	const uint8_t *payload;
+};
+
+struct spot_inbuf {
+	uint32_t start;  /* first byte not handed out yet */
+	uint32_t len;
+	uint8_t data[SPOT_PROTO_MAX_FRAME];
+};
+
+/*
+ * Encoding
+ */
+
+struct spot_writer {
+	uint8_t *buf;
+	size_t cap;
+	size_t len;
+	int overflow;
+};
+
+static inline void spot_put_u8(struct spot_writer *w, uint8_t v)
+{
+	if (w->len + 1 > w->cap) {
+		w->overflow = 1;
+		return;
+	}
+	w->buf[w->len++] = v;
+}
+
+static inline void spot_put_u16(struct spot_writer *w, uint16_t v)
+{
+	spot_put_u8(w, v >> 8);
+	spot_put_u8(w, v);
+}
+
+static inline void spot_put_u32(struct spot_writer *w, uint32_t v)
+{
+	spot_put_u16(w, v >> 16);
+	spot_put_u16(w, v);
+}
+
+static inline void spot_put_i32(struct spot_writer *w, int32_t v)
+{
+	spot_put_u32(w, (uint32_t) v);
+}
+
+static inline void spot_put_str(struct spot_writer *w, const char *s)
+{
+	size_t len = strnlen(s, SPOT_PROTO_MAX_IP);
+
+	spot_put_u8(w, len);
+	if (w->len + len > w->cap) {
+		w->overflow = 1;
+		return;
+	}
+	memcpy(w->buf + w->len, s, len);
+	w->len += len;
+}
+
+static inline void spot_encode_payload(struct spot_writer *w, const struct spot_msg *msg)
+{
+	int i, n;
+
+	switch (msg->type) {
+	case PRODUCER_REG:
+	case CONSUMER_REG:
+		spot_put_str(w, msg->reg.ip);
+		spot_put_u16(w, msg->reg.port);
+		break;
+	case REGISTRATION_ACK:
+		spot_put_i32(w, msg->ack.id);
+		break;
+	case PRODUCER_AVAILABILITY:
+		spot_put_i32(w, msg->availability.id);
+		spot_put_i32(w, msg->availability.available_slabs);
+		spot_put_i32(w, msg->availability.total_slabs);
+		n = msg->availability.nr_nodes < SPOT_PROTO_MAX_NODES ? msg->availability.nr_nodes : SPOT_PROTO_MAX_NODES;
+		spot_put_u8(w, n);
+		for (i = 0; i < n; i++)
+			spot_put_i32(w, msg->availability.node_available_slabs[i]);
+		break;
+	case SPOT_REQUEST:
+		spot_put_i32(w, msg->request.consumer_id);
+		spot_put_i32(w, msg->request.spot_size);
+		spot_put_i32(w, msg->request.lease_time);
+		break;
+	case SPOT_ASSIGNMENT_CONSUMER:
+	case SPOT_ASSIGNMENT_PRODUCER:
+		n = msg->assignment.count < SPOT_PROTO_MAX_ASSIGNMENTS ? msg->assignment.count : SPOT_PROTO_MAX_ASSIGNMENTS;
+		spot_put_u8(w, n);
+		for (i = 0; i < n; i++) {
+			spot_put_str(w, msg->assignment.entries[i].ip);
+			spot_put_u16(w, msg->assignment.entries[i].port);
+			spot_put_i32(w, msg->assignment.entries[i].slabs);
+			spot_put_i32(w, msg->assignment.entries[i].id);
+		}
+		break;
+	case PRODUCER_READY:
+		spot_put_i32(w, msg->ready.producer_id);
+		spot_put_i32(w, msg->ready.consumer_id);
+		spot_put_u16(w, msg->ready.port);
+		break;
+	case LEASE_GRANT:
+	case LEASE_RENEW:
+	case LEASE_RELEASE:
+	case LEASE_END:
+		spot_put_i32(w, msg->lease.lease_id);
+		spot_put_i32(w, msg->lease.producer_id);
+		spot_put_i32(w, msg->lease.consumer_id);
+		spot_put_i32(w, msg->lease.slabs);
+		spot_put_i32(w, msg->lease.duration);
+		spot_put_u8(w, msg->lease.reason);
+		break;
+	case SPOT_SHRINK:
+		spot_put_i32(w, msg->shrink.producer_id);
+		spot_put_i32(w, msg->shrink.consumer_id);
+		spot_put_i32(w, msg->shrink.slabs);
+		spot_put_i32(w, msg->shrink.quota_slabs);
+		spot_put_i32(w, msg->shrink.deadline_ms);
+		break;
+	default:  /* CONNECTION_ACK has no payload */
+		break;
+	}
+}
+
+/* encodes @msg as a frame into @buf, returns its size or -1 if it does not fit */
+static inline int spot_encode(const struct spot_msg *msg, uint8_t *buf, size_t cap)
+{
+	struct spot_writer w = { buf, cap < SPOT_PROTO_MAX_FRAME ? cap : SPOT_PROTO_MAX_FRAME, 0, 0 };
+	size_t size;
+
+	if (msg->type < 0 || msg->type >= NR_MSG_TYPES)
+		return -1;
+	spot_put_u16(&w, SPOT_PROTO_MAGIC);
+	spot_put_u8(&w, SPOT_PROTO_VERSION);
+	spot_put_u8(&w, msg->type);
+	spot_put_u32(&w, 0);
+	spot_encode_payload(&w, msg);
+	if (w.overflow)
+		return -1;
+	/* patch in the payload length */
+	size = w.len;
+	w.len = 4;
+	spot_put_u32(&w, size - SPOT_PROTO_HEADER_SIZE);
+	return size;
+}
+
+/* sends @msg as one frame on a blocking socket, returns 0 or -1 */
+static inline int spot_send(int sock, const struct spot_msg *msg)
+{
+	uint8_t buf[SPOT_PROTO_MAX_FRAME];
+	int size = spot_encode(msg, buf, sizeof(buf));
+	ssize_t n;
+	int off = 0;
+
+	if (size < 0)
+		return -1;
+	while (off < size) {
+		n = send(sock, buf + off, size - off, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * Decoding
+ */
+
+struct spot_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+	int error;  /* read past the end */
+};
+
+static inline uint8_t spot_get_u8(struct spot_reader *r)
+{
+	if (r->p >= r->end) {
+		r->error = 1;
+		return 0;
+	}
+	return *r->p++;
+}
+
+static inline uint16_t spot_get_u16(struct spot_reader *r)
+{
+	uint16_t v = spot_get_u8(r) << 8;
+
+	return v | spot_get_u8(r);
+}
+
+static inline uint32_t spot_get_u32(struct spot_reader *r)
+{
+	uint32_t v = (uint32_t) spot_get_u16(r) << 16;
+
+	return v | spot_get_u16(r);
+}
+
+static inline int32_t spot_get_i32(struct spot_reader *r)
+{
+	return (int32_t) spot_get_u32(r);
+}
+
+static inline void spot_get_str(struct spot_reader *r, char *s)
+{
+	size_t len = spot_get_u8(r);
+
+	if (len > SPOT_PROTO_MAX_IP || len > (size_t)(r->end - r->p)) {
+		r->error = 1;
+		s[0] = '\0';
+		return;
+	}
+	memcpy(s, r->p, len);
+	s[len] = '\0';
+	r->p += len;
+}
+
+/*
+ * Parses the frame at the head of @buf. Returns 1 and fills @frame if a
+ * whole frame is there, 0 if more bytes are needed, -1 if the stream is
+ * not a spot protocol stream (or an unsupported version of it).
+ */
+static inline int spot_frame_parse(const uint8_t *buf, size_t len, struct spot_frame *frame)
+{
+	struct spot_reader r = { buf, buf + len, 0 };
+	uint16_t magic;
+	uint32_t payload_len;
+
+	if (len < SPOT_PROTO_HEADER_SIZE) {
+		/* reject garbage as soon as its first bytes are in */
+		if (len >= 1 && buf[0] != (SPOT_PROTO_MAGIC >> 8))
+			return -1;
+		return 0;
+	}
+	magic = spot_get_u16(&r);
+	frame->version = spot_get_u8(&r);
+	frame->type = spot_get_u8(&r);
+	payload_len = spot_get_u32(&r);
+	if (magic != SPOT_PROTO_MAGIC || frame->version != SPOT_PROTO_VERSION ||
+	    payload_len > SPOT_PROTO_MAX_PAYLOAD)
+		return -1;
+	if (len - SPOT_PROTO_HEADER_SIZE < payload_len)
+		return 0;
+	frame->payload_len = payload_len;
+	frame->payload = buf + SPOT_PROTO_HEADER_SIZE;
+	frame->size = SPOT_PROTO_HEADER_SIZE + payload_len;
+	return 1;
+}
+
+/* decodes @frame into @msg, returns 0, or -1 if its type is unknown or its payload too short */
+static inline int spot_decode(const struct spot_frame *frame, struct spot_msg *msg)
+{
+	struct spot_reader r = { frame->payload, frame->payload + frame->payload_len, 0 };
+	int i, n;
+
+	msg->type = frame->type;
+	switch (frame->type) {
+	case CONNECTION_ACK:
+		break;
+	case PRODUCER_REG:
+	case CONSUMER_REG:
+		spot_get_str(&r, msg->reg.ip);
+		msg->reg.port = spot_get_u16(&r);
+		break;
+	case REGISTRATION_ACK:
+		msg->ack.id = spot_get_i32(&r);
+		break;
+	case PRODUCER_AVAILABILITY:
+		msg->availability.id = spot_get_i32(&r);
+		msg->availability.available_slabs = spot_get_i32(&r);
+		msg->availability.total_slabs = spot_get_i32(&r);
+		n = spot_get_u8(&r);
+		if (n > SPOT_PROTO_MAX_NODES)
+			return -1;
+		msg->availability.nr_nodes = n;
+		for (i = 0; i < n; i++)
+			msg->availability.node_available_slabs[i] = spot_get_i32(&r);
+		break;
+	case SPOT_REQUEST:
+		msg->request.consumer_id = spot_get_i32(&r);
+		msg->request.spot_size = spot_get_i32(&r);
+		msg->request.lease_time = spot_get_i32(&r);
+		break;
+	case SPOT_ASSIGNMENT_CONSUMER:
+	case SPOT_ASSIGNMENT_PRODUCER:
+		n = spot_get_u8(&r);
+		if (n > SPOT_PROTO_MAX_ASSIGNMENTS)
+			return -1;
+		msg->assignment.count = n;
+		for (i = 0; i < n && !r.error; i++) {
+			spot_get_str(&r, msg->assignment.entries[i].ip);
+			msg->assignment.entries[i].port = spot_get_u16(&r);
+			msg->assignment.entries[i].slabs = spot_get_i32(&r);
+			msg->assignment.entries[i].id = spot_get_i32(&r);
+		}
+		break;
+	case PRODUCER_READY:
+		msg->ready.producer_id = spot_get_i32(&r);
+		msg->ready.consumer_id = spot_get_i32(&r);
+		msg->ready.port = spot_get_u16(&r);
+		break;
+	case LEASE_GRANT:
+	case LEASE_RENEW:
+	case LEASE_RELEASE:
+	case LEASE_END:
+		msg->lease.lease_id = spot_get_i32(&r);
+		msg->lease.producer_id = spot_get_i32(&r);
+		msg->lease.consumer_id = spot_get_i32(&r);
+		msg->lease.slabs = spot_get_i32(&r);
+		msg->lease.duration = spot_get_i32(&r);
+		msg->lease.reason = spot_get_u8(&r);
+		break;
+	case SPOT_SHRINK:
+		msg->shrink.producer_id = spot_get_i32(&r);
+		msg->shrink.consumer_id = spot_get_i32(&r);
+		msg->shrink.slabs = spot_get_i32(&r);
+		msg->shrink.quota_slabs = spot_get_i32(&r);
+		msg->shrink.deadline_ms = spot_get_i32(&r);
+		break;
+	default:
+		return -1;
+	}
+	return r.error ? -1 : 0;
+}
+
+/*
+ * Stream buffer
+ */
+
+static inline void spot_inbuf_init(struct spot_inbuf *in)
+{
+	in->start = 0;
+	in->len = 0;
+}
+
+/*
+ * Appends what @sock has to @in, moving the unconsumed bytes to the front
+ * first. Frames handed out before are no longer valid afterwards. Returns
+ * what recv() returned.
+ */
+static inline ssize_t spot_inbuf_recv(int sock, struct spot_inbuf *in, int flags)
+{
+	ssize_t n;
+
+	if (in->start > 0) {
+		memmove(in->data, in->data + in->start, in->len - in->start);
+		in->len -= in->start;
+		in->start = 0;
+	}
+	n = recv(sock, in->data + in->len, sizeof(in->data) - in->len, flags);
+	if (n > 0)
+		in->len += n;
+	return n;
+}
+
+/* like spot_inbuf_recv(), from memory; returns the bytes taken */
+static inline size_t spot_inbuf_append(struct spot_inbuf *in, const void *data, size_t len)
+{
+	if (in->start > 0) {
+		memmove(in->data, in->data + in->start, in->len - in->start);
+		in->len -= in->start;
+		in->start = 0;
+	}
+	if (len > sizeof(in->data) - in->len)
+		len = sizeof(in->data) - in->len;
+	memcpy(in->data + in->len, data, len);
+	in->len += len;
+	return len;
+}
+
+/* hands out the next complete frame, same return values as spot_frame_parse() */
+static inline int spot_inbuf_next(struct spot_inbuf *in, struct spot_frame *frame)
+{
+	int ret = spot_frame_parse(in->data + in->start, in->len - in->start, frame);
+
+	if (ret == 1)
+		in->start += frame->size;
+	return ret;
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+    Throughput benchmark of the spot protocol codec (spot_proto.h) against
+    the comma-separated text messages it replaced, which were padded to
+    sizeof(msg) and parsed with sscanf/strtok. Reports messages/sec for
+    encoding and for parsing a stream, and bytes per message on the wire.
+    Compile
+    gcc -O2 spot_proto_bench.c -o spot_proto_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "spot_proto.h"
+
+#define NR_MESSAGES 1000000
+#define NR_NODES 4
+#define TEXT_MSG_SIZE 200 //sizeof(msg) of the availability, request and ready messages
+#define STREAM_CHUNK 4096 //bytes per simulated read
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void set_msg(struct spot_msg *msg, int i) {
+	int n;
+
+	switch(i % 3) {
+	case 0:
+		msg->type = PRODUCER_AVAILABILITY;
+		msg->availability.id = i % 128;
+		msg->availability.available_slabs = i % 500;
+		msg->availability.total_slabs = 1024;
+		msg->availability.nr_nodes = NR_NODES;
+		for(n = 0; n < NR_NODES; n++)
+			msg->availability.node_available_slabs[n] = (i + n) % 125;
+		break;
+	case 1:
+		msg->type = SPOT_REQUEST;
+		msg->request.consumer_id = i % 128;
+		msg->request.spot_size = 5;
+		msg->request.lease_time = 1;
+		break;
+	default:
+		msg->type = SPOT_ASSIGNMENT_CONSUMER;
+		msg->assignment.count = 1;
+		strcpy(msg->assignment.entries[0].ip, "192.168.122.141");
+		msg->assignment.entries[0].port = 9702;
+		msg->assignment.entries[0].slabs = i % 64;
+		msg->assignment.entries[0].id = i % 128;
+		break;
+	}
+}
+
+/* the text format, as producer.c, consumer.c and broker.c built it */
+int text_encode(const struct spot_msg *msg, char *buf) {
+	int n, len;
+	const struct spot_assignment *a;
+
+	memset(buf, 0, TEXT_MSG_SIZE);
+	switch(msg->type) {
+	case PRODUCER_AVAILABILITY:
+		len = sprintf(buf, "%d,%d,%d,%d,%d", PRODUCER_AVAILABILITY, msg->availability.id,
+		              msg->availability.available_slabs, msg->availability.total_slabs, msg->availability.nr_nodes);
+		for(n = 0; n < msg->availability.nr_nodes; n++)
+			len += sprintf(buf + len, ",%d", msg->availability.node_available_slabs[n]);
+		return TEXT_MSG_SIZE;
+	case SPOT_REQUEST:
+		sprintf(buf, "%d,%d,%d,%d", SPOT_REQUEST, msg->request.consumer_id, msg->request.spot_size, msg->request.lease_time);
+		return TEXT_MSG_SIZE;
+	default:
+		a = &msg->assignment.entries[0];
+		//assignments were sent with strlen()
+		return sprintf(buf, "%d,%d,%s:%d:%d:%d\n", SPOT_ASSIGNMENT_CONSUMER, 1, a->ip, a->port, a->slabs, a->id) + 1;
+	}
+}
+
+int text_decode(char *buf, struct spot_msg *msg) {
+	char *token, *save, s[] = ",:";
+	int type, count = 0;
+
+	sscanf(buf, "%d,", &type);
+	msg->type = type;
+	switch(type) {
+	case PRODUCER_AVAILABILITY:
+		sscanf(buf, "%d,%d,%d,%d", &type, &msg->availability.id, &msg->availability.available_slabs, &msg->availability.total_slabs);
+		msg->availability.nr_nodes = 0;
+		for(token = strtok_r(buf, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save), count++) {
+			if(count == 4)
+				msg->availability.nr_nodes = atoi(token);
+			else if(count > 4 && count - 5 < msg->availability.nr_nodes)
+				msg->availability.node_available_slabs[count - 5] = atoi(token);
+		}
+		break;
+	case SPOT_REQUEST:
+		sscanf(buf, "%d,%d,%d,%d", &type, &msg->request.consumer_id, &msg->request.spot_size, &msg->request.lease_time);
+		break;
+	default:
+		for(token = strtok_r(buf, s, &save); token != NULL; token = strtok_r(NULL, s, &save), count++) {
+			if(count == 1)
+				msg->assignment.count = atoi(token);
+			else if(count == 2)
+				strcpy(msg->assignment.entries[0].ip, token);
+			else if(count == 3)
+				msg->assignment.entries[0].port = atoi(token);
+			else if(count == 4)
+				msg->assignment.entries[0].slabs = atoi(token);
+			else if(count == 5)
+				msg->assignment.entries[0].id = atoi(token);
+		}
+		break;
+	}
+	return 0;
+}
+
+void report(const char *name, int nr, uint64_t encode_ns, uint64_t decode_ns, size_t bytes) {
+	printf("%-7s encode %6.2f Mmsg/s  decode %6.2f Mmsg/s  %6.1f bytes/msg\n", name,
+	       nr / (encode_ns / 1e3), nr / (decode_ns / 1e3), (double) bytes / nr);
+}
+
+int main(int argc, char *argv[]) {
+	static struct spot_inbuf in;
+	struct spot_frame frame;
+	struct spot_msg msg, out;
+	uint8_t *stream;
+	char *text, *start, *nul;
+	size_t len = 0, off, chunk, text_len = 0;
+	uint64_t t0, t1, t2, checksum = 0;
+	int i, size, nr = NR_MESSAGES, opt;
+
+	while((opt = getopt(argc, argv, "hn:")) != -1) {
+		switch(opt) {
+		case 'n':
+			nr = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./spot_proto_bench [-n messages]\n");
+			return 0;
+		}
+	}
+	stream = malloc((size_t) nr * SPOT_PROTO_MAX_FRAME / 32 + SPOT_PROTO_MAX_FRAME);
+	text = malloc((size_t) nr * TEXT_MSG_SIZE + 1);
+	if(!stream || !text) {
+		printf("cannot allocate the streams\n");
+		return 1;
+	}
+	printf("%d messages, a third each of availability (%d nodes), spot request and assignment\n", nr, NR_NODES);
+
+	//binary: encode into one stream, then parse it back in STREAM_CHUNK reads
+	t0 = now_ns();
+	for(i = 0; i < nr; i++) {
+		set_msg(&msg, i);
+		size = spot_encode(&msg, stream + len, SPOT_PROTO_MAX_FRAME);
+		len += size;
+	}
+	t1 = now_ns();
+	spot_inbuf_init(&in);
+	for(off = 0; off < len; off += chunk) {
+		chunk = len - off < STREAM_CHUNK ? len - off : STREAM_CHUNK;
+		spot_inbuf_append(&in, stream + off, chunk);
+		while(spot_inbuf_next(&in, &frame) == 1) {
+			spot_decode(&frame, &out);
+			checksum += out.type;
+		}
+	}
+	t2 = now_ns();
+	report("binary", nr, t1 - t0, t2 - t1, len);
+
+	//text: fixed-size NUL-padded messages, one per recv
+	t0 = now_ns();
+	for(i = 0; i < nr; i++) {
+		set_msg(&msg, i);
+		text_len += text_encode(&msg, text + text_len);
+	}
+	t1 = now_ns();
+	for(start = text; start < text + text_len; start = nul + 1) {
+		nul = memchr(start, '\0', text + text_len - start);
+		if(nul == NULL)
+			break;
+		if(nul == start)
+			continue;
+		text_decode(start, &out);
+		checksum += out.type;
+	}
+	t2 = now_ns();
+	report("text", nr, t1 - t0, t2 - t1, text_len);
+
+	printf("checksum %lu\n", (unsigned long) checksum);
+	free(stream);
+	free(text);
+	return 0;
+}
@@ -0,0 +1,269 @@
+/*
+    Fuzz test of the spot protocol codec (spot_proto.h). Random messages
+    must survive encode/decode, streams of frames must parse the same
+    however they are split into reads, and corrupted streams must be
+    rejected or parsed without reading out of bounds.
+    Compile
+    gcc -g -fsanitize=address,undefined spot_proto_fuzz.c -o spot_proto_fuzz
+    or, as a libFuzzer target
+    clang -g -fsanitize=fuzzer,address -DSPOT_PROTO_LIBFUZZER spot_proto_fuzz.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "spot_proto.h"
+
+#define NR_ITERATIONS 100000
+#define MAX_STREAM_FRAMES 16
+#define STREAM_SIZE (MAX_STREAM_FRAMES * SPOT_PROTO_MAX_FRAME)
+
+uint64_t rng_state;
+
+uint64_t rng() {
+	//xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ull;
+}
+
+int rng_int() {
+	//mostly small values, sometimes anything
+	if(rng() % 4 == 0)
+		return (int32_t) rng();
+	return rng() % 1000 - 10;
+}
+
+void rng_ip(char *ip) {
+	int len = rng() % (SPOT_PROTO_MAX_IP + 1), i;
+
+	for(i = 0; i < len; i++)
+		ip[i] = 1 + rng() % 255;
+	ip[len] = '\0';
+}
+
+void random_msg(struct spot_msg *msg) {
+	int i;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->type = rng() % NR_MSG_TYPES;
+	switch(msg->type) {
+	case PRODUCER_REG:
+	case CONSUMER_REG:
+		rng_ip(msg->reg.ip);
+		msg->reg.port = rng() % 65536;
+		break;
+	case REGISTRATION_ACK:
+		msg->ack.id = rng_int();
+		break;
+	case PRODUCER_AVAILABILITY:
+		msg->availability.id = rng_int();
+		msg->availability.available_slabs = rng_int();
+		msg->availability.total_slabs = rng_int();
+		msg->availability.nr_nodes = rng() % (SPOT_PROTO_MAX_NODES + 1);
+		for(i = 0; i < msg->availability.nr_nodes; i++)
+			msg->availability.node_available_slabs[i] = rng_int();
+		break;
+	case SPOT_REQUEST:
+		msg->request.consumer_id = rng_int();
+		msg->request.spot_size = rng_int();
+		msg->request.lease_time = rng_int();
+		break;
+	case SPOT_ASSIGNMENT_CONSUMER:
+	case SPOT_ASSIGNMENT_PRODUCER:
+		msg->assignment.count = rng() % (SPOT_PROTO_MAX_ASSIGNMENTS + 1);
+		for(i = 0; i < msg->assignment.count; i++) {
+			rng_ip(msg->assignment.entries[i].ip);
+			msg->assignment.entries[i].port = rng() % 65536;
+			msg->assignment.entries[i].slabs = rng_int();
+			msg->assignment.entries[i].id = rng_int();
+		}
+		break;
+	case PRODUCER_READY:
+		msg->ready.producer_id = rng_int();
+		msg->ready.consumer_id = rng_int();
+		msg->ready.port = rng() % 65536;
+		break;
+	case LEASE_GRANT:
+	case LEASE_RENEW:
+	case LEASE_RELEASE:
+	case LEASE_END:
+		msg->lease.lease_id = rng_int();
+		msg->lease.producer_id = rng_int();
+		msg->lease.consumer_id = rng_int();
+		msg->lease.slabs = rng_int();
+		msg->lease.duration = rng_int();
+		msg->lease.reason = rng() % 256;
+		break;
+	case SPOT_SHRINK:
+		msg->shrink.producer_id = rng_int();
+		msg->shrink.consumer_id = rng_int();
+		msg->shrink.slabs = rng_int();
+		msg->shrink.quota_slabs = rng_int();
+		msg->shrink.deadline_ms = rng_int();
+		break;
+	default:
+		break;
+	}
+}
+
+void fail(const char *what, uint64_t iteration) {
+	printf("FAIL: %s at iteration %lu\n", what, (unsigned long) iteration);
+	exit(1);
+}
+
+/*
+ * Feeds @stream to an inbuf in random chunks. Every frame handed out is
+ * decoded and, when @expect is set, must re-encode to the bytes it was
+ * parsed from, in the order of @expect. Returns the frames parsed, or -1
+ * once the stream was rejected.
+ */
+int feed(const uint8_t *stream, size_t len, const uint8_t *expect, uint64_t iteration) {
+	static struct spot_inbuf in;
+	uint8_t buf[SPOT_PROTO_MAX_FRAME];
+	struct spot_frame frame;
+	struct spot_msg msg;
+	size_t off = 0, chunk, expect_off = 0;
+	int ret, size, nr_frames = 0;
+
+	spot_inbuf_init(&in);
+	while(off < len) {
+		chunk = rng() % 3 == 0 ? 1 + rng() % 8 : 1 + rng() % (2 * SPOT_PROTO_MAX_FRAME);
+		if(chunk > len - off)
+			chunk = len - off;
+		off += spot_inbuf_append(&in, stream + off, chunk);
+		while((ret = spot_inbuf_next(&in, &frame)) == 1) {
+			nr_frames++;
+			if(frame.size > SPOT_PROTO_MAX_FRAME || frame.payload_len + SPOT_PROTO_HEADER_SIZE != frame.size)
+				fail("frame size", iteration);
+			if(spot_decode(&frame, &msg) < 0) {
+				if(expect)
+					fail("decode of a valid frame", iteration);
+				continue;
+			}
+			size = spot_encode(&msg, buf, sizeof(buf));
+			if(size < 0)
+				fail("re-encode of a decoded frame", iteration);
+			if(expect) {
+				if((uint32_t) size != frame.size || memcmp(buf, expect + expect_off, size) != 0)
+					fail("round trip", iteration);
+				expect_off += size;
+			}
+		}
+		if(ret < 0) {
+			if(expect)
+				fail("valid stream rejected", iteration);
+			return -1;
+		}
+	}
+	if(expect && expect_off != len)
+		fail("frames left in the buffer", iteration);
+	return nr_frames;
+}
+
+size_t random_stream(uint8_t *stream, int *nr_frames) {
+	struct spot_msg msg;
+	size_t len = 0;
+	int i, size, n = 1 + rng() % MAX_STREAM_FRAMES;
+
+	for(i = 0; i < n; i++) {
+		random_msg(&msg);
+		size = spot_encode(&msg, stream + len, STREAM_SIZE - len);
+		if(size < 0) {
+			printf("FAIL: cannot encode message type %d\n", msg.type);
+			exit(1);
+		}
+		len += size;
+	}
+	*nr_frames = n;
+	return len;
+}
+
+void corrupt(uint8_t *stream, size_t *len) {
+	size_t pos;
+	int i, n = 1 + rng() % 4;
+
+	for(i = 0; i < n && *len > 0; i++) {
+		pos = rng() % *len;
+		switch(rng() % 4) {
+		case 0: //flip a byte
+			stream[pos] ^= 1 + rng() % 255;
+			break;
+		case 1: //truncate
+			*len = pos;
+			break;
+		case 2: //overwrite a length or count with something large
+			stream[pos] = 0xff;
+			break;
+		default: //duplicate a piece of the stream
+			if(*len + 64 <= STREAM_SIZE && pos + 64 <= *len) {
+				memmove(stream + pos + 64, stream + pos, *len - pos);
+				*len += 64;
+			}
+			break;
+		}
+	}
+}
+
+#ifdef SPOT_PROTO_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	rng_state = 0x9e3779b97f4a7c15ull ^ size;
+	feed(data, size, NULL, 0);
+	return 0;
+}
+#else
+int main(int argc, char *argv[]) {
+	static uint8_t stream[STREAM_SIZE];
+	uint64_t iteration, nr_iterations = NR_ITERATIONS, nr_frames = 0, nr_rejected = 0;
+	size_t len;
+	int opt, n, i;
+
+	rng_state = 0x9e3779b97f4a7c15ull;
+	while((opt = getopt(argc, argv, "hn:s:")) != -1) {
+		switch(opt) {
+		case 'n':
+			nr_iterations = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		default:
+			printf("Usage ./spot_proto_fuzz [-n iterations] [-s seed]\n");
+			return 0;
+		}
+	}
+
+	for(iteration = 0; iteration < nr_iterations; iteration++) {
+		//valid streams parse back frame by frame, whatever the read boundaries
+		len = random_stream(stream, &n);
+		if(feed(stream, len, stream, iteration) != n)
+			fail("frame count", iteration);
+		nr_frames += n;
+
+		//corrupted streams are rejected or parse into something harmless
+		corrupt(stream, &len);
+		if(feed(stream, len, NULL, iteration) < 0)
+			nr_rejected++;
+
+		//random bytes behind a valid header
+		len = SPOT_PROTO_HEADER_SIZE + rng() % 256;
+		for(i = 0; i < (int) len; i++)
+			stream[i] = rng();
+		stream[0] = SPOT_PROTO_MAGIC >> 8;
+		stream[1] = SPOT_PROTO_MAGIC & 0xff;
+		stream[2] = SPOT_PROTO_VERSION;
+		stream[3] = rng() % (NR_MSG_TYPES + 2);
+		stream[4] = stream[5] = 0;
+		stream[6] = 0;
+		stream[7] = len - SPOT_PROTO_HEADER_SIZE;
+		if(feed(stream, len, NULL, iteration) != 1)
+			fail("frame with random payload", iteration);
+	}
+	printf("%lu iterations, %lu frames round-tripped, %lu corrupted streams rejected\n",
+	       (unsigned long) nr_iterations, (unsigned long) nr_frames, (unsigned long) nr_rejected);
+	return 0;
+}
+#endif
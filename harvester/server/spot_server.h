@@ -0,0 +1,647 @@
+#ifndef __SPOT_SERVER_H_
+#define __SPOT_SERVER_H_
+
+/*
+ * RESP listener of the producer's embedded spot store: one listening port
+ * per consumer, each bound to a tenant of spot_store.h, all served by a
+ * single epoll thread. Hashes (HSET and friends, used by YCSB) are kept as
+ * one value holding the encoded fields; sorted sets, expiry and
+ * persistence are not supported.
+ *
+ * A shrink announced to the consumer stops the tenant from growing at once
+ * but only cuts it down at the deadline, giving up its coldest pages
+ * (spot_tenant_shrink()); a tenant left without quota is closed then.
+ *
+ * A single lock guards the tenants, so the harvest thread can resize a
+ * quota while requests are served. Connections closed from another thread
+ * are freed by the epoll thread, before it waits again, so no event it
+ * holds refers to freed memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "spot_store.h"
+#include "resp.h"
+
+#define SPOT_SERVER_MAX_EVENTS 64
+#define SPOT_SERVER_MAX_REQUEST (8 << 20)  /* of a connection's unparsed input */
+#define SPOT_SERVER_READ_SIZE 65536
+
+struct spot_conn {
+	int sock;  /* -1 once closed */
+	int tenant;
+	int listening;
+	int quit;  /* closes after its replies are sent */
+	int writing;  /* waits for EPOLLOUT */
+	struct resp_buf in;
+	struct resp_buf out;
+	struct spot_conn *next;  /* of the tenant, or of the dead list */
+};
+
+struct spot_server_tenant {
+	struct spot_tenant store;
+	struct spot_conn listener;  /* sock -1 while the tenant is closed */
+	struct spot_conn *conns;
+	uint64_t last_active;  /* ms, of its last request */
+	uint64_t shrink_deadline;  /* ms, 0 if no shrink is pending */
+	long shrink_quota;
+};
+
+struct spot_server {
+	int epfd;
+	int wake_fd;  /* eventfd, for a new deadline */
+	int nr_tenants;
+	struct spot_server_tenant *tenants;
+	struct spot_conn *dead;  /* closed, freed before the next epoll_wait */
+	pthread_mutex_t lock;
+	pthread_t thread;
+	struct resp_cmd cmd;
+	struct resp_buf scratch;  /* hash values being built */
+};
+
+static inline uint64_t spot_server_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static inline int spot_server_nonblock(int sock)
+{
+	return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static inline int spot_server_watch(struct spot_server *srv, struct spot_conn *conn, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	return epoll_ctl(srv->epfd, op, conn->sock, &ev);
+}
+
+static inline void spot_conn_close(struct spot_server *srv, struct spot_conn *conn)
+{
+	struct spot_conn **p = &srv->tenants[conn->tenant].conns;
+
+	while (*p != conn)
+		p = &(*p)->next;
+	*p = conn->next;
+	close(conn->sock);
+	conn->sock = -1;
+	conn->next = srv->dead;
+	srv->dead = conn;
+}
+
+static inline void spot_server_free_dead(struct spot_server *srv)
+{
+	struct spot_conn *conn;
+
+	while ((conn = srv->dead) != NULL) {
+		srv->dead = conn->next;
+		resp_buf_free(&conn->in);
+		resp_buf_free(&conn->out);
+		free(conn);
+	}
+}
+
+/* hash values are a sequence of <u32 length, field, u32 length, value> */
+static inline const char *spot_hash_next(const char *p, const char *end, const char **s, uint32_t *len)
+{
+	if (end - p < 4)
+		return NULL;
+	memcpy(len, p, 4);
+	if ((size_t)(end - p - 4) < *len)
+		return NULL;
+	*s = p + 4;
+	return p + 4 + *len;
+}
+
+static inline void spot_hash_put(struct resp_buf *b, const char *s, uint32_t len)
+{
+	resp_append(b, &len, 4);
+	resp_append(b, s, len);
+}
+
+/* the value of field @f of the hash in [p, end), NULL if it has none */
+static inline const char *spot_hash_get(const char *p, const char *end, const char *f, size_t flen, uint32_t *vlen)
+{
+	const char *field, *value;
+	uint32_t len;
+
+	while (p != NULL && p < end) {
+		p = spot_hash_next(p, end, &field, &len);
+		if (p == NULL || (p = spot_hash_next(p, end, &value, vlen)) == NULL)
+			return NULL;
+		if (len == flen && memcmp(field, f, flen) == 0)
+			return value;
+	}
+	return NULL;
+}
+
+/* HSET and HMSET: the fields not set by the command are kept, returns the fields added */
+static inline long spot_server_hset(struct spot_server *srv, struct spot_tenant *t, const struct resp_cmd *cmd,
+                                    struct spot_item *it)
+{
+	const char *p, *end, *field, *value;
+	uint32_t flen, vlen;
+	long added = (cmd->argc - 2) / 2;
+	int i, replaced;
+
+	srv->scratch.len = 0;
+	if (it != NULL) {
+		p = spot_item_value(it);
+		end = p + it->vlen;
+		while (p != NULL && p < end) {
+			p = spot_hash_next(p, end, &field, &flen);
+			if (p == NULL || (p = spot_hash_next(p, end, &value, &vlen)) == NULL)
+				break;
+			for (replaced = 0, i = 2; i < cmd->argc; i += 2)
+				replaced |= cmd->argl[i] == flen && memcmp(cmd->argv[i], field, flen) == 0;
+			if (replaced) {
+				added--;
+				continue;
+			}
+			spot_hash_put(&srv->scratch, field, flen);
+			spot_hash_put(&srv->scratch, value, vlen);
+		}
+	}
+	for (i = 2; i < cmd->argc; i += 2) {
+		spot_hash_put(&srv->scratch, cmd->argv[i], cmd->argl[i]);
+		spot_hash_put(&srv->scratch, cmd->argv[i + 1], cmd->argl[i + 1]);
+	}
+	if (spot_set(t, cmd->argv[1], cmd->argl[1], srv->scratch.data, srv->scratch.len, SPOT_TYPE_HASH) < 0)
+		return -1;
+	return added;
+}
+
+static inline void spot_server_info(struct spot_tenant *t, struct resp_buf *out)
+{
+	char info[512];
+	int len;
+
+	len = snprintf(info, sizeof(info),
+	               "# Memory\r\nused_memory:%ld\r\nused_memory_dataset:%ld\r\nmaxmemory:%ld\r\n"
+	               "maxmemory_policy:clock\r\n# Stats\r\nkeyspace_hits:%llu\r\nkeyspace_misses:%llu\r\n"
+	               "evicted_keys:%llu\r\n# Keyspace\r\ndb0:keys=%ld\r\n",
+	               spot_tenant_bytes(t), t->item_bytes, t->quota_pages * (long) SPOT_STORE_PAGE_SIZE,
+	               (unsigned long long) t->hits, (unsigned long long) t->misses,
+	               (unsigned long long) t->evictions, t->nr_items);
+	resp_bulk(out, info, len);
+}
+
+static inline void spot_server_execute(struct spot_server *srv, struct spot_conn *conn, const struct resp_cmd *cmd)
+{
+	struct spot_tenant *t = &srv->tenants[conn->tenant].store;
+	struct resp_buf *out = &conn->out;
+	struct spot_item *it;
+	const char *value;
+	uint32_t vlen;
+	long n;
+	int i, exists;
+
+	if (cmd->argc == 0)
+		return;
+	if (resp_is(cmd, 0, "GET") && cmd->argc == 2) {
+		it = spot_get(t, cmd->argv[1], cmd->argl[1]);
+		if (it == NULL)
+			resp_null(out);
+		else if (it->type != SPOT_TYPE_STRING)
+			resp_error(out, "WRONGTYPE Operation against a key holding the wrong kind of value");
+		else
+			resp_bulk(out, spot_item_value(it), it->vlen);
+	} else if (resp_is(cmd, 0, "SET") && cmd->argc >= 3) {
+		exists = -1;  /* do not care */
+		for (i = 3; i < cmd->argc; i++) {
+			if (resp_is(cmd, i, "NX"))
+				exists = 0;
+			else if (resp_is(cmd, i, "XX"))
+				exists = 1;
+			else
+				break;
+		}
+		if (i < cmd->argc)
+			resp_error(out, "ERR syntax error, expiry is not supported");
+		else if (exists >= 0 && (spot_find(t, cmd->argv[1], cmd->argl[1], spot_hash(cmd->argv[1], cmd->argl[1])) != NULL) != exists)
+			resp_null(out);
+		else if (spot_set(t, cmd->argv[1], cmd->argl[1], cmd->argv[2], cmd->argl[2], SPOT_TYPE_STRING) < 0)
+			resp_error(out, "OOM command not allowed when used memory > 'maxmemory'.");
+		else
+			resp_simple(out, "OK");
+	} else if (resp_is(cmd, 0, "MGET") && cmd->argc >= 2) {
+		resp_array(out, cmd->argc - 1);
+		for (i = 1; i < cmd->argc; i++) {
+			it = spot_get(t, cmd->argv[i], cmd->argl[i]);
+			if (it == NULL || it->type != SPOT_TYPE_STRING)
+				resp_null(out);
+			else
+				resp_bulk(out, spot_item_value(it), it->vlen);
+		}
+	} else if (resp_is(cmd, 0, "MSET") && cmd->argc >= 3 && cmd->argc % 2 == 1) {
+		for (n = 0, i = 1; i < cmd->argc; i += 2)
+			n |= spot_set(t, cmd->argv[i], cmd->argl[i], cmd->argv[i + 1], cmd->argl[i + 1], SPOT_TYPE_STRING);
+		if (n < 0)
+			resp_error(out, "OOM command not allowed when used memory > 'maxmemory'.");
+		else
+			resp_simple(out, "OK");
+	} else if ((resp_is(cmd, 0, "DEL") || resp_is(cmd, 0, "UNLINK")) && cmd->argc >= 2) {
+		for (n = 0, i = 1; i < cmd->argc; i++)
+			n += spot_del(t, cmd->argv[i], cmd->argl[i]);
+		resp_integer(out, n);
+	} else if (resp_is(cmd, 0, "EXISTS") && cmd->argc >= 2) {
+		for (n = 0, i = 1; i < cmd->argc; i++)
+			n += spot_find(t, cmd->argv[i], cmd->argl[i], spot_hash(cmd->argv[i], cmd->argl[i])) != NULL;
+		resp_integer(out, n);
+	} else if ((resp_is(cmd, 0, "HSET") || resp_is(cmd, 0, "HMSET")) && cmd->argc >= 4 && cmd->argc % 2 == 0) {
+		it = spot_get(t, cmd->argv[1], cmd->argl[1]);
+		if (it != NULL && it->type != SPOT_TYPE_HASH)
+			resp_error(out, "WRONGTYPE Operation against a key holding the wrong kind of value");
+		else if ((n = spot_server_hset(srv, t, cmd, it)) < 0)
+			resp_error(out, "OOM command not allowed when used memory > 'maxmemory'.");
+		else if (resp_is(cmd, 0, "HSET"))
+			resp_integer(out, n);
+		else
+			resp_simple(out, "OK");
+	} else if ((resp_is(cmd, 0, "HGET") && cmd->argc == 3) || (resp_is(cmd, 0, "HMGET") && cmd->argc >= 3)) {
+		it = spot_get(t, cmd->argv[1], cmd->argl[1]);
+		if (it != NULL && it->type != SPOT_TYPE_HASH) {
+			resp_error(out, "WRONGTYPE Operation against a key holding the wrong kind of value");
+			return;
+		}
+		if (resp_is(cmd, 0, "HMGET"))
+			resp_array(out, cmd->argc - 2);
+		for (i = 2; i < cmd->argc; i++) {
+			value = it == NULL ? NULL : spot_hash_get(spot_item_value(it), spot_item_value(it) + it->vlen,
+			                                          cmd->argv[i], cmd->argl[i], &vlen);
+			if (value == NULL)
+				resp_null(out);
+			else
+				resp_bulk(out, value, vlen);
+		}
+	} else if (resp_is(cmd, 0, "HGETALL") && cmd->argc == 2) {
+		const char *p, *end, *s;
+
+		it = spot_get(t, cmd->argv[1], cmd->argl[1]);
+		if (it == NULL) {
+			resp_array(out, 0);
+			return;
+		}
+		if (it->type != SPOT_TYPE_HASH) {
+			resp_error(out, "WRONGTYPE Operation against a key holding the wrong kind of value");
+			return;
+		}
+		p = spot_item_value(it);
+		end = p + it->vlen;
+		for (n = 0; p != NULL && p < end; n++)
+			p = spot_hash_next(p, end, &s, &vlen);
+		resp_array(out, n);
+		for (p = spot_item_value(it); p != NULL && p < end;) {
+			p = spot_hash_next(p, end, &s, &vlen);
+			if (p != NULL)
+				resp_bulk(out, s, vlen);
+		}
+	} else if (resp_is(cmd, 0, "PING")) {
+		if (cmd->argc > 1)
+			resp_bulk(out, cmd->argv[1], cmd->argl[1]);
+		else
+			resp_simple(out, "PONG");
+	} else if (resp_is(cmd, 0, "ECHO") && cmd->argc == 2) {
+		resp_bulk(out, cmd->argv[1], cmd->argl[1]);
+	} else if (resp_is(cmd, 0, "DBSIZE")) {
+		resp_integer(out, t->nr_items);
+	} else if (resp_is(cmd, 0, "FLUSHDB") || resp_is(cmd, 0, "FLUSHALL")) {
+		spot_tenant_flush(t);
+		resp_simple(out, "OK");
+	} else if (resp_is(cmd, 0, "INFO")) {
+		spot_server_info(t, out);
+	} else if (resp_is(cmd, 0, "CONFIG") && resp_is(cmd, 1, "GET") && resp_is(cmd, 2, "maxmemory")) {
+		char quota[32];
+
+		resp_array(out, 2);
+		resp_bulk(out, "maxmemory", 9);
+		resp_bulk(out, quota, snprintf(quota, sizeof(quota), "%ld", t->quota_pages * (long) SPOT_STORE_PAGE_SIZE));
+	} else if (resp_is(cmd, 0, "CONFIG") && resp_is(cmd, 1, "SET")) {
+		resp_error(out, "ERR the quota of a spot store is set by its producer");
+	} else if (resp_is(cmd, 0, "SELECT") || resp_is(cmd, 0, "CLIENT")) {
+		resp_simple(out, "OK");
+	} else if (resp_is(cmd, 0, "COMMAND")) {
+		resp_array(out, 0);
+	} else if (resp_is(cmd, 0, "QUIT")) {
+		resp_simple(out, "OK");
+		conn->quit = 1;
+	} else {
+		resp_error(out, "ERR unknown command or wrong number of arguments");
+	}
+}
+
+/* sends what it can of the replies, waits for EPOLLOUT for the rest; returns -1 if the connection is gone */
+static inline int spot_conn_flush(struct spot_server *srv, struct spot_conn *conn)
+{
+	ssize_t n;
+	size_t sent = 0;
+
+	while (sent < conn->out.len) {
+		n = send(conn->sock, conn->out.data + sent, conn->out.len - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			return -1;
+		sent += n;
+	}
+	resp_consume(&conn->out, sent);
+	if (conn->out.len == 0 && conn->quit)
+		return -1;
+	if (conn->writing == (conn->out.len > 0))
+		return 0;
+	conn->writing = conn->out.len > 0;
+	return spot_server_watch(srv, conn, EPOLL_CTL_MOD, conn->writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static inline int spot_conn_read(struct spot_server *srv, struct spot_conn *conn)
+{
+	char *p;
+	ssize_t n;
+	long used = 0;
+	size_t off;
+
+	do {
+		if ((p = resp_reserve(&conn->in, SPOT_SERVER_READ_SIZE)) == NULL)
+			return -1;
+		n = recv(conn->sock, p, SPOT_SERVER_READ_SIZE, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			break;  /* level-triggered, the rest comes with the next event */
+		if (n <= 0)
+			return -1;
+		conn->in.len += n;
+		srv->tenants[conn->tenant].last_active = spot_server_now();
+		/* all the complete requests, pipelined or not */
+		off = 0;
+		while (!conn->quit && (used = resp_parse(conn->in.data + off, conn->in.len - off, &srv->cmd)) > 0) {
+			spot_server_execute(srv, conn, &srv->cmd);
+			off += used;
+		}
+		resp_consume(&conn->in, off);
+		if (used < 0 || conn->in.len >= SPOT_SERVER_MAX_REQUEST) {
+			resp_error(&conn->out, "ERR Protocol error");
+			conn->quit = 1;
+		}
+		if (spot_conn_flush(srv, conn) < 0)
+			return -1;
+	} while (n == SPOT_SERVER_READ_SIZE && !conn->quit);
+	return 0;
+}
+
+static inline void spot_server_accept(struct spot_server *srv, struct spot_conn *listener)
+{
+	struct spot_server_tenant *tenant = &srv->tenants[listener->tenant];
+	struct spot_conn *conn;
+	int sock, one = 1;
+
+	while ((sock = accept(listener->sock, NULL, NULL)) >= 0) {
+		conn = (struct spot_conn *) calloc(1, sizeof(*conn));
+		if (conn == NULL) {
+			close(sock);
+			continue;
+		}
+		spot_server_nonblock(sock);
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn->sock = sock;
+		conn->tenant = listener->tenant;
+		conn->next = tenant->conns;
+		tenant->conns = conn;
+		if (spot_server_watch(srv, conn, EPOLL_CTL_ADD, EPOLLIN) < 0)
+			spot_conn_close(srv, conn);
+	}
+}
+
+static inline void spot_server_close_locked(struct spot_server *srv, int tenant)
+{
+	struct spot_server_tenant *t = &srv->tenants[tenant];
+
+	while (t->conns != NULL)
+		spot_conn_close(srv, t->conns);
+	close(t->listener.sock);
+	t->listener.sock = -1;
+	t->shrink_deadline = 0;
+	spot_tenant_destroy(&t->store);
+}
+
+/* cuts down the tenants whose shrink deadline is past, returns the ms to the next one or -1 */
+static inline int spot_server_run_deadlines(struct spot_server *srv)
+{
+	struct spot_server_tenant *t;
+	uint64_t now = spot_server_now(), next = 0;
+	int i;
+
+	for (i = 0; i < srv->nr_tenants; i++) {
+		t = &srv->tenants[i];
+		if (t->shrink_deadline == 0)
+			continue;
+		if (t->shrink_deadline > now) {
+			if (next == 0 || t->shrink_deadline < next)
+				next = t->shrink_deadline;
+			continue;
+		}
+		t->shrink_deadline = 0;
+		if (t->shrink_quota < SPOT_STORE_PAGE_SIZE)
+			spot_server_close_locked(srv, i);
+		else if (spot_tenant_shrink(&t->store, t->shrink_quota) < 0)
+			spot_tenant_set_quota(&t->store, t->shrink_quota);
+	}
+	return next ? (int) (next - now) : -1;
+}
+
+static inline void *spot_server_loop(void *arg)
+{
+	struct spot_server *srv = (struct spot_server *) arg;
+	struct epoll_event events[SPOT_SERVER_MAX_EVENTS];
+	struct spot_conn *conn;
+	uint64_t wakeups;
+	int i, n, timeout;
+
+	for (;;) {
+		pthread_mutex_lock(&srv->lock);
+		timeout = spot_server_run_deadlines(srv);
+		spot_server_free_dead(srv);
+		pthread_mutex_unlock(&srv->lock);
+		n = epoll_wait(srv->epfd, events, SPOT_SERVER_MAX_EVENTS, timeout);
+		pthread_mutex_lock(&srv->lock);
+		for (i = 0; i < n; i++) {
+			conn = (struct spot_conn *) events[i].data.ptr;
+			if (conn == NULL) {
+				while (read(srv->wake_fd, &wakeups, sizeof(wakeups)) > 0);
+				continue;
+			}
+			if (conn->sock < 0)
+				continue;  /* closed meanwhile */
+			if (conn->listening)
+				spot_server_accept(srv, conn);
+			else if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN))
+				spot_conn_close(srv, conn);
+			else if ((events[i].events & EPOLLIN ? spot_conn_read(srv, conn) : spot_conn_flush(srv, conn)) < 0)
+				spot_conn_close(srv, conn);
+		}
+		pthread_mutex_unlock(&srv->lock);
+	}
+	return NULL;
+}
+
+/* serves up to @nr_tenants tenants from a thread of its own, returns 0 or -1 */
+static inline int spot_server_start(struct spot_server *srv, int nr_tenants)
+{
+	struct epoll_event ev;
+	int i;
+
+	memset(srv, 0, sizeof(*srv));
+	srv->tenants = (struct spot_server_tenant *) calloc(nr_tenants, sizeof(*srv->tenants));
+	if (srv->tenants == NULL)
+		return -1;
+	srv->nr_tenants = nr_tenants;
+	for (i = 0; i < nr_tenants; i++) {
+		srv->tenants[i].listener.sock = -1;
+		srv->tenants[i].listener.tenant = i;
+		srv->tenants[i].listener.listening = 1;
+	}
+	srv->epfd = epoll_create1(0);
+	srv->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (srv->epfd < 0 || srv->wake_fd < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->wake_fd, &ev) < 0)
+		return -1;
+	pthread_mutex_init(&srv->lock, NULL);
+	return pthread_create(&srv->thread, NULL, spot_server_loop, srv) == 0 ? 0 : -1;
+}
+
+static inline int spot_server_is_open(struct spot_server *srv, int tenant)
+{
+	return srv->tenants[tenant].listener.sock >= 0;
+}
+
+/* whether the tenant is open, a shrink to no quota closing it at its deadline */
+static inline int spot_server_serving(struct spot_server *srv, int tenant)
+{
+	int open;
+
+	pthread_mutex_lock(&srv->lock);
+	open = spot_server_is_open(srv, tenant);
+	pthread_mutex_unlock(&srv->lock);
+	return open;
+}
+
+/*
+ * Opens tenant @tenant, with a quota of @quota bytes in pages of NUMA node
+ * @node (-1 for any), listening on @ip:@port. Returns 0 or -1.
+ */
+static inline int spot_server_open(struct spot_server *srv, int tenant, const char *ip, int port,
+                                   long quota, int node)
+{
+	struct spot_server_tenant *t = &srv->tenants[tenant];
+	struct sockaddr_in addr;
+	int sock, one = 1;
+
+	/* a tenant left to its shrink deadline still holds the port */
+	pthread_mutex_lock(&srv->lock);
+	if (spot_server_is_open(srv, tenant))
+		spot_server_close_locked(srv, tenant);
+	pthread_mutex_unlock(&srv->lock);
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(sock, 128) < 0 || spot_server_nonblock(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	pthread_mutex_lock(&srv->lock);
+	t->last_active = spot_server_now();
+	if (spot_tenant_init(&t->store, quota, node) < 0) {
+		pthread_mutex_unlock(&srv->lock);
+		close(sock);
+		return -1;
+	}
+	t->listener.sock = sock;
+	if (spot_server_watch(srv, &t->listener, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+		spot_tenant_destroy(&t->store);
+		t->listener.sock = -1;
+		close(sock);
+		pthread_mutex_unlock(&srv->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&srv->lock);
+	return 0;
+}
+
+/* evicts down to @quota bytes right away, dropping a pending shrink; returns the bytes given back */
+static inline long spot_server_set_quota(struct spot_server *srv, int tenant, long quota)
+{
+	long released = 0;
+
+	pthread_mutex_lock(&srv->lock);
+	if (spot_server_is_open(srv, tenant)) {
+		srv->tenants[tenant].shrink_deadline = 0;
+		released = spot_tenant_set_quota(&srv->tenants[tenant].store, quota) * (long) SPOT_STORE_PAGE_SIZE;
+	}
+	pthread_mutex_unlock(&srv->lock);
+	return released;
+}
+
+/* stops the tenant from growing past @quota bytes now, and cuts it down to them in @deadline_ms */
+static inline void spot_server_shrink(struct spot_server *srv, int tenant, long quota, int deadline_ms)
+{
+	struct spot_server_tenant *t = &srv->tenants[tenant];
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&srv->lock);
+	if (spot_server_is_open(srv, tenant)) {
+		spot_tenant_quota(&t->store, quota);
+		t->shrink_quota = quota;
+		t->shrink_deadline = spot_server_now() + (deadline_ms > 0 ? deadline_ms : 0) + 1;
+		if (write(srv->wake_fd, &one, sizeof(one)) < 0)
+			perror("spot server wakeup");
+	}
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/* ms since the tenant last served a request */
+static inline uint64_t spot_server_idle(struct spot_server *srv, int tenant)
+{
+	uint64_t idle;
+
+	pthread_mutex_lock(&srv->lock);
+	idle = spot_server_now() - srv->tenants[tenant].last_active;
+	pthread_mutex_unlock(&srv->lock);
+	return idle;
+}
+
+/* closes the tenant's port and connections and frees its memory */
+static inline void spot_server_close(struct spot_server *srv, int tenant)
+{
+	pthread_mutex_lock(&srv->lock);
+	if (spot_server_is_open(srv, tenant))
+		spot_server_close_locked(srv, tenant);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+    Simulation of a producer taking memory back from the spot stores of
+    its consumers (spot_store.h). Tenants run zipfian cache-aside
+    workloads of different rates; some go idle for a while, and the
+    producer takes back part of its memory while they are. Compares the
+    hit rates of the consumers after the shrink, when every store is cut
+    down at once in proportion, the behavior without SPOT_SHRINK, with
+    those when the stores are cut at the deadline of a SPOT_SHRINK, by
+    their coldest pages, either in proportion or from the stores idle the
+    longest, as the producer does.
+    Compile
+    gcc -O2 spot_shrink_sim.c -lm -o spot_shrink_sim
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "spot_store.h"
+
+#define NR_TENANTS 8
+#define NR_IDLE 3 //the last tenants, idle around the shrink
+#define QUOTA_MB 32 //per tenant
+#define SLAB_MB 4 //taken back at a time
+#define NR_KEYS 60000 //per tenant
+#define VALUE_SIZE 1000
+#define NR_OPS 4000000
+#define ZIPF_THETA 0.99
+#define GET_PERCENT 90
+#define DEADLINE_OPS 20000 //notice given before a SPOT_SHRINK cuts the stores
+
+enum shrink_policy {
+	SHRINK_NONE = 0,
+	SHRINK_ABRUPT = 1, //every store cut in proportion at once
+	SHRINK_PROPORTIONAL = 2, //every store cut in proportion, coldest pages, at the deadline
+	SHRINK_IDLE_FIRST = 3, //the stores idle the longest cut first, coldest pages, at the deadline
+	NR_SHRINK_POLICIES
+};
+
+const char *policy_names[] = { "none", "abrupt", "proportional", "idle-first" };
+const int weights[NR_TENANTS] = { 30, 20, 15, 10, 10, 5, 5, 5 }; //share of the requests
+int shrink_percent = 40, nr_ops = NR_OPS;
+double zipf_zetan, zipf_eta, zipf_alpha;
+uint64_t rng_state;
+char value[VALUE_SIZE];
+
+struct tenant {
+	struct spot_tenant store;
+	long quota;
+	long last_active; //op
+	long gets[3], hits[3]; //per phase after the shrink
+};
+
+struct tenant tenants[NR_TENANTS];
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+/* the zipfian generator of Gray et al., as in YCSB */
+void zipf_init(int n, double theta) {
+	double zeta2 = 1 + pow(0.5, theta);
+	int i;
+
+	zipf_zetan = 0;
+	for(i = 1; i <= n; i++)
+		zipf_zetan += 1 / pow(i, theta);
+	zipf_alpha = 1 / (1 - theta);
+	zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+int zipf_next(int n) {
+	double u = rng() / 4294967296.0, uz = u * zipf_zetan;
+
+	if(uz < 1)
+		return 0;
+	if(uz < 1 + pow(0.5, ZIPF_THETA))
+		return 1;
+	return (int) (n * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha)) % n;
+}
+
+/* a tenant by the weights, the idle ones left out between @idle_from and @idle_to */
+int pick_tenant(long op, long idle_from, long idle_to) {
+	int total = 0, i, r;
+
+	for(i = 0; i < NR_TENANTS; i++)
+		total += (op >= idle_from && op < idle_to && i >= NR_TENANTS - NR_IDLE) ? 0 : weights[i];
+	r = rng() % total;
+	for(i = 0; i < NR_TENANTS; i++) {
+		if(op >= idle_from && op < idle_to && i >= NR_TENANTS - NR_IDLE)
+			continue;
+		if((r -= weights[i]) < 0)
+			break;
+	}
+	return i;
+}
+
+void request(struct tenant *t, long op, int phase) {
+	char key[32];
+	int len = sprintf(key, "user%d", (int) (zipf_next(NR_KEYS) * 2654435761u % 1000003));
+
+	t->last_active = op;
+	if(rng() % 100 >= GET_PERCENT) {
+		spot_set(&t->store, key, len, value, VALUE_SIZE, SPOT_TYPE_STRING);
+		return;
+	}
+	if(phase >= 0)
+		t->gets[phase]++;
+	if(spot_get(&t->store, key, len) != NULL) {
+		if(phase >= 0)
+			t->hits[phase]++;
+		return;
+	}
+	spot_set(&t->store, key, len, value, VALUE_SIZE, SPOT_TYPE_STRING);
+}
+
+/* the quotas after taking back @percent of the memory with @policy */
+void plan_shrink(int policy, int percent) {
+	long total = 0, deficit, slab = (long) SLAB_MB << 20, cut;
+	int i, idlest;
+
+	for(i = 0; i < NR_TENANTS; i++)
+		total += tenants[i].quota;
+	deficit = total * percent / 100;
+	if(policy == SHRINK_ABRUPT || policy == SHRINK_PROPORTIONAL) {
+		for(i = 0; i < NR_TENANTS; i++)
+			tenants[i].quota -= tenants[i].quota * percent / 100;
+		return;
+	}
+	while(deficit > 0) {
+		idlest = -1;
+		for(i = 0; i < NR_TENANTS; i++) {
+			if(tenants[i].quota > 0 && (idlest < 0 || tenants[i].last_active < tenants[idlest].last_active))
+				idlest = i;
+		}
+		if(idlest < 0)
+			break;
+		cut = (deficit + slab - 1) / slab * slab;
+		if(cut > tenants[idlest].quota)
+			cut = tenants[idlest].quota;
+		tenants[idlest].quota -= cut;
+		deficit -= cut;
+	}
+}
+
+void run(int policy) {
+	long shrink_at = nr_ops / 2, idle_from = nr_ops * 2 / 5, idle_to = nr_ops * 3 / 4;
+	long bounds[4] = { shrink_at, shrink_at + nr_ops / 20, idle_to, nr_ops };
+	long gets[3] = { 0 }, hits[3] = { 0 }, active_gets = 0, active_hits = 0, op;
+	int i, phase;
+
+	rng_state = 0x9e3779b97f4a7c15ull;
+	for(i = 0; i < NR_TENANTS; i++) {
+		memset(&tenants[i], 0, sizeof(tenants[i]));
+		tenants[i].quota = (long) QUOTA_MB << 20;
+		if(spot_tenant_init(&tenants[i].store, tenants[i].quota, -1) < 0) {
+			printf("cannot allocate a tenant\n");
+			exit(1);
+		}
+	}
+	for(op = 0; op < nr_ops; op++) {
+		if(op == shrink_at && policy != SHRINK_NONE) {
+			plan_shrink(policy, shrink_percent);
+			for(i = 0; i < NR_TENANTS; i++) {
+				if(policy == SHRINK_ABRUPT)
+					spot_tenant_set_quota(&tenants[i].store, tenants[i].quota);
+				else
+					spot_tenant_quota(&tenants[i].store, tenants[i].quota); //no more growth until the deadline
+			}
+		}
+		if(op == shrink_at + DEADLINE_OPS && (policy == SHRINK_PROPORTIONAL || policy == SHRINK_IDLE_FIRST)) {
+			for(i = 0; i < NR_TENANTS; i++)
+				spot_tenant_shrink(&tenants[i].store, tenants[i].quota);
+		}
+		for(phase = -1; phase < 2 && op >= bounds[phase + 1]; phase++);
+		request(&tenants[pick_tenant(op, idle_from, idle_to)], op, phase);
+	}
+	for(i = 0; i < NR_TENANTS; i++) {
+		for(phase = 0; phase < 3; phase++) {
+			gets[phase] += tenants[i].gets[phase];
+			hits[phase] += tenants[i].hits[phase];
+		}
+		if(i < NR_TENANTS - NR_IDLE) {
+			active_gets += tenants[i].gets[0] + tenants[i].gets[1];
+			active_hits += tenants[i].hits[0] + tenants[i].hits[1];
+		}
+		spot_tenant_destroy(&tenants[i].store);
+	}
+	printf("%-13s %13.2f%% %13.2f%% %13.2f%% %15.2f%%\n", policy_names[policy], 100.0 * hits[0] / gets[0],
+	       100.0 * hits[1] / gets[1], 100.0 * hits[2] / gets[2], 100.0 * active_hits / active_gets);
+}
+
+int main(int argc, char *argv[]) {
+	int opt, policy;
+
+	while((opt = getopt(argc, argv, "hs:n:")) != -1) {
+		switch(opt) {
+		case 's':
+			shrink_percent = atoi(optarg);
+			break;
+		case 'n':
+			nr_ops = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./spot_shrink_sim [-s shrink-percent] [-n ops]\n");
+			return 0;
+		}
+	}
+	memset(value, 'v', VALUE_SIZE);
+	zipf_init(NR_KEYS, ZIPF_THETA);
+	printf("%d tenants of %d MB, %d keys of %d bytes each, %d%% gets, %d idle from 40%% to 75%% of %d ops\n",
+	       NR_TENANTS, QUOTA_MB, NR_KEYS, VALUE_SIZE, GET_PERCENT, NR_IDLE, nr_ops);
+	printf("%d%% of the memory taken back at 50%%, SPOT_SHRINK deadline %d ops later; hit rates\n", shrink_percent, DEADLINE_OPS);
+	printf("%-13s %14s %14s %14s %16s\n", "shrink", "first 5%", "until 75%", "idle back", "active, after");
+	for(policy = 0; policy < NR_SHRINK_POLICIES; policy++)
+		run(policy);
+	return 0;
+}
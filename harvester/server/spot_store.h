@@ -0,0 +1,631 @@
+#ifndef __SPOT_STORE_H_
+#define __SPOT_STORE_H_
+
+/*
+ * Key-value engine of the producer's embedded spot store, one tenant per
+ * consumer.
+ *
+ * A tenant's memory is a set of SPOT_STORE_PAGE_SIZE pages mapped for it
+ * alone, each carved into the chunks of one size class, so its usage is a
+ * number of pages and so is its quota. Items are found through a chained
+ * hash table and evicted with CLOCK: every hit sets the item's reference
+ * bit, and the hand of its size class sweeps the chunks, clearing the bits
+ * it passes and evicting the first item it finds without one. Once a class
+ * has evicted a page's worth of items, it takes a page from the class that
+ * has gone longest without evicting, if that one has not evicted since, so
+ * pages follow the item sizes in use. Shrinking the quota evicts whole
+ * pages from the classes holding the most and unmaps them, so the memory
+ * is given back before the call returns. A shrink announced ahead of time
+ * gives up the coldest pages instead, those with the fewest referenced
+ * items, after moving these items to room left in the pages kept.
+ *
+ * A tenant is not thread-safe; its user serializes the calls.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define SPOT_STORE_PAGE_SHIFT 20
+#define SPOT_STORE_PAGE_SIZE (1 << SPOT_STORE_PAGE_SHIFT)
+#define SPOT_STORE_MIN_CHUNK 64
+#define SPOT_STORE_MAX_CLASSES 64
+#define SPOT_STORE_MIN_BUCKETS 1024
+#define SPOT_STORE_MPOL_BIND 2  /* of mbind(2) */
+
+#define SPOT_ITEM_USED 0x1
+#define SPOT_ITEM_REF 0x2
+
+enum spot_item_type {
+	SPOT_TYPE_STRING = 0,
+	SPOT_TYPE_HASH = 1,
+};
+
+struct spot_page;
+
+struct spot_item {
+	struct spot_item *hnext;  /* hash chain, or free list while the chunk is free */
+	struct spot_page *page;
+	uint32_t hash;
+	uint32_t vlen;
+	uint16_t klen;
+	uint8_t flags;  /* 0 while the chunk is free */
+	uint8_t type;
+	char data[];  /* the key, then the value */
+};
+
+#define SPOT_ITEM_HEADER offsetof(struct spot_item, data)
+
+struct spot_page {
+	char *mem;
+	struct spot_page *next_partial;  /* pages of the class with room */
+	struct spot_page *prev_partial;
+	struct spot_item *free_chunks;
+	int cls;
+	int index;  /* in the class's pages[] */
+	int nr_carved;  /* chunks in use at least once, from the start of the page */
+	int nr_used;
+	int in_partial;
+	int heat;  /* referenced items, while shrinking */
+};
+
+struct spot_class {
+	uint32_t size;  /* of its chunks */
+	uint32_t per_page;
+	struct spot_page **pages;
+	int nr_pages;
+	int cap_pages;
+	struct spot_page *partial;
+	int hand_page;  /* CLOCK hand */
+	int hand_chunk;
+	uint64_t evict_clock;  /* tenant evictions at its last one */
+	uint64_t move_clock;  /* tenant evictions when it last looked for a page to take */
+	long evicted;  /* since then */
+};
+
+struct spot_tenant {
+	struct spot_class classes[SPOT_STORE_MAX_CLASSES];
+	int nr_classes;
+	struct spot_item **buckets;
+	uint32_t nr_buckets;  /* a power of two */
+	long nr_items;
+	long item_bytes;  /* headers, keys and values of the items */
+	long nr_pages;
+	long quota_pages;
+	int node;  /* NUMA node the pages are bound to, -1 for any */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+static inline uint32_t spot_hash(const char *key, size_t klen)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < klen; i++)
+		h = (h ^ (uint8_t) key[i]) * 16777619u;
+	return h;
+}
+
+static inline char *spot_item_key(struct spot_item *it)
+{
+	return it->data;
+}
+
+static inline char *spot_item_value(struct spot_item *it)
+{
+	return it->data + it->klen;
+}
+
+static inline long spot_tenant_bytes(const struct spot_tenant *t)
+{
+	return t->nr_pages * (long) SPOT_STORE_PAGE_SIZE;
+}
+
+/* sets the quota, does not evict: see spot_tenant_set_quota() */
+static inline void spot_tenant_quota(struct spot_tenant *t, long bytes)
+{
+	t->quota_pages = bytes > 0 ? bytes / SPOT_STORE_PAGE_SIZE : 0;
+}
+
+/* returns 0, or -1 if out of memory */
+static inline int spot_tenant_init(struct spot_tenant *t, long quota_bytes, int node)
+{
+	uint32_t size = SPOT_STORE_MIN_CHUNK;
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	/* classes growing by a quarter, the last one a whole page */
+	for (i = 0; i < SPOT_STORE_MAX_CLASSES - 1 && size < SPOT_STORE_PAGE_SIZE / 2; i++) {
+		t->classes[i].size = size;
+		size = (size + size / 4 + 7) & ~7u;
+	}
+	t->classes[i].size = SPOT_STORE_PAGE_SIZE;
+	t->nr_classes = i + 1;
+	for (i = 0; i < t->nr_classes; i++)
+		t->classes[i].per_page = SPOT_STORE_PAGE_SIZE / t->classes[i].size;
+	t->nr_buckets = SPOT_STORE_MIN_BUCKETS;
+	t->buckets = (struct spot_item **) calloc(t->nr_buckets, sizeof(struct spot_item *));
+	if (t->buckets == NULL)
+		return -1;
+	t->node = node;
+	spot_tenant_quota(t, quota_bytes);
+	return 0;
+}
+
+static inline int spot_class_of(const struct spot_tenant *t, size_t size)
+{
+	int lo = 0, hi = t->nr_classes - 1, mid;
+
+	if (size > SPOT_STORE_PAGE_SIZE)
+		return -1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->classes[mid].size >= size)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static inline struct spot_item *spot_page_chunk(struct spot_tenant *t, struct spot_page *page, int i)
+{
+	return (struct spot_item *)(page->mem + (size_t) i * t->classes[page->cls].size);
+}
+
+static inline void spot_partial_add(struct spot_class *c, struct spot_page *page)
+{
+	if (page->in_partial)
+		return;
+	page->prev_partial = NULL;
+	page->next_partial = c->partial;
+	if (c->partial)
+		c->partial->prev_partial = page;
+	c->partial = page;
+	page->in_partial = 1;
+}
+
+static inline void spot_partial_remove(struct spot_class *c, struct spot_page *page)
+{
+	if (!page->in_partial)
+		return;
+	if (page->prev_partial)
+		page->prev_partial->next_partial = page->next_partial;
+	else
+		c->partial = page->next_partial;
+	if (page->next_partial)
+		page->next_partial->prev_partial = page->prev_partial;
+	page->in_partial = 0;
+}
+
+/* maps a page for class @cls, returns it or NULL */
+static inline struct spot_page *spot_page_alloc(struct spot_tenant *t, int cls)
+{
+	struct spot_class *c = &t->classes[cls];
+	struct spot_page *page, **pages;
+	unsigned long mask;
+
+	if (c->nr_pages == c->cap_pages) {
+		pages = (struct spot_page **) realloc(c->pages, (c->cap_pages * 2 + 4) * sizeof(*pages));
+		if (pages == NULL)
+			return NULL;
+		c->pages = pages;
+		c->cap_pages = c->cap_pages * 2 + 4;
+	}
+	page = (struct spot_page *) calloc(1, sizeof(*page));
+	if (page == NULL)
+		return NULL;
+	page->mem = (char *) mmap(NULL, SPOT_STORE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+	                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page->mem == MAP_FAILED) {
+		free(page);
+		return NULL;
+	}
+	if (t->node >= 0 && t->node < (int)(8 * sizeof(mask))) {
+		/* best effort, as numactl --membind was for redis-server */
+		mask = 1ul << t->node;
+		syscall(SYS_mbind, page->mem, SPOT_STORE_PAGE_SIZE, SPOT_STORE_MPOL_BIND, &mask, 8 * sizeof(mask), 0);
+	}
+	page->cls = cls;
+	page->index = c->nr_pages;
+	c->pages[c->nr_pages++] = page;
+	spot_partial_add(c, page);
+	t->nr_pages++;
+	return page;
+}
+
+static inline void spot_unlink_item(struct spot_tenant *t, struct spot_item *it)
+{
+	struct spot_item **p = &t->buckets[it->hash & (t->nr_buckets - 1)];
+
+	while (*p != it)
+		p = &(*p)->hnext;
+	*p = it->hnext;
+	t->nr_items--;
+	t->item_bytes -= SPOT_ITEM_HEADER + it->klen + it->vlen;
+}
+
+static inline void spot_free_chunk(struct spot_tenant *t, struct spot_item *it)
+{
+	struct spot_page *page = it->page;
+
+	it->flags = 0;
+	it->hnext = page->free_chunks;
+	page->free_chunks = it;
+	page->nr_used--;
+	spot_partial_add(&t->classes[page->cls], page);
+}
+
+/* evicts the items of @page and unmaps it */
+static inline void spot_page_release(struct spot_tenant *t, struct spot_page *page)
+{
+	struct spot_class *c = &t->classes[page->cls];
+	struct spot_item *it;
+	int i;
+
+	for (i = 0; i < page->nr_carved; i++) {
+		it = spot_page_chunk(t, page, i);
+		if (it->flags & SPOT_ITEM_USED) {
+			spot_unlink_item(t, it);
+			t->evictions++;
+		}
+	}
+	spot_partial_remove(c, page);
+	c->pages[page->index] = c->pages[--c->nr_pages];
+	c->pages[page->index]->index = page->index;
+	if (c->hand_page >= c->nr_pages) {
+		c->hand_page = 0;
+		c->hand_chunk = 0;
+	}
+	munmap(page->mem, SPOT_STORE_PAGE_SIZE);
+	free(page);
+	t->nr_pages--;
+}
+
+/* releases a page of class @cls: an empty one if at hand, else the one under the hand */
+static inline void spot_release_class_page(struct spot_tenant *t, int cls)
+{
+	struct spot_class *c = &t->classes[cls];
+
+	if (c->partial != NULL && c->partial->nr_used == 0)
+		spot_page_release(t, c->partial);
+	else
+		spot_page_release(t, c->pages[c->hand_page]);
+}
+
+/* releases a page of the class holding the most pages, but @keep; returns 0 or -1 */
+static inline int spot_release_largest(struct spot_tenant *t, int keep)
+{
+	int i, victim = -1;
+
+	for (i = 0; i < t->nr_classes; i++) {
+		if (i != keep && t->classes[i].nr_pages > 0 &&
+		    (victim < 0 || t->classes[i].nr_pages > t->classes[victim].nr_pages))
+			victim = i;
+	}
+	if (victim < 0)
+		return -1;
+	spot_release_class_page(t, victim);
+	return 0;
+}
+
+/* releases a page of the class, but @keep, gone longest without evicting, if not since @clock; returns 0 or -1 */
+static inline int spot_release_idle(struct spot_tenant *t, int keep, uint64_t clock)
+{
+	int i, victim = -1;
+
+	for (i = 0; i < t->nr_classes; i++) {
+		if (i != keep && t->classes[i].nr_pages > 0 &&
+		    (victim < 0 || t->classes[i].evict_clock < t->classes[victim].evict_clock))
+			victim = i;
+	}
+	if (victim < 0 || t->classes[victim].evict_clock > clock)
+		return -1;
+	spot_release_class_page(t, victim);
+	return 0;
+}
+
+/* CLOCK over the chunks of class @cls: the first unreferenced item is evicted and its chunk returned */
+static inline struct spot_item *spot_clock_evict(struct spot_tenant *t, int cls)
+{
+	struct spot_class *c = &t->classes[cls];
+	long budget = 2 * ((long) c->nr_pages * c->per_page + c->nr_pages);
+	struct spot_page *page;
+	struct spot_item *it;
+
+	while (budget-- > 0 && c->nr_pages > 0) {
+		if (c->hand_page >= c->nr_pages) {
+			c->hand_page = 0;
+			c->hand_chunk = 0;
+		}
+		page = c->pages[c->hand_page];
+		if (c->hand_chunk >= page->nr_carved) {
+			c->hand_page++;
+			c->hand_chunk = 0;
+			continue;
+		}
+		it = spot_page_chunk(t, page, c->hand_chunk++);
+		if (!(it->flags & SPOT_ITEM_USED))
+			continue;
+		if (it->flags & SPOT_ITEM_REF) {
+			it->flags &= ~SPOT_ITEM_REF;
+			continue;
+		}
+		spot_unlink_item(t, it);
+		c->evict_clock = ++t->evictions;
+		c->evicted++;
+		return it;
+	}
+	return NULL;
+}
+
+/* a free chunk of class @cls in the pages it has, or NULL */
+static inline struct spot_item *spot_chunk_take(struct spot_tenant *t, int cls)
+{
+	struct spot_class *c = &t->classes[cls];
+	struct spot_page *page = c->partial;
+	struct spot_item *it;
+
+	if (page == NULL)
+		return NULL;
+	if (page->free_chunks) {
+		it = page->free_chunks;
+		page->free_chunks = it->hnext;
+	} else {
+		it = spot_page_chunk(t, page, page->nr_carved++);
+	}
+	page->nr_used++;
+	if (page->free_chunks == NULL && page->nr_carved == (int) c->per_page)
+		spot_partial_remove(c, page);
+	it->page = page;
+	return it;
+}
+
+/* a chunk of class @cls, from free space, a new page within the quota or eviction; NULL if none */
+static inline struct spot_item *spot_chunk_alloc(struct spot_tenant *t, int cls)
+{
+	struct spot_class *c = &t->classes[cls];
+	struct spot_item *it;
+
+	if (c->partial == NULL) {
+		/* at quota, a class without pages takes one from the largest, an evicting one from an idle one */
+		if (t->nr_pages >= t->quota_pages && c->nr_pages == 0 && t->quota_pages > 0) {
+			spot_release_largest(t, cls);
+		} else if (t->nr_pages >= t->quota_pages && c->evicted >= (long) c->per_page) {
+			spot_release_idle(t, cls, c->move_clock);
+			c->move_clock = t->evictions;
+			c->evicted = 0;
+		}
+		if (t->nr_pages < t->quota_pages)
+			spot_page_alloc(t, cls);
+	}
+	it = spot_chunk_take(t, cls);
+	return it != NULL ? it : spot_clock_evict(t, cls);
+}
+
+static inline struct spot_item *spot_find(struct spot_tenant *t, const char *key, size_t klen, uint32_t hash)
+{
+	struct spot_item *it = t->buckets[hash & (t->nr_buckets - 1)];
+
+	for (; it != NULL; it = it->hnext) {
+		if (it->hash == hash && it->klen == klen && memcmp(it->data, key, klen) == 0)
+			return it;
+	}
+	return NULL;
+}
+
+/* doubles the hash table once it holds twice as many items as buckets */
+static inline void spot_rehash(struct spot_tenant *t)
+{
+	uint32_t nr_buckets = t->nr_buckets * 2, i;
+	struct spot_item **buckets, *it, *next;
+
+	buckets = (struct spot_item **) calloc(nr_buckets, sizeof(*buckets));
+	if (buckets == NULL)
+		return;  /* longer chains then */
+	for (i = 0; i < t->nr_buckets; i++) {
+		for (it = t->buckets[i]; it != NULL; it = next) {
+			next = it->hnext;
+			it->hnext = buckets[it->hash & (nr_buckets - 1)];
+			buckets[it->hash & (nr_buckets - 1)] = it;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->nr_buckets = nr_buckets;
+}
+
+/* the item of @key, referenced, or NULL */
+static inline struct spot_item *spot_get(struct spot_tenant *t, const char *key, size_t klen)
+{
+	struct spot_item *it = spot_find(t, key, klen, spot_hash(key, klen));
+
+	if (it == NULL) {
+		t->misses++;
+		return NULL;
+	}
+	it->flags |= SPOT_ITEM_REF;
+	t->hits++;
+	return it;
+}
+
+/* the largest value that fits with a key of @klen */
+static inline size_t spot_max_value(size_t klen)
+{
+	return SPOT_STORE_PAGE_SIZE - SPOT_ITEM_HEADER - klen;
+}
+
+/*
+ * Stores @value under @key. Returns 0, or -1 if the item is larger than a
+ * page or nothing can be evicted for it (a quota below a page).
+ */
+static inline int spot_set(struct spot_tenant *t, const char *key, size_t klen,
+                           const char *value, size_t vlen, int type)
+{
+	size_t size = SPOT_ITEM_HEADER + klen + vlen;
+	uint32_t hash = spot_hash(key, klen);
+	struct spot_item *it, *old;
+	int cls;
+
+	if (klen > UINT16_MAX || size > SPOT_STORE_PAGE_SIZE)
+		return -1;
+	cls = spot_class_of(t, size);
+	old = spot_find(t, key, klen, hash);
+	if (old != NULL && old->page->cls == cls) {
+		/* rewritten in place, it keeps its reference bit */
+		t->item_bytes += (long) vlen - old->vlen;
+		memmove(spot_item_value(old), value, vlen);
+		old->vlen = vlen;
+		old->type = type;
+		return 0;
+	}
+	it = spot_chunk_alloc(t, cls);
+	if (it == NULL)
+		return -1;
+	/* the old item may have been evicted for the new one */
+	old = spot_find(t, key, klen, hash);
+	if (old != NULL) {
+		spot_unlink_item(t, old);
+		spot_free_chunk(t, old);
+	}
+	it->hash = hash;
+	it->klen = klen;
+	it->vlen = vlen;
+	it->type = type;
+	it->flags = SPOT_ITEM_USED;
+	memcpy(it->data, key, klen);
+	memcpy(it->data + klen, value, vlen);
+	it->hnext = t->buckets[hash & (t->nr_buckets - 1)];
+	t->buckets[hash & (t->nr_buckets - 1)] = it;
+	t->nr_items++;
+	t->item_bytes += size;
+	if (t->nr_items > 2 * (long) t->nr_buckets)
+		spot_rehash(t);
+	return 0;
+}
+
+/* returns 1 if @key was there, else 0 */
+static inline int spot_del(struct spot_tenant *t, const char *key, size_t klen)
+{
+	struct spot_item *it = spot_find(t, key, klen, spot_hash(key, klen));
+
+	if (it == NULL)
+		return 0;
+	spot_unlink_item(t, it);
+	spot_free_chunk(t, it);
+	return 1;
+}
+
+/* sets the quota and evicts down to it at once, returns the pages unmapped */
+static inline long spot_tenant_set_quota(struct spot_tenant *t, long bytes)
+{
+	long released = 0;
+
+	spot_tenant_quota(t, bytes);
+	while (t->nr_pages > t->quota_pages && spot_release_largest(t, -1) == 0)
+		released++;
+	return released;
+}
+
+static inline int spot_cmp_heat(const void *a, const void *b)
+{
+	const struct spot_page *p = *(struct spot_page *const *) a, *q = *(struct spot_page *const *) b;
+
+	if (p->heat != q->heat)
+		return p->heat - q->heat;
+	return p->nr_used - q->nr_used;
+}
+
+/* moves @it to the free chunk @to, where the hash chain finds it instead */
+static inline void spot_move_item(struct spot_tenant *t, struct spot_item *it, struct spot_item *to)
+{
+	struct spot_item **p = &t->buckets[it->hash & (t->nr_buckets - 1)];
+	struct spot_page *page = to->page;
+
+	while (*p != it)
+		p = &(*p)->hnext;
+	memcpy(to, it, SPOT_ITEM_HEADER + it->klen + it->vlen);
+	to->page = page;
+	*p = to;
+	it->page->nr_used--;
+	it->flags = 0;
+}
+
+/*
+ * Sets the quota and gets down to it by unmapping the pages with the
+ * fewest referenced items. Their referenced items are moved to the free
+ * chunks of the pages kept first, the others evicted. Slower than
+ * spot_tenant_set_quota(), which it replaces when the shrink is announced
+ * ahead of time. Returns the pages unmapped, or -1 if out of memory.
+ */
+static inline long spot_tenant_shrink(struct spot_tenant *t, long bytes)
+{
+	struct spot_page **pages, *page;
+	struct spot_item *it, *to;
+	long n = 0, excess, i;
+	int cls, j;
+
+	spot_tenant_quota(t, bytes);
+	excess = t->nr_pages - t->quota_pages;
+	if (excess <= 0)
+		return 0;
+	pages = (struct spot_page **) malloc(t->nr_pages * sizeof(*pages));
+	if (pages == NULL)
+		return -1;
+	for (cls = 0; cls < t->nr_classes; cls++) {
+		for (j = 0; j < t->classes[cls].nr_pages; j++) {
+			page = t->classes[cls].pages[j];
+			page->heat = 0;
+			for (i = 0; i < page->nr_carved; i++)
+				page->heat += (spot_page_chunk(t, page, i)->flags & SPOT_ITEM_REF) != 0;
+			pages[n++] = page;
+		}
+	}
+	qsort(pages, n, sizeof(*pages), spot_cmp_heat);
+	/* the free chunks of the pages leaving are not moved to */
+	for (i = 0; i < excess; i++)
+		spot_partial_remove(&t->classes[pages[i]->cls], pages[i]);
+	for (i = 0; i < excess; i++) {
+		page = pages[i];
+		for (j = 0; page->heat > 0 && j < page->nr_carved; j++) {
+			it = spot_page_chunk(t, page, j);
+			if ((it->flags & (SPOT_ITEM_USED | SPOT_ITEM_REF)) != (SPOT_ITEM_USED | SPOT_ITEM_REF))
+				continue;
+			to = spot_chunk_take(t, page->cls);
+			if (to == NULL)
+				break;
+			spot_move_item(t, it, to);
+		}
+		spot_page_release(t, page);
+	}
+	free(pages);
+	return excess;
+}
+
+static inline void spot_tenant_flush(struct spot_tenant *t)
+{
+	long quota = t->quota_pages;
+
+	spot_tenant_set_quota(t, 0);
+	t->quota_pages = quota;
+}
+
+static inline void spot_tenant_destroy(struct spot_tenant *t)
+{
+	int i;
+
+	spot_tenant_flush(t);
+	for (i = 0; i < t->nr_classes; i++)
+		free(t->classes[i].pages);
+	free(t->buckets);
+	memset(t, 0, sizeof(*t));
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+    Microbenchmark of a tenant of the embedded spot store (spot_store.h):
+    loads more keys than its quota holds, then runs a zipfian get/set mix
+    as YCSB workload A does, a set after each miss. Reports the load and
+    mix throughput and the hit rate, then how long it takes to halve the
+    quota, as the producer does when harvested memory drops, and the hit
+    rate after it.
+    Compile
+    gcc -O2 spot_store_bench.c -lm -o spot_store_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "spot_store.h"
+
+#define QUOTA_MB 256
+#define NR_KEYS 1000000
+#define VALUE_SIZE 1000 //YCSB's 10 fields of 100 bytes
+#define NR_OPS 5000000
+#define ZIPF_THETA 0.99
+#define SET_PERCENT 50
+
+int quota_mb = QUOTA_MB, nr_keys = NR_KEYS, value_size = VALUE_SIZE, nr_ops = NR_OPS;
+double zipf_zetan, zipf_eta, zipf_alpha;
+uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+char *value;
+
+uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+/* the zipfian generator of Gray et al., as in YCSB */
+void zipf_init(int n, double theta) {
+	double zeta2 = 1 + pow(0.5, theta);
+	int i;
+
+	zipf_zetan = 0;
+	for(i = 1; i <= n; i++)
+		zipf_zetan += 1 / pow(i, theta);
+	zipf_alpha = 1 / (1 - theta);
+	zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+int zipf_next(int n) {
+	double u = rng() / 4294967296.0, uz = u * zipf_zetan;
+
+	if(uz < 1)
+		return 0;
+	if(uz < 1 + pow(0.5, ZIPF_THETA))
+		return 1;
+	return (int) (n * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha)) % n;
+}
+
+/* keys are scattered so that popular ones are not all alike */
+int make_key(char *key, int i) {
+	return sprintf(key, "user%llu", (unsigned long long) (i * 2654435761ull % 4294967291ull));
+}
+
+/* runs the mix, returns the hit rate */
+double run_mix(struct spot_tenant *t, int ops, const char *phase) {
+	uint64_t t0, hits = 0, gets = 0;
+	char key[32];
+	int i, len;
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i++) {
+		len = make_key(key, zipf_next(nr_keys));
+		if(rng() % 100 < SET_PERCENT) {
+			spot_set(t, key, len, value, value_size, SPOT_TYPE_STRING);
+			continue;
+		}
+		gets++;
+		if(spot_get(t, key, len) != NULL)
+			hits++;
+		else
+			spot_set(t, key, len, value, value_size, SPOT_TYPE_STRING);
+	}
+	printf("%-14s %10.2f Mops/s %8.2f%% hits %9ld items %6ld MB\n", phase, ops * 1e3 / (now_ns() - t0),
+	       100.0 * hits / gets, t->nr_items, spot_tenant_bytes(t) >> 20);
+	return (double) hits / gets;
+}
+
+int main(int argc, char *argv[]) {
+	struct spot_tenant t;
+	uint64_t t0, elapsed;
+	char key[32];
+	long released;
+	int opt, i, len;
+
+	while((opt = getopt(argc, argv, "hq:k:v:n:")) != -1) {
+		switch(opt) {
+		case 'q':
+			quota_mb = atoi(optarg);
+			break;
+		case 'k':
+			nr_keys = atoi(optarg);
+			break;
+		case 'v':
+			value_size = atoi(optarg);
+			break;
+		case 'n':
+			nr_ops = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./spot_store_bench [-q quota-MB] [-k keys] [-v value-size] [-n ops]\n");
+			return 0;
+		}
+	}
+	value = malloc(value_size);
+	if(value == NULL || nr_keys < 2 || spot_tenant_init(&t, (long) quota_mb << 20, -1) < 0) {
+		printf("cannot allocate a tenant of %d MB\n", quota_mb);
+		return 1;
+	}
+	memset(value, 'v', value_size);
+	zipf_init(nr_keys, ZIPF_THETA);
+	printf("quota %d MB, %d keys of %d bytes (%ld MB), zipfian %.2f, %d%% sets\n", quota_mb, nr_keys, value_size,
+	       (long) nr_keys * value_size >> 20, ZIPF_THETA, SET_PERCENT);
+
+	t0 = now_ns();
+	for(i = 0; i < nr_keys; i++) {
+		len = make_key(key, i);
+		spot_set(&t, key, len, value, value_size, SPOT_TYPE_STRING);
+	}
+	printf("%-14s %10.2f Mops/s %18s %9ld items %6ld MB\n", "load", nr_keys * 1e3 / (now_ns() - t0), "",
+	       t.nr_items, spot_tenant_bytes(&t) >> 20);
+	run_mix(&t, nr_ops, "mix");
+
+	t0 = now_ns();
+	released = spot_tenant_set_quota(&t, (long) quota_mb << 19);
+	elapsed = now_ns() - t0;
+	printf("quota halved in %.2f ms, %ld MB unmapped\n", elapsed / 1e6, released * SPOT_STORE_PAGE_SIZE >> 20);
+	run_mix(&t, nr_ops, "mix, halved");
+	spot_tenant_destroy(&t);
+	return 0;
+}
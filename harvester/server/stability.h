@@ -0,0 +1,103 @@
+#ifndef __STABILITY_H_
+#define __STABILITY_H_
+
+/*
+ * Rolling availability history of a producer, kept by the broker: an EWMA
+ * of the available slabs it reports and of their deviation from it, and
+ * the times of its last revocations in a fixed ring. From these, the
+ * expected lifetime of a lease on the producer, the time to its next
+ * revocation, is
+ *
+ *	(observed + STABILITY_PRIOR) / (revocations + 1)
+ *
+ * over the last STABILITY_WINDOW seconds, shortened by how much the
+ * producer's availability oscillates. A new producer is credited with
+ * STABILITY_PRIOR seconds. The placement policy compares lifetimes with
+ * the lease asked for through stability_score().
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define STABILITY_EWMA_ALPHA 0.2  /* weight of a new availability report */
+#define STABILITY_RING 16  /* revocations remembered */
+#define STABILITY_WINDOW 86400  /* seconds a revocation counts for */
+#define STABILITY_PRIOR 3600  /* seconds */
+#define STABILITY_VOLATILITY_WEIGHT 4.0  /* lifetime divided by 1 + weight * deviation / mean */
+
+struct stability {
+	double mean;  /* EWMA of the available slabs */
+	double deviation;  /* EWMA of |available - mean| */
+	uint32_t since;  /* first report, in seconds */
+	uint32_t revocations[STABILITY_RING];  /* times, the last nr_revocations of them */
+	int head;  /* next ring entry */
+	int nr_revocations;
+	int nr_reports;
+};
+
+/* what the scores of a placement are computed against, its score_ctx */
+struct stability_ctx {
+	uint32_t now;  /* seconds */
+	double lease_seconds;
+};
+
+static inline void stability_init(struct stability *s, uint32_t now)
+{
+	memset(s, 0, sizeof(*s));
+	s->since = now;
+}
+
+static inline void stability_report(struct stability *s, int available)
+{
+	double diff;
+
+	if (s->nr_reports++ == 0) {
+		s->mean = available;
+		return;
+	}
+	diff = available - s->mean;
+	s->deviation += STABILITY_EWMA_ALPHA * (fabs(diff) - s->deviation);
+	s->mean += STABILITY_EWMA_ALPHA * diff;
+}
+
+static inline void stability_revocation(struct stability *s, uint32_t now)
+{
+	s->revocations[s->head] = now;
+	s->head = (s->head + 1) % STABILITY_RING;
+	if (s->nr_revocations < STABILITY_RING)
+		s->nr_revocations++;
+}
+
+/* revocations in the last STABILITY_WINDOW seconds */
+static inline int stability_recent_revocations(const struct stability *s, uint32_t now)
+{
+	int i, n = 0;
+
+	for (i = 0; i < s->nr_revocations; i++) {
+		if (now - s->revocations[(s->head - 1 - i + STABILITY_RING) % STABILITY_RING] < STABILITY_WINDOW)
+			n++;
+	}
+	return n;
+}
+
+/* expected seconds until the producer revokes */
+static inline double stability_lifetime(const struct stability *s, uint32_t now)
+{
+	double observed = now - s->since, volatility = 0;
+
+	if (observed > STABILITY_WINDOW)
+		observed = STABILITY_WINDOW;
+	if (s->mean > 0)
+		volatility = s->deviation / s->mean;
+	return (observed + STABILITY_PRIOR) / (stability_recent_revocations(s, now) + 1) /
+	       (1 + STABILITY_VOLATILITY_WEIGHT * volatility);
+}
+
+/* the odds that a lease of @lease_seconds ends before the producer revokes it, in (0, 1] */
+static inline double stability_score(const struct stability *s, uint32_t now, double lease_seconds)
+{
+	return exp(-lease_seconds / stability_lifetime(s, now));
+}
+
+#endif
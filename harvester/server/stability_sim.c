@@ -0,0 +1,225 @@
+/*
+    Simulation of leases on a mix of stable producers and producers whose
+    harvested memory oscillates, minute by minute. A producer whose
+    availability drops below what it has leased out revokes its most
+    recent leases. For each placement policy, reports the leases revoked
+    and the share of the leased slab-time lost to revocations, to compare
+    the stable policy, which weighs each producer's history (stability.h)
+    against the lease asked for, with the others.
+    Compile
+    gcc -O2 stability_sim.c -lm -o stability_sim
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "placement.h"
+#include "stability.h"
+
+#define NR_PRODUCERS 1000
+#define FLAKY_PERCENT 30
+#define MINUTES (3 * 24 * 60)
+#define REQUESTS_PER_MINUTE 20
+#define MIN_CAPACITY 32 //slabs
+#define MAX_CAPACITY 128
+#define MAX_SPOT_SIZE 16
+#define MAX_LEASE_HOURS 4
+#define MIN_FREE 1
+#define MAX_PICKS 64
+
+struct producer {
+	int capacity;
+	int flaky;
+	int available;
+	int down_until; //minute the availability recovers at
+	int leased;
+	int leases; //most recent lease, -1 if none
+	struct stability stability;
+};
+
+struct lease {
+	int producer;
+	int slabs;
+	int start;
+	int expires;
+	int next; //older lease of the producer, or next free lease
+	int prev;
+};
+
+int nr_producers = NR_PRODUCERS, flaky_percent = FLAKY_PERCENT, requests_per_minute = REQUESTS_PER_MINUTE;
+struct producer *producers;
+struct lease *leases;
+int nr_leases, free_lease = -1;
+uint64_t rng_state;
+struct stability_ctx score_ctx;
+
+uint32_t rng() {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+double rng_unit() {
+	return rng() / 4294967296.0;
+}
+
+double score(void *ctx, int id) {
+	struct stability_ctx *sc = ctx;
+
+	return stability_score(&producers[id].stability, sc->now, sc->lease_seconds);
+}
+
+int alloc_lease() {
+	int l = free_lease;
+
+	if(l >= 0) {
+		free_lease = leases[l].next;
+		return l;
+	}
+	leases = realloc(leases, (nr_leases + 1) * sizeof(struct lease));
+	if(leases == NULL) {
+		printf("cannot allocate the leases\n");
+		exit(1);
+	}
+	return nr_leases++;
+}
+
+void unlink_lease(int l) {
+	struct producer *p = &producers[leases[l].producer];
+
+	if(leases[l].prev >= 0)
+		leases[leases[l].prev].next = leases[l].next;
+	else
+		p->leases = leases[l].next;
+	if(leases[l].next >= 0)
+		leases[leases[l].next].prev = leases[l].prev;
+	p->leased -= leases[l].slabs;
+	leases[l].expires = -1;
+	leases[l].next = free_lease;
+	free_lease = l;
+}
+
+/* the availability of producer @i at minute @now */
+void step_producer(int i, int now, long *revoked, double *lost) {
+	struct producer *p = &producers[i];
+	double drop_rate = p->flaky ? 0.02 : 0.0005;
+
+	if(now >= p->down_until) {
+		if(rng_unit() < drop_rate) {
+			p->available = rng() % (p->capacity + 1);
+			p->down_until = now + (p->flaky ? 10 + rng() % 50 : 30 + rng() % 90);
+		} else {
+			//flaky producers also wobble around their capacity
+			p->available = p->flaky ? p->capacity / 2 + (int) (rng() % (p->capacity / 2 + 1)) : p->capacity;
+		}
+	}
+	if(p->leased > p->available) {
+		stability_revocation(&p->stability, now * 60);
+		while(p->leased > p->available && p->leases >= 0) {
+			*lost += (double) leases[p->leases].slabs * (leases[p->leases].expires - now);
+			(*revoked)++;
+			unlink_lease(p->leases);
+		}
+	}
+	stability_report(&p->stability, p->available);
+}
+
+void run(int policy) {
+	struct placement_pick picks[MAX_PICKS];
+	struct placement_index idx;
+	long granted = 0, revoked = 0, slabs = 0, asked = 0;
+	double leased_time = 0, lost = 0;
+	int now, i, j, n, l, spot_size, lease_minutes;
+
+	rng_state = 0x9e3779b97f4a7c15ull;
+	nr_leases = 0;
+	free_lease = -1;
+	if(placement_init(&idx, nr_producers) < 0) {
+		printf("cannot allocate the index\n");
+		exit(1);
+	}
+	idx.score = score;
+	idx.score_ctx = &score_ctx;
+	for(i = 0; i < nr_producers; i++) {
+		producers[i].capacity = MIN_CAPACITY + rng() % (MAX_CAPACITY - MIN_CAPACITY + 1);
+		producers[i].flaky = rng() % 100 < (uint32_t) flaky_percent;
+		producers[i].down_until = 0;
+		producers[i].leased = 0;
+		producers[i].leases = -1;
+		stability_init(&producers[i].stability, 0);
+	}
+
+	for(now = 0; now < MINUTES; now++) {
+		//expired leases give their slabs back
+		for(l = 0; l < nr_leases; l++) {
+			if(leases[l].expires >= 0 && leases[l].expires <= now)
+				unlink_lease(l);
+		}
+		for(i = 0; i < nr_producers; i++) {
+			step_producer(i, now, &revoked, &lost);
+			placement_update(&idx, i, producers[i].available - producers[i].leased);
+		}
+		for(j = 0; j < requests_per_minute; j++) {
+			spot_size = 1 + rng() % MAX_SPOT_SIZE;
+			lease_minutes = 60 * (1 + rng() % MAX_LEASE_HOURS);
+			score_ctx.now = now * 60;
+			score_ctx.lease_seconds = lease_minutes * 60;
+			n = placement_place(&idx, policy, PLACEMENT_DEFAULT_SPREAD, spot_size, MIN_FREE, picks, MAX_PICKS);
+			asked += spot_size;
+			for(i = 0; i < n; i++) {
+				l = alloc_lease();
+				leases[l].producer = picks[i].id;
+				leases[l].slabs = picks[i].slabs;
+				leases[l].start = now;
+				leases[l].expires = now + lease_minutes;
+				leases[l].prev = -1;
+				leases[l].next = producers[picks[i].id].leases;
+				if(leases[l].next >= 0)
+					leases[leases[l].next].prev = l;
+				producers[picks[i].id].leases = l;
+				producers[picks[i].id].leased += picks[i].slabs;
+				leased_time += (double) picks[i].slabs * lease_minutes;
+				slabs += picks[i].slabs;
+				granted++;
+			}
+		}
+	}
+	printf("%-10s %9ld %9ld %8.2f%% %12.2f%% %8.1f%%\n", placement_policy_names[policy], granted, revoked,
+	       100.0 * revoked / granted, 100.0 * lost / leased_time, 100.0 * slabs / asked);
+	placement_destroy(&idx);
+}
+
+int main(int argc, char *argv[]) {
+	int opt, policy;
+
+	while((opt = getopt(argc, argv, "hp:f:r:")) != -1) {
+		switch(opt) {
+		case 'p':
+			nr_producers = atoi(optarg);
+			break;
+		case 'f':
+			flaky_percent = atoi(optarg);
+			break;
+		case 'r':
+			requests_per_minute = atoi(optarg);
+			break;
+		default:
+			printf("Usage ./stability_sim [-p producers] [-f flaky-percent] [-r requests-per-minute]\n");
+			return 0;
+		}
+	}
+	producers = calloc(nr_producers, sizeof(struct producer));
+	if(producers == NULL) {
+		printf("cannot allocate %d producers\n", nr_producers);
+		return 1;
+	}
+	printf("%d producers, %d%% of them oscillating, %d requests/minute of up to %d slabs for 1-%d hours, over %d days\n",
+	       nr_producers, flaky_percent, requests_per_minute, MAX_SPOT_SIZE, MAX_LEASE_HOURS, MINUTES / (24 * 60));
+	printf("%-10s %9s %9s %9s %13s %9s\n", "policy", "leases", "revoked", "revoked", "slab-time lost", "placed");
+	for(policy = 0; policy < NR_PLACEMENT_POLICIES; policy++)
+		run(policy);
+	return 0;
+}
@@ -0,0 +1,149 @@
+#ifndef __TIMER_WHEEL_H_
+#define __TIMER_WHEEL_H_
+
+/*
+ * Hierarchical timing wheel: TIMER_WHEEL_LEVELS wheels of
+ * TIMER_WHEEL_SLOTS slots, a slot of level l spanning 64^l ticks. A timer
+ * is linked into the level its distance falls in and moves one level down
+ * each time the wheel below it wraps, so adding, cancelling and expiring a
+ * timer are O(1) and a tick touches one slot per level at most.
+ *
+ * Timers are embedded in the caller's records, which must not move while
+ * the timer is pending.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_RANGE (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer_entry {
+	struct timer_entry *next;
+	struct timer_entry *prev;  /* NULL while not pending */
+	uint64_t expires;  /* tick */
+};
+
+struct timer_wheel {
+	uint64_t now;  /* last tick run */
+	int nr_pending;
+	struct timer_entry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  /* list heads */
+};
+
+static inline void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	int l, s;
+
+	w->now = now;
+	w->nr_pending = 0;
+	for (l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		for (s = 0; s < TIMER_WHEEL_SLOTS; s++)
+			w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+	}
+}
+
+static inline int timer_pending(const struct timer_entry *t)
+{
+	return t->prev != NULL;
+}
+
+static inline void timer_wheel_link(struct timer_wheel *w, struct timer_entry *t)
+{
+	uint64_t expires = t->expires, delta;
+	struct timer_entry *head;
+	int level = 0;
+
+	if (expires <= w->now)
+		expires = w->now + 1;  /* due already, fires on the next tick */
+	delta = expires - w->now;
+	if (delta >= TIMER_WHEEL_RANGE) {
+		/* parked in the last slot to cascade, linked again from there */
+		expires = w->now + TIMER_WHEEL_RANGE - 1;
+		delta = TIMER_WHEEL_RANGE - 1;
+	}
+	while (delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	head = &w->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+	t->next = head->next;
+	t->prev = head;
+	head->next->prev = t;
+	head->next = t;
+}
+
+static inline void timer_wheel_unlink(struct timer_entry *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+/* arms @t to expire at tick @expires, or re-arms it if pending */
+static inline void timer_wheel_add(struct timer_wheel *w, struct timer_entry *t, uint64_t expires)
+{
+	if (timer_pending(t))
+		timer_wheel_unlink(t);
+	else
+		w->nr_pending++;
+	t->expires = expires;
+	timer_wheel_link(w, t);
+}
+
+static inline void timer_wheel_del(struct timer_wheel *w, struct timer_entry *t)
+{
+	if (!timer_pending(t))
+		return;
+	timer_wheel_unlink(t);
+	w->nr_pending--;
+}
+
+/* moves the timers of slot @s of @level to the levels their distance now falls in */
+static inline void timer_wheel_cascade(struct timer_wheel *w, int level, int s)
+{
+	struct timer_entry *head = &w->slots[level][s], *t = head->next, *next;
+
+	head->next = head->prev = head;
+	for (; t != head; t = next) {
+		next = t->next;
+		timer_wheel_link(w, t);
+	}
+}
+
+/*
+ * Runs the wheel up to tick @now and returns the timers that expired,
+ * no longer pending, in a list through their next pointer.
+ */
+static inline struct timer_entry *timer_wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+	struct timer_entry *expired = NULL, *head, *t, *next;
+	int level;
+
+	while (w->now < now) {
+		if (w->nr_pending == 0) {
+			w->now = now;
+			break;
+		}
+		w->now++;
+		for (level = 1; level < TIMER_WHEEL_LEVELS &&
+		     (w->now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) == 0; level++)
+			timer_wheel_cascade(w, level, (w->now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+		head = &w->slots[0][w->now & (TIMER_WHEEL_SLOTS - 1)];
+		t = head->next;
+		head->next = head->prev = head;
+		for (; t != head; t = next) {
+			next = t->next;
+			if (t->expires > w->now) {
+				timer_wheel_link(w, t);  /* parked beyond the range */
+				continue;
+			}
+			t->prev = NULL;
+			t->next = expired;
+			expired = t;
+			w->nr_pending--;
+		}
+	}
+	return expired;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+    Checks the broker's timing wheel (timer_wheel.h) against a naive model
+    keeping the due tick of every timer. Random adds (near, far, beyond the
+    wheel's range and already due), cancels and advances (by a few ticks or
+    by many) are applied to both; every timer the wheel expires must be due
+    and armed in the model, the wheel must hold as many pending timers as
+    the model, and no armed timer may be left behind once its tick has
+    passed (checked every SCAN_INTERVAL advances and at the end).
+    Compile
+    gcc -O2 timer_wheel_check.c -o timer_wheel_check
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "timer_wheel.h"
+
+#define NR_OPS 3000000
+#define NR_TIMERS 20000
+#define START_TICK 12345
+#define SCAN_INTERVAL 64 //advances between scans of every timer for missed ones
+
+uint64_t rng_state = 88172645463325252ull;
+
+uint64_t rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+//ticks ahead of now, spread over the levels of the wheel and beyond its range
+uint64_t random_distance() {
+	switch(rng() % 4) {
+	case 0:
+		return rng() % 70;
+	case 1:
+		return rng() % 5000;
+	case 2:
+		return rng() % 400000;
+	default:
+		return rng() % (TIMER_WHEEL_RANGE * 3);
+	}
+}
+
+//returns -1 if an armed timer is due by @now
+int check_missed(const char *armed, const uint64_t *due, int nr_timers, uint64_t now) {
+	int k;
+
+	for(k = 0; k < nr_timers; k++) {
+		if(armed[k] && due[k] <= now) {
+			printf("FAIL: timer %d due %lu still pending at %lu\n",
+			       k, (unsigned long) due[k], (unsigned long) now);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void usage() {
+	printf("Usage ./timer_wheel_check [-n ops] [-t timers] [-s seed]\n");
+	printf("Default is %d ops on %d timers\n", NR_OPS, NR_TIMERS);
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	static struct timer_wheel wheel;
+	struct timer_entry *timers, *t;
+	uint64_t *due, now = START_TICK, to, expires;
+	char *armed;
+	long op, nr_ops = NR_OPS, nr_fired = 0, nr_advance = 0;
+	int i, k, opt, nr_timers = NR_TIMERS, nr_armed = 0;
+
+	while((opt = getopt(argc, argv, "hn:t:s:")) != -1) {
+		switch(opt) {
+		case 'n':
+			nr_ops = atol(optarg);
+			break;
+		case 't':
+			nr_timers = atoi(optarg);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
+
+	timers = calloc(nr_timers, sizeof(struct timer_entry));
+	due = calloc(nr_timers, sizeof(uint64_t));
+	armed = calloc(nr_timers, 1);
+	if(timers == NULL || due == NULL || armed == NULL) {
+		printf("cannot allocate %d timers\n", nr_timers);
+		return 1;
+	}
+	timer_wheel_init(&wheel, now);
+
+	for(op = 0; op < nr_ops; op++) {
+		i = rng() % nr_timers;
+		k = rng() % 10;
+		if(k < 4) {
+			//re-adding a pending timer moves it, one in three is already due
+			expires = now + random_distance() - (rng() % 3 == 0 ? 5 : 0);
+			timer_wheel_add(&wheel, &timers[i], expires);
+			nr_armed += !armed[i];
+			armed[i] = 1;
+			due[i] = expires <= now ? now + 1 : expires;
+		}
+		else if(k < 5) {
+			timer_wheel_del(&wheel, &timers[i]);
+			nr_armed -= armed[i];
+			armed[i] = 0;
+		}
+		else {
+			to = now + (rng() % 8 == 0 ? rng() % 100000 : rng() % 3);
+			for(t = timer_wheel_advance(&wheel, to); t != NULL; t = t->next) {
+				k = t - timers;
+				if(!armed[k] || due[k] > to || due[k] <= now) {
+					printf("FAIL: timer %d expired at %lu, due %lu, armed %d, previous tick %lu\n",
+					       k, (unsigned long) to, (unsigned long) due[k], armed[k], (unsigned long) now);
+					return 1;
+				}
+				armed[k] = 0;
+				nr_armed--;
+				nr_fired++;
+			}
+			now = to;
+			if(wheel.nr_pending != nr_armed) {
+				printf("FAIL: %d timers pending at %lu, %d armed\n", wheel.nr_pending, (unsigned long) now, nr_armed);
+				return 1;
+			}
+			if(++nr_advance % SCAN_INTERVAL == 0 && check_missed(armed, due, nr_timers, now) < 0)
+				return 1;
+		}
+	}
+	if(check_missed(armed, due, nr_timers, now) < 0)
+		return 1;
+
+	printf("OK: %ld ops, %ld timers expired, %d pending\n", nr_ops, nr_fired, wheel.nr_pending);
+	free(timers);
+	free(due);
+	free(armed);
+	return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __TSWAP_COMPAT_H_
+#define __TSWAP_COMPAT_H_
+
+/*
+ * Kernel primitives used by tswap's core. In the module they are the real
+ * thing; the userspace build gets stand-ins with the same names.
+ */
+
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/sort.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/swap.h>
+#include <linux/memcontrol.h>
+#include <linux/cgroup.h>
+#include <linux/version.h>
+
+/* inode number of the cgroup @page is charged to, 0 if none */
+static inline unsigned long tswap_page_cgroup_ino(struct page *page)
+{
+#ifdef CONFIG_MEMCG
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	struct mem_cgroup *memcg = page_memcg(page);
+#else
+	struct mem_cgroup *memcg = page->mem_cgroup;
+#endif
+
+	return memcg ? cgroup_ino(memcg->css.cgroup) : 0;
+#else
+	return 0;
+#endif
+}
+#else
+#include "user/kshim.h"
+#endif
+
+#endif
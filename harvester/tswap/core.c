@@ -0,0 +1,1886 @@
+#include "tswap.h"
+
+/*
+ * Global Variables
+ */
+
+struct tswap_stat tswap_stat;
+
+static struct radix_tree_root __rcu *tswap_tree_roots[MAX_SWAPFILES];
+static struct spinlock tswap_tree_locks[MAX_SWAPFILES];
+
+atomic_t quarantine_time;
+atomic_t quarantine_auto;
+struct tswap_memcg_quarantine tswap_memcg_quarantines[MAX_MEMCG_QUARANTINES];
+static struct spinlock tswap_memcg_quarantine_lock;  /* serializes slot updates */
+static unsigned long quarantine_auto_last;  /* jiffies of the last auto mode update */
+
+static struct tswap_quarantine tswap_quarantines[NR_QUARANTINE_SHARDS];
+
+static struct spinlock tswap_prefetch_buffer_lock;
+static struct tswap_prefetch_info tswap_prefetch_buffer[PREFETCH_BUFFER_SIZE];
+static int tswap_prefetch_buffer_head;
+static int tswap_prefetch_buffer_tail;
+atomic_t prefetch_budget;
+
+atomic_t readahead_max_pages;
+static struct spinlock readahead_lock;
+static int readahead_window;  /* pages, adapted to the readahead hit rate */
+static long readahead_last_page;  /* nr_readahead_page at the last window update */
+static long readahead_last_hit;
+
+atomic_t discharge_batch_pages;
+/* only used by the discharge thread */
+static struct tswap_entry *discharge_batch[DISCHARGE_BATCH_MAX_ENTRIES];
+
+static struct spinlock discharge_busy_lock;
+static long discharge_nr_inflight_bio;
+static unsigned long discharge_busy_start;  /* jiffies accounted up to, while bios are in flight */
+
+static struct kmem_cache *tswap_entry_cache;
+
+static DEFINE_PER_CPU(struct tswap_page_pool, tswap_page_pools);
+atomic_t page_reserve_target;
+static struct spinlock tswap_page_reserve_lock;
+static void *tswap_page_reserve_list;  /* linked through the first word of each free page */
+
+atomic_t compress_enabled;
+static DEFINE_PER_CPU(struct tswap_compress_ctx, tswap_compress_ctxs);
+static struct kmem_cache *tswap_blob_caches[NR_BLOB_CLASSES];  /* blob sizes are multiples of BLOB_CLASS_SIZE */
+static char tswap_blob_cache_names[NR_BLOB_CLASSES][24];
+
+/*
+ * Allocation Functions
+ */
+
+static struct tswap_entry *tswap_entry_alloc(void)
+{
+	return kmem_cache_alloc(tswap_entry_cache, GFP_NOIO);
+}
+
+static void tswap_entry_free(struct tswap_entry *entry)
+{
+	kmem_cache_free(tswap_entry_cache, entry);
+}
+
+static void tswap_entry_free_rcu_callback(struct rcu_head *head)
+{
+	kmem_cache_free(tswap_entry_cache, container_of(head, struct tswap_entry, rcu_head));
+}
+
+/* replaces kfree_rcu(), which cannot free into a kmem_cache on older kernels */
+static void tswap_entry_free_rcu(struct tswap_entry *entry)
+{
+	call_rcu(&entry->rcu_head, tswap_entry_free_rcu_callback);
+}
+
+static void *tswap_page_reserve_get(void)
+{
+	unsigned long flags;
+	void *page;
+
+	spin_lock_irqsave(&tswap_page_reserve_lock, flags);
+	page = tswap_page_reserve_list;
+	if (page) {
+		tswap_page_reserve_list = *(void **) page;
+		atomic_long_dec(&tswap_stat.nr_reserve_page);
+	}
+	spin_unlock_irqrestore(&tswap_page_reserve_lock, flags);
+	return page;
+}
+
+static void tswap_page_reserve_put(void *page)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tswap_page_reserve_lock, flags);
+	*(void **) page = tswap_page_reserve_list;
+	tswap_page_reserve_list = page;
+	atomic_long_inc(&tswap_stat.nr_reserve_page);
+	spin_unlock_irqrestore(&tswap_page_reserve_lock, flags);
+}
+
+/*
+ * Pages come from this CPU's pool first, then from the page allocator,
+ * and from the reserve only when the allocator fails, so that stores keep
+ * succeeding under memory pressure while the reserve lasts.
+ */
+static void *tswap_page_alloc(bool use_reserve)
+{
+	struct tswap_page_pool *pool;
+	unsigned long flags;
+	void *page = NULL;
+
+	pool = &per_cpu(tswap_page_pools, raw_smp_processor_id());
+	spin_lock_irqsave(&pool->lock, flags);
+	if (pool->nr_pages > 0)
+		page = pool->pages[--pool->nr_pages];
+	spin_unlock_irqrestore(&pool->lock, flags);
+	if (page)
+		return page;
+
+	page = (void *) __get_free_page(GFP_NOIO | __GFP_NOWARN);
+	if (page || !use_reserve)
+		return page;
+
+	page = tswap_page_reserve_get();
+	if (page)
+		atomic_long_inc(&tswap_stat.nr_reserve_alloc);
+	return page;
+}
+
+/* may be called from bio completion */
+static void tswap_page_free(void *page)
+{
+	struct tswap_page_pool *pool;
+	unsigned long flags;
+
+	/* refill a reserve that was drawn on before caching anything */
+	if (atomic_long_read(&tswap_stat.nr_reserve_page) < atomic_read(&page_reserve_target)) {
+		tswap_page_reserve_put(page);
+		return;
+	}
+
+	pool = &per_cpu(tswap_page_pools, raw_smp_processor_id());
+	spin_lock_irqsave(&pool->lock, flags);
+	if (pool->nr_pages < PAGE_POOL_CPU_PAGES) {
+		pool->pages[pool->nr_pages++] = page;
+		page = NULL;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+	if (page)
+		free_page((unsigned long) page);
+}
+
+void tswap_page_reserve_resize(void)
+{
+	void *page;
+
+	while (atomic_long_read(&tswap_stat.nr_reserve_page) < atomic_read(&page_reserve_target)) {
+		/* GFP_NOIO keeps reclaim from swapping back into tswap */
+		page = (void *) __get_free_page(GFP_NOIO | __GFP_NOWARN);
+		if (!page)
+			break;
+		tswap_page_reserve_put(page);
+	}
+	while (atomic_long_read(&tswap_stat.nr_reserve_page) > atomic_read(&page_reserve_target)) {
+		page = tswap_page_reserve_get();
+		if (!page)
+			break;
+		free_page((unsigned long) page);
+	}
+}
+
+/*
+ * Compression Functions
+ */
+
+static inline int blob_class(unsigned int length)
+{
+	return (length - 1) / BLOB_CLASS_SIZE;
+}
+
+static inline long blob_size(unsigned int length)
+{
+	return (blob_class(length) + 1) * BLOB_CLASS_SIZE;
+}
+
+/*
+ * returns @src compressed into a blob and its length,
+ * or NULL if compression is off or the page does not compress well
+ */
+static void *tswap_compress(const void *src, unsigned int *length)
+{
+	struct tswap_compress_ctx *ctx;
+	unsigned int dlen = 2 * PAGE_SIZE;
+	unsigned long flags;
+	void *blob = NULL;
+	int ret;
+
+	if (!atomic_read(&compress_enabled))
+		return NULL;
+
+	ctx = &per_cpu(tswap_compress_ctxs, raw_smp_processor_id());
+	spin_lock_irqsave(&ctx->lock, flags);
+	ret = crypto_comp_compress(ctx->tfm, src, PAGE_SIZE, ctx->buffer, &dlen);
+	if (ret == 0 && dlen <= MAX_BLOB_SIZE) {
+		blob = kmem_cache_alloc(tswap_blob_caches[blob_class(dlen)], GFP_NOIO);
+		if (blob)
+			memcpy(blob, ctx->buffer, dlen);
+	}
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	if (!blob) {
+		/* an unavailable blob falls back to a page as well */
+		atomic_long_inc(&tswap_stat.nr_compress_reject);
+		return NULL;
+	}
+	atomic_long_inc(&tswap_stat.nr_compressed_page);
+	atomic_long_add(blob_size(dlen), &tswap_stat.compressed_size);
+	*length = dlen;
+	return blob;
+}
+
+/* frees entry->data, a page or a compressed blob */
+static void tswap_data_free(struct tswap_entry *entry)
+{
+	if (!entry->data)
+		return;
+	if (entry->length == PAGE_SIZE) {
+		tswap_page_free(entry->data);
+	} else {
+		atomic_long_dec(&tswap_stat.nr_compressed_page);
+		atomic_long_sub(blob_size(entry->length), &tswap_stat.compressed_size);
+		kmem_cache_free(tswap_blob_caches[blob_class(entry->length)], entry->data);
+	}
+	entry->data = NULL;
+}
+
+/* stores the page at @src into entry->data, which must not be under I/O */
+static int tswap_data_fill(struct tswap_entry *entry, const void *src)
+{
+	unsigned int length = PAGE_SIZE;
+	void *data;
+
+	data = tswap_compress(src, &length);
+	if (!data) {
+		if (entry->data && entry->length == PAGE_SIZE) {
+			memcpy(entry->data, src, PAGE_SIZE);
+			return 0;
+		}
+		data = tswap_page_alloc(true);
+		if (!data)
+			return -ENOMEM;
+		memcpy(data, src, PAGE_SIZE);
+	}
+	tswap_data_free(entry);
+	entry->data = data;
+	entry->length = length;
+	return 0;
+}
+
+/* copies entry->data, decompressed, into the page at @dst */
+static int tswap_data_copy(struct tswap_entry *entry, void *dst)
+{
+	struct tswap_compress_ctx *ctx;
+	unsigned int dlen = PAGE_SIZE;
+	unsigned long flags;
+	int ret;
+
+	if (entry->length == PAGE_SIZE) {
+		memcpy(dst, entry->data, PAGE_SIZE);
+		return 0;
+	}
+
+	ctx = &per_cpu(tswap_compress_ctxs, raw_smp_processor_id());
+	spin_lock_irqsave(&ctx->lock, flags);
+	ret = crypto_comp_decompress(ctx->tfm, entry->data, entry->length, dst, &dlen);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+	if (ret == 0 && dlen != PAGE_SIZE)
+		ret = -EINVAL;
+	if (ret < 0) {
+		pr_err("tswap: failed to decompress tswap page\n");
+		atomic_long_inc(&tswap_stat.nr_decompress_fail);
+	}
+	return ret;
+}
+
+/* discharge bios write whole pages, so decompress entry->data first */
+static int tswap_data_expand(struct tswap_entry *entry)
+{
+	void *page;
+
+	if (entry->length == PAGE_SIZE)
+		return 0;
+	page = tswap_page_alloc(false);
+	if (!page)
+		return -ENOMEM;
+	if (tswap_data_copy(entry, page) < 0) {
+		tswap_page_free(page);
+		return -EINVAL;
+	}
+	tswap_data_free(entry);
+	entry->data = page;
+	entry->length = PAGE_SIZE;
+	return 0;
+}
+
+static void tswap_compress_destroy(void)
+{
+	struct tswap_compress_ctx *ctx;
+	int i, cpu;
+
+	for_each_possible_cpu(cpu) {
+		ctx = &per_cpu(tswap_compress_ctxs, cpu);
+		if (ctx->tfm)
+			crypto_free_comp(ctx->tfm);
+		kfree(ctx->buffer);
+		ctx->tfm = NULL;
+		ctx->buffer = NULL;
+	}
+	for (i = 0; i < NR_BLOB_CLASSES; ++i) {
+		if (tswap_blob_caches[i])
+			kmem_cache_destroy(tswap_blob_caches[i]);
+		tswap_blob_caches[i] = NULL;
+	}
+}
+
+int tswap_compress_init(const char *name)
+{
+	struct tswap_compress_ctx *ctx;
+	int i, cpu, ret;
+
+	if (tswap_blob_caches[0])
+		return -EBUSY;
+
+	for (i = 0; i < NR_BLOB_CLASSES; ++i) {
+		snprintf(tswap_blob_cache_names[i], sizeof(tswap_blob_cache_names[i]),
+		         "tswap_blob_%d", (i + 1) * BLOB_CLASS_SIZE);
+		tswap_blob_caches[i] = kmem_cache_create(tswap_blob_cache_names[i],
+		                                         (i + 1) * BLOB_CLASS_SIZE, 0, 0, NULL);
+		if (!tswap_blob_caches[i]) {
+			pr_err("tswap: failed to create compressed page cache\n");
+			ret = -ENOMEM;
+			goto destroy;
+		}
+	}
+
+	for_each_possible_cpu(cpu) {
+		ctx = &per_cpu(tswap_compress_ctxs, cpu);
+		spin_lock_init(&ctx->lock);
+		ctx->tfm = crypto_alloc_comp(name, 0, 0);
+		if (IS_ERR(ctx->tfm)) {
+			pr_err("tswap: cannot allocate compressor %s\n", name);
+			ret = PTR_ERR(ctx->tfm);
+			ctx->tfm = NULL;
+			goto destroy;
+		}
+		ctx->buffer = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+		if (!ctx->buffer) {
+			pr_err("tswap: failed to allocate compression buffer\n");
+			ret = -ENOMEM;
+			goto destroy;
+		}
+	}
+
+	atomic_set(&compress_enabled, 1);
+	return 0;
+
+destroy:
+	tswap_compress_destroy();
+	return ret;
+}
+
+/*
+ * Helper Functions
+ */
+
+/*
+ * Adds @delta to the discharge bios in flight. The time since the last
+ * update is accounted whenever some were in flight, so that the busy time
+ * grows under sustained discharge too, when they never all complete.
+ */
+static void discharge_busy_update(long delta)
+{
+	unsigned long flags, now;
+
+	spin_lock_irqsave(&discharge_busy_lock, flags);
+	now = jiffies;  /* under the lock, never behind discharge_busy_start */
+	if (discharge_nr_inflight_bio > 0)
+		atomic_long_add(jiffies_to_msecs(now - discharge_busy_start),
+		                &tswap_stat.discharge_busy_time);
+	discharge_busy_start = now;
+	discharge_nr_inflight_bio += delta;
+	spin_unlock_irqrestore(&discharge_busy_lock, flags);
+}
+
+/*
+ * Since frontswap is a read-write workload,
+ * we need to free entries with call_rcu() instead of synchronize_rcu()
+ * in general for performance concern
+ */
+
+static struct tswap_entry *atomic_entry_lookup_lock(unsigned type,
+                                                    unsigned long offset,
+                                                    unsigned long *flags)
+{
+	struct radix_tree_root *tswap_tree_root;
+	struct tswap_entry *entry;
+
+	rcu_read_lock();
+	tswap_tree_root = rcu_dereference(tswap_tree_roots[type]);
+	if (!tswap_tree_root) {
+		rcu_read_unlock();
+		return NULL;
+	}
+	entry = radix_tree_lookup(tswap_tree_root, offset);
+	if (entry) {
+		spin_lock_irqsave(&entry->lock, *flags);
+		if (entry->state == INVALID) {
+			/* this entry is going to be deleted, DO NOT USE IT */
+			spin_unlock_irqrestore(&entry->lock, *flags);
+			entry = NULL;
+		}
+	}
+	rcu_read_unlock();
+	/*
+	 * locked non-invalid entry is guaranteed to be valid
+	 * after rcu_read_unlock
+	 */
+	return entry;
+}
+
+/* tswap_tree_lock should be acquired *after* acquiring entry's lock */
+
+static int atomic_entry_delete(struct tswap_entry *entry)
+{
+	/* entry lock must be hold */
+	struct radix_tree_root *tswap_tree_root;
+	struct spinlock *tswap_tree_lock;
+	int ret;
+	void *item;
+	unsigned long flags;
+
+	/*
+	 * non-empty radix tree is guaranteed to exist,
+	 * no need for rcu_read_lock
+	 */
+	tswap_tree_root = entry->tswap_tree_root;
+	tswap_tree_lock = &tswap_tree_locks[entry->type];
+
+	/*
+	 * only delete the entry from the radix tree,
+	 * will not free the entry
+	 */
+	spin_lock_irqsave(tswap_tree_lock, flags);
+	item = radix_tree_delete(tswap_tree_root, entry->offset);
+	spin_unlock_irqrestore(tswap_tree_lock, flags);
+	if (item != NULL)
+		entry->tswap_tree_root = NULL;
+
+	ret = (item == NULL) ? -EINVAL : 0;
+	return ret;
+}
+
+static int atomic_entry_insert(struct tswap_entry *entry, bool try_lock)
+{
+	/* entry lock must be hold */
+	struct radix_tree_root *tswap_tree_root;
+	struct spinlock *tswap_tree_lock;
+	int ret;
+	unsigned long flags;
+
+	rcu_read_lock();
+	tswap_tree_root = rcu_dereference(tswap_tree_roots[entry->type]);
+	if (!tswap_tree_root) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+	tswap_tree_lock = &tswap_tree_locks[entry->type];
+
+	/*
+	 * For whatever reason spin_lock_irqsave might not prevent
+	 * all types of hardware interrupt within QEMU-KVM
+	 * when prefetch_async_io_end is called, so in this case
+	 * we only trylock instead of spinning on it
+	 */
+
+	if (try_lock) {
+		if (!spin_trylock_irqsave(tswap_tree_lock, flags)) {
+			rcu_read_unlock();
+			return -EINVAL;
+		}
+	} else {
+		spin_lock_irqsave(tswap_tree_lock, flags);
+	}
+	ret = radix_tree_insert(tswap_tree_root, entry->offset, entry);
+	spin_unlock_irqrestore(tswap_tree_lock, flags);
+	entry->tswap_tree_root = (ret == 0) ? tswap_tree_root : NULL;
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * quarantine locks should be acquired *after* acquiring entry's lock
+ * (in the case we need to acquire the lock in the reversed order, we
+ *  may only try lock entry's lock)
+ */
+
+static inline int quarantine_local(void)
+{
+	return raw_smp_processor_id() % NR_QUARANTINE_SHARDS;
+}
+
+/* the slot of the cgroup @page is charged to, slots are looked up without locking */
+static int memcg_quarantine_lookup(struct page *page)
+{
+	unsigned long ino = tswap_page_cgroup_ino(page);
+	int i;
+
+	if (!ino)
+		return 0;
+	for (i = 1; i < MAX_MEMCG_QUARANTINES; ++i) {
+		if (READ_ONCE(tswap_memcg_quarantines[i].cgroup_ino) == ino)
+			return i;
+	}
+	return 0;
+}
+
+/* s, entries of a freed slot fall back to the default */
+static inline int memcg_quarantine_time(int memcg)
+{
+	struct tswap_memcg_quarantine *mq = &tswap_memcg_quarantines[memcg];
+
+	if (memcg == 0 || !READ_ONCE(mq->cgroup_ino))
+		return atomic_read(&quarantine_time);
+	return atomic_read(&mq->quarantine_time);
+}
+
+static inline unsigned long entry_quarantine_jiffies(struct tswap_entry *entry)
+{
+	return msecs_to_jiffies(memcg_quarantine_time(entry->memcg) * 1000);
+}
+
+/* the tick in which @entry is past its quarantine time */
+static inline unsigned long quarantine_expire_tick(struct tswap_entry *entry)
+{
+	return (entry->time_stamp + entry_quarantine_jiffies(entry)) / QUARANTINE_TICK + 1;
+}
+
+/* q->lock must be hold */
+static void quarantine_wheel_add(struct tswap_quarantine *q, struct tswap_entry *entry)
+{
+	unsigned long expire = quarantine_expire_tick(entry);
+	long delta = expire - q->clock;
+	int level;
+
+	if (delta < 0) {
+		/* already expired, run it with the next tick */
+		expire = q->clock;
+		delta = 0;
+	}
+	for (level = 0; level < QUARANTINE_WHEEL_LEVELS - 1; ++level) {
+		if (delta < 1l << ((level + 1) * QUARANTINE_WHEEL_BITS))
+			break;
+	}
+	if (delta >= 1l << (QUARANTINE_WHEEL_LEVELS * QUARANTINE_WHEEL_BITS)) {
+		/* beyond the wheel, will be re-added when its bucket runs */
+		expire = q->clock + (1l << (QUARANTINE_WHEEL_LEVELS * QUARANTINE_WHEEL_BITS)) - 1;
+	}
+	list_add_tail(&entry->list,
+	              &q->buckets[level][(expire >> (level * QUARANTINE_WHEEL_BITS))
+	                                 & (QUARANTINE_WHEEL_SIZE - 1)]);
+}
+
+/* re-adds the entries of a higher level bucket, which now fall into lower levels */
+static void quarantine_wheel_cascade(struct tswap_quarantine *q, int level)
+{
+	struct tswap_entry *entry, *next;
+	int index = (q->clock >> (level * QUARANTINE_WHEEL_BITS)) & (QUARANTINE_WHEEL_SIZE - 1);
+	LIST_HEAD(bucket);
+
+	list_splice_tail_init(&q->buckets[level][index], &bucket);
+	list_for_each_entry_safe(entry, next, &bucket, list) {
+		list_del(&entry->list);
+		quarantine_wheel_add(q, entry);
+	}
+}
+
+/* moves the buckets of every tick up to @now to q->expired, q->lock must be hold */
+static void quarantine_wheel_run(struct tswap_quarantine *q, unsigned long now)
+{
+	unsigned long now_tick = now / QUARANTINE_TICK;
+	int index, level;
+
+	while (!time_after(q->clock, now_tick)) {
+		index = q->clock & (QUARANTINE_WHEEL_SIZE - 1);
+		for (level = 1; index == 0 && level < QUARANTINE_WHEEL_LEVELS; ++level) {
+			quarantine_wheel_cascade(q, level);
+			index = (q->clock >> (level * QUARANTINE_WHEEL_BITS)) & (QUARANTINE_WHEEL_SIZE - 1);
+		}
+		list_splice_tail_init(&q->buckets[0][q->clock & (QUARANTINE_WHEEL_SIZE - 1)], &q->expired);
+		++q->clock;
+	}
+}
+
+/* (re)queues entry on quarantine shard @quarantine by its time stamp */
+static void atomic_entry_quarantine(struct tswap_entry *entry, int quarantine)
+{
+	struct tswap_quarantine *q;
+	unsigned long flags;
+
+	/* entry lock must be hold */
+	if (!list_empty(&entry->list) && entry->quarantine != quarantine) {
+		q = &tswap_quarantines[entry->quarantine];
+		spin_lock_irqsave(&q->lock, flags);
+		list_del_init(&entry->list);
+		atomic_long_dec(&tswap_stat.len_quarantine_list);
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	entry->quarantine = quarantine;
+
+	q = &tswap_quarantines[quarantine];
+	spin_lock_irqsave(&q->lock, flags);
+	if (list_empty(&entry->list))
+		atomic_long_inc(&tswap_stat.len_quarantine_list);
+	else
+		list_del(&entry->list);
+	quarantine_wheel_add(q, entry);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+static void atomic_entry_dequarantine(struct tswap_entry *entry)
+{
+	struct tswap_quarantine *q;
+	unsigned long flags;
+
+	/* entry lock must be hold */
+	if (list_empty(&entry->list))
+		return;
+	q = &tswap_quarantines[entry->quarantine];
+	spin_lock_irqsave(&q->lock, flags);
+	list_del_init(&entry->list);
+	atomic_long_dec(&tswap_stat.len_quarantine_list);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void tswap_quarantine_rearm(void)
+{
+	struct tswap_quarantine *q;
+	struct tswap_entry *entry, *next;
+	unsigned long flags;
+	int i, level, index;
+	LIST_HEAD(entries);
+
+	for (i = 0; i < NR_QUARANTINE_SHARDS; ++i) {
+		q = &tswap_quarantines[i];
+		spin_lock_irqsave(&q->lock, flags);
+		for (level = 0; level < QUARANTINE_WHEEL_LEVELS; ++level) {
+			for (index = 0; index < QUARANTINE_WHEEL_SIZE; ++index)
+				list_splice_tail_init(&q->buckets[level][index], &entries);
+		}
+		list_for_each_entry_safe(entry, next, &entries, list) {
+			list_del(&entry->list);
+			quarantine_wheel_add(q, entry);
+		}
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+}
+
+int tswap_memcg_quarantine_set(unsigned long ino, int time)
+{
+	struct tswap_memcg_quarantine *mq = NULL;
+	unsigned long flags;
+	int i, ret = 0;
+
+	if (ino == 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&tswap_memcg_quarantine_lock, flags);
+	for (i = 1; i < MAX_MEMCG_QUARANTINES; ++i) {
+		if (tswap_memcg_quarantines[i].cgroup_ino == ino) {
+			mq = &tswap_memcg_quarantines[i];
+			break;
+		}
+	}
+	if (mq) {
+		if (time > 0)
+			atomic_set(&mq->quarantine_time, time);
+		else
+			WRITE_ONCE(mq->cgroup_ino, 0);
+	} else if (time > 0) {
+		for (i = 1; i < MAX_MEMCG_QUARANTINES && !mq; ++i) {
+			if (!tswap_memcg_quarantines[i].cgroup_ino)
+				mq = &tswap_memcg_quarantines[i];
+		}
+		if (mq) {
+			atomic_set(&mq->quarantine_time, time);
+			for (i = 0; i < NR_REUSE_BUCKETS; ++i) {
+				atomic_long_set(&mq->hist.nr_reuse[i], 0);
+				mq->hist.last_nr_reuse[i] = 0;
+			}
+			atomic_long_set(&mq->hist.nr_disk_reuse, 0);
+			mq->hist.last_nr_disk_reuse = 0;
+			WRITE_ONCE(mq->cgroup_ino, ino);
+		} else {
+			ret = -ENOSPC;
+		}
+	}
+	spin_unlock_irqrestore(&tswap_memcg_quarantine_lock, flags);
+
+	if (ret == 0)
+		tswap_quarantine_rearm();
+	return ret;
+}
+
+/* @entry is promoted while still in memory, entry lock must be hold */
+static void reuse_hist_record(struct tswap_entry *entry)
+{
+	struct tswap_reuse_hist *hist = &tswap_memcg_quarantines[entry->memcg].hist;
+	unsigned long now = jiffies;
+	unsigned int ms;
+
+	if (entry->prefetched) {
+		/* it had been discharged */
+		atomic_long_inc(&hist->nr_disk_reuse);
+		return;
+	}
+	ms = jiffies_to_msecs(now - entry->time_stamp);
+	atomic_long_inc(&hist->nr_reuse[min(fls(ms), NR_REUSE_BUCKETS - 1)]);
+}
+
+/*
+ * The quarantine time that would have kept @percentile of the reuses
+ * since the last update in memory. Reuses from disk took longer than
+ * @time, so if they are needed to reach the percentile, @time doubles.
+ */
+static int reuse_hist_quarantine_time(struct tswap_reuse_hist *hist, int time, int percentile)
+{
+	long nr_reuse[NR_REUSE_BUCKETS], nr_disk_reuse, total, target, sum = 0;
+	int i;
+
+	nr_disk_reuse = atomic_long_read(&hist->nr_disk_reuse) - hist->last_nr_disk_reuse;
+	total = nr_disk_reuse;
+	for (i = 0; i < NR_REUSE_BUCKETS; ++i) {
+		nr_reuse[i] = atomic_long_read(&hist->nr_reuse[i]) - hist->last_nr_reuse[i];
+		total += nr_reuse[i];
+	}
+	if (total < QUARANTINE_AUTO_MIN_REUSES)
+		return time;  /* keep counting */
+
+	hist->last_nr_disk_reuse += nr_disk_reuse;
+	for (i = 0; i < NR_REUSE_BUCKETS; ++i)
+		hist->last_nr_reuse[i] += nr_reuse[i];
+
+	target = DIV_ROUND_UP(total * percentile, 100);
+	for (i = 0; i < NR_REUSE_BUCKETS - 1; ++i) {
+		sum += nr_reuse[i];
+		if (sum >= target)
+			return clamp((int) DIV_ROUND_UP(1 << i, 1000),
+			             MIN_AUTO_QUARANTINE_TIME, MAX_AUTO_QUARANTINE_TIME);
+	}
+	return min(2 * time, MAX_AUTO_QUARANTINE_TIME);
+}
+
+/* in auto mode, moves every quarantine time to the target percentile once per period */
+static void tswap_quarantine_autotune(void)
+{
+	struct tswap_memcg_quarantine *mq;
+	int percentile = atomic_read(&quarantine_auto);
+	bool changed = false;
+	unsigned long flags;
+	int i, time, new_time;
+
+	if (!percentile || time_before(jiffies, quarantine_auto_last
+	                                        + msecs_to_jiffies(QUARANTINE_AUTO_PERIOD * 1000)))
+		return;
+	quarantine_auto_last = jiffies;
+
+	spin_lock_irqsave(&tswap_memcg_quarantine_lock, flags);
+	for (i = 0; i < MAX_MEMCG_QUARANTINES; ++i) {
+		mq = &tswap_memcg_quarantines[i];
+		if (i > 0 && !mq->cgroup_ino)
+			continue;
+		time = memcg_quarantine_time(i);
+		new_time = reuse_hist_quarantine_time(&mq->hist, time, percentile);
+		if (new_time == time)
+			continue;
+		atomic_set(i == 0 ? &quarantine_time : &mq->quarantine_time, new_time);
+		changed = true;
+	}
+	spin_unlock_irqrestore(&tswap_memcg_quarantine_lock, flags);
+
+	if (changed)
+		tswap_quarantine_rearm();
+}
+
+/* remembers a page written to disk, the most recent ones are prefetched first */
+static void prefetch_buffer_push(unsigned type, unsigned long offset)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tswap_prefetch_buffer_lock, flags);
+	if ((tswap_prefetch_buffer_tail + 1) % PREFETCH_BUFFER_SIZE == tswap_prefetch_buffer_head)
+		tswap_prefetch_buffer_head = (tswap_prefetch_buffer_head + 1) % PREFETCH_BUFFER_SIZE;
+	tswap_prefetch_buffer[tswap_prefetch_buffer_tail].type = type;
+	tswap_prefetch_buffer[tswap_prefetch_buffer_tail].offset = offset;
+	tswap_prefetch_buffer_tail = (tswap_prefetch_buffer_tail + 1) % PREFETCH_BUFFER_SIZE;
+	spin_unlock_irqrestore(&tswap_prefetch_buffer_lock, flags);
+}
+
+/* @bio_err < 0 puts a still wanted entry back into the quarantine list */
+static void discharge_entry_end(struct tswap_entry *entry, int bio_err)
+{
+	unsigned long flags;
+	int err;
+
+	spin_lock_irqsave(&entry->lock, flags);
+	if (entry->state == IN_MEMORY_FOLLOWED_BY_ZOMBIE) {
+		atomic_long_dec(&tswap_stat.nr_in_memory_zombie_page);
+		atomic_long_inc(&tswap_stat.nr_in_memory_page);
+
+		entry->state = IN_MEMORY;
+		spin_unlock_irqrestore(&entry->lock, flags);
+	} else if (entry->state == IN_FLIGHT) {
+		if (bio_err < 0) {
+			atomic_long_dec(&tswap_stat.nr_in_flight_page);
+			atomic_long_inc(&tswap_stat.nr_in_memory_page);
+
+			entry->state = IN_MEMORY;
+			atomic_entry_quarantine(entry, entry->quarantine);
+			spin_unlock_irqrestore(&entry->lock, flags);
+		} else {
+			atomic_long_dec(&tswap_stat.nr_in_flight_page);
+			prefetch_buffer_push(entry->type, entry->offset);
+
+			entry->state = INVALID;
+			tswap_data_free(entry);
+			/*
+			 * don't need to dequarantine entry here, since IN_FLIGHT page
+			 * will never appear in the quarantine list
+			 */
+			err = atomic_entry_delete(entry);
+			if (err < 0) {
+				pr_err("tswap: failed to delete tswap entry\n");
+				atomic_long_inc(&tswap_stat.nr_radix_tree_delete_fail);
+			}
+			spin_unlock_irqrestore(&entry->lock, flags);
+			tswap_entry_free_rcu(entry);
+		}
+	} else if (entry->state == ZOMBIE) {
+		atomic_long_dec(&tswap_stat.nr_zombie_page);
+
+		entry->state = INVALID;
+		tswap_data_free(entry);
+		/*
+		 * don't need to dequarantine entry here, since ZOMBIE page
+		 * will never appear in the quarantine list
+		 */
+		err = atomic_entry_delete(entry);
+		if (err < 0) {
+			pr_err("tswap: failed to delete tswap entry\n");
+			atomic_long_inc(&tswap_stat.nr_radix_tree_delete_fail);
+		}
+		spin_unlock_irqrestore(&entry->lock, flags);
+		tswap_entry_free_rcu(entry);
+	} else {
+		BUG();
+	}
+}
+
+static void discharge_async_io_end(struct bio *bio)
+{
+	struct tswap_discharge_io *io = bio->bi_private;
+	int bio_err;
+	int i;
+
+	atomic_long_inc(&tswap_stat.nr_async_end_io);
+	bio_err = blk_status_to_errno(bio->bi_status);
+	if (bio_err < 0) {
+		atomic_long_inc(&tswap_stat.nr_async_end_io_fail);
+		pr_err("tswap: async io failed, ret: %d\n", bio_err);
+	}
+
+	for (i = 0; i < io->nr_entries; ++i)
+		discharge_entry_end(io->entries[i], bio_err);
+
+	discharge_busy_update(-1);
+
+	kfree(io);
+	bio_put(bio);
+}
+
+/* writes @nr_entries entries with consecutive offsets with a single bio */
+static int discharge_async_io(struct block_device *bdev,
+                              struct tswap_entry **entries, int nr_entries) {
+	struct tswap_discharge_io *io;
+	struct bio *bio;
+	int ret, i;
+
+	atomic_long_inc(&tswap_stat.nr_async_io);
+
+	io = kmalloc(sizeof(struct tswap_discharge_io)
+	             + nr_entries * sizeof(struct tswap_entry *), GFP_NOIO);
+	if (!io) {
+		pr_err("tswap: failed to allocate discharge io in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto out;
+	}
+	io->nr_entries = nr_entries;
+	memcpy(io->entries, entries, nr_entries * sizeof(struct tswap_entry *));
+
+	bio = bio_alloc(GFP_NOIO, nr_entries);
+	if (!bio) {
+		pr_err("tswap: failed to allocate bio in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto free_io;
+	}
+
+	bio_set_dev(bio, bdev);
+	bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
+
+	bio->bi_iter.bi_sector = entries[0]->offset;
+	bio->bi_iter.bi_sector <<= PAGE_SHIFT - SECTOR_SHIFT;
+	for (i = 0; i < nr_entries; ++i)
+		bio_add_page(bio, virt_to_page(entries[i]->data), PAGE_SIZE, 0);
+
+	bio->bi_private = io;
+	bio->bi_end_io = discharge_async_io_end;
+
+	atomic_long_inc(&tswap_stat.nr_discharge_bio);
+	atomic_long_add(nr_entries, &tswap_stat.nr_discharge_page);
+	discharge_busy_update(1);
+
+	submit_bio(bio);
+	return 0;
+
+free_io:
+	kfree(io);
+out:
+	return ret;
+}
+
+static int sync_io(struct block_device *bdev, unsigned long offset,
+                   struct page *page, int write) {
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		pr_err("tswap: failed to allocate bio in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto out;
+	}
+
+	bio_set_dev(bio, bdev);
+	bio_set_op_attrs(bio, write ? REQ_OP_WRITE : REQ_OP_READ, 0);
+
+	bio->bi_iter.bi_sector = offset;
+	bio->bi_iter.bi_sector <<= PAGE_SHIFT - SECTOR_SHIFT;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+
+out:
+	return ret;
+}
+
+static void prefetch_entry_end(struct tswap_entry *entry, int bio_err)
+{
+	unsigned long flags;
+	int err;
+
+	spin_lock_irqsave(&entry->lock, flags);
+	if (bio_err < 0)
+		goto invalidate_entry;
+
+	entry->time_stamp = jiffies + msecs_to_jiffies(PREFETCH_GRACE_TIME * 1000);
+	err = atomic_entry_insert(entry, true);
+	if (err < 0) {
+		atomic_long_inc(&tswap_stat.nr_radix_tree_insert_fail);
+		goto invalidate_entry;
+	}
+	atomic_entry_quarantine(entry, quarantine_local());
+	spin_unlock_irqrestore(&entry->lock, flags);
+	return;
+
+invalidate_entry:
+	atomic_long_dec(&tswap_stat.nr_in_memory_page);
+	entry->state = INVALID;
+	tswap_data_free(entry);
+	spin_unlock_irqrestore(&entry->lock, flags);
+	tswap_entry_free(entry);
+}
+
+static void prefetch_async_io_end(struct bio *bio)
+{
+	struct tswap_discharge_io *io = bio->bi_private;
+	int bio_err;
+	int i;
+
+	atomic_long_inc(&tswap_stat.nr_async_end_io);
+	bio_err = blk_status_to_errno(bio->bi_status);
+	if (bio_err < 0) {
+		atomic_long_inc(&tswap_stat.nr_async_end_io_fail);
+		pr_err("tswap: prefetch async io failed, ret: %d\n", bio_err);
+	}
+
+	for (i = 0; i < io->nr_entries; ++i)
+		prefetch_entry_end(io->entries[i], bio_err);
+	atomic_long_sub(io->nr_entries, &tswap_stat.nr_prefetch_inflight);
+
+	kfree(io);
+	bio_put(bio);
+}
+
+/* reads @nr_entries entries with consecutive offsets with a single bio */
+static int prefetch_async_io(struct block_device *bdev,
+                             struct tswap_entry **entries, int nr_entries) {
+	struct tswap_discharge_io *io;
+	struct bio *bio;
+	int ret, i;
+
+	atomic_long_inc(&tswap_stat.nr_async_io);
+
+	io = kmalloc(sizeof(struct tswap_discharge_io)
+	             + nr_entries * sizeof(struct tswap_entry *), GFP_NOIO);
+	if (!io) {
+		pr_err("tswap: failed to allocate prefetch io in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto out;
+	}
+	io->nr_entries = nr_entries;
+	memcpy(io->entries, entries, nr_entries * sizeof(struct tswap_entry *));
+
+	bio = bio_alloc(GFP_NOIO, nr_entries);
+	if (!bio) {
+		pr_err("tswap: failed to allocate bio in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto free_io;
+	}
+
+	bio_set_dev(bio, bdev);
+	bio_set_op_attrs(bio, REQ_OP_READ, 0);
+
+	bio->bi_iter.bi_sector = entries[0]->offset;
+	bio->bi_iter.bi_sector <<= PAGE_SHIFT - SECTOR_SHIFT;
+	for (i = 0; i < nr_entries; ++i)
+		bio_add_page(bio, virt_to_page(entries[i]->data), PAGE_SIZE, 0);
+
+	bio->bi_private = io;
+	bio->bi_end_io = prefetch_async_io_end;
+
+	atomic_long_inc(&tswap_stat.nr_prefetch_bio);
+	atomic_long_add(nr_entries, &tswap_stat.nr_prefetch_inflight);
+	submit_bio(bio);
+	return 0;
+
+free_io:
+	kfree(io);
+out:
+	return ret;
+}
+
+static int invalidate_entry_struct(struct tswap_entry *entry, bool free_page)
+{
+	int old_state = entry->state;
+
+	if (entry->state == IN_MEMORY) {
+		atomic_long_dec(&tswap_stat.nr_in_memory_page);
+
+		if (free_page)
+			tswap_data_free(entry);
+		entry->state = INVALID;
+	} else if (entry->state == IN_MEMORY_FOLLOWED_BY_ZOMBIE) {
+		atomic_long_dec(&tswap_stat.nr_in_memory_zombie_page);
+		atomic_long_inc(&tswap_stat.nr_zombie_page);
+
+		entry->state = ZOMBIE;
+	} else if (entry->state == IN_FLIGHT) {
+		atomic_long_dec(&tswap_stat.nr_in_flight_page);
+		atomic_long_inc(&tswap_stat.nr_zombie_page);
+
+		entry->state = ZOMBIE;
+	} else if (entry->state == ZOMBIE) {
+		/* do nothing */
+	} else if (entry->state == INVALID){
+		/* do nothing */
+	}
+
+	return old_state;
+}
+
+static void tswap_readahead(unsigned type, unsigned long offset);
+
+/*
+ * Frontswap Interface Functions
+ */
+
+int tswap_frontswap_store(unsigned type, pgoff_t offset, struct page *page)
+{
+	struct tswap_entry *prev_entry, *entry;
+	int old_state, ret, err;
+	unsigned long flags;
+	void *page_addr;
+
+	atomic_long_inc(&tswap_stat.nr_store);
+
+	if (PageTransHuge(page)) {
+		/* should be careful about THP after 4.11 */
+		atomic_long_inc(&tswap_stat.nr_thp);
+		ret = -EINVAL;
+		goto reject;
+	}
+
+	prev_entry = atomic_entry_lookup_lock(type, offset, &flags);
+
+	if (!prev_entry) {
+		entry = tswap_entry_alloc();
+		if (!entry) {
+			pr_err("tswap: cannot allocate memory for tswap entry\n");
+			ret = -ENOMEM;
+			atomic_long_inc(&tswap_stat.nr_malloc_fail);
+			goto reject;
+		}
+		spin_lock_init(&entry->lock);
+		entry->state = INVALID;
+		entry->type = type;
+		entry->offset = offset;
+		entry->data = NULL;
+		INIT_LIST_HEAD(&entry->list);
+
+		spin_lock_irqsave(&entry->lock, flags);
+	} else {
+		entry = prev_entry;
+	}
+
+	old_state = invalidate_entry_struct(entry, false);
+	if (old_state != entry->state) {
+		/* in-disk overwrite is not tracked */
+		atomic_long_inc(&tswap_stat.nr_overwrite_store);
+	}
+
+	page_addr = kmap_atomic(page);
+	if (!page_addr) {
+		pr_err("tswap: failed to map user's memory in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_kmap_fail);
+		goto free_mem;
+	}
+	if (entry->state == INVALID) {
+		/* new or previously in-memory entry, its data is not under I/O */
+		ret = tswap_data_fill(entry, page_addr);
+	} else {
+		/* a discharge bio still holds entry->data, which is a full page */
+		memcpy(entry->data, page_addr, PAGE_SIZE);
+		ret = 0;
+	}
+	kunmap_atomic(page_addr);
+	if (ret < 0) {
+		pr_err("tswap: failed to allocate memory for tswap page\n");
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto free_mem;
+	}
+
+	entry->time_stamp = jiffies;
+	entry->memcg = memcg_quarantine_lookup(page);
+	entry->prefetched = PREFETCH_NONE;
+	if (entry->state == INVALID) {
+		atomic_long_inc(&tswap_stat.nr_in_memory_page);
+
+		entry->state = IN_MEMORY;
+	} else if (entry->state == ZOMBIE) {
+		atomic_long_dec(&tswap_stat.nr_zombie_page);
+		atomic_long_inc(&tswap_stat.nr_in_memory_zombie_page);
+
+		entry->state = IN_MEMORY_FOLLOWED_BY_ZOMBIE;
+	} else {
+		BUG();
+	}
+
+	if (!prev_entry) {
+		ret = atomic_entry_insert(entry, false);
+		if (ret < 0) {
+			pr_err("tswap: failed to insert entry into radix tree, ret: %d\n", ret);
+			ret = -EINVAL;
+
+			atomic_long_inc(&tswap_stat.nr_radix_tree_insert_fail);
+			goto invalidate_entry;
+		}
+	}
+	atomic_entry_quarantine(entry, quarantine_local());
+	spin_unlock_irqrestore(&entry->lock, flags);
+
+	return 0;
+
+invalidate_entry:
+	invalidate_entry_struct(entry, false);
+free_mem:
+	if (entry->state == INVALID)
+		tswap_data_free(entry);
+	atomic_entry_dequarantine(entry);
+	if (entry->state == INVALID) {
+		if (prev_entry) {
+			err = atomic_entry_delete(entry);
+			if (err < 0) {
+				pr_err("tswap: failed to delete tswap entry\n");
+				atomic_long_inc(&tswap_stat.nr_radix_tree_delete_fail);
+			}
+		}
+		spin_unlock_irqrestore(&entry->lock, flags);
+		if (prev_entry) {
+			tswap_entry_free_rcu(entry);
+		} else {
+			tswap_entry_free(entry);
+		}
+	} else {
+		spin_unlock_irqrestore(&entry->lock, flags);
+	}
+reject:
+	return ret;
+}
+
+int tswap_frontswap_load(unsigned type, pgoff_t offset, struct page *page)
+{
+	struct tswap_entry *entry;
+	int ret, err;
+	unsigned long flags;
+	void *page_addr;
+
+	atomic_long_inc(&tswap_stat.nr_load);
+	atomic_long_inc(&tswap_stat.nr_promoted_page);
+
+	entry = atomic_entry_lookup_lock(type, offset, &flags);
+	if (!entry) {
+		/* in-disk page */
+		atomic_long_inc(&tswap_stat.nr_invalid_load);
+		atomic_long_inc(&tswap_stat.nr_disk_promoted_page);
+		atomic_long_inc(&tswap_memcg_quarantines[memcg_quarantine_lookup(page)].hist.nr_disk_reuse);
+
+		ret = sync_io(tswap_swap_bdev(type), offset, page, 0);
+		if (ret < 0) {
+			pr_err("tswap: failed to read in-disk page\n");
+			ret = -EINVAL;
+			goto out;
+		}
+		tswap_swap_slot_free_notify(type, offset);
+		tswap_readahead(type, offset);
+		ret = 0;
+		goto out;
+	}
+
+	page_addr = kmap_atomic(page);
+	if (!page_addr) {
+		pr_err("tswap: failed to map user's memory in tswap\n");
+		ret = -ENOMEM;
+		atomic_long_inc(&tswap_stat.nr_kmap_fail);
+		goto invalidate_entry;
+	}
+	ret = tswap_data_copy(entry, page_addr);
+	kunmap_atomic(page_addr);
+	if (ret == 0) {
+		reuse_hist_record(entry);
+		if (entry->prefetched == PREFETCH_RING)
+			atomic_long_inc(&tswap_stat.nr_prefetch_hit);
+		else if (entry->prefetched == PREFETCH_READAHEAD)
+			atomic_long_inc(&tswap_stat.nr_readahead_hit);
+	}
+
+invalidate_entry:
+	invalidate_entry_struct(entry, true);
+	atomic_entry_dequarantine(entry);
+	if (entry->state == INVALID) {
+		err = atomic_entry_delete(entry);
+		if (err < 0) {
+			pr_err("tswap: failed to delete tswap entry\n");
+			atomic_long_inc(&tswap_stat.nr_radix_tree_delete_fail);
+		}
+		spin_unlock_irqrestore(&entry->lock, flags);
+		tswap_entry_free_rcu(entry);
+	} else {
+		spin_unlock_irqrestore(&entry->lock, flags);
+	}
+out:
+	return ret;
+}
+
+void tswap_frontswap_invalidate_page(unsigned type, pgoff_t offset)
+{
+	struct tswap_entry *entry;
+	unsigned long flags;
+	int err;
+
+	atomic_long_inc(&tswap_stat.nr_invalidate_page);
+
+	entry = atomic_entry_lookup_lock(type, offset, &flags);
+	if (!entry) {
+		/* could be in-disk page */
+		atomic_long_inc(&tswap_stat.nr_invalid_invalidate_page);
+	} else {
+		invalidate_entry_struct(entry, true);
+		atomic_entry_dequarantine(entry);
+		if (entry->state == INVALID) {
+			err = atomic_entry_delete(entry);
+			if (err < 0) {
+				pr_err("tswap: failed to delete tswap entry\n");
+				atomic_long_inc(&tswap_stat.nr_radix_tree_delete_fail);
+			}
+			spin_unlock_irqrestore(&entry->lock, flags);
+			tswap_entry_free_rcu(entry);
+		} else {
+			spin_unlock_irqrestore(&entry->lock, flags);
+		}
+	}
+}
+
+void tswap_frontswap_invalidate_area(unsigned type)
+{
+	struct radix_tree_root *tswap_tree_root;
+	struct tswap_entry *entry;
+	unsigned long flags = 0;
+	int err;
+
+	atomic_long_inc(&tswap_stat.nr_invalidate_area);
+
+	/*
+	 * assume no concurrent invalidator and no invalid invalidation
+	 * for a given swap type
+	 */
+	tswap_tree_root = tswap_tree_roots[type];
+	BUG_ON(tswap_tree_root == NULL);
+	rcu_assign_pointer(tswap_tree_roots[type], NULL);
+
+	/*
+	 * area invalidation is rather infrequent (e.g., when swap off),
+	 * so we can use synchronize_rcu() here
+	 */
+	synchronize_rcu();
+
+	/*
+	 * should wait for all with-zombie pages to be terminated by themselves
+	 * before reclaiming the radix tree
+	 * (i.e., radix tree is guaranteed to exist when zombies exist)
+	 */
+	while (1) {
+		/*
+		 * might spin on zombie pages
+		 */
+		entry = NULL;
+		rcu_read_lock();
+		radix_tree_gang_lookup(tswap_tree_root, (void **)&entry, 0, 1);
+		if (entry) {
+			spin_lock_irqsave(&entry->lock, flags);
+			if (entry->state == INVALID) {
+				/* invalid page will never appear in the next lookup */
+				spin_unlock_irqrestore(&entry->lock, flags);
+				rcu_read_unlock();
+				continue;
+			}
+		}
+		rcu_read_unlock();
+
+		if (!entry)
+			break;
+
+		invalidate_entry_struct(entry, true);
+		atomic_entry_dequarantine(entry);
+		if (entry->state == INVALID) {
+			err = atomic_entry_delete(entry);
+			if (err < 0) {
+				pr_err("tswap: failed to delete tswap entry\n");
+				atomic_long_inc(&tswap_stat.nr_radix_tree_delete_fail);
+			}
+			spin_unlock_irqrestore(&entry->lock, flags);
+			tswap_entry_free_rcu(entry);
+		} else {
+			/*
+			 * should let zombie pages be freed by the discharge_async_io callback
+			 */
+			spin_unlock_irqrestore(&entry->lock, flags);
+		}
+	}
+
+	kfree(tswap_tree_root);
+}
+
+void tswap_frontswap_init(unsigned type)
+{
+	struct radix_tree_root *tswap_tree_root;
+
+	atomic_long_inc(&tswap_stat.nr_init);
+
+	/* does not consider re-init on a given swap type */
+	tswap_tree_root = kmalloc(sizeof(struct radix_tree_root), GFP_KERNEL);
+	if (!tswap_tree_root) {
+		pr_err("tswap: failed to allocate memory for tswap radix tree root\n");
+		return;
+	}
+	INIT_RADIX_TREE(tswap_tree_root, GFP_KERNEL);
+	spin_lock_init(&tswap_tree_locks[type]);
+	rcu_assign_pointer(tswap_tree_roots[type], tswap_tree_root);
+}
+
+/*
+ * Discharge Functions
+ */
+
+static int discharge_entry_cmp(const void *a, const void *b)
+{
+	const struct tswap_entry *entry_a = *(const struct tswap_entry **) a;
+	const struct tswap_entry *entry_b = *(const struct tswap_entry **) b;
+
+	if (entry_a->type != entry_b->type)
+		return entry_a->type < entry_b->type ? -1 : 1;
+	if (entry_a->offset != entry_b->offset)
+		return entry_a->offset < entry_b->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort IN_FLIGHT entries by (type, offset) and write each run of
+ * consecutive offsets with one bio of at most discharge_batch pages.
+ * Cold pages of a large harvest are usually contiguous in swap.
+ */
+static void discharge_submit_batch(struct tswap_entry **entries, int nr_entries)
+{
+	struct blk_plug plug;
+	int max_pages = atomic_read(&discharge_batch_pages);
+	int i, j, k, ret;
+
+	sort(entries, nr_entries, sizeof(struct tswap_entry *), discharge_entry_cmp, NULL);
+
+	/* MUST release spinlock before entering "might sleep" region */
+	blk_start_plug(&plug);
+	for (i = 0; i < nr_entries; i = j) {
+		for (j = i + 1; j < nr_entries && j - i < max_pages; ++j) {
+			if (entries[j]->type != entries[i]->type
+			    || entries[j]->offset != entries[j - 1]->offset + 1)
+				break;
+		}
+
+		ret = discharge_async_io(tswap_swap_bdev(entries[i]->type), entries + i, j - i);
+		if (ret < 0) {
+			pr_err("tswap: failed to discharge tswap page to swap device\n");
+			for (k = i; k < j; ++k)
+				discharge_entry_end(entries[k], ret);
+			atomic_long_inc(&tswap_stat.nr_async_io_fail);
+		}
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Takes the entries of every quarantine shard whose tick has come and
+ * discharges those still expired; the rest go back into the wheel.
+ */
+void tswap_discharge(void)
+{
+	struct tswap_quarantine *q;
+	struct tswap_entry *entry;
+	unsigned long cur_jiffies;
+	unsigned long flags, outer_flags;
+	int nr_batch = 0;
+	int i;
+
+	/* top up what stores under memory pressure took from the reserve */
+	tswap_page_reserve_resize();
+	tswap_quarantine_autotune();
+
+	for (i = 0; i < NR_QUARANTINE_SHARDS; ++i) {
+		q = &tswap_quarantines[i];
+		spin_lock_irqsave(&q->lock, flags);
+		quarantine_wheel_run(q, jiffies);
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		while (1) {
+			spin_lock_irqsave(&q->lock, outer_flags);
+			if (list_empty(&q->expired)) {
+				spin_unlock_irqrestore(&q->lock, outer_flags);
+				break;
+			}
+			entry = list_first_entry(&q->expired, struct tswap_entry, list);
+			if (spin_trylock_irqsave(&entry->lock, flags)) {
+				list_del_init(&entry->list);
+				atomic_long_dec(&tswap_stat.len_quarantine_list);
+			} else {
+				spin_unlock_irqrestore(&q->lock, outer_flags);
+				continue;
+				/* spin on this entry */
+			}
+			spin_unlock_irqrestore(&q->lock, flags);
+			flags = outer_flags;
+
+			if (entry->state == INVALID
+			    || entry->state == ZOMBIE
+			    || entry->state == IN_FLIGHT) {
+				/*
+				 * unlocked entry with those states should never appear
+				 * in the quarantine list
+				 */
+				BUG();
+			}
+			if (entry->state == IN_MEMORY_FOLLOWED_BY_ZOMBIE) {
+				/* comes back with the next tick */
+				atomic_entry_quarantine(entry, entry->quarantine);
+				spin_unlock_irqrestore(&entry->lock, flags);
+
+				atomic_long_inc(&tswap_stat.nr_quarantine_skip_mem_zombie);
+				continue;
+			}
+
+			cur_jiffies = jiffies;
+			if (time_after(cur_jiffies, entry->time_stamp + entry_quarantine_jiffies(entry))) {
+				if (tswap_data_expand(entry) < 0) {
+					/* retry with the next tick */
+					atomic_entry_quarantine(entry, entry->quarantine);
+					spin_unlock_irqrestore(&entry->lock, flags);
+					continue;
+				}
+				entry->state = IN_FLIGHT;
+				atomic_long_dec(&tswap_stat.nr_in_memory_page);
+				atomic_long_inc(&tswap_stat.nr_in_flight_page);
+				spin_unlock_irqrestore(&entry->lock, flags);
+
+				discharge_batch[nr_batch++] = entry;
+				if (nr_batch == DISCHARGE_BATCH_MAX_ENTRIES) {
+					discharge_submit_batch(discharge_batch, nr_batch);
+					nr_batch = 0;
+				}
+			} else {
+				/* its quarantine time grew since it was queued */
+				atomic_entry_quarantine(entry, entry->quarantine);
+				spin_unlock_irqrestore(&entry->lock, flags);
+			}
+		}
+	}
+
+	if (nr_batch > 0)
+		discharge_submit_batch(discharge_batch, nr_batch);
+}
+
+/*
+ * Prefetch Functions
+ */
+
+static int prefetch_info_cmp(const void *a, const void *b)
+{
+	const struct tswap_prefetch_info *info_a = a;
+	const struct tswap_prefetch_info *info_b = b;
+
+	if (info_a->type != info_b->type)
+		return info_a->type < info_b->type ? -1 : 1;
+	if (info_a->offset != info_b->offset)
+		return info_a->offset < info_b->offset ? -1 : 1;
+	return 0;
+}
+
+/* a new IN_MEMORY entry for a page on disk, NULL if it is not, ERR_PTR on failure */
+static struct tswap_entry *prefetch_entry_alloc(int type, unsigned long offset, int source)
+{
+	struct tswap_entry *entry;
+	unsigned long flags;
+
+	if (!tswap_swap_frontswap_test(type, offset))
+		return NULL;
+	entry = atomic_entry_lookup_lock(type, offset, &flags);
+	if (entry) {
+		spin_unlock_irqrestore(&entry->lock, flags);
+		return NULL;
+	}
+
+	entry = tswap_entry_alloc();
+	if (!entry) {
+		pr_err("tswap: cannot allocate memory for prefetch tswap entry\n");
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		return ERR_PTR(-ENOMEM);
+	}
+	/* prefetching is speculative, leave the reserve to stores */
+	entry->data = tswap_page_alloc(false);
+	if (!entry->data) {
+		pr_err("tswap: failed to allocate memory for prefetch tswap page\n");
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		tswap_entry_free(entry);
+		return ERR_PTR(-ENOMEM);
+	}
+	entry->length = PAGE_SIZE;
+	atomic_long_inc(&tswap_stat.nr_in_memory_page);
+	spin_lock_init(&entry->lock);
+	entry->state = IN_MEMORY;
+	entry->type = type;
+	entry->offset = offset;
+	entry->memcg = 0;
+	entry->prefetched = source;
+	INIT_LIST_HEAD(&entry->list);
+	return entry;
+}
+
+/*
+ * Reads back the pages of @infos that are still on disk, sorted and
+ * deduplicated, with a bio per run of consecutive offsets.
+ * Returns -ENOMEM if prefetching should stop.
+ */
+static int prefetch_batch(struct tswap_prefetch_info *infos, int nr_infos,
+                          struct tswap_entry **entries, int source)
+{
+	struct tswap_entry *entry;
+	struct blk_plug plug;
+	int nr_entries = 0;
+	int i, j, k, ret = 0;
+
+	sort(infos, nr_infos, sizeof(struct tswap_prefetch_info), prefetch_info_cmp, NULL);
+	for (i = 0; i < nr_infos; ++i) {
+		if (i > 0 && prefetch_info_cmp(&infos[i], &infos[i - 1]) == 0)
+			continue;
+		entry = prefetch_entry_alloc(infos[i].type, infos[i].offset, source);
+		if (IS_ERR(entry)) {
+			ret = PTR_ERR(entry);
+			break;
+		}
+		if (entry)
+			entries[nr_entries++] = entry;
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr_entries; i = j) {
+		for (j = i + 1; j < nr_entries && j - i < PREFETCH_BIO_MAX_PAGES; ++j) {
+			if (entries[j]->type != entries[i]->type
+			    || entries[j]->offset != entries[j - 1]->offset + 1)
+				break;
+		}
+
+		if (prefetch_async_io(tswap_swap_bdev(entries[i]->type), entries + i, j - i) < 0) {
+			pr_err("tswap: failed to send async io to prefetch page\n");
+			atomic_long_inc(&tswap_stat.nr_async_io_fail);
+			for (k = i; k < j; ++k) {
+				atomic_long_dec(&tswap_stat.nr_in_memory_page);
+				tswap_data_free(entries[k]);
+				tswap_entry_free(entries[k]);
+			}
+		} else {
+			atomic_long_add(j - i, source == PREFETCH_READAHEAD ? &tswap_stat.nr_readahead_page
+			                                                    : &tswap_stat.nr_prefetch_page);
+		}
+	}
+	blk_finish_plug(&plug);
+	return ret;
+}
+
+void tswap_prefetch(long nr_pages)
+{
+	struct tswap_prefetch_info *infos;
+	struct tswap_entry **entries;
+	unsigned long flags;
+	long nr_batch;
+	int nr_infos;
+
+	infos = kmalloc(PREFETCH_BATCH_MAX_ENTRIES * sizeof(struct tswap_prefetch_info), GFP_KERNEL);
+	entries = kmalloc(PREFETCH_BATCH_MAX_ENTRIES * sizeof(struct tswap_entry *), GFP_KERNEL);
+	if (!infos || !entries) {
+		pr_err("tswap: failed to allocate prefetch batch\n");
+		atomic_long_inc(&tswap_stat.nr_malloc_fail);
+		goto out;
+	}
+
+	while (nr_pages > 0) {
+		nr_batch = atomic_read(&prefetch_budget) - atomic_long_read(&tswap_stat.nr_prefetch_inflight);
+		nr_batch = min(nr_batch, nr_pages);
+		nr_batch = min(nr_batch, (long) PREFETCH_BATCH_MAX_ENTRIES);
+		if (nr_batch <= 0)
+			break;
+
+		/* the most recently discharged pages first */
+		spin_lock_irqsave(&tswap_prefetch_buffer_lock, flags);
+		for (nr_infos = 0; nr_infos < nr_batch
+		     && tswap_prefetch_buffer_tail != tswap_prefetch_buffer_head; ++nr_infos) {
+			tswap_prefetch_buffer_tail = (tswap_prefetch_buffer_tail + PREFETCH_BUFFER_SIZE - 1) % PREFETCH_BUFFER_SIZE;
+			infos[nr_infos] = tswap_prefetch_buffer[tswap_prefetch_buffer_tail];
+		}
+		spin_unlock_irqrestore(&tswap_prefetch_buffer_lock, flags);
+		if (nr_infos == 0)
+			break;
+		nr_pages -= nr_infos;
+
+		if (prefetch_batch(infos, nr_infos, entries, PREFETCH_RING) < 0)
+			break;
+	}
+
+out:
+	kfree(infos);
+	kfree(entries);
+}
+
+/*
+ * Reads the pages still on disk around a disk promotion at @offset into
+ * tswap, within an aligned window like swap clusters. The window doubles
+ * while at least half of what is read ahead gets loaded, and halves when
+ * less than a quarter does.
+ */
+static void tswap_readahead(unsigned type, unsigned long offset)
+{
+	struct tswap_prefetch_info infos[PREFETCH_BIO_MAX_PAGES];
+	struct tswap_entry *entries[PREFETCH_BIO_MAX_PAGES];
+	int max_pages = min(atomic_read(&readahead_max_pages), PREFETCH_BIO_MAX_PAGES);
+	unsigned long start, flags;
+	long nr_page, nr_hit;
+	int window, nr_infos = 0;
+	int i;
+
+	if (max_pages < READAHEAD_MIN_PAGES)
+		return;
+
+	spin_lock_irqsave(&readahead_lock, flags);
+	nr_page = atomic_long_read(&tswap_stat.nr_readahead_page) - readahead_last_page;
+	nr_hit = atomic_long_read(&tswap_stat.nr_readahead_hit) - readahead_last_hit;
+	if (nr_page >= READAHEAD_ADAPT_PAGES) {
+		if (nr_hit * 2 >= nr_page)
+			readahead_window *= 2;
+		else if (nr_hit * 4 < nr_page)
+			readahead_window /= 2;
+	}
+	if (nr_page >= READAHEAD_ADAPT_PAGES || nr_page < 0 || nr_hit < 0) {
+		/* negative after the stats were reset */
+		readahead_last_page += nr_page;
+		readahead_last_hit += nr_hit;
+	}
+	readahead_window = clamp(readahead_window, READAHEAD_MIN_PAGES, max_pages);
+	window = readahead_window;
+	spin_unlock_irqrestore(&readahead_lock, flags);
+
+	if (atomic_long_read(&tswap_stat.nr_prefetch_inflight) + window > atomic_read(&prefetch_budget))
+		return;
+
+	start = offset - offset % window;
+	for (i = 0; i < window; ++i) {
+		if (start + i == offset)
+			continue;
+		infos[nr_infos].type = type;
+		infos[nr_infos].offset = start + i;
+		++nr_infos;
+	}
+	prefetch_batch(infos, nr_infos, entries, PREFETCH_READAHEAD);
+}
+
+/*
+ * Initialization
+ */
+
+static void init_stat(void)
+{
+	atomic_long_set(&tswap_stat.nr_zombie_page, 0);
+	atomic_long_set(&tswap_stat.nr_in_memory_page, 0);
+	atomic_long_set(&tswap_stat.nr_in_memory_zombie_page, 0);
+	atomic_long_set(&tswap_stat.nr_in_flight_page, 0);
+
+	atomic_long_set(&tswap_stat.len_quarantine_list, 0);
+
+	atomic_long_set(&tswap_stat.nr_async_io, 0);
+	atomic_long_set(&tswap_stat.nr_async_end_io, 0);
+	atomic_long_set(&tswap_stat.nr_async_io_fail, 0);
+	atomic_long_set(&tswap_stat.nr_async_end_io_fail, 0);
+
+	atomic_long_set(&tswap_stat.nr_thp, 0);
+	atomic_long_set(&tswap_stat.nr_malloc_fail, 0);
+	atomic_long_set(&tswap_stat.nr_kmap_fail, 0);
+	atomic_long_set(&tswap_stat.nr_radix_tree_insert_fail, 0);
+	atomic_long_set(&tswap_stat.nr_radix_tree_delete_fail, 0);
+
+	atomic_long_set(&tswap_stat.nr_store, 0);
+	atomic_long_set(&tswap_stat.nr_load, 0);
+	atomic_long_set(&tswap_stat.nr_invalid_load, 0);
+	atomic_long_set(&tswap_stat.nr_overwrite_store, 0);
+
+	atomic_long_set(&tswap_stat.nr_invalidate_page, 0);
+	atomic_long_set(&tswap_stat.nr_invalid_invalidate_page, 0);
+	atomic_long_set(&tswap_stat.nr_invalidate_area, 0);
+	atomic_long_set(&tswap_stat.nr_init, 0);
+
+	atomic_long_set(&tswap_stat.nr_quarantine_delete_stale, 0);
+	atomic_long_set(&tswap_stat.nr_quarantine_skip_mem_zombie, 0);
+
+	atomic_long_set(&tswap_stat.nr_discharge_bio, 0);
+	atomic_long_set(&tswap_stat.nr_discharge_page, 0);
+	atomic_long_set(&tswap_stat.discharge_busy_time, 0);
+
+	atomic_long_set(&tswap_stat.nr_reserve_page, 0);
+	atomic_long_set(&tswap_stat.nr_reserve_alloc, 0);
+
+	atomic_long_set(&tswap_stat.nr_compressed_page, 0);
+	atomic_long_set(&tswap_stat.compressed_size, 0);
+	atomic_long_set(&tswap_stat.nr_compress_reject, 0);
+	atomic_long_set(&tswap_stat.nr_decompress_fail, 0);
+
+	atomic_long_set(&tswap_stat.nr_prefetch_bio, 0);
+	atomic_long_set(&tswap_stat.nr_prefetch_page, 0);
+	atomic_long_set(&tswap_stat.nr_prefetch_hit, 0);
+	atomic_long_set(&tswap_stat.nr_prefetch_inflight, 0);
+	atomic_long_set(&tswap_stat.nr_readahead_page, 0);
+	atomic_long_set(&tswap_stat.nr_readahead_hit, 0);
+
+	atomic_long_set(&tswap_stat.nr_promoted_page, 0);
+	atomic_long_set(&tswap_stat.nr_disk_promoted_page, 0);
+}
+
+void tswap_stat_export(struct tswap_stat_export *export)
+{
+	atomic_long_t *counters = (atomic_long_t *) &tswap_stat;
+	int i;
+
+	export->magic = TSWAP_STAT_MAGIC;
+	export->version = TSWAP_STAT_VERSION;
+	export->nr_counters = NR_TSWAP_STAT_COUNTERS;
+	export->reserved = 0;
+	export->timestamp_ms = (u64) jiffies * 1000 / HZ;
+	for (i = 0; i < NR_TSWAP_STAT_COUNTERS; ++i)
+		export->counters[i] = atomic_long_read(&counters[i]);
+}
+
+int tswap_core_init(void)
+{
+	struct tswap_quarantine *q;
+	struct tswap_page_pool *pool;
+	int i, cpu, level, index;
+
+	atomic_set(&quarantine_time, DEFAULT_QUARANTINE_TIME);
+	atomic_set(&quarantine_auto, 0);
+	memset(tswap_memcg_quarantines, 0, sizeof(tswap_memcg_quarantines));
+	spin_lock_init(&tswap_memcg_quarantine_lock);
+	quarantine_auto_last = jiffies;
+
+	for (i = 0; i < NR_QUARANTINE_SHARDS; ++i) {
+		q = &tswap_quarantines[i];
+		spin_lock_init(&q->lock);
+		q->clock = jiffies / QUARANTINE_TICK;
+		INIT_LIST_HEAD(&q->expired);
+		for (level = 0; level < QUARANTINE_WHEEL_LEVELS; ++level) {
+			for (index = 0; index < QUARANTINE_WHEEL_SIZE; ++index)
+				INIT_LIST_HEAD(&q->buckets[level][index]);
+		}
+	}
+
+	init_stat();
+
+	for (i = 0; i < MAX_SWAPFILES; ++i)
+		tswap_tree_roots[i] = NULL;
+
+	tswap_prefetch_buffer_head = 0;
+	tswap_prefetch_buffer_tail = 0;
+	spin_lock_init(&tswap_prefetch_buffer_lock);
+	atomic_set(&prefetch_budget, DEFAULT_PREFETCH_BUDGET);
+	atomic_set(&readahead_max_pages, DEFAULT_READAHEAD_PAGES);
+	spin_lock_init(&readahead_lock);
+	readahead_window = DEFAULT_READAHEAD_PAGES;
+	readahead_last_page = 0;
+	readahead_last_hit = 0;
+
+	atomic_set(&discharge_batch_pages, DEFAULT_DISCHARGE_BATCH_PAGES);
+	spin_lock_init(&discharge_busy_lock);
+	discharge_nr_inflight_bio = 0;
+
+	tswap_entry_cache = kmem_cache_create("tswap_entry", sizeof(struct tswap_entry),
+	                                      0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!tswap_entry_cache) {
+		pr_err("tswap: failed to create tswap entry cache\n");
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		pool = &per_cpu(tswap_page_pools, cpu);
+		spin_lock_init(&pool->lock);
+		pool->nr_pages = 0;
+	}
+	spin_lock_init(&tswap_page_reserve_lock);
+	tswap_page_reserve_list = NULL;
+	atomic_set(&page_reserve_target, DEFAULT_PAGE_RESERVE);
+	tswap_page_reserve_resize();
+
+	atomic_set(&compress_enabled, 0);
+	return 0;
+}
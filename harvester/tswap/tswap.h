@@ -0,0 +1,268 @@
+#ifndef __TSWAP_H_
+#define __TSWAP_H_
+
+/*
+ * tswap's core: the entry state machine, the per-swap-type radix trees,
+ * the quarantine list, discharge and prefetch. core.c only relies on the
+ * kernel primitives listed in compat.h, so that it builds both into the
+ * kernel module (main.c) and into the userspace library (user/).
+ */
+
+#include "compat.h"
+
+#define DEFAULT_QUARANTINE_TIME 300
+#define PREFETCH_BUFFER_SIZE (1 << (34 - PAGE_SHIFT))
+#define PREFETCH_GRACE_TIME 600
+#define PREFETCH_BATCH_MAX_ENTRIES 1024  /* candidates sorted together */
+#define PREFETCH_BIO_MAX_PAGES 32
+#define DEFAULT_PREFETCH_BUDGET 8192  /* prefetched pages in flight */
+#define DEFAULT_READAHEAD_PAGES 8  /* max window read around a disk promotion */
+#define READAHEAD_MIN_PAGES 2
+#define READAHEAD_ADAPT_PAGES 256  /* pages read ahead between window updates */
+#define DEFAULT_DISCHARGE_BATCH_PAGES 32
+#define DISCHARGE_BATCH_MAX_ENTRIES 1024  /* expired entries sorted together */
+#define PAGE_POOL_CPU_PAGES 64  /* free pages cached per CPU */
+#define DEFAULT_PAGE_RESERVE 1024  /* pages kept for stores under memory pressure */
+#define BLOB_CLASS_SIZE 128  /* compressed pages are rounded up to this */
+#define MAX_BLOB_SIZE (PAGE_SIZE * 3 / 4)  /* pages compressing worse stay uncompressed */
+#define NR_BLOB_CLASSES (MAX_BLOB_SIZE / BLOB_CLASS_SIZE)
+#ifndef NR_QUARANTINE_SHARDS
+#define NR_QUARANTINE_SHARDS 64  /* stores queue on the shard of their CPU */
+#endif
+#define QUARANTINE_TICK HZ  /* timing wheel resolution (jiffies) */
+#define QUARANTINE_WHEEL_BITS 6
+#define QUARANTINE_WHEEL_SIZE (1 << QUARANTINE_WHEEL_BITS)
+#define QUARANTINE_WHEEL_LEVELS 3  /* 64 ticks, 4096 ticks, 262144 ticks */
+#define DISCHARGE_INTERVAL 1000  /* ms */
+#define NR_REUSE_BUCKETS 24  /* log2 of ms, the last one also counts longer reuses */
+#define MAX_MEMCG_QUARANTINES 8  /* cgroups with their own quarantine time, and the default */
+#ifndef QUARANTINE_AUTO_PERIOD
+#define QUARANTINE_AUTO_PERIOD 60  /* s between quarantine time updates in auto mode */
+#endif
+#define QUARANTINE_AUTO_MIN_REUSES 256  /* fewer reuses in a period keep the quarantine time */
+#define MIN_AUTO_QUARANTINE_TIME 1
+#define MAX_AUTO_QUARANTINE_TIME 3600
+
+/*
+ * Data Structures
+ */
+
+struct tswap_entry {
+	struct spinlock lock;
+	int state;
+	unsigned type;  /* swap type */
+	unsigned long offset;  /* offset within a swap type */
+	struct radix_tree_root *tswap_tree_root;  /* radix tree of the corresponding swap type;
+                                               * valid after being inserted into the radix tree;
+                                               * invalid after being removed from the radix tree
+                                               */
+	union {
+		struct {
+			unsigned long time_stamp;
+			void *data;
+			unsigned int length;  /* of data, PAGE_SIZE unless compressed */
+			struct list_head list;  /* in a quarantine bucket */
+			int quarantine;  /* index of that quarantine shard */
+			int memcg;  /* index of its cgroup's quarantine time */
+			int prefetched;  /* how it was read back from disk, PREFETCH_NONE once stored */
+		};
+		struct rcu_head rcu_head;
+	};
+};
+
+/*
+ * A hierarchical timing wheel of quarantined entries keyed by the tick
+ * they expire in. Level 0 has a bucket per tick, each higher level a
+ * bucket per QUARANTINE_WHEEL_SIZE buckets of the level below, which is
+ * cascaded down when level 0 wraps around.
+ */
+struct tswap_quarantine {
+	struct spinlock lock;
+	unsigned long clock;  /* next tick to run */
+	struct list_head expired;  /* due entries not yet taken by discharge */
+	struct list_head buckets[QUARANTINE_WHEEL_LEVELS][QUARANTINE_WHEEL_SIZE];
+} ____cacheline_aligned_in_smp;
+
+/*
+ * How long the pages of a cgroup stayed swapped out before being promoted:
+ * pages still in memory are counted by log2 of milliseconds, bucket i up
+ * to 2^i ms, and pages promoted from disk only by their number.
+ */
+struct tswap_reuse_hist {
+	atomic_long_t nr_reuse[NR_REUSE_BUCKETS];
+	atomic_long_t nr_disk_reuse;
+	/* counts at the last auto mode update, only used by the discharge thread */
+	long last_nr_reuse[NR_REUSE_BUCKETS];
+	long last_nr_disk_reuse;
+};
+
+/* slot 0 holds the pages of every cgroup without a slot of its own */
+struct tswap_memcg_quarantine {
+	unsigned long cgroup_ino;  /* 0 if free, and for slot 0 */
+	atomic_t quarantine_time;  /* s, slot 0 uses quarantine_time */
+	struct tswap_reuse_hist hist;
+};
+
+/* free pages for entry->data, recycled without going through the page allocator */
+struct tswap_page_pool {
+	struct spinlock lock;
+	int nr_pages;
+	void *pages[PAGE_POOL_CPU_PAGES];
+};
+
+/* each CPU compresses with its own transform into its own buffer */
+struct tswap_compress_ctx {
+	struct spinlock lock;
+	struct crypto_comp *tfm;
+	u8 *buffer;  /* two pages, room for pages that expand */
+};
+
+enum tswap_entry_state {
+	INVALID = 0,
+	ZOMBIE = 1,
+	IN_MEMORY = 2,
+	IN_MEMORY_FOLLOWED_BY_ZOMBIE = 3,
+	IN_FLIGHT = 4,
+};
+
+enum tswap_prefetch_source {
+	PREFETCH_NONE = 0,
+	PREFETCH_RING = 1,  /* tswap_prefetch() */
+	PREFETCH_READAHEAD = 2,  /* around a disk promotion */
+};
+
+/*
+ * Exported in this order (struct tswap_stat_export), new counters go at the
+ * end. Gauges are current levels and go down too, the rest only grow.
+ */
+struct tswap_stat {
+	atomic_long_t nr_zombie_page;  /* gauge */
+	atomic_long_t nr_in_memory_page;  /* gauge */
+	atomic_long_t nr_in_memory_zombie_page;  /* gauge */
+	atomic_long_t nr_in_flight_page;  /* gauge */
+
+	atomic_long_t len_quarantine_list;  /* gauge */
+
+	atomic_long_t nr_async_io;
+	atomic_long_t nr_async_end_io;
+	atomic_long_t nr_async_io_fail;
+	atomic_long_t nr_async_end_io_fail;
+
+	atomic_long_t nr_thp;
+	atomic_long_t nr_malloc_fail;
+	atomic_long_t nr_kmap_fail;
+	atomic_long_t nr_radix_tree_insert_fail;
+	atomic_long_t nr_radix_tree_delete_fail;
+
+	atomic_long_t nr_store;
+	atomic_long_t nr_load;
+	atomic_long_t nr_invalid_load;
+	atomic_long_t nr_overwrite_store;
+	atomic_long_t nr_invalidate_page;
+	atomic_long_t nr_invalid_invalidate_page;
+	atomic_long_t nr_invalidate_area;
+	atomic_long_t nr_init;
+
+	atomic_long_t nr_quarantine_delete_stale;
+	atomic_long_t nr_quarantine_skip_mem_zombie;
+
+	atomic_long_t nr_discharge_bio;
+	atomic_long_t nr_discharge_page;
+	atomic_long_t discharge_busy_time;  /* ms with discharge I/O in flight */
+
+	atomic_long_t nr_reserve_page;  /* gauge, pages currently in the reserve */
+	atomic_long_t nr_reserve_alloc;  /* pages taken from the reserve */
+
+	atomic_long_t nr_compressed_page;  /* gauge, in-memory pages held compressed */
+	atomic_long_t compressed_size;  /* gauge, bytes of blobs they take */
+	atomic_long_t nr_compress_reject;  /* pages that did not compress enough */
+	atomic_long_t nr_decompress_fail;
+
+	atomic_long_t nr_prefetch_bio;
+	atomic_long_t nr_prefetch_page;  /* pages read back from disk */
+	atomic_long_t nr_prefetch_hit;  /* prefetched pages loaded afterwards */
+	atomic_long_t nr_prefetch_inflight;  /* gauge, prefetch and read ahead pages under I/O */
+	atomic_long_t nr_readahead_page;
+	atomic_long_t nr_readahead_hit;  /* read ahead pages loaded afterwards */
+
+	atomic_long_t nr_promoted_page;  /* has exclusive sysfs file */
+	atomic_long_t nr_disk_promoted_page;  /* has exclusive sysfs file */
+};
+
+#define NR_TSWAP_STAT_COUNTERS (sizeof(struct tswap_stat) / sizeof(atomic_long_t))
+#define TSWAP_STAT_MAGIC 0x50575354u  /* "TSWP" */
+#define TSWAP_STAT_VERSION 1
+
+/*
+ * Binary snapshot of tswap_stat (sysfs tswap_stat_bin), mirrored for
+ * readers by common/tswap_stat.h. Neither reads nor resets of the text
+ * stat change it, so every reader keeps its own previous snapshot and
+ * computes deltas.
+ */
+struct tswap_stat_export {
+	u32 magic;
+	u32 version;
+	u32 nr_counters;
+	u32 reserved;
+	u64 timestamp_ms;  /* ms since boot on the jiffies clock */
+	u64 counters[NR_TSWAP_STAT_COUNTERS];
+};
+
+/* bi_private of a discharge or prefetch bio */
+struct tswap_discharge_io {
+	int nr_entries;
+	struct tswap_entry *entries[];
+};
+
+struct tswap_prefetch_info {
+	int type;
+	unsigned long offset;
+};
+
+/*
+ * Core (core.c)
+ */
+
+extern struct tswap_stat tswap_stat;
+extern atomic_t quarantine_time;
+extern atomic_t quarantine_auto;  /* target reuse percentile, 0 keeps quarantine times fixed */
+extern struct tswap_memcg_quarantine tswap_memcg_quarantines[MAX_MEMCG_QUARANTINES];
+extern atomic_t discharge_batch_pages;  /* max pages per discharge bio */
+extern atomic_t page_reserve_target;  /* pages */
+extern atomic_t compress_enabled;  /* only settable after tswap_compress_init() */
+extern atomic_t prefetch_budget;  /* max prefetched pages in flight */
+extern atomic_t readahead_max_pages;  /* 0 turns readahead off */
+
+int tswap_core_init(void);
+void tswap_stat_export(struct tswap_stat_export *export);
+
+int tswap_frontswap_store(unsigned type, pgoff_t offset, struct page *page);
+int tswap_frontswap_load(unsigned type, pgoff_t offset, struct page *page);
+void tswap_frontswap_invalidate_page(unsigned type, pgoff_t offset);
+void tswap_frontswap_invalidate_area(unsigned type);
+void tswap_frontswap_init(unsigned type);
+
+/* discharges the expired entries, called by the discharge thread every DISCHARGE_INTERVAL */
+void tswap_discharge(void);
+/* re-buckets every quarantined entry after quarantine_time changed */
+void tswap_quarantine_rearm(void);
+/* gives the pages of cgroup @ino their own quarantine time, or back the default if @time <= 0 */
+int tswap_memcg_quarantine_set(unsigned long ino, int time);
+/* prefetch up to @nr_pages of the most recently discharged pages still on disk */
+void tswap_prefetch(long nr_pages);
+/* fill up or trim the page reserve to page_reserve_target, may sleep */
+void tswap_page_reserve_resize(void);
+/* sets up compression with crypto compressor @name (e.g. "lz4") and enables it */
+int tswap_compress_init(const char *name);
+
+/*
+ * Swap Devices (main.c in the kernel, user/swap.c in userspace)
+ */
+
+struct block_device *tswap_swap_bdev(unsigned type);
+/* whether frontswap holds the page, i.e. it was stored and not invalidated, false past the end */
+int tswap_swap_frontswap_test(unsigned type, unsigned long offset);
+/* the swap slot of a promoted in-disk page is no longer needed */
+void tswap_swap_slot_free_notify(unsigned type, unsigned long offset);
+
+#endif
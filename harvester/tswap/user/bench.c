@@ -0,0 +1,356 @@
+#include <pthread.h>
+#include <getopt.h>
+#include "tswap_user.h"
+
+/*
+ * Multi-threaded stress and throughput benchmark for tswap's core.
+ *
+ * Every thread owns a disjoint range of swap offsets and drives its pages
+ * through random swap-outs, swap-ins and invalidations while the discharge
+ * thread writes expired pages to the swap file. Every swap-in is checked
+ * against the content that was swapped out, and all pages still swapped
+ * out are checked once more at the end. With -S, threads sweep their
+ * offsets in order instead, which lets discharge coalesce the writes.
+ * With -c, quarantined pages are compressed, and -r makes that share of
+ * every page a constant run that compresses well. With -a, quarantine
+ * times follow a reuse percentile, and -m charges every other thread to
+ * a cgroup whose quarantine time starts twice as long.
+ */
+
+#define BENCH_SWAP_TYPE 0
+#define BENCH_CGROUP_INO 1000  /* the cgroup of odd threads with -m */
+#define BENCH_NR_LATENCY_BUCKETS 40  /* log2 of nanoseconds */
+
+enum bench_op {
+	OP_STORE = 0,
+	OP_LOAD = 1,
+	OP_INVALIDATE = 2,
+	NR_OPS = 3
+};
+
+static const char *bench_op_names[NR_OPS] = { "store", "load", "invalidate" };
+
+struct bench_page {
+	unsigned long version;
+	bool swapped;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	unsigned long first_offset;
+	unsigned long seed;
+	unsigned long cgroup;
+	struct bench_page *pages;
+	long nr_ops[NR_OPS];
+	long nr_corrupt;
+	long latency[NR_OPS][BENCH_NR_LATENCY_BUCKETS];
+};
+
+static int nr_threads = 4;
+static unsigned long nr_pages_per_thread = 16384;
+static int duration = 10;
+static int nr_io_threads = 4;
+static int load_percent = 80;
+static long prefetch_rate;  /* pages per second */
+static bool sequential;
+static const char *compressor;
+static int compressible_percent;
+static int auto_percentile;
+static bool split_cgroups;
+static const char *swap_path = "/tmp/tswap_bench.swap";
+
+static volatile bool stopped;
+
+/*
+ * Helper Functions
+ */
+
+static inline unsigned long bench_random(unsigned long *seed)
+{
+	/* xorshift64 */
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static inline long bench_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000l + now.tv_nsec;
+}
+
+/* the first words of a page differ from each other, the rest repeat */
+static inline unsigned long bench_word(unsigned long offset, unsigned long version, unsigned long i)
+{
+	unsigned long nr_words = PAGE_SIZE / sizeof(unsigned long);
+
+	if (i >= nr_words - nr_words * compressible_percent / 100)
+		return (offset << 24) ^ (version << 8);
+	return (offset << 24) ^ (version << 8) ^ i;
+}
+
+static void bench_fill_page(unsigned long *page, unsigned long offset, unsigned long version)
+{
+	unsigned long i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); ++i)
+		page[i] = bench_word(offset, version, i);
+}
+
+static bool bench_check_page(const unsigned long *page, unsigned long offset, unsigned long version)
+{
+	unsigned long i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); ++i) {
+		if (page[i] != bench_word(offset, version, i))
+			return false;
+	}
+	return true;
+}
+
+static void bench_record(struct bench_thread *thread, int op, long start_ns)
+{
+	long latency = bench_now_ns() - start_ns;
+	int bucket = 0;
+
+	while (latency > 1 && bucket < BENCH_NR_LATENCY_BUCKETS - 1) {
+		latency >>= 1;
+		++bucket;
+	}
+	++thread->latency[op][bucket];
+	++thread->nr_ops[op];
+}
+
+/* upper bound (ns) of the bucket holding the @percentile-th percentile */
+static long bench_percentile(const long *latency, long nr, double percentile)
+{
+	long target = (long) (percentile * nr), sum = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < BENCH_NR_LATENCY_BUCKETS; ++bucket) {
+		sum += latency[bucket];
+		if (sum > target)
+			break;
+	}
+	return 1l << (bucket + 1);
+}
+
+/*
+ * Thread Functions
+ */
+
+static void *bench_threadfn(void *data)
+{
+	struct bench_thread *thread = data;
+	unsigned long *page, i, offset, cursor = 0;
+	struct bench_page *state;
+	long start;
+
+	if (posix_memalign((void **) &page, PAGE_SIZE, PAGE_SIZE))
+		return NULL;
+	tswap_user_set_cgroup(thread->cgroup);
+
+	while (!stopped) {
+		if (sequential)
+			i = cursor++ % nr_pages_per_thread;
+		else
+			i = bench_random(&thread->seed) % nr_pages_per_thread;
+		offset = thread->first_offset + i;
+		state = &thread->pages[i];
+
+		if (!state->swapped) {
+			bench_fill_page(page, offset, ++state->version);
+			start = bench_now_ns();
+			tswap_user_store(BENCH_SWAP_TYPE, offset, page);
+			bench_record(thread, OP_STORE, start);
+			state->swapped = true;
+		} else if ((long) (bench_random(&thread->seed) % 100) < load_percent) {
+			start = bench_now_ns();
+			if (tswap_user_load(BENCH_SWAP_TYPE, offset, page) < 0
+			    || !bench_check_page(page, offset, state->version))
+				++thread->nr_corrupt;
+			bench_record(thread, OP_LOAD, start);
+			state->swapped = false;
+		} else {
+			start = bench_now_ns();
+			tswap_user_invalidate_page(BENCH_SWAP_TYPE, offset);
+			bench_record(thread, OP_INVALIDATE, start);
+			state->swapped = false;
+		}
+	}
+
+	free(page);
+	return NULL;
+}
+
+static void *bench_prefetch_threadfn(void *data)
+{
+	while (!stopped) {
+		/* ten batches per second */
+		tswap_prefetch(prefetch_rate / 10);
+		msleep(100);
+	}
+	return NULL;
+}
+
+/* swap every page still swapped out back in and check it */
+static long bench_verify(struct bench_thread *threads)
+{
+	unsigned long *page, i;
+	long nr_corrupt = 0;
+	int t;
+
+	if (posix_memalign((void **) &page, PAGE_SIZE, PAGE_SIZE))
+		return -1;
+	for (t = 0; t < nr_threads; ++t) {
+		for (i = 0; i < nr_pages_per_thread; ++i) {
+			if (!threads[t].pages[i].swapped)
+				continue;
+			if (tswap_user_load(BENCH_SWAP_TYPE, threads[t].first_offset + i, page) < 0
+			    || !bench_check_page(page, threads[t].first_offset + i, threads[t].pages[i].version))
+				++nr_corrupt;
+			threads[t].pages[i].swapped = false;
+		}
+	}
+	free(page);
+	return nr_corrupt;
+}
+
+/*
+ * Main Function
+ */
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-t threads] [-n pages per thread] [-d duration (s)] [-q quarantine time (s)]\n"
+	       "       [-i I/O threads] [-l load percent] [-P prefetch pages per second] [-f swap file]\n"
+	       "       [-S (sweep offsets in order)] [-c compressor] [-r compressible percent]\n"
+	       "       [-a auto quarantine percentile] [-m (two cgroups)]\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread *threads;
+	pthread_t prefetch_thread;
+	long total[NR_OPS] = { 0 }, latency[NR_OPS][BENCH_NR_LATENCY_BUCKETS] = { { 0 } };
+	long nr_corrupt = 0, nr_final_corrupt;
+	int quarantine = 2;
+	int opt, t, op, bucket;
+
+	while ((opt = getopt(argc, argv, "ht:n:d:q:i:l:P:f:Sc:r:a:m")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_pages_per_thread = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'q':
+			quarantine = atoi(optarg);
+			break;
+		case 'i':
+			nr_io_threads = atoi(optarg);
+			break;
+		case 'l':
+			load_percent = atoi(optarg);
+			break;
+		case 'P':
+			prefetch_rate = atol(optarg);
+			break;
+		case 'f':
+			swap_path = optarg;
+			break;
+		case 'S':
+			sequential = true;
+			break;
+		case 'c':
+			compressor = optarg;
+			break;
+		case 'r':
+			compressible_percent = atoi(optarg);
+			break;
+		case 'a':
+			auto_percentile = atoi(optarg);
+			break;
+		case 'm':
+			split_cgroups = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (tswap_user_init(nr_io_threads) < 0) {
+		printf("cannot start tswap\n");
+		return 1;
+	}
+	atomic_set(&quarantine_time, quarantine);
+	atomic_set(&quarantine_auto, auto_percentile);
+	if (split_cgroups)
+		tswap_memcg_quarantine_set(BENCH_CGROUP_INO, 2 * quarantine);
+	if (compressor && tswap_compress_init(compressor) < 0) {
+		printf("cannot use compressor %s\n", compressor);
+		return 1;
+	}
+	if (tswap_user_swapon(BENCH_SWAP_TYPE, swap_path, nr_threads * nr_pages_per_thread) < 0) {
+		printf("cannot create swap file %s\n", swap_path);
+		return 1;
+	}
+
+	threads = calloc(nr_threads, sizeof(struct bench_thread));
+	for (t = 0; t < nr_threads; ++t) {
+		threads[t].first_offset = t * nr_pages_per_thread;
+		threads[t].seed = 0x9e3779b97f4a7c15ul * (t + 1);
+		threads[t].cgroup = (split_cgroups && t % 2) ? BENCH_CGROUP_INO : 0;
+		threads[t].pages = calloc(nr_pages_per_thread, sizeof(struct bench_page));
+		pthread_create(&threads[t].thread, NULL, bench_threadfn, &threads[t]);
+	}
+	if (prefetch_rate > 0)
+		pthread_create(&prefetch_thread, NULL, bench_prefetch_threadfn, NULL);
+
+	sleep(duration);
+	stopped = true;
+	for (t = 0; t < nr_threads; ++t)
+		pthread_join(threads[t].thread, NULL);
+	if (prefetch_rate > 0)
+		pthread_join(prefetch_thread, NULL);
+
+	for (t = 0; t < nr_threads; ++t) {
+		nr_corrupt += threads[t].nr_corrupt;
+		for (op = 0; op < NR_OPS; ++op) {
+			total[op] += threads[t].nr_ops[op];
+			for (bucket = 0; bucket < BENCH_NR_LATENCY_BUCKETS; ++bucket)
+				latency[op][bucket] += threads[t].latency[op][bucket];
+		}
+	}
+
+	printf("threads: %d, pages: %lu, duration: %d s, quarantine time: %d s\n",
+	       nr_threads, nr_threads * nr_pages_per_thread, duration, quarantine);
+	printf("op,ops_per_sec,mb_per_sec,p50_ns,p99_ns\n");
+	for (op = 0; op < NR_OPS; ++op) {
+		printf("%s,%.0f,%.1f,%ld,%ld\n", bench_op_names[op],
+		       (double) total[op] / duration,
+		       (double) total[op] * PAGE_SIZE / duration / (1 << 20),
+		       bench_percentile(latency[op], total[op], 0.5),
+		       bench_percentile(latency[op], total[op], 0.99));
+	}
+	tswap_user_print_stat(stdout);
+	printf("reuse histograms (cgroup, quarantine time, disk reuses, reuses up to 2^i ms):\n");
+	tswap_user_print_reuse_hist(stdout);
+
+	nr_final_corrupt = bench_verify(threads);
+	printf("corrupt loads: %ld, corrupt pages at exit: %ld\n", nr_corrupt, nr_final_corrupt);
+
+	tswap_user_swapoff(BENCH_SWAP_TYPE);
+	tswap_user_exit();
+	unlink(swap_path);
+	return (nr_corrupt == 0 && nr_final_corrupt == 0) ? 0 : 1;
+}
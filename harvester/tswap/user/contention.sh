@@ -0,0 +1,18 @@
+#!/bin/bash
+# quarantine contention sweep: tswap_bench at 1 to 64 threads, all pages stay
+# in memory (long quarantine time) so stores, loads and invalidations only
+# contend on tswap's locks
+# usage: ./contention.sh [duration (s)] [pages per thread]
+# to compare with a single quarantine list: make clean && make EXTRA_CFLAGS=-DNR_QUARANTINE_SHARDS=1
+
+duration=${1:-5}
+pages=${2:-4096}
+
+echo "threads,store_ops_per_sec,load_ops_per_sec,invalidate_ops_per_sec"
+for threads in 1 2 4 8 16 32 64; do
+	result=$(./tswap_bench -t $threads -n $pages -d $duration -q 600 -l 50 -i 1 -f /tmp/tswap_contention.swap)
+	store=$(echo "$result" | grep "^store," | cut -d, -f2)
+	load=$(echo "$result" | grep "^load," | cut -d, -f2)
+	invalidate=$(echo "$result" | grep "^invalidate," | cut -d, -f2)
+	echo "$threads,$store,$load,$invalidate"
+done
@@ -0,0 +1,537 @@
+#include <pthread.h>
+#include "kshim.h"
+
+/*
+ * RCU
+ *
+ * Every thread that enters a read-side section registers a reader whose
+ * sequence number is odd while it is inside the outermost section.
+ * synchronize_rcu() snapshots the sequence of every reader and waits for
+ * the odd ones to move on. Callbacks are batched on a reclaim thread.
+ */
+
+struct rcu_reader {
+	unsigned long seq;
+	int nesting;
+	struct rcu_reader *next;
+	struct rcu_reader *prev;
+};
+
+static __thread struct rcu_reader *rcu_self;
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rcu_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_reader rcu_registry = { 0, 0, &rcu_registry, &rcu_registry };
+
+static pthread_mutex_t rcu_callback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcu_callback_cv = PTHREAD_COND_INITIALIZER;
+static struct rcu_head *rcu_callback_list;
+static unsigned long rcu_nr_queued;
+static unsigned long rcu_nr_done;
+static bool rcu_stopped;
+static pthread_t rcu_thread;
+
+#define RCU_BATCH_DELAY_MS 1
+
+static void rcu_unregister(void *data)
+{
+	struct rcu_reader *reader = data;
+
+	pthread_mutex_lock(&rcu_registry_lock);
+	reader->prev->next = reader->next;
+	reader->next->prev = reader->prev;
+	pthread_mutex_unlock(&rcu_registry_lock);
+	free(reader);
+}
+
+static void rcu_make_key(void)
+{
+	pthread_key_create(&rcu_key, rcu_unregister);
+}
+
+static struct rcu_reader *rcu_register(void)
+{
+	struct rcu_reader *reader = calloc(1, sizeof(struct rcu_reader));
+
+	BUG_ON(!reader);
+	pthread_once(&rcu_key_once, rcu_make_key);
+	pthread_setspecific(rcu_key, reader);
+
+	pthread_mutex_lock(&rcu_registry_lock);
+	reader->next = rcu_registry.next;
+	reader->prev = &rcu_registry;
+	rcu_registry.next->prev = reader;
+	rcu_registry.next = reader;
+	pthread_mutex_unlock(&rcu_registry_lock);
+
+	rcu_self = reader;
+	return reader;
+}
+
+void rcu_read_lock(void)
+{
+	struct rcu_reader *reader = rcu_self ? rcu_self : rcu_register();
+
+	if (reader->nesting++ == 0) {
+		__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELAXED);
+		/* pairs with the fence in synchronize_rcu() */
+		smp_mb();
+	}
+}
+
+void rcu_read_unlock(void)
+{
+	struct rcu_reader *reader = rcu_self;
+
+	if (--reader->nesting == 0)
+		__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
+}
+
+void synchronize_rcu(void)
+{
+	struct rcu_reader *reader;
+	unsigned long seq;
+	int nr_spin;
+
+	smp_mb();
+	pthread_mutex_lock(&rcu_registry_lock);
+	for (reader = rcu_registry.next; reader != &rcu_registry; reader = reader->next) {
+		seq = __atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1))
+			continue;
+		nr_spin = 0;
+		while (__atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE) == seq) {
+			if (++nr_spin == KSHIM_SPIN_BEFORE_YIELD) {
+				sched_yield();
+				nr_spin = 0;
+			} else {
+				cpu_relax();
+			}
+		}
+	}
+	pthread_mutex_unlock(&rcu_registry_lock);
+	smp_mb();
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	head->func = func;
+	pthread_mutex_lock(&rcu_callback_lock);
+	head->next = rcu_callback_list;
+	if (!rcu_callback_list)
+		pthread_cond_broadcast(&rcu_callback_cv);
+	rcu_callback_list = head;
+	++rcu_nr_queued;
+	pthread_mutex_unlock(&rcu_callback_lock);
+}
+
+/* like the kernel, small "function pointers" are offsets of the rcu_head */
+#define RCU_KFREE_MAX_OFFSET 4096
+
+void __kfree_rcu(struct rcu_head *head, size_t offset)
+{
+	call_rcu(head, (void (*)(struct rcu_head *)) offset);
+}
+
+static void rcu_invoke(struct rcu_head *head)
+{
+	unsigned long offset = (unsigned long) head->func;
+
+	if (offset < RCU_KFREE_MAX_OFFSET)
+		free((char *) head - offset);
+	else
+		head->func(head);
+}
+
+static void *rcu_threadfn(void *data)
+{
+	struct rcu_head *list, *next;
+	unsigned long nr;
+
+	pthread_mutex_lock(&rcu_callback_lock);
+	while (!rcu_stopped || rcu_callback_list) {
+		if (!rcu_callback_list) {
+			pthread_cond_wait(&rcu_callback_cv, &rcu_callback_lock);
+			continue;
+		}
+		/* let callbacks accumulate so that one grace period serves many */
+		pthread_mutex_unlock(&rcu_callback_lock);
+		usleep(RCU_BATCH_DELAY_MS * 1000);
+		pthread_mutex_lock(&rcu_callback_lock);
+		list = rcu_callback_list;
+		rcu_callback_list = NULL;
+		pthread_mutex_unlock(&rcu_callback_lock);
+
+		synchronize_rcu();
+		for (nr = 0; list; list = next, ++nr) {
+			next = list->next;
+			rcu_invoke(list);
+		}
+
+		pthread_mutex_lock(&rcu_callback_lock);
+		rcu_nr_done += nr;
+		pthread_cond_broadcast(&rcu_callback_cv);
+	}
+	pthread_mutex_unlock(&rcu_callback_lock);
+	return NULL;
+}
+
+void rcu_barrier(void)
+{
+	unsigned long target;
+
+	pthread_mutex_lock(&rcu_callback_lock);
+	target = rcu_nr_queued;
+	while (rcu_nr_done < target)
+		pthread_cond_wait(&rcu_callback_cv, &rcu_callback_lock);
+	pthread_mutex_unlock(&rcu_callback_lock);
+}
+
+/*
+ * Radix Tree
+ */
+
+#define RADIX_TREE_MAP_MASK (RADIX_TREE_MAP_SIZE - 1)
+
+static inline unsigned long radix_tree_slot(unsigned long index, int level)
+{
+	return (index >> (level * RADIX_TREE_MAP_SHIFT)) & RADIX_TREE_MAP_MASK;
+}
+
+static void radix_tree_node_free(struct rcu_head *head)
+{
+	free(container_of(head, struct radix_tree_node, rcu_head));
+}
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index, void *item)
+{
+	struct radix_tree_node *node, *child;
+	void **slot;
+	int level;
+
+	if (index >> (RADIX_TREE_HEIGHT * RADIX_TREE_MAP_SHIFT))
+		return -E2BIG;
+
+	node = root->rnode;
+	if (!node) {
+		node = calloc(1, sizeof(struct radix_tree_node));
+		if (!node)
+			return -ENOMEM;
+		/* publish the initialized node to lockless readers */
+		__atomic_store_n(&root->rnode, node, __ATOMIC_RELEASE);
+	}
+	for (level = RADIX_TREE_HEIGHT - 1; level > 0; --level) {
+		slot = &node->slots[radix_tree_slot(index, level)];
+		child = *slot;
+		if (!child) {
+			child = calloc(1, sizeof(struct radix_tree_node));
+			if (!child)
+				return -ENOMEM;
+			__atomic_store_n(slot, child, __ATOMIC_RELEASE);
+			++node->count;
+		}
+		node = child;
+	}
+
+	slot = &node->slots[radix_tree_slot(index, 0)];
+	if (*slot)
+		return -EEXIST;
+	__atomic_store_n(slot, item, __ATOMIC_RELEASE);
+	++node->count;
+	return 0;
+}
+
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
+{
+	struct radix_tree_node *node;
+	int level;
+
+	if (index >> (RADIX_TREE_HEIGHT * RADIX_TREE_MAP_SHIFT))
+		return NULL;
+
+	node = __atomic_load_n(&root->rnode, __ATOMIC_ACQUIRE);
+	for (level = RADIX_TREE_HEIGHT - 1; node && level > 0; --level)
+		node = __atomic_load_n(&node->slots[radix_tree_slot(index, level)], __ATOMIC_ACQUIRE);
+	return node ? __atomic_load_n(&node->slots[radix_tree_slot(index, 0)], __ATOMIC_ACQUIRE) : NULL;
+}
+
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
+{
+	struct radix_tree_node *path[RADIX_TREE_HEIGHT];
+	struct radix_tree_node *node;
+	void *item;
+	int level, i;
+
+	if (index >> (RADIX_TREE_HEIGHT * RADIX_TREE_MAP_SHIFT))
+		return NULL;
+
+	node = root->rnode;
+	for (i = 0, level = RADIX_TREE_HEIGHT - 1; level >= 0; ++i, --level) {
+		if (!node)
+			return NULL;
+		path[i] = node;
+		if (level > 0)
+			node = node->slots[radix_tree_slot(index, level)];
+	}
+	item = path[RADIX_TREE_HEIGHT - 1]->slots[radix_tree_slot(index, 0)];
+	if (!item)
+		return NULL;
+	__atomic_store_n(&path[RADIX_TREE_HEIGHT - 1]->slots[radix_tree_slot(index, 0)], NULL, __ATOMIC_RELEASE);
+
+	/* free nodes that became empty, bottom up */
+	for (i = RADIX_TREE_HEIGHT - 1; i >= 0; --i) {
+		if (--path[i]->count > 0)
+			break;
+		if (i == 0)
+			__atomic_store_n(&root->rnode, NULL, __ATOMIC_RELEASE);
+		else
+			__atomic_store_n(&path[i - 1]->slots[radix_tree_slot(index, RADIX_TREE_HEIGHT - i)],
+			                 NULL, __ATOMIC_RELEASE);
+		call_rcu(&path[i]->rcu_head, radix_tree_node_free);
+	}
+	return item;
+}
+
+static unsigned int radix_tree_gang_lookup_node(struct radix_tree_node *node, int level,
+                                                unsigned long base, void **results,
+                                                unsigned long first_index, unsigned int max_items)
+{
+	unsigned long i, span = 1ul << (level * RADIX_TREE_MAP_SHIFT);
+	unsigned int nr_found = 0;
+	void *child;
+
+	for (i = 0; i < RADIX_TREE_MAP_SIZE && nr_found < max_items; ++i) {
+		if (base + (i + 1) * span <= first_index)
+			continue;
+		child = __atomic_load_n(&node->slots[i], __ATOMIC_ACQUIRE);
+		if (!child)
+			continue;
+		if (level == 0)
+			results[nr_found++] = child;
+		else
+			nr_found += radix_tree_gang_lookup_node(child, level - 1, base + i * span,
+			                                        results + nr_found, first_index,
+			                                        max_items - nr_found);
+	}
+	return nr_found;
+}
+
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
+                                    unsigned long first_index, unsigned int max_items)
+{
+	struct radix_tree_node *node = __atomic_load_n(&root->rnode, __ATOMIC_ACQUIRE);
+
+	if (!node)
+		return 0;
+	return radix_tree_gang_lookup_node(node, RADIX_TREE_HEIGHT - 1, 0, results,
+	                                   first_index, max_items);
+}
+
+/*
+ * Pages
+ */
+
+__thread unsigned long kshim_cgroup_ino;
+
+/*
+ * Time
+ */
+
+unsigned long kshim_jiffies(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long) now.tv_sec * HZ + (unsigned long) now.tv_nsec / (1000000000l / HZ);
+}
+
+/*
+ * Block Layer
+ */
+
+static pthread_mutex_t bio_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bio_queue_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bio_idle_cv = PTHREAD_COND_INITIALIZER;
+static struct bio *bio_queue_head;
+static struct bio *bio_queue_tail;
+static long bio_nr_pending;  /* queued or being served */
+static bool bio_stopped;
+
+static int nr_bio_threads;
+static pthread_t *bio_threads;
+
+struct bio *bio_alloc(gfp_t gfp, unsigned int nr_iovecs)
+{
+	struct bio *bio = kzalloc(sizeof(struct bio) + nr_iovecs * sizeof(struct bio_vec), gfp);
+
+	if (bio)
+		bio->bi_max_vecs = nr_iovecs;
+	return bio;
+}
+
+void bio_put(struct bio *bio)
+{
+	kfree(bio);
+}
+
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len, unsigned int offset)
+{
+	if (bio->bi_vcnt >= bio->bi_max_vecs)
+		return 0;
+	bio->bi_io_vec[bio->bi_vcnt].bv_page = page;
+	bio->bi_io_vec[bio->bi_vcnt].bv_len = len;
+	bio->bi_io_vec[bio->bi_vcnt].bv_offset = offset;
+	++bio->bi_vcnt;
+	bio->bi_iter.bi_size += len;
+	return len;
+}
+
+static int bio_serve(struct bio *bio)
+{
+	off_t pos = (off_t) bio->bi_iter.bi_sector << SECTOR_SHIFT;
+	struct bio_vec *vec;
+	char *addr;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < bio->bi_vcnt; ++i) {
+		vec = &bio->bi_io_vec[i];
+		addr = (char *) page_address(vec->bv_page) + vec->bv_offset;
+		if ((bio->bi_opf & 1) == REQ_OP_WRITE)
+			ret = pwrite(bio->bi_bdev->fd, addr, vec->bv_len, pos);
+		else
+			ret = pread(bio->bi_bdev->fd, addr, vec->bv_len, pos);
+		if (ret != (ssize_t) vec->bv_len)
+			return -EIO;
+		pos += vec->bv_len;
+	}
+	return 0;
+}
+
+static void *bio_threadfn(void *data)
+{
+	struct bio *bio;
+
+	pthread_mutex_lock(&bio_queue_lock);
+	while (true) {
+		while (!bio_queue_head && !bio_stopped)
+			pthread_cond_wait(&bio_queue_cv, &bio_queue_lock);
+		if (!bio_queue_head)
+			break;
+		bio = bio_queue_head;
+		bio_queue_head = bio->bi_next;
+		if (!bio_queue_head)
+			bio_queue_tail = NULL;
+		pthread_mutex_unlock(&bio_queue_lock);
+
+		bio->bi_status = bio_serve(bio);
+		bio->bi_end_io(bio);
+
+		pthread_mutex_lock(&bio_queue_lock);
+		if (--bio_nr_pending == 0)
+			pthread_cond_broadcast(&bio_idle_cv);
+	}
+	pthread_mutex_unlock(&bio_queue_lock);
+	return NULL;
+}
+
+void submit_bio(struct bio *bio)
+{
+	bio->bi_next = NULL;
+	pthread_mutex_lock(&bio_queue_lock);
+	if (bio_queue_tail)
+		bio_queue_tail->bi_next = bio;
+	else
+		bio_queue_head = bio;
+	bio_queue_tail = bio;
+	++bio_nr_pending;
+	pthread_cond_signal(&bio_queue_cv);
+	pthread_mutex_unlock(&bio_queue_lock);
+}
+
+int submit_bio_wait(struct bio *bio)
+{
+	bio->bi_status = bio_serve(bio);
+	return bio->bi_status;
+}
+
+/*
+ * Compression
+ */
+
+#define KSHIM_MAX_COMPRESSORS 8
+
+static const struct kshim_compressor *kshim_compressors[KSHIM_MAX_COMPRESSORS] = { &kshim_lz4 };
+static int kshim_nr_compressors = 1;
+
+int kshim_register_compressor(const struct kshim_compressor *alg)
+{
+	if (kshim_nr_compressors == KSHIM_MAX_COMPRESSORS)
+		return -ENOMEM;
+	kshim_compressors[kshim_nr_compressors++] = alg;
+	return 0;
+}
+
+struct crypto_comp *crypto_alloc_comp(const char *alg_name, u32 type, u32 mask)
+{
+	struct crypto_comp *tfm;
+	int i;
+
+	for (i = 0; i < kshim_nr_compressors; ++i) {
+		if (strcmp(kshim_compressors[i]->name, alg_name) == 0)
+			break;
+	}
+	if (i == kshim_nr_compressors)
+		return ERR_PTR(-ENOENT);
+	tfm = malloc(sizeof(struct crypto_comp));
+	if (!tfm)
+		return ERR_PTR(-ENOMEM);
+	tfm->alg = kshim_compressors[i];
+	return tfm;
+}
+
+/*
+ * Setup
+ */
+
+int kshim_init(int nr_io_threads)
+{
+	int i;
+
+	rcu_stopped = false;
+	if (pthread_create(&rcu_thread, NULL, rcu_threadfn, NULL))
+		return -1;
+
+	bio_stopped = false;
+	nr_bio_threads = nr_io_threads;
+	bio_threads = calloc(nr_io_threads, sizeof(pthread_t));
+	if (!bio_threads)
+		return -1;
+	for (i = 0; i < nr_io_threads; ++i) {
+		if (pthread_create(&bio_threads[i], NULL, bio_threadfn, NULL))
+			return -1;
+	}
+	return 0;
+}
+
+void kshim_exit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&bio_queue_lock);
+	while (bio_nr_pending > 0)
+		pthread_cond_wait(&bio_idle_cv, &bio_queue_lock);
+	bio_stopped = true;
+	pthread_cond_broadcast(&bio_queue_cv);
+	pthread_mutex_unlock(&bio_queue_lock);
+	for (i = 0; i < nr_bio_threads; ++i)
+		pthread_join(bio_threads[i], NULL);
+	free(bio_threads);
+
+	rcu_barrier();
+	pthread_mutex_lock(&rcu_callback_lock);
+	rcu_stopped = true;
+	pthread_cond_broadcast(&rcu_callback_cv);
+	pthread_mutex_unlock(&rcu_callback_lock);
+	pthread_join(rcu_thread, NULL);
+}
@@ -0,0 +1,621 @@
+#ifndef __TSWAP_KSHIM_H_
+#define __TSWAP_KSHIM_H_
+
+/*
+ * Userspace stand-ins for the kernel primitives used by tswap's core.
+ *
+ * Only the subset core.c needs is provided, with the kernel's names and
+ * semantics, so that core.c compiles unchanged in both builds:
+ *   - spinlocks spin briefly and then yield (no preemption control here)
+ *   - RCU is a per-thread counter scheme: synchronize_rcu() waits for every
+ *     thread that was inside a read-side section, call_rcu()/kfree_rcu()
+ *     callbacks run on a reclaim thread after a grace period
+ *   - the radix tree is a fixed-height 64-ary trie with lockless lookups
+ *     under RCU, updates are serialized by the caller like in the kernel
+ *   - bios are served by a pool of I/O threads doing pread/pwrite on the
+ *     file backing each block device
+ *   - jiffies is CLOCK_MONOTONIC in milliseconds (HZ = 1000)
+ *   - crypto_alloc_comp() picks from a table of registered compressors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Types and Compiler Helpers
+ */
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef unsigned long pgoff_t;
+typedef unsigned long sector_t;
+typedef unsigned int gfp_t;
+typedef int blk_status_t;
+
+#define __rcu
+#define __init
+#define __exit
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val) __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define L1_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(L1_CACHE_BYTES)))
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define clamp(val, lo, hi) min(max(val, lo), hi)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define pr_err(...) fprintf(stderr, __VA_ARGS__)
+#define pr_warn(...) fprintf(stderr, __VA_ARGS__)
+#define pr_info(...) fprintf(stderr, __VA_ARGS__)
+
+#define BUG() do { \
+	fprintf(stderr, "tswap: BUG at %s:%d\n", __FILE__, __LINE__); \
+	abort(); \
+} while (0)
+#define BUG_ON(cond) do { if (unlikely(cond)) BUG(); } while (0)
+#define WARN_ON(cond) ({ \
+	int __ret = !!(cond); \
+	if (unlikely(__ret)) \
+		fprintf(stderr, "tswap: WARNING at %s:%d\n", __FILE__, __LINE__); \
+	__ret; \
+})
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) unlikely((unsigned long) (x) >= (unsigned long) -MAX_ERRNO)
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *) error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long) ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return IS_ERR_VALUE((unsigned long) ptr);
+}
+
+/*
+ * Atomics
+ */
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v) __atomic_fetch_add(&(v)->counter, 1, __ATOMIC_RELAXED)
+#define atomic_dec(v) __atomic_fetch_sub(&(v)->counter, 1, __ATOMIC_RELAXED)
+
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_inc(v) ((void) __atomic_fetch_add(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_long_dec(v) ((void) __atomic_fetch_sub(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_long_add(i, v) ((void) __atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_long_sub(i, v) ((void) __atomic_fetch_sub(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_long_add_return(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_long_xchg(v, i) __atomic_exchange_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+
+/*
+ * Bit Operations
+ */
+
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr)
+{
+	return (__atomic_load_n(&addr[nr / BITS_PER_LONG], __ATOMIC_RELAXED) >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline void set_bit(unsigned long nr, unsigned long *addr)
+{
+	__atomic_fetch_or(&addr[nr / BITS_PER_LONG], 1ul << (nr % BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(unsigned long nr, unsigned long *addr)
+{
+	__atomic_fetch_and(&addr[nr / BITS_PER_LONG], ~(1ul << (nr % BITS_PER_LONG)), __ATOMIC_RELAXED);
+}
+
+/*
+ * Spinlocks
+ */
+
+struct spinlock {
+	int locked;
+};
+typedef struct spinlock spinlock_t;
+
+#define KSHIM_SPIN_BEFORE_YIELD 128
+
+static inline void spin_lock_init(struct spinlock *lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELAXED);
+}
+
+static inline int spin_trylock(struct spinlock *lock)
+{
+	return !__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)
+	       && !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_lock(struct spinlock *lock)
+{
+	int nr_spin = 0;
+
+	while (!spin_trylock(lock)) {
+		/* userspace threads can be preempted while holding the lock */
+		if (++nr_spin == KSHIM_SPIN_BEFORE_YIELD) {
+			sched_yield();
+			nr_spin = 0;
+		} else {
+			cpu_relax();
+		}
+	}
+}
+
+static inline void spin_unlock(struct spinlock *lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define spin_lock_irqsave(lock, flags) do { (flags) = 0; spin_lock(lock); } while (0)
+#define spin_unlock_irqrestore(lock, flags) do { (void) (flags); spin_unlock(lock); } while (0)
+#define spin_trylock_irqsave(lock, flags) ({ (flags) = 0; spin_trylock(lock); })
+
+/*
+ * Doubly Linked Lists
+ */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *entry, struct list_head *prev, struct list_head *next)
+{
+	next->prev = entry;
+	entry->next = next;
+	entry->prev = prev;
+	prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+	__list_add(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	__list_add(entry, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move_tail(struct list_head *entry, struct list_head *head)
+{
+	list_del(entry);
+	list_add_tail(entry, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline void list_splice_tail_init(struct list_head *list, struct list_head *head)
+{
+	if (!list_empty(list)) {
+		list->next->prev = head->prev;
+		head->prev->next = list->next;
+		list->prev->next = head;
+		head->prev = list->prev;
+		INIT_LIST_HEAD(list);
+	}
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, typeof(*(pos)), member)
+
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member); \
+	     &pos->member != (head); \
+	     pos = list_next_entry(pos, member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member), \
+	     n = list_next_entry(pos, member); \
+	     &pos->member != (head); \
+	     pos = n, n = list_next_entry(n, member))
+
+/*
+ * Sorting
+ */
+
+static inline void sort(void *base, size_t num, size_t size,
+                        int (*cmp)(const void *, const void *),
+                        void (*swap)(void *, void *, int))
+{
+	(void) swap;
+	qsort(base, num, size, cmp);
+}
+
+/*
+ * Memory
+ */
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1ul << PAGE_SHIFT)
+
+#define GFP_KERNEL 0u
+#define GFP_NOIO 1u
+#define GFP_ATOMIC 2u
+#define __GFP_NOWARN 4u
+
+/* a page is identified with its (page-aligned) address */
+struct page;
+
+static inline void *kmalloc(size_t size, gfp_t gfp)
+{
+	void *ptr;
+
+	(void) gfp;
+	if (size == PAGE_SIZE)
+		return posix_memalign(&ptr, PAGE_SIZE, PAGE_SIZE) ? NULL : ptr;
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t gfp)
+{
+	void *ptr = kmalloc(size, gfp);
+
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *) ptr);
+}
+
+static inline unsigned long __get_free_page(gfp_t gfp)
+{
+	return (unsigned long) kmalloc(PAGE_SIZE, gfp);
+}
+
+static inline void free_page(unsigned long addr)
+{
+	free((void *) addr);
+}
+
+#define SLAB_HWCACHE_ALIGN 0x2000ul
+
+/* objects come from malloc, the cache only remembers their size */
+struct kmem_cache {
+	size_t size;
+	size_t align;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+                                                   unsigned int align, unsigned long flags,
+                                                   void (*ctor)(void *))
+{
+	struct kmem_cache *cache = malloc(sizeof(struct kmem_cache));
+
+	(void) name;
+	(void) ctor;
+	if (!cache)
+		return NULL;
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max(align, (unsigned int) L1_CACHE_BYTES);
+	cache->align = align ? align : sizeof(void *);
+	cache->size = (size + cache->align - 1) & ~(cache->align - 1);
+	return cache;
+}
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t gfp)
+{
+	(void) gfp;
+	return aligned_alloc(cache->align, cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	(void) cache;
+	free(ptr);
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+#define virt_to_page(addr) ((struct page *) (addr))
+#define page_address(page) ((void *) (page))
+#define kmap_atomic(page) page_address(page)
+#define kunmap_atomic(addr) do { (void) (addr); } while (0)
+#define PageTransHuge(page) 0
+
+/* pages are charged to the cgroup of the thread swapping them out */
+extern __thread unsigned long kshim_cgroup_ino;
+
+static inline unsigned long tswap_page_cgroup_ino(struct page *page)
+{
+	(void) page;
+	return kshim_cgroup_ino;
+}
+
+/*
+ * Per-CPU Variables
+ */
+
+/*
+ * a slot per CPU the thread happens to run on; threads can be preempted,
+ * so per-CPU data still needs its own lock (tswap's per-CPU data has one)
+ */
+#define NR_CPUS 256
+
+#define DEFINE_PER_CPU(type, name) __typeof__(type) name[NR_CPUS]
+#define per_cpu(var, cpu) ((var)[cpu])
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; ++(cpu))
+
+static inline int raw_smp_processor_id(void)
+{
+	int cpu = sched_getcpu();
+
+	return cpu < 0 ? 0 : cpu % NR_CPUS;
+}
+
+/*
+ * RCU
+ */
+
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+/* waits for all callbacks queued so far to be invoked */
+void rcu_barrier(void);
+void __kfree_rcu(struct rcu_head *head, size_t offset);
+
+#define kfree_rcu(ptr, field) __kfree_rcu(&(ptr)->field, offsetof(typeof(*(ptr)), field))
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/*
+ * Radix Tree
+ */
+
+#define RADIX_TREE_MAP_SHIFT 6
+#define RADIX_TREE_MAP_SIZE (1ul << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_HEIGHT 6  /* indices below 2^36 */
+
+struct radix_tree_node {
+	void *slots[RADIX_TREE_MAP_SIZE];
+	unsigned int count;
+	struct rcu_head rcu_head;
+};
+
+struct radix_tree_root {
+	struct radix_tree_node *rnode;
+};
+
+#define INIT_RADIX_TREE(root, mask) do { (void) (mask); (root)->rnode = NULL; } while (0)
+
+/* updates must be serialized by the caller, lookups only need rcu_read_lock() */
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index, void *item);
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index);
+void *radix_tree_delete(struct radix_tree_root *root, unsigned long index);
+unsigned int radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
+                                    unsigned long first_index, unsigned int max_items);
+
+/*
+ * Time
+ */
+
+#define HZ 1000
+
+unsigned long kshim_jiffies(void);
+
+#define jiffies kshim_jiffies()
+#define msecs_to_jiffies(ms) ((unsigned long) (ms))
+#define jiffies_to_msecs(j) ((unsigned int) (j))
+#define time_after(a, b) ((long) ((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define time_after_eq(a, b) ((long) ((a) - (b)) >= 0)
+
+static inline void msleep(unsigned int msecs)
+{
+	usleep(msecs * 1000);
+}
+
+/*
+ * Block Layer
+ */
+
+#define SECTOR_SHIFT 9
+#define MAX_SWAPFILES 32
+
+#define BIO_MAX_PAGES 256
+
+#define REQ_OP_READ 0
+#define REQ_OP_WRITE 1
+
+struct block_device;
+
+struct block_device_operations {
+	void (*swap_slot_free_notify)(struct block_device *bdev, unsigned long offset);
+};
+
+struct gendisk {
+	const struct block_device_operations *fops;
+};
+
+struct block_device {
+	int fd;  /* backing file */
+	struct gendisk *bd_disk;
+};
+
+struct bio_vec {
+	struct page *bv_page;
+	unsigned int bv_len;
+	unsigned int bv_offset;
+};
+
+struct bvec_iter {
+	sector_t bi_sector;
+	unsigned int bi_size;
+};
+
+struct bio;
+typedef void (bio_end_io_t)(struct bio *bio);
+
+struct bio {
+	struct bio *bi_next;  /* I/O queue */
+	struct block_device *bi_bdev;
+	int bi_opf;
+	blk_status_t bi_status;
+	struct bvec_iter bi_iter;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	unsigned short bi_vcnt;
+	unsigned short bi_max_vecs;
+	struct bio_vec bi_io_vec[];
+};
+
+#define bio_set_dev(bio, bdev) ((bio)->bi_bdev = (bdev))
+#define bio_set_op_attrs(bio, op, flags) ((bio)->bi_opf = (op) | (flags))
+#define blk_status_to_errno(status) (status)
+
+/* requests are not held back, the I/O threads serve them in order */
+struct blk_plug {
+	int unused;
+};
+
+#define blk_start_plug(plug) do { (void) (plug); } while (0)
+#define blk_finish_plug(plug) do { (void) (plug); } while (0)
+
+struct bio *bio_alloc(gfp_t gfp, unsigned int nr_iovecs);
+void bio_put(struct bio *bio);
+int bio_add_page(struct bio *bio, struct page *page, unsigned int len, unsigned int offset);
+void submit_bio(struct bio *bio);
+int submit_bio_wait(struct bio *bio);
+
+/*
+ * Compression (the crypto API's synchronous compressors)
+ */
+
+/* a compressor plugged into crypto_alloc_comp(), "lz4" is built in */
+struct kshim_compressor {
+	const char *name;
+	/* both return 0 or -errno, *dlen is the size of dst on entry and the output size on return */
+	int (*compress)(const u8 *src, unsigned int slen, u8 *dst, unsigned int *dlen);
+	int (*decompress)(const u8 *src, unsigned int slen, u8 *dst, unsigned int *dlen);
+};
+
+extern const struct kshim_compressor kshim_lz4;
+
+/* makes @alg available to crypto_alloc_comp() under its name */
+int kshim_register_compressor(const struct kshim_compressor *alg);
+
+struct crypto_comp {
+	const struct kshim_compressor *alg;
+};
+
+struct crypto_comp *crypto_alloc_comp(const char *alg_name, u32 type, u32 mask);
+
+static inline void crypto_free_comp(struct crypto_comp *tfm)
+{
+	free(tfm);
+}
+
+static inline int crypto_comp_compress(struct crypto_comp *tfm, const u8 *src, unsigned int slen,
+                                       u8 *dst, unsigned int *dlen)
+{
+	return tfm->alg->compress(src, slen, dst, dlen);
+}
+
+static inline int crypto_comp_decompress(struct crypto_comp *tfm, const u8 *src, unsigned int slen,
+                                         u8 *dst, unsigned int *dlen)
+{
+	return tfm->alg->decompress(src, slen, dst, dlen);
+}
+
+/*
+ * Userspace-only Setup
+ */
+
+/* starts the reclaim and I/O threads */
+int kshim_init(int nr_io_threads);
+/* drains pending I/O and RCU callbacks and stops the threads */
+void kshim_exit(void);
+
+#endif
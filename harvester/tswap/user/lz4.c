@@ -0,0 +1,187 @@
+#include "kshim.h"
+
+/*
+ * LZ4 block format coder for the userspace "lz4" compressor.
+ *
+ * A small greedy encoder (one hash probe per position, 4-byte minimum
+ * match) that emits standard LZ4 blocks, and a bounds-checked decoder.
+ * It compresses less than liblz4 but needs no external library.
+ */
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5  /* the block always ends with literals */
+#define LZ4_MATCH_SAFE_DISTANCE 12  /* no match may start closer to the end */
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_BITS 12
+
+static inline u32 lz4_read32(const u8 *p)
+{
+	u32 value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline u32 lz4_hash(u32 sequence)
+{
+	return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* writes the extra length bytes of a length that did not fit its nibble */
+static u8 *lz4_write_length(u8 *op, const u8 *oend, unsigned int length)
+{
+	for (; length >= 255; length -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = length;
+	return op;
+}
+
+/* emits a sequence; a match length of 0 ends the block with literals only */
+static u8 *lz4_write_sequence(u8 *op, const u8 *oend, const u8 *literals,
+                              unsigned int nr_literals, unsigned int distance,
+                              unsigned int match_length)
+{
+	u8 *token = op++;
+	unsigned int code;
+
+	if (token >= oend)
+		return NULL;
+	*token = min(nr_literals, 15u) << 4;
+	if (nr_literals >= 15 && !(op = lz4_write_length(op, oend, nr_literals - 15)))
+		return NULL;
+	if (op + nr_literals > oend)
+		return NULL;
+	memcpy(op, literals, nr_literals);
+	op += nr_literals;
+	if (match_length == 0)
+		return op;
+
+	if (op + 2 > oend)
+		return NULL;
+	*op++ = distance & 0xff;
+	*op++ = distance >> 8;
+	code = match_length - LZ4_MIN_MATCH;
+	*token |= min(code, 15u);
+	if (code >= 15 && !(op = lz4_write_length(op, oend, code - 15)))
+		return NULL;
+	return op;
+}
+
+static int lz4_compress(const u8 *src, unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	u16 table[1 << LZ4_HASH_BITS];  /* position + 1, 0 if empty */
+	const u8 *ip = src, *anchor = src, *ref;
+	const u8 *iend = src + slen;
+	const u8 *match_limit = slen > LZ4_MATCH_SAFE_DISTANCE ? iend - LZ4_MATCH_SAFE_DISTANCE : src;
+	u8 *op = dst, *oend = dst + *dlen;
+	unsigned int match_length;
+	u32 sequence, h;
+
+	if (slen >= LZ4_MAX_DISTANCE)
+		return -EINVAL;
+	memset(table, 0, sizeof(table));
+
+	while (ip < match_limit) {
+		sequence = lz4_read32(ip);
+		h = lz4_hash(sequence);
+		ref = table[h] ? src + table[h] - 1 : NULL;
+		table[h] = ip - src + 1;
+		if (!ref || lz4_read32(ref) != sequence) {
+			++ip;
+			continue;
+		}
+
+		match_length = LZ4_MIN_MATCH;
+		while (ip + match_length < iend - LZ4_LAST_LITERALS
+		       && ref[match_length] == ip[match_length])
+			++match_length;
+		op = lz4_write_sequence(op, oend, anchor, ip - anchor, ip - ref, match_length);
+		if (!op)
+			return -ENOSPC;
+		ip += match_length;
+		anchor = ip;
+	}
+
+	op = lz4_write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return -ENOSPC;
+	*dlen = op - dst;
+	return 0;
+}
+
+/* reads the extra length bytes, returns -1 on truncated input */
+static long lz4_read_length(const u8 **ip, const u8 *iend)
+{
+	long length = 0;
+	u8 byte;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		byte = *(*ip)++;
+		length += byte;
+	} while (byte == 255);
+	return length;
+}
+
+static int lz4_decompress(const u8 *src, unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	const u8 *ip = src, *iend = src + slen;
+	u8 *op = dst, *oend = dst + *dlen;
+	const u8 *ref;
+	long length, extra;
+	unsigned int distance;
+	u8 token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15) {
+			if ((extra = lz4_read_length(&ip, iend)) < 0)
+				return -EINVAL;
+			length += extra;
+		}
+		if (length > iend - ip || length > oend - op)
+			return -EINVAL;
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+		if (ip == iend)
+			break;  /* the last sequence has no match */
+
+		if (iend - ip < 2)
+			return -EINVAL;
+		distance = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (distance == 0 || distance > op - dst)
+			return -EINVAL;
+		ref = op - distance;
+
+		length = token & 15;
+		if (length == 15) {
+			if ((extra = lz4_read_length(&ip, iend)) < 0)
+				return -EINVAL;
+			length += extra;
+		}
+		length += LZ4_MIN_MATCH;
+		if (length > oend - op)
+			return -EINVAL;
+		/* byte by byte, matches may overlap their own output */
+		while (length-- > 0)
+			*op++ = *ref++;
+	}
+	*dlen = op - dst;
+	return 0;
+}
+
+const struct kshim_compressor kshim_lz4 = {
+	.name = "lz4",
+	.compress = lz4_compress,
+	.decompress = lz4_decompress,
+};
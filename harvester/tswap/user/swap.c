@@ -0,0 +1,274 @@
+#include <pthread.h>
+#include <fcntl.h>
+#include "tswap_user.h"
+
+struct tswap_user_swap {
+	struct block_device bdev;
+	struct gendisk disk;
+	unsigned long nr_pages;
+	unsigned long *frontswap_map;
+};
+
+static struct tswap_user_swap *tswap_user_swaps[MAX_SWAPFILES];
+
+static const struct block_device_operations tswap_user_fops = {
+	.swap_slot_free_notify = NULL,
+};
+
+static pthread_t discharge_thread;
+static bool discharge_stopped;
+
+/*
+ * Swap Device Functions (called by the core)
+ */
+
+struct block_device *tswap_swap_bdev(unsigned type)
+{
+	return &tswap_user_swaps[type]->bdev;
+}
+
+int tswap_swap_frontswap_test(unsigned type, unsigned long offset)
+{
+	struct tswap_user_swap *swap = tswap_user_swaps[type];
+
+	return offset < swap->nr_pages && test_bit(offset, swap->frontswap_map);
+}
+
+void tswap_swap_slot_free_notify(unsigned type, unsigned long offset)
+{
+	struct tswap_user_swap *swap = tswap_user_swaps[type];
+
+	if (swap->disk.fops->swap_slot_free_notify)
+		swap->disk.fops->swap_slot_free_notify(&swap->bdev, offset);
+}
+
+/*
+ * Discharge Thread Functions
+ */
+
+static void *tswap_user_discharge_threadfn(void *data)
+{
+	unsigned long slept;
+
+	while (!__atomic_load_n(&discharge_stopped, __ATOMIC_ACQUIRE)) {
+		tswap_discharge();
+		/* same period as the kernel thread, but notice stop requests quickly */
+		for (slept = 0; slept < DISCHARGE_INTERVAL && !__atomic_load_n(&discharge_stopped, __ATOMIC_ACQUIRE);
+		     slept += 10)
+			msleep(10);
+	}
+	return NULL;
+}
+
+/*
+ * Library Functions
+ */
+
+int tswap_user_init(int nr_io_threads)
+{
+	if (kshim_init(nr_io_threads) < 0)
+		return -1;
+	if (tswap_core_init() < 0)
+		return -1;
+
+	discharge_stopped = false;
+	if (pthread_create(&discharge_thread, NULL, tswap_user_discharge_threadfn, NULL))
+		return -1;
+	return 0;
+}
+
+void tswap_user_exit(void)
+{
+	__atomic_store_n(&discharge_stopped, true, __ATOMIC_RELEASE);
+	pthread_join(discharge_thread, NULL);
+	kshim_exit();
+}
+
+int tswap_user_swapon(unsigned type, const char *path, unsigned long nr_pages)
+{
+	struct tswap_user_swap *swap;
+
+	if (type >= MAX_SWAPFILES || tswap_user_swaps[type])
+		return -EINVAL;
+	swap = calloc(1, sizeof(struct tswap_user_swap));
+	if (!swap)
+		return -ENOMEM;
+	swap->frontswap_map = calloc(BITS_TO_LONGS(nr_pages), sizeof(unsigned long));
+	if (!swap->frontswap_map)
+		goto free_swap;
+	swap->bdev.fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (swap->bdev.fd < 0)
+		goto free_map;
+	if (ftruncate(swap->bdev.fd, (off_t) nr_pages << PAGE_SHIFT) < 0)
+		goto close_file;
+	swap->disk.fops = &tswap_user_fops;
+	swap->bdev.bd_disk = &swap->disk;
+	swap->nr_pages = nr_pages;
+
+	tswap_user_swaps[type] = swap;
+	tswap_frontswap_init(type);
+	return 0;
+
+close_file:
+	close(swap->bdev.fd);
+free_map:
+	free(swap->frontswap_map);
+free_swap:
+	free(swap);
+	return -EIO;
+}
+
+void tswap_user_swapoff(unsigned type)
+{
+	struct tswap_user_swap *swap = tswap_user_swaps[type];
+
+	tswap_frontswap_invalidate_area(type);
+	/* zombies are gone, but their completions may still hold the radix tree */
+	rcu_barrier();
+	tswap_user_swaps[type] = NULL;
+	close(swap->bdev.fd);
+	free(swap->frontswap_map);
+	free(swap);
+}
+
+/* mirrors __frontswap_store() followed by swap_writepage() on rejection */
+int tswap_user_store(unsigned type, pgoff_t offset, void *page)
+{
+	struct tswap_user_swap *swap = tswap_user_swaps[type];
+	int dup = test_bit(offset, swap->frontswap_map);
+	int ret;
+
+	ret = tswap_frontswap_store(type, offset, virt_to_page(page));
+	if (ret == 0) {
+		set_bit(offset, swap->frontswap_map);
+		return 0;
+	}
+	if (dup) {
+		tswap_frontswap_invalidate_page(type, offset);
+		clear_bit(offset, swap->frontswap_map);
+	}
+	if (pwrite(swap->bdev.fd, page, PAGE_SIZE, (off_t) offset << PAGE_SHIFT) != PAGE_SIZE)
+		pr_err("tswap: failed to write rejected page\n");
+	return ret;
+}
+
+/* mirrors __frontswap_load() with exclusive gets, or swap_readpage() */
+int tswap_user_load(unsigned type, pgoff_t offset, void *page)
+{
+	struct tswap_user_swap *swap = tswap_user_swaps[type];
+	int ret;
+
+	if (!test_bit(offset, swap->frontswap_map)) {
+		if (pread(swap->bdev.fd, page, PAGE_SIZE, (off_t) offset << PAGE_SHIFT) != PAGE_SIZE)
+			return -EIO;
+		return 0;
+	}
+	ret = tswap_frontswap_load(type, offset, virt_to_page(page));
+	if (ret == 0)
+		clear_bit(offset, swap->frontswap_map);
+	return ret;
+}
+
+void tswap_user_invalidate_page(unsigned type, pgoff_t offset)
+{
+	struct tswap_user_swap *swap = tswap_user_swaps[type];
+
+	if (!test_bit(offset, swap->frontswap_map))
+		return;
+	tswap_frontswap_invalidate_page(type, offset);
+	clear_bit(offset, swap->frontswap_map);
+}
+
+void tswap_user_set_cgroup(unsigned long ino)
+{
+	kshim_cgroup_ino = ino;
+}
+
+void tswap_user_print_stat(FILE *out)
+{
+	fprintf(out,
+	        "nr_zombie_page %ld\n"
+	        "nr_in_memory_page %ld\n"
+	        "nr_in_memory_zombie_page %ld\n"
+	        "nr_in_flight_page %ld\n"
+	        "len_quarantine_list %ld\n"
+	        "nr_async_io %ld\n"
+	        "nr_async_end_io %ld\n"
+	        "nr_async_io_fail %ld\n"
+	        "nr_async_end_io_fail %ld\n"
+	        "nr_malloc_fail %ld\n"
+	        "nr_radix_tree_insert_fail %ld\n"
+	        "nr_radix_tree_delete_fail %ld\n"
+	        "nr_store %ld\n"
+	        "nr_load %ld\n"
+	        "nr_invalid_load %ld\n"
+	        "nr_overwrite_store %ld\n"
+	        "nr_invalidate_page %ld\n"
+	        "nr_quarantine_skip_mem_zombie %ld\n"
+	        "nr_discharge_bio %ld\n"
+	        "nr_discharge_page %ld\n"
+	        "discharge_busy_time %ld\n"
+	        "nr_reserve_page %ld\n"
+	        "nr_reserve_alloc %ld\n"
+	        "nr_compressed_page %ld\n"
+	        "compressed_size %ld\n"
+	        "nr_compress_reject %ld\n"
+	        "nr_decompress_fail %ld\n"
+	        "nr_prefetch_bio %ld\n"
+	        "nr_prefetch_page %ld\n"
+	        "nr_prefetch_hit %ld\n"
+	        "nr_readahead_page %ld\n"
+	        "nr_readahead_hit %ld\n",
+	        atomic_long_read(&tswap_stat.nr_zombie_page),
+	        atomic_long_read(&tswap_stat.nr_in_memory_page),
+	        atomic_long_read(&tswap_stat.nr_in_memory_zombie_page),
+	        atomic_long_read(&tswap_stat.nr_in_flight_page),
+	        atomic_long_read(&tswap_stat.len_quarantine_list),
+	        atomic_long_read(&tswap_stat.nr_async_io),
+	        atomic_long_read(&tswap_stat.nr_async_end_io),
+	        atomic_long_read(&tswap_stat.nr_async_io_fail),
+	        atomic_long_read(&tswap_stat.nr_async_end_io_fail),
+	        atomic_long_read(&tswap_stat.nr_malloc_fail),
+	        atomic_long_read(&tswap_stat.nr_radix_tree_insert_fail),
+	        atomic_long_read(&tswap_stat.nr_radix_tree_delete_fail),
+	        atomic_long_read(&tswap_stat.nr_store),
+	        atomic_long_read(&tswap_stat.nr_load),
+	        atomic_long_read(&tswap_stat.nr_invalid_load),
+	        atomic_long_read(&tswap_stat.nr_overwrite_store),
+	        atomic_long_read(&tswap_stat.nr_invalidate_page),
+	        atomic_long_read(&tswap_stat.nr_quarantine_skip_mem_zombie),
+	        atomic_long_read(&tswap_stat.nr_discharge_bio),
+	        atomic_long_read(&tswap_stat.nr_discharge_page),
+	        atomic_long_read(&tswap_stat.discharge_busy_time),
+	        atomic_long_read(&tswap_stat.nr_reserve_page),
+	        atomic_long_read(&tswap_stat.nr_reserve_alloc),
+	        atomic_long_read(&tswap_stat.nr_compressed_page),
+	        atomic_long_read(&tswap_stat.compressed_size),
+	        atomic_long_read(&tswap_stat.nr_compress_reject),
+	        atomic_long_read(&tswap_stat.nr_decompress_fail),
+	        atomic_long_read(&tswap_stat.nr_prefetch_bio),
+	        atomic_long_read(&tswap_stat.nr_prefetch_page),
+	        atomic_long_read(&tswap_stat.nr_prefetch_hit),
+	        atomic_long_read(&tswap_stat.nr_readahead_page),
+	        atomic_long_read(&tswap_stat.nr_readahead_hit));
+}
+
+void tswap_user_print_reuse_hist(FILE *out)
+{
+	struct tswap_memcg_quarantine *mq;
+	unsigned long ino;
+	int i, bucket;
+
+	for (i = 0; i < MAX_MEMCG_QUARANTINES; ++i) {
+		mq = &tswap_memcg_quarantines[i];
+		ino = READ_ONCE(mq->cgroup_ino);
+		if (i > 0 && !ino)
+			continue;
+		fprintf(out, "%lu %d %ld", ino,
+		        atomic_read(i == 0 ? &quarantine_time : &mq->quarantine_time),
+		        atomic_long_read(&mq->hist.nr_disk_reuse));
+		for (bucket = 0; bucket < NR_REUSE_BUCKETS; ++bucket)
+			fprintf(out, " %ld", atomic_long_read(&mq->hist.nr_reuse[bucket]));
+		fprintf(out, "\n");
+	}
+}
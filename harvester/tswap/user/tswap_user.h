@@ -0,0 +1,40 @@
+#ifndef __TSWAP_USER_H_
+#define __TSWAP_USER_H_
+
+/*
+ * Userspace build of tswap (libtswap.a).
+ *
+ * Stands in for the frontswap and swap layers around tswap's core: swap
+ * devices are plain files, the frontswap map is kept here, and pages
+ * frontswap would not keep are written to the file like the swap layer
+ * does. Callers must not issue concurrent operations on the same
+ * (type, offset), which the kernel guarantees through the page lock.
+ */
+
+#include "../tswap.h"
+
+/* starts the I/O, RCU and discharge threads */
+int tswap_user_init(int nr_io_threads);
+/* stops the discharge thread and waits for in-flight I/O and RCU callbacks */
+void tswap_user_exit(void);
+
+/* backs swap type @type with @nr_pages pages of the file at @path */
+int tswap_user_swapon(unsigned type, const char *path, unsigned long nr_pages);
+void tswap_user_swapoff(unsigned type);
+
+/* swap out @page (PAGE_SIZE bytes), returns tswap's store result */
+int tswap_user_store(unsigned type, pgoff_t offset, void *page);
+/* swap in into @page, returns 0 or -errno */
+int tswap_user_load(unsigned type, pgoff_t offset, void *page);
+/* the swapped-out page is no longer needed */
+void tswap_user_invalidate_page(unsigned type, pgoff_t offset);
+
+/* charges the swap-outs of the calling thread to cgroup @ino, 0 for none */
+void tswap_user_set_cgroup(unsigned long ino);
+
+/* writes tswap_stat as "key value" lines */
+void tswap_user_print_stat(FILE *out);
+/* writes the reuse histograms like /sys/kernel/tswap/tswap_reuse_hist */
+void tswap_user_print_reuse_hist(FILE *out);
+
+#endif
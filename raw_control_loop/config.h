@@ -37,6 +37,10 @@ struct control_config {
 			long disk_promo_rate;
 			long size;
 		} prefetch;
+		struct {
+			long max_decrement;
+			int timeout;  /* ms */
+		} actuator;
 	} control_loop;
 
 	struct {
@@ -83,6 +87,9 @@ control_config control_config::parse_yaml(YAML::Node &root) {
 	config.control_loop.prefetch.promo_rate = prefetch["promo_rate"].as<long>();
 	config.control_loop.prefetch.disk_promo_rate = prefetch["disk_promo_rate"].as<long>();
 	config.control_loop.prefetch.size = prefetch["size"].as<long>();
+	YAML::Node actuator = control_loop["actuator"];
+	config.control_loop.actuator.max_decrement = actuator["max_decrement"].as<long>();
+	config.control_loop.actuator.timeout = actuator["timeout"].as<int>();
 
 	YAML::Node logging = root["logging"];
 	config.logging.file_path = logging["file_path"].as<string>();
@@ -11,6 +11,7 @@
 #include <cstring>
 #include "yaml-cpp/yaml.h"
 #include "config.h"
+#include "../harvester/common/cgroup_actuator.h"
 
 #define CGROUP_PATH_MAX_LEN 256
 #define MAX_PERFORMANCE_LEN 256
@@ -34,6 +35,7 @@ struct control_context {
 
 	/* cgroup limit */
 	atomic<long> cgroup_limit;
+	cgroup_actuator *actuator;
 
 	/* timestamp */
 	long timestamp;
@@ -53,22 +55,10 @@ struct control_context {
 	ofstream logging_file;
 } g_ctx;
 
+/* never blocks on reclaim, returns false if a previous limit could not be applied */
 bool apply_cgroup_limit() {
-	char cgroup_limit_path[CGROUP_PATH_MAX_LEN];
-	sprintf(cgroup_limit_path,
-		"/sys/fs/cgroup/memory/%s/memory.limit_in_bytes",
-		g_ctx.config.cgroup_name.c_str());
-
-	ofstream limit_file;
-	limit_file.open(cgroup_limit_path);
-	if (!limit_file) {
-		cout << "[ERROR] cannot open cgroup limit file" << endl;
-		exit(1);
-	}
-
-	limit_file << g_ctx.cgroup_limit << endl;
-
-	return !!limit_file;
+	g_ctx.actuator->set_target(g_ctx.cgroup_limit);
+	return !g_ctx.actuator->consume_failure();
 }
 
 long get_memory_size() {
@@ -297,6 +287,9 @@ void init_ctx(YAML::Node &config_file) {
 
 	g_ctx.state = RECOVERY;
 
+	g_ctx.actuator = new cgroup_actuator(g_ctx.config.cgroup_name,
+	                                     g_ctx.config.control_loop.actuator.max_decrement,
+	                                     chrono::milliseconds(g_ctx.config.control_loop.actuator.timeout));
 	g_ctx.cgroup_limit = get_memory_size();
 	apply_cgroup_limit();
 
@@ -336,7 +329,9 @@ void init_ctx(YAML::Node &config_file) {
 			   << "disk_promotion_rate,"
 			   << "silo_memory_size,"
 			   << "cgroup_rss,"
-			   << "cgroup_swap"
+			   << "cgroup_swap,"
+			   << "applied_cgroup_limit,"
+			   << "actuator_latency_us"
 			   << endl;
 }
 
@@ -407,9 +402,11 @@ int main(int argc, char *argv[]) {
 		}
 
 		/* log */
+		cgroup_actuator::stats actuator_stats = g_ctx.actuator->get_stats();
 		cout << "[INFO] timestamp: " << g_ctx.timestamp << ", "
 		     << "state: " << ((cur_state == HARVEST) ? "HARVEST" : "RECOVERY") << ", "
 		     << "cgroup limit: " << (g_ctx.cgroup_limit >> 20) << " MB, "
+		     << "applied cgroup limit: " << (actuator_stats.applied_limit >> 20) << " MB, "
 		     << "recovery time: " << cur_recovery_time << " s, "
 		     << "performance: " << performance << ", "
 		     << "promotion rate: " << (promotion_rate >> 20) << " MB, "
@@ -427,7 +424,9 @@ int main(int argc, char *argv[]) {
 				   << disk_promotion_rate << ","
 				   << silo_memory_size << ","
 				   << cgroup_rss << ","
-				   << cgroup_swap << endl;
+				   << cgroup_swap << ","
+				   << actuator_stats.applied_limit << ","
+				   << actuator_stats.last_latency_us << endl;
 		++g_ctx.timestamp;
 		this_thread::sleep_for(chrono::seconds(g_ctx.config.control_loop.sleep_time));
 	}